@@ -0,0 +1,396 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+// Throughput benchmark of the decode, encode and palette expansion paths.
+// Usage: xyzimage_bench [--min-time SECONDS] [--output FILE.csv] [FILE.xyz...]
+// Without files a synthetic corpus is generated. Results are printed and
+// written as CSV (one row per corpus entry and operation) to track regressions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xyzimage.h"
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#  include <psapi.h>
+#else
+#  include <sys/resource.h>
+#  include <time.h>
+#endif
+
+typedef struct {
+	char name[64];
+	uint16_t width;
+	uint16_t height;
+	// Palette followed by the pixels
+	XYZImage* image;
+	// Compressed file at the default level
+	uint8_t* file;
+	size_t file_len;
+} bench_entry;
+
+typedef struct {
+	FILE* csv;
+	double min_time;
+} bench_config;
+
+static double bench_now(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static long bench_peak_rss_kb(void) {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return (long)(counters.PeakWorkingSetSize / 1024);
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#  ifdef __APPLE__
+		return usage.ru_maxrss / 1024;
+#  else
+		return usage.ru_maxrss;
+#  endif
+	}
+	return 0;
+#endif
+}
+
+static uint32_t bench_rand_state = 0x12345678u;
+
+static uint32_t bench_rand(void) {
+	// xorshift32, deterministic across platforms
+	bench_rand_state ^= bench_rand_state << 13;
+	bench_rand_state ^= bench_rand_state >> 17;
+	bench_rand_state ^= bench_rand_state << 5;
+	return bench_rand_state;
+}
+
+enum bench_pattern {
+	// Few colors, large transparent areas (charsets, faces)
+	BENCH_PATTERN_SPRITE,
+	// Repeating 16x16 tiles (chipsets)
+	BENCH_PATTERN_TILES,
+	// Gradients with dithering noise (pictures, panoramas)
+	BENCH_PATTERN_PICTURE,
+	// Uniform noise, worst case for deflate
+	BENCH_PATTERN_NOISE
+};
+
+static void bench_fill(XYZImage* image, enum bench_pattern pattern) {
+	uint16_t w = xyzimage_get_width(image);
+	uint16_t h = xyzimage_get_height(image);
+	uint8_t* pixels = (uint8_t*)xyzimage_get_buffer(image, NULL);
+	XYZImage_Palette* palette = xyzimage_get_palette(image, NULL);
+
+	int i;
+	for (i = 0; i < XYZIMAGE_PALETTE_ENTRIES; ++i) {
+		palette->entry[i].red = (uint8_t)bench_rand();
+		palette->entry[i].green = (uint8_t)bench_rand();
+		palette->entry[i].blue = (uint8_t)bench_rand();
+	}
+
+	uint8_t tile[16][16];
+	int tx, ty;
+	for (ty = 0; ty < 16; ++ty) {
+		for (tx = 0; tx < 16; ++tx) {
+			tile[ty][tx] = (uint8_t)(bench_rand() % 24);
+		}
+	}
+
+	uint32_t x, y;
+	for (y = 0; y < h; ++y) {
+		for (x = 0; x < w; ++x) {
+			uint8_t value;
+
+			switch (pattern) {
+				case BENCH_PATTERN_SPRITE:
+					value = ((x / 6 + y / 5) % 3 == 0) ? 0 : (uint8_t)(1 + (x * 3 + y) / 8 % 12);
+					break;
+				case BENCH_PATTERN_TILES:
+					value = (uint8_t)(tile[y % 16][x % 16] + 24 * (((x / 16) * 7 + (y / 16) * 3) % 9));
+					break;
+				case BENCH_PATTERN_PICTURE:
+					value = (uint8_t)((x * 200 / (w ? w : 1) + y * 55 / (h ? h : 1) + bench_rand() % 3) & 0xFF);
+					break;
+				default:
+					value = (uint8_t)bench_rand();
+					break;
+			}
+
+			pixels[y * w + x] = value;
+		}
+	}
+}
+
+static int bench_add_synthetic(bench_entry* entry, const char* name, uint16_t width, uint16_t height, enum bench_pattern pattern) {
+	xyzimage_error_t error;
+
+	entry->image = xyzimage_alloc(width, height, XYZIMAGE_FORMAT_DEFAULT, &error);
+
+	if (entry->image == NULL) {
+		fprintf(stderr, "%s: %s\n", name, xyzimage_get_error_message(error));
+		return 0;
+	}
+
+	bench_fill(entry->image, pattern);
+
+	size_t bound = xyzimage_get_write_bound(entry->image);
+	entry->file = (uint8_t*)malloc(bound);
+
+	if (entry->file == NULL || !xyzimage_mwrite(entry->image, entry->file, bound, &entry->file_len, &error)) {
+		fprintf(stderr, "%s: %s\n", name, entry->file ? xyzimage_get_error_message(error) : "Out of memory");
+		free(entry->file);
+		xyzimage_free(entry->image);
+		return 0;
+	}
+
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	entry->width = width;
+	entry->height = height;
+
+	return 1;
+}
+
+static int bench_add_file(bench_entry* entry, const char* path) {
+	FILE* file = fopen(path, "rb");
+
+	if (file == NULL) {
+		fprintf(stderr, "%s: Unable to open\n", path);
+		return 0;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	entry->file = (uint8_t*)malloc(len > 0 ? (size_t)len : 1);
+	entry->file_len = entry->file ? fread(entry->file, 1, (size_t)len, file) : 0;
+	fclose(file);
+
+	xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+	entry->image = entry->file ? xyzimage_mopen(entry->file, entry->file_len, &error) : NULL;
+
+	if (entry->image == NULL) {
+		fprintf(stderr, "%s: %s\n", path, xyzimage_get_error_message(error));
+		free(entry->file);
+		return 0;
+	}
+
+	const char* name = strrchr(path, '/');
+	snprintf(entry->name, sizeof(entry->name), "%s", name ? name + 1 : path);
+	entry->width = xyzimage_get_width(entry->image);
+	entry->height = xyzimage_get_height(entry->image);
+
+	return 1;
+}
+
+typedef int (*bench_func_t)(bench_entry* entry, void* arg);
+
+static void bench_report(const bench_config* config, const bench_entry* entry, const char* operation, int level,
+		unsigned long iterations, double seconds, size_t bytes, size_t output_bytes) {
+	// MB/s are based on the uncompressed size (palette and pixels) of the image
+	double mb_per_s = seconds > 0 ? (double)bytes * iterations / seconds / (1024.0 * 1024.0) : 0;
+	double images_per_s = seconds > 0 ? iterations / seconds : 0;
+	long rss = bench_peak_rss_kb();
+
+	printf("%-22s %5ux%-5u %-12s %2d %10.1f MB/s %12.1f img/s %10lu B\n",
+		entry->name, entry->width, entry->height, operation, level, mb_per_s, images_per_s, (unsigned long)output_bytes);
+
+	if (config->csv) {
+		fprintf(config->csv, "%s,%u,%u,%s,%d,%lu,%.6f,%.3f,%.3f,%lu,%ld\n",
+			entry->name, entry->width, entry->height, operation, level, iterations, seconds,
+			mb_per_s, images_per_s, (unsigned long)output_bytes, rss);
+	}
+}
+
+static int bench_run(const bench_config* config, bench_entry* entry, const char* operation, int level,
+		bench_func_t func, void* arg, size_t output_bytes) {
+	unsigned long iterations = 0;
+	double start = bench_now();
+	double elapsed;
+
+	do {
+		if (!func(entry, arg)) {
+			fprintf(stderr, "%s: %s failed\n", entry->name, operation);
+			return 0;
+		}
+
+		++iterations;
+		elapsed = bench_now() - start;
+	} while (elapsed < config->min_time);
+
+	bench_report(config, entry, operation, level, iterations, elapsed,
+		XYZIMAGE_PALETTE_SIZE + (size_t)entry->width * entry->height, output_bytes);
+
+	return 1;
+}
+
+static int bench_mopen(bench_entry* entry, void* arg) {
+	(void)arg;
+	XYZImage* image = xyzimage_mopen(entry->file, entry->file_len, NULL);
+	xyzimage_free(image);
+	return image != NULL;
+}
+
+static int bench_open_rgba(bench_entry* entry, void* arg) {
+	XYZImage_MemoryReader reader;
+	reader.data = entry->file;
+	reader.size = entry->file_len;
+	reader.offset = 0;
+
+	return xyzimage_open_rgba(&reader, xyzimage_mread_func, arg, (size_t)entry->width * entry->height * 4, 0,
+		XYZIMAGE_CHANNEL_ORDER_RGBA, 0, NULL, NULL, NULL);
+}
+
+static int bench_convert_rgba(bench_entry* entry, void* arg) {
+	return xyzimage_convert_rgba(entry->image, arg, (size_t)entry->width * entry->height * 4, 0,
+		XYZIMAGE_CHANNEL_ORDER_RGBA, 0, NULL);
+}
+
+typedef struct {
+	uint8_t* buffer;
+	size_t len;
+	size_t written;
+} bench_write_arg;
+
+static int bench_mwrite(bench_entry* entry, void* arg) {
+	bench_write_arg* write_arg = (bench_write_arg*)arg;
+	return xyzimage_mwrite(entry->image, write_arg->buffer, write_arg->len, &write_arg->written, NULL);
+}
+
+static int bench_entry_run(const bench_config* config, bench_entry* entry) {
+	size_t rgba_len = (size_t)entry->width * entry->height * 4;
+	uint8_t* rgba = (uint8_t*)malloc(rgba_len > 0 ? rgba_len : 1);
+
+	bench_write_arg write_arg;
+	write_arg.len = xyzimage_get_write_bound(entry->image);
+	write_arg.buffer = (uint8_t*)malloc(write_arg.len);
+
+	if (rgba == NULL || write_arg.buffer == NULL) {
+		free(rgba);
+		free(write_arg.buffer);
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+
+	int success = bench_run(config, entry, "mopen", -1, bench_mopen, NULL, entry->file_len) &&
+		bench_run(config, entry, "open_rgba", -1, bench_open_rgba, rgba, rgba_len) &&
+		bench_run(config, entry, "convert_rgba", -1, bench_convert_rgba, rgba, rgba_len);
+
+	XYZImage_CompressOptions options;
+	xyzimage_get_compress_options(entry->image, &options);
+
+	static const int levels[] = { 1, 6, 9 };
+	size_t i;
+
+	for (i = 0; success && i < sizeof(levels) / sizeof(levels[0]); ++i) {
+		options.level = levels[i];
+		options.threads = 1;
+		xyzimage_set_compress_options(entry->image, &options, NULL);
+
+		// The written size of the first iteration is the same for all
+		success = bench_mwrite(entry, &write_arg) &&
+			bench_run(config, entry, "mwrite", levels[i], bench_mwrite, &write_arg, write_arg.written);
+
+		if (success) {
+			options.threads = 0;
+			xyzimage_set_compress_options(entry->image, &options, NULL);
+
+			success = bench_mwrite(entry, &write_arg) &&
+				bench_run(config, entry, "mwrite_mt", levels[i], bench_mwrite, &write_arg, write_arg.written);
+		}
+	}
+
+	free(rgba);
+	free(write_arg.buffer);
+
+	return success;
+}
+
+int main(int argc, char** argv) {
+	bench_config config;
+	config.csv = NULL;
+	config.min_time = 0.25;
+
+	const char* output = "xyzimage_bench.csv";
+	bench_entry entries[64];
+	size_t count = 0;
+
+	int i;
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+			config.min_time = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		} else if (count < sizeof(entries) / sizeof(entries[0])) {
+			if (!bench_add_file(&entries[count], argv[i])) {
+				return EXIT_FAILURE;
+			}
+			++count;
+		}
+	}
+
+	if (count == 0) {
+		// Sizes used by RPG Maker 2000 and 2003 assets
+		int ok = bench_add_synthetic(&entries[count++], "char_16x16", 16, 16, BENCH_PATTERN_SPRITE) &&
+			bench_add_synthetic(&entries[count++], "charset_288x256", 288, 256, BENCH_PATTERN_SPRITE) &&
+			bench_add_synthetic(&entries[count++], "chipset_480x256", 480, 256, BENCH_PATTERN_TILES) &&
+			bench_add_synthetic(&entries[count++], "picture_320x240", 320, 240, BENCH_PATTERN_PICTURE) &&
+			bench_add_synthetic(&entries[count++], "noise_320x240", 320, 240, BENCH_PATTERN_NOISE) &&
+			bench_add_synthetic(&entries[count++], "panorama_4096x4096", 4096, 4096, BENCH_PATTERN_PICTURE);
+
+		if (!ok) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	config.csv = fopen(output, "w");
+
+	if (config.csv == NULL) {
+		fprintf(stderr, "%s: Unable to open\n", output);
+	} else {
+		fprintf(config.csv, "corpus,width,height,operation,level,iterations,seconds,mb_per_s,images_per_s,output_bytes,peak_rss_kb\n");
+	}
+
+	int success = 1;
+	size_t j;
+
+	for (j = 0; j < count; ++j) {
+		if (success) {
+			success = bench_entry_run(&config, &entries[j]);
+		}
+
+		xyzimage_free(entries[j].image);
+		free(entries[j].file);
+	}
+
+	printf("Peak RSS: %ld KiB\n", bench_peak_rss_kb());
+
+	if (config.csv) {
+		fclose(config.csv);
+		printf("Results written to %s\n", output);
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,565 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+// Stress benchmark of the decoder limits: Headers of the maximal size, truncated streams and
+// streams at the size limit of XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_BIG (twice the uncompressed size).
+// Every case is decoded by the memory, stream, push and unverified decoders. Prints the outcome,
+// the time until the result and the peak memory allocated by the library.
+// Usage: xyzimage_stress [--min-time SECONDS] [--output FILE.csv]
+// Fails when a decoder accepts a broken file or rejects a valid one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "xyzimage.h"
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+// Size of the chunks passed by the stream and push decoders
+#define STRESS_CHUNK_SIZE 4096u
+
+typedef struct {
+	char name[64];
+	uint8_t* file;
+	size_t file_len;
+	// 1: Must be accepted, 0: Must be rejected
+	int valid;
+} stress_case;
+
+typedef struct {
+	FILE* csv;
+	double min_time;
+} stress_config;
+
+// Allocations are prefixed with their size to track the amount of live memory
+typedef union {
+	size_t size;
+	double align_double;
+	void* align_pointer;
+} stress_alloc_header;
+
+static size_t stress_alloc_current = 0;
+static size_t stress_alloc_peak = 0;
+
+static void* stress_malloc(void* userdata, size_t size) {
+	(void)userdata;
+	stress_alloc_header* header = (stress_alloc_header*)malloc(sizeof(stress_alloc_header) + size);
+
+	if (header == NULL) {
+		return NULL;
+	}
+
+	header->size = size;
+	stress_alloc_current += size;
+	if (stress_alloc_current > stress_alloc_peak) {
+		stress_alloc_peak = stress_alloc_current;
+	}
+
+	return header + 1;
+}
+
+static void stress_free(void* userdata, void* ptr) {
+	(void)userdata;
+
+	if (ptr) {
+		stress_alloc_header* header = (stress_alloc_header*)ptr - 1;
+		stress_alloc_current -= header->size;
+		free(header);
+	}
+}
+
+static void* stress_realloc(void* userdata, void* ptr, size_t size) {
+	if (ptr == NULL) {
+		return stress_malloc(userdata, size);
+	}
+
+	stress_alloc_header* header = (stress_alloc_header*)ptr - 1;
+	size_t old_size = header->size;
+	stress_alloc_header* new_header = (stress_alloc_header*)realloc(header, sizeof(stress_alloc_header) + size);
+
+	if (new_header == NULL) {
+		return NULL;
+	}
+
+	new_header->size = size;
+	stress_alloc_current = stress_alloc_current - old_size + size;
+	if (stress_alloc_current > stress_alloc_peak) {
+		stress_alloc_peak = stress_alloc_current;
+	}
+
+	return new_header + 1;
+}
+
+static double stress_now(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static void stress_put_header(uint8_t* file, uint16_t width, uint16_t height) {
+	memcpy(file, "XYZ1", 4);
+	file[4] = (uint8_t)(width & 0xFF);
+	file[5] = (uint8_t)(width >> 8);
+	file[6] = (uint8_t)(height & 0xFF);
+	file[7] = (uint8_t)(height >> 8);
+}
+
+static int stress_add(stress_case* entry, const char* name, uint8_t* file, size_t file_len, int valid) {
+	entry->file = file;
+
+	if (file == NULL) {
+		fprintf(stderr, "%s: Out of memory\n", name);
+		return 0;
+	}
+
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	entry->file_len = file_len;
+	entry->valid = valid;
+
+	return 1;
+}
+
+static uint8_t* stress_deflate_zeros(uint16_t width, uint16_t height, size_t zeros, int finish, size_t* file_len) {
+	// Header followed by a zlib stream of zeros, unfinished streams end after the last full block
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	if (deflateInit(&stream, Z_BEST_COMPRESSION) != Z_OK) {
+		return NULL;
+	}
+
+	size_t capacity = 8 + deflateBound(&stream, (uLong)zeros) + 64;
+	uint8_t* file = (uint8_t*)malloc(capacity);
+	uint8_t* chunk = (uint8_t*)calloc(1, 65536);
+
+	if (file == NULL || chunk == NULL) {
+		free(file);
+		free(chunk);
+		deflateEnd(&stream);
+		return NULL;
+	}
+
+	stress_put_header(file, width, height);
+	stream.next_out = file + 8;
+	stream.avail_out = (uInt)(capacity - 8);
+
+	size_t remaining = zeros;
+	int zlib_error = Z_OK;
+
+	while (zlib_error == Z_OK && remaining > 0) {
+		size_t len = remaining < 65536 ? remaining : 65536;
+		stream.next_in = chunk;
+		stream.avail_in = (uInt)len;
+		zlib_error = deflate(&stream, Z_NO_FLUSH);
+		remaining -= len - stream.avail_in;
+	}
+
+	if (zlib_error == Z_OK) {
+		zlib_error = deflate(&stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
+	}
+
+	*file_len = capacity - stream.avail_out;
+	deflateEnd(&stream);
+	free(chunk);
+
+	if (zlib_error != Z_OK && zlib_error != Z_STREAM_END) {
+		free(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+static uint8_t* stress_stored(uint16_t width, uint16_t height, size_t compressed_len, size_t* file_len) {
+	// Valid image made of stored blocks with exactly compressed_len bytes behind the XYZ header:
+	// 2 bytes zlib header, 5 bytes per block header and 4 bytes checksum. Empty blocks pad the size.
+	size_t raw_len = XYZIMAGE_PALETTE_SIZE + (size_t)width * height;
+
+	if (compressed_len < raw_len + 6 || (compressed_len - raw_len - 6) % 5 != 0) {
+		return NULL;
+	}
+
+	size_t block_count = (compressed_len - raw_len - 6) / 5;
+	size_t data_blocks = (raw_len + 65534) / 65535;
+
+	if (block_count < data_blocks || block_count == 0) {
+		return NULL;
+	}
+
+	uint8_t* raw = (uint8_t*)malloc(raw_len);
+	uint8_t* file = (uint8_t*)malloc(8 + compressed_len);
+
+	if (raw == NULL || file == NULL) {
+		free(raw);
+		free(file);
+		return NULL;
+	}
+
+	size_t i;
+	for (i = 0; i < raw_len; ++i) {
+		raw[i] = (uint8_t)(i * 31 + (i >> 8));
+	}
+
+	stress_put_header(file, width, height);
+	uint8_t* out = file + 8;
+	*out++ = 0x78;
+	*out++ = 0x01;
+
+	size_t offset = 0;
+	for (i = 0; i < block_count; ++i) {
+		size_t len = raw_len - offset < 65535 ? raw_len - offset : 65535;
+		*out++ = i + 1 == block_count ? 1 : 0;
+		out[0] = (uint8_t)(len & 0xFF);
+		out[1] = (uint8_t)(len >> 8);
+		out[2] = (uint8_t)(~len & 0xFF);
+		out[3] = (uint8_t)((~len >> 8) & 0xFF);
+		out += 4;
+		memcpy(out, raw + offset, len);
+		out += len;
+		offset += len;
+	}
+
+	uLong adler = adler32(adler32(0L, Z_NULL, 0), raw, (uInt)raw_len);
+	out[0] = (uint8_t)(adler >> 24);
+	out[1] = (uint8_t)((adler >> 16) & 0xFF);
+	out[2] = (uint8_t)((adler >> 8) & 0xFF);
+	out[3] = (uint8_t)(adler & 0xFF);
+
+	free(raw);
+	*file_len = 8 + compressed_len;
+
+	return file;
+}
+
+static uint16_t stress_limit_height(uint16_t width, size_t remainder) {
+	// Smallest height from 64 on where the size limit is reachable with stored blocks:
+	// compressed_len = raw_len + 6 + 5 * blocks, padded by remainder bytes above the limit
+	uint16_t height = 64;
+
+	while (((XYZIMAGE_PALETTE_SIZE + (size_t)width * height) + remainder - 6) % 5 != 0) {
+		++height;
+	}
+
+	return height;
+}
+
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+	size_t offset;
+} stress_reader;
+
+static size_t stress_read_func(void* userdata, void* buffer, size_t amount, xyzimage_error_t* error) {
+	// Not xyzimage_mread_func: Forces the copying stream decoder
+	stress_reader* reader = (stress_reader*)userdata;
+	size_t remaining = reader->size - reader->offset;
+
+	if (amount > remaining) {
+		amount = remaining;
+		if (error) {
+			*error = XYZIMAGE_ERROR_IO_READ_END_OF_FILE;
+		}
+	}
+
+	memcpy(buffer, reader->data + reader->offset, amount);
+	reader->offset += amount;
+
+	return amount;
+}
+
+static XYZImage* stress_mopen(const stress_case* entry, xyzimage_error_t* error) {
+	return xyzimage_mopen(entry->file, entry->file_len, error);
+}
+
+static XYZImage* stress_open(const stress_case* entry, xyzimage_error_t* error) {
+	stress_reader reader;
+	reader.data = entry->file;
+	reader.size = entry->file_len;
+	reader.offset = 0;
+
+	return xyzimage_open(&reader, stress_read_func, error);
+}
+
+static XYZImage* stress_feed(const stress_case* entry, xyzimage_error_t* error) {
+	XYZImage_Decoder* decoder = xyzimage_decoder_create(error);
+
+	if (decoder == NULL) {
+		return NULL;
+	}
+
+	enum XYZImage_DecoderStatus status = XYZIMAGE_DECODER_NEED_MORE_INPUT;
+	size_t offset = 0;
+
+	while (status != XYZIMAGE_DECODER_ERROR && status != XYZIMAGE_DECODER_DONE) {
+		size_t len = entry->file_len - offset;
+		size_t consumed = 0;
+
+		if (len > STRESS_CHUNK_SIZE) {
+			len = STRESS_CHUNK_SIZE;
+		}
+
+		status = xyzimage_decoder_feed(decoder, entry->file + offset, len, &consumed, error);
+		offset += consumed;
+
+		if (status == XYZIMAGE_DECODER_NEED_MORE_INPUT && offset == entry->file_len) {
+			// The decoder has no error for a truncated file, it waits for more data
+			if (error) {
+				*error = XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_SMALL;
+			}
+			break;
+		}
+	}
+
+	XYZImage* image = xyzimage_decoder_take_image(decoder);
+	xyzimage_decoder_free(decoder);
+
+	return image;
+}
+
+static XYZImage* stress_trusted(const stress_case* entry, xyzimage_error_t* error) {
+	XYZImage_Context* context = xyzimage_context_create(NULL, error);
+
+	if (context == NULL) {
+		return NULL;
+	}
+
+	xyzimage_context_set_verify_checksum(context, 0);
+
+	XYZImage* image = xyzimage_context_mopen(context, entry->file, entry->file_len, error);
+	xyzimage_context_free(context);
+
+	return image;
+}
+
+typedef XYZImage* (*stress_open_func_t)(const stress_case* entry, xyzimage_error_t* error);
+
+static int stress_run(const stress_config* config, const stress_case* entry, const char* decoder, stress_open_func_t func) {
+	unsigned long iterations = 0;
+	xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+	int accepted = 0;
+	double start = stress_now();
+	double elapsed;
+
+	stress_alloc_peak = stress_alloc_current;
+
+	do {
+		error = XYZIMAGE_ERROR_OK;
+		XYZImage* image = func(entry, &error);
+		accepted = image != NULL;
+		xyzimage_free(image);
+
+		++iterations;
+		elapsed = stress_now() - start;
+	} while (elapsed < config->min_time);
+
+	double us = elapsed / iterations * 1e6;
+	int expected = accepted == entry->valid;
+	const char* result = accepted ? "accepted" : xyzimage_get_error_message(error);
+
+	printf("%-26s %-8s %12.1f us %12lu KiB  %s%s\n", entry->name, decoder, us, (unsigned long)(stress_alloc_peak / 1024),
+		expected ? "" : "UNEXPECTED: ", result);
+
+	if (config->csv) {
+		fprintf(config->csv, "%s,%s,%d,%d,%lu,%.3f,%lu,%d\n", entry->name, decoder, entry->valid, accepted,
+			iterations, us, (unsigned long)stress_alloc_peak, (int)error);
+	}
+
+	return expected;
+}
+
+static int stress_add_cases(stress_case* cases, size_t* count) {
+	size_t n = 0;
+	size_t len = 0;
+	int ok = 1;
+
+	// Header of the maximal size without data: Rejected before allocating the image?
+	uint8_t* header = (uint8_t*)malloc(8);
+	if (header) {
+		stress_put_header(header, 0xFFFF, 0xFFFF);
+	}
+	ok = ok && stress_add(&cases[n++], "max_header_only", header, 8, 0);
+
+	// Maximal size with 1 MiB of zeros and the stream cut off
+	uint8_t* zeros = stress_deflate_zeros(0xFFFF, 0xFFFF, 1024 * 1024, 0, &len);
+	ok = ok && stress_add(&cases[n++], "max_header_truncated", zeros, len, 0);
+
+	// Maximal size with a finished stream of 64 MiB zeros: Inflates quickly but is too small
+	zeros = ok ? stress_deflate_zeros(0xFFFF, 0xFFFF, 64 * 1024 * 1024, 1, &len) : NULL;
+	ok = ok && stress_add(&cases[n++], "max_header_short_stream", zeros, len, 0);
+
+	// A regular 320x240 picture cut at several points
+	XYZImage* image = ok ? xyzimage_alloc(320, 240, XYZIMAGE_FORMAT_DEFAULT, NULL) : NULL;
+	uint8_t* valid_file = NULL;
+	size_t valid_len = 0;
+
+	if (image) {
+		uint8_t* pixels = (uint8_t*)xyzimage_get_buffer(image, NULL);
+		size_t i;
+		for (i = 0; i < 320u * 240u; ++i) {
+			pixels[i] = (uint8_t)((i % 320) / 4 + (i / 320) / 3 + (i * 2654435761u >> 29));
+		}
+		memset(xyzimage_get_palette(image, NULL), 0x40, sizeof(XYZImage_Palette));
+
+		size_t bound = xyzimage_get_write_bound(image);
+		valid_file = (uint8_t*)malloc(bound);
+		if (valid_file && !xyzimage_mwrite(image, valid_file, bound, &valid_len, NULL)) {
+			free(valid_file);
+			valid_file = NULL;
+		}
+		xyzimage_free(image);
+	}
+
+	ok = ok && valid_file != NULL;
+
+	if (ok) {
+		// Cut in the header, in the zlib header, in the palette, in the pixels and in the checksum
+		size_t cuts[8];
+		cuts[0] = 4;
+		cuts[1] = 9;
+		cuts[2] = 40;
+		cuts[3] = valid_len / 4;
+		cuts[4] = valid_len / 2;
+		cuts[5] = valid_len * 3 / 4;
+		cuts[6] = valid_len - 4;
+		cuts[7] = valid_len - 1;
+
+		size_t i;
+		for (i = 0; ok && i < sizeof(cuts) / sizeof(cuts[0]); ++i) {
+			char name[64];
+			uint8_t* copy = (uint8_t*)malloc(cuts[i]);
+			if (copy) {
+				memcpy(copy, valid_file, cuts[i]);
+			}
+			snprintf(name, sizeof(name), "truncated_%lu_of_%lu", (unsigned long)cuts[i], (unsigned long)valid_len);
+			ok = stress_add(&cases[n++], name, copy, cuts[i], 0);
+		}
+
+		ok = ok && stress_add(&cases[n++], "regular_320x240", valid_file, valid_len, 1);
+	} else {
+		free(valid_file);
+	}
+
+	// Exactly at the compressed size limit and one byte beyond it
+	if (ok) {
+		uint16_t height = stress_limit_height(64, 0);
+		size_t limit = 2 * (XYZIMAGE_PALETTE_SIZE + (size_t)64 * height);
+		char name[64];
+
+		uint8_t* file = stress_stored(64, height, limit, &len);
+		snprintf(name, sizeof(name), "limit_exact_64x%u", height);
+		ok = stress_add(&cases[n++], name, file, len, 1);
+
+		height = stress_limit_height(64, 1);
+		limit = 2 * (XYZIMAGE_PALETTE_SIZE + (size_t)64 * height);
+		file = ok ? stress_stored(64, height, limit + 1, &len) : NULL;
+		snprintf(name, sizeof(name), "limit_plus_one_64x%u", height);
+		ok = ok && stress_add(&cases[n++], name, file, len, 0);
+
+		// Far beyond the limit, one byte more makes the size reachable with stored blocks
+		height = stress_limit_height(64, 0);
+		limit = 2 * (XYZIMAGE_PALETTE_SIZE + (size_t)64 * height);
+		file = ok ? stress_stored(64, height, limit * 8 + 1, &len) : NULL;
+		snprintf(name, sizeof(name), "limit_times_eight_64x%u", height);
+		ok = ok && stress_add(&cases[n++], name, file, len, 0);
+	}
+
+	*count = n;
+
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	stress_config config;
+	config.csv = NULL;
+	config.min_time = 0.1;
+
+	const char* output = "xyzimage_stress.csv";
+
+	int i;
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+			config.min_time = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		} else {
+			fprintf(stderr, "Usage: %s [--min-time SECONDS] [--output FILE.csv]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	XYZImage_Allocator allocator;
+	allocator.malloc_func = stress_malloc;
+	allocator.realloc_func = stress_realloc;
+	allocator.free_func = stress_free;
+	allocator.userdata = NULL;
+
+	if (!xyzimage_set_allocator(&allocator, NULL)) {
+		fprintf(stderr, "Unable to set the allocator\n");
+		return EXIT_FAILURE;
+	}
+
+	stress_case cases[32];
+	size_t count = 0;
+	int success = stress_add_cases(cases, &count);
+	int failures = 0;
+
+	config.csv = fopen(output, "w");
+
+	if (config.csv == NULL) {
+		fprintf(stderr, "%s: Unable to open\n", output);
+	} else {
+		fprintf(config.csv, "case,decoder,valid,accepted,iterations,us_per_open,peak_alloc_bytes,error\n");
+	}
+
+	size_t j;
+	for (j = 0; success && j < count; ++j) {
+		// All cases run, unexpected results are marked
+		if (!stress_run(&config, &cases[j], "mopen", stress_mopen)) {
+			failures += 1;
+		}
+		if (!stress_run(&config, &cases[j], "open", stress_open)) {
+			failures += 1;
+		}
+		if (!stress_run(&config, &cases[j], "feed", stress_feed)) {
+			failures += 1;
+		}
+		if (!stress_run(&config, &cases[j], "trusted", stress_trusted)) {
+			failures += 1;
+		}
+	}
+
+	for (j = 0; j < count; ++j) {
+		free(cases[j].file);
+	}
+
+	if (config.csv) {
+		fclose(config.csv);
+		printf("Results written to %s\n", output);
+	}
+
+	if (failures > 0) {
+		printf("%d unexpected results\n", failures);
+	}
+
+	return success && failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+// Helpers shared by the fuzz targets. A failed check aborts, the fuzzer reports it as a crash.
+
+#ifndef LIBXYZIMAGE_FUZZ_H
+#define LIBXYZIMAGE_FUZZ_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xyzimage.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+#define FUZZ_CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #cond); \
+			abort(); \
+		} \
+	} while (0)
+
+// Larger images are skipped, allocating them exceeds the memory limit of the fuzzers.
+// xyzimage_stress covers the maximal size.
+#define FUZZ_MAX_PIXELS (4096u * 1024u)
+
+// Read function returning at most chunk bytes per call, exercises the buffering of the stream decoders
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+	size_t offset;
+	size_t chunk;
+} fuzz_reader;
+
+// Checks the header of a XYZ file for more than FUZZ_MAX_PIXELS pixels
+int fuzz_too_large(const uint8_t* file, size_t size);
+
+size_t fuzz_read_func(void* userdata, void* buffer, size_t amount, xyzimage_error_t* error);
+
+// Aborts when the palettes or pixels of the images differ
+void fuzz_check_same_image(XYZImage* a, XYZImage* b);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+// Driver for compilers without libFuzzer: Runs the target on every file passed as argument
+// or on stdin when there are none. Used for AFL (afl-fuzz -i in -o out -- target @@)
+// and for reproducing crashes.
+
+#include "xyzimage_fuzz.h"
+
+static int fuzz_run(FILE* file, const char* name) {
+	size_t capacity = 65536;
+	size_t size = 0;
+	uint8_t* data = (uint8_t*)malloc(capacity);
+
+	while (data) {
+		size += fread(data + size, 1, capacity - size, file);
+
+		if (size < capacity) {
+			break;
+		}
+
+		uint8_t* new_data = (uint8_t*)realloc(data, capacity * 2);
+		if (new_data == NULL) {
+			free(data);
+			data = NULL;
+		} else {
+			data = new_data;
+			capacity *= 2;
+		}
+	}
+
+	if (data == NULL || ferror(file)) {
+		fprintf(stderr, "%s: Unable to read\n", name);
+		free(data);
+		return 0;
+	}
+
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		return fuzz_run(stdin, "stdin") ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	int success = 1;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		FILE* file = fopen(argv[i], "rb");
+
+		if (file == NULL) {
+			fprintf(stderr, "%s: Unable to open\n", argv[i]);
+			success = 0;
+			continue;
+		}
+
+		success &= fuzz_run(file, argv[i]);
+		fclose(file);
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,172 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+// Fuzz target of the memory reader: xyzimage_mopen, xyzimage_mprobe, xyzimage_mread_rows,
+// xyzimage_open_rgba and xyzimage_open_buffer through xyzimage_mread_func and xyzimage_mhash.
+// The results of the functions decoding without a XYZImage must match xyzimage_mopen.
+// Input: Three bytes selecting the parameters, followed by the XYZ file.
+
+#include "xyzimage_fuzz.h"
+
+typedef struct {
+	XYZImage* reference;
+	uint16_t next_row;
+	uint16_t first_row;
+	uint16_t stop_row;
+} fuzz_rows;
+
+static int fuzz_row_func(void* userdata, const XYZImage_Palette* palette, uint16_t y, const uint8_t* row, uint16_t width) {
+	fuzz_rows* rows = (fuzz_rows*)userdata;
+
+	// The rows arrive in order starting at the first requested row
+	FUZZ_CHECK(y == rows->next_row);
+	rows->next_row = (uint16_t)(y + 1);
+
+	if (rows->reference) {
+		const uint8_t* pixels = (const uint8_t*)xyzimage_get_buffer(rows->reference, NULL);
+		size_t pitch = xyzimage_get_pitch(rows->reference);
+
+		FUZZ_CHECK(width == xyzimage_get_width(rows->reference));
+		FUZZ_CHECK(memcmp(palette, xyzimage_get_palette_handle(rows->reference, NULL), sizeof(XYZImage_Palette)) == 0);
+		FUZZ_CHECK(memcmp(row, pixels + y * pitch, width) == 0);
+	}
+
+	return y != rows->stop_row;
+}
+
+static void fuzz_probe(XYZImage* reference, const uint8_t* file, size_t size) {
+	uint16_t w, h;
+	XYZImage_Palette palette;
+
+	int success = xyzimage_mprobe(file, size, &w, &h, &palette, NULL);
+
+	// Probing only inflates the palette, it can succeed for a broken image
+	FUZZ_CHECK(reference == NULL || success);
+
+	if (reference) {
+		FUZZ_CHECK(w == xyzimage_get_width(reference) && h == xyzimage_get_height(reference));
+		FUZZ_CHECK(memcmp(&palette, xyzimage_get_palette_handle(reference, NULL), sizeof(palette)) == 0);
+	}
+}
+
+static void fuzz_read_rows(XYZImage* reference, const uint8_t* file, size_t size, uint8_t first, uint8_t count) {
+	fuzz_rows rows;
+	rows.reference = reference;
+	rows.first_row = first;
+	rows.next_row = first;
+	// Stopping early in half of the runs
+	rows.stop_row = count & 1 ? (uint16_t)(first + count / 2) : 0xFFFF;
+
+	uint16_t row_count = count == 0xFF ? XYZIMAGE_ROWS_ALL : count;
+	uint16_t w, h;
+
+	int success = xyzimage_mread_rows(file, size, first, row_count, fuzz_row_func, &rows, &w, &h, NULL);
+
+	FUZZ_CHECK(reference == NULL || success);
+}
+
+static void fuzz_open_rgba(XYZImage* reference, const uint8_t* file, size_t size, uint8_t flags) {
+	if (reference == NULL) {
+		// Only for the memory checks
+		uint8_t pixel[4];
+		XYZImage_MemoryReader reader;
+		reader.data = file;
+		reader.size = size;
+		reader.offset = 0;
+		xyzimage_open_rgba(&reader, xyzimage_mread_func, pixel, sizeof(pixel), 0, XYZIMAGE_CHANNEL_ORDER_RGBA, 0, NULL, NULL, NULL);
+		return;
+	}
+
+	uint16_t w = xyzimage_get_width(reference);
+	uint16_t h = xyzimage_get_height(reference);
+	enum XYZImage_ChannelOrder order = (enum XYZImage_ChannelOrder)(flags & 3);
+	int transparent_index = flags & 4 ? 0 : XYZIMAGE_NO_TRANSPARENCY;
+	size_t pitch = flags & 8 ? (size_t)w * 4 + (flags >> 4) : 0;
+	size_t len = (pitch ? pitch : (size_t)w * 4) * h;
+
+	uint8_t* expected = (uint8_t*)calloc(1, len ? len : 1);
+	uint8_t* actual = (uint8_t*)calloc(1, len ? len : 1);
+
+	if (expected && actual) {
+		XYZImage_MemoryReader reader;
+		reader.data = file;
+		reader.size = size;
+		reader.offset = 0;
+
+		uint16_t rgba_w, rgba_h;
+		int converted = xyzimage_convert_rgba(reference, expected, len, pitch, order, transparent_index, NULL);
+		int decoded = xyzimage_open_rgba(&reader, xyzimage_mread_func, actual, len, pitch, order, transparent_index, &rgba_w, &rgba_h, NULL);
+
+		FUZZ_CHECK(converted && decoded);
+		FUZZ_CHECK(rgba_w == w && rgba_h == h);
+		FUZZ_CHECK(memcmp(expected, actual, len) == 0);
+	}
+
+	free(expected);
+	free(actual);
+}
+
+static void fuzz_open_buffer(XYZImage* reference, const uint8_t* file, size_t size, uint8_t flags) {
+	uint16_t w, h;
+
+	if (reference == NULL || !xyzimage_mprobe(file, size, &w, &h, NULL, NULL)) {
+		return;
+	}
+
+	// Padded rows
+	size_t pitch = (size_t)w + (flags >> 4);
+	size_t len = h > 0 ? pitch * (h - 1) + w : 0;
+	uint8_t* buffer = (uint8_t*)malloc(len ? len : 1);
+
+	if (buffer) {
+		XYZImage_MemoryReader reader;
+		reader.data = file;
+		reader.size = size;
+		reader.offset = 0;
+
+		XYZImage* image = xyzimage_open_buffer(&reader, xyzimage_mread_func, buffer, len, pitch, NULL);
+		FUZZ_CHECK(image != NULL);
+		fuzz_check_same_image(reference, image);
+		xyzimage_free(image);
+	}
+
+	free(buffer);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	if (size < 3) {
+		return 0;
+	}
+
+	uint8_t flags = data[0];
+	uint8_t first_row = data[1];
+	uint8_t row_count = data[2];
+	const uint8_t* file = data + 3;
+	size -= 3;
+
+	if (fuzz_too_large(file, size)) {
+		return 0;
+	}
+
+	XYZImage* reference = xyzimage_mopen(file, size, NULL);
+
+	fuzz_probe(reference, file, size);
+	fuzz_read_rows(reference, file, size, first_row, row_count);
+	fuzz_open_rgba(reference, file, size, flags);
+	fuzz_open_buffer(reference, file, size, flags);
+
+	uint64_t hash_a, hash_b;
+	int hashed = xyzimage_mhash(file, size, &hash_a, NULL);
+	FUZZ_CHECK(hashed == xyzimage_mhash(file, size, &hash_b, NULL));
+	FUZZ_CHECK(!hashed || hash_a == hash_b);
+
+	xyzimage_free(reference);
+
+	return 0;
+}
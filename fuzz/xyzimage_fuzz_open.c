@@ -0,0 +1,115 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+// Fuzz target of the stream decoders: xyzimage_open with short reads, xyzimage_open_sized,
+// the push decoder and a context skipping the checksum. Every image decoded from the same
+// data must be identical to the one of xyzimage_mopen.
+// Input: One byte selecting the chunk size of the reads, followed by the XYZ file.
+
+#include "xyzimage_fuzz.h"
+
+static XYZImage* fuzz_open_stream(const uint8_t* file, size_t size, size_t chunk, int sized) {
+	fuzz_reader reader;
+	reader.data = file;
+	reader.size = size;
+	reader.offset = 0;
+	reader.chunk = chunk;
+
+	xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+	XYZImage* image = sized ? xyzimage_open_sized(&reader, fuzz_read_func, size, &error) :
+		xyzimage_open(&reader, fuzz_read_func, &error);
+
+	FUZZ_CHECK((image == NULL) == (error != XYZIMAGE_ERROR_OK));
+
+	return image;
+}
+
+static XYZImage* fuzz_open_push(const uint8_t* file, size_t size, size_t chunk) {
+	XYZImage_Decoder* decoder = xyzimage_decoder_create(NULL);
+
+	if (decoder == NULL) {
+		return NULL;
+	}
+
+	enum XYZImage_DecoderStatus status = XYZIMAGE_DECODER_NEED_MORE_INPUT;
+	size_t offset = 0;
+
+	while (status != XYZIMAGE_DECODER_ERROR && status != XYZIMAGE_DECODER_DONE) {
+		size_t len = size - offset < chunk ? size - offset : chunk;
+		size_t consumed = 0;
+
+		status = xyzimage_decoder_feed(decoder, file + offset, len, &consumed, NULL);
+		FUZZ_CHECK(consumed <= len);
+		offset += consumed;
+
+		if (status == XYZIMAGE_DECODER_NEED_MORE_INPUT && offset == size) {
+			// Truncated
+			break;
+		}
+	}
+
+	XYZImage* image = xyzimage_decoder_take_image(decoder);
+	FUZZ_CHECK((image != NULL) == (status == XYZIMAGE_DECODER_DONE));
+	xyzimage_decoder_free(decoder);
+
+	return image;
+}
+
+static XYZImage* fuzz_open_trusted(const uint8_t* file, size_t size) {
+	XYZImage_Context* context = xyzimage_context_create(NULL, NULL);
+
+	if (context == NULL) {
+		return NULL;
+	}
+
+	xyzimage_context_set_verify_checksum(context, 0);
+
+	XYZImage* image = xyzimage_context_mopen(context, file, size, NULL);
+	xyzimage_context_free(context);
+
+	return image;
+}
+
+static void fuzz_compare(XYZImage* reference, XYZImage* image) {
+	if (reference && image) {
+		fuzz_check_same_image(reference, image);
+	}
+
+	xyzimage_free(image);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	if (size < 1) {
+		return 0;
+	}
+
+	// 1 byte to 64 KiB
+	size_t chunk = (size_t)1 << (data[0] % 17);
+	const uint8_t* file = data + 1;
+	size -= 1;
+
+	if (fuzz_too_large(file, size)) {
+		return 0;
+	}
+
+	XYZImage* reference = xyzimage_mopen(file, size, NULL);
+
+	fuzz_compare(reference, fuzz_open_stream(file, size, chunk, 0));
+	fuzz_compare(reference, fuzz_open_stream(file, size, chunk, 1));
+	fuzz_compare(reference, fuzz_open_push(file, size, chunk));
+
+	// Skipping the checksum accepts corrupted images, the pixels of valid ones must not differ
+	XYZImage* trusted = fuzz_open_trusted(file, size);
+	FUZZ_CHECK(reference == NULL || trusted != NULL);
+	fuzz_compare(reference, trusted);
+
+	xyzimage_free(reference);
+
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+// Fuzz target of the write functions: Writes an image with fuzzed compression options,
+// decodes it again and compares both. Covers the parallel, optimizing and incremental
+// compressors and xyzimage_rewrite_palette.
+// Input: Width, height, four bytes of options, followed by the palette and pixels (repeated when short).
+
+#include "xyzimage_fuzz.h"
+
+// Keeps the optimizing compressor fast enough, 64 KiB pixels still span several parallel blocks
+#define FUZZ_ROUNDTRIP_MAX_SIDE 256u
+
+typedef struct {
+	uint8_t* data;
+	size_t len;
+} fuzz_buffer;
+
+static int fuzz_write(XYZImage* image, fuzz_buffer* buffer) {
+	// The bound holds for all compress options, running out of space is a bug
+	size_t capacity = xyzimage_get_write_bound(image);
+
+	free(buffer->data);
+	buffer->data = (uint8_t*)malloc(capacity);
+	buffer->len = 0;
+
+	if (buffer->data == NULL) {
+		return 0;
+	}
+
+	xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+	int success = xyzimage_mwrite(image, buffer->data, capacity, &buffer->len, &error);
+
+	// Out of memory is fine, everything else is a bug
+	FUZZ_CHECK(success || error == XYZIMAGE_ERROR_OUT_OF_MEMORY);
+
+	return success;
+}
+
+static XYZImage* fuzz_reopen(const fuzz_buffer* buffer) {
+	xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+	XYZImage* image = xyzimage_mopen(buffer->data, buffer->len, &error);
+
+	FUZZ_CHECK(image != NULL || error == XYZIMAGE_ERROR_OUT_OF_MEMORY);
+
+	return image;
+}
+
+static void fuzz_check_same_picture(XYZImage* a, XYZImage* b) {
+	// The optimizer can reorder the palette: Compare the colors, not the indices
+	size_t len = (size_t)xyzimage_get_width(a) * xyzimage_get_height(a) * 4;
+	uint8_t* rgba_a = (uint8_t*)malloc(len ? len : 1);
+	uint8_t* rgba_b = (uint8_t*)malloc(len ? len : 1);
+
+	if (rgba_a && rgba_b) {
+		FUZZ_CHECK(xyzimage_convert_rgba(a, rgba_a, len, 0, XYZIMAGE_CHANNEL_ORDER_RGBA, 0, NULL));
+		FUZZ_CHECK(xyzimage_convert_rgba(b, rgba_b, len, 0, XYZIMAGE_CHANNEL_ORDER_RGBA, 0, NULL));
+		FUZZ_CHECK(memcmp(rgba_a, rgba_b, len) == 0);
+	}
+
+	free(rgba_a);
+	free(rgba_b);
+}
+
+static void fuzz_check_decoded(XYZImage* image, const XYZImage_CompressOptions* options, XYZImage* decoded) {
+	if (options->optimize && options->optimize_palette) {
+		fuzz_check_same_picture(image, decoded);
+	} else {
+		fuzz_check_same_image(image, decoded);
+	}
+}
+
+static void fuzz_rewrite_palette(const fuzz_buffer* buffer, XYZImage* decoded) {
+	XYZImage_Palette palette;
+	memcpy(&palette, xyzimage_get_palette_handle(decoded, NULL), sizeof(palette));
+
+	int i;
+	for (i = 0; i < XYZIMAGE_PALETTE_ENTRIES; ++i) {
+		palette.entry[i].red ^= 0xFF;
+	}
+
+	fuzz_buffer rewritten;
+	rewritten.len = 0;
+	rewritten.data = (uint8_t*)malloc(buffer->len * 2 + 4096);
+
+	if (rewritten.data) {
+		XYZImage_MemoryWriter writer;
+		writer.data = rewritten.data;
+		writer.size = buffer->len * 2 + 4096;
+		writer.offset = 0;
+
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		int success = xyzimage_rewrite_palette(buffer->data, buffer->len, &palette, &writer, xyzimage_mwrite_func, &error);
+		FUZZ_CHECK(success || error == XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		rewritten.len = writer.offset;
+
+		XYZImage* image = success ? fuzz_reopen(&rewritten) : NULL;
+
+		if (image) {
+			FUZZ_CHECK(memcmp(xyzimage_get_palette_handle(image, NULL), &palette, sizeof(palette)) == 0);
+
+			// Same pixels as before
+			XYZImage_Palette* image_palette = xyzimage_get_palette(image, NULL);
+			memcpy(image_palette, xyzimage_get_palette_handle(decoded, NULL), sizeof(palette));
+			fuzz_check_same_image(decoded, image);
+			xyzimage_free(image);
+		}
+	}
+
+	free(rewritten.data);
+}
+
+static void fuzz_incremental(XYZImage* image, const XYZImage_CompressOptions* options, const uint8_t* data, size_t size,
+		fuzz_buffer* buffer) {
+	// Changes a rectangle and writes again, the result must equal a fresh incremental write
+	uint16_t w = xyzimage_get_width(image);
+	uint16_t h = xyzimage_get_height(image);
+
+	if (w == 0 || h == 0 || size < 4) {
+		return;
+	}
+
+	uint16_t x = data[0] % w;
+	uint16_t y = data[1] % h;
+	uint16_t rect_w = (uint16_t)(1 + data[2] % (w - x));
+	uint16_t rect_h = (uint16_t)(1 + data[3] % (h - y));
+
+	uint8_t* pixels = (uint8_t*)xyzimage_get_buffer(image, NULL);
+	uint16_t i, j;
+	for (j = 0; j < rect_h; ++j) {
+		for (i = 0; i < rect_w; ++i) {
+			pixels[(size_t)(y + j) * w + x + i] ^= 0x55;
+		}
+	}
+
+	FUZZ_CHECK(xyzimage_mark_dirty(image, x, y, rect_w, rect_h, NULL));
+
+	if (!fuzz_write(image, buffer)) {
+		return;
+	}
+
+	XYZImage* fresh = fuzz_reopen(buffer);
+
+	if (fresh == NULL) {
+		return;
+	}
+
+	fuzz_check_same_image(image, fresh);
+	FUZZ_CHECK(xyzimage_set_compress_options(fresh, options, NULL));
+
+	fuzz_buffer fresh_buffer;
+	fresh_buffer.data = NULL;
+	fresh_buffer.len = 0;
+
+	if (fuzz_write(fresh, &fresh_buffer)) {
+		FUZZ_CHECK(fresh_buffer.len == buffer->len && memcmp(fresh_buffer.data, buffer->data, buffer->len) == 0);
+	}
+
+	free(fresh_buffer.data);
+	xyzimage_free(fresh);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	if (size < 6) {
+		return 0;
+	}
+
+	uint16_t w = (uint16_t)((data[0] | (data[1] << 8)) % (FUZZ_ROUNDTRIP_MAX_SIDE + 1));
+	uint16_t h = (uint16_t)((data[2] | (data[3] << 8)) % (FUZZ_ROUNDTRIP_MAX_SIDE + 1));
+	uint8_t flags = data[4];
+	uint8_t settings = data[5];
+	data += 6;
+	size -= 6;
+
+	XYZImage* image = xyzimage_alloc(w, h, XYZIMAGE_FORMAT_DEFAULT, NULL);
+
+	if (image == NULL) {
+		return 0;
+	}
+
+	// Palette and pixels are one block like in the file
+	XYZImage_Palette* palette = xyzimage_get_palette(image, NULL);
+	uint8_t* pixels = (uint8_t*)xyzimage_get_buffer(image, NULL);
+	size_t pixel_count = (size_t)w * h;
+	size_t i;
+
+	for (i = 0; i < XYZIMAGE_PALETTE_SIZE + pixel_count; ++i) {
+		uint8_t value = size > 0 ? data[i % size] : 0;
+
+		if (i < XYZIMAGE_PALETTE_SIZE) {
+			((uint8_t*)palette)[i] = value;
+		} else {
+			pixels[i - XYZIMAGE_PALETTE_SIZE] = value;
+		}
+	}
+
+	XYZImage_CompressOptions options;
+	xyzimage_get_compress_options(image, &options);
+	options.level = settings % 10;
+	options.strategy = (enum XYZImage_CompressStrategy)((settings / 10) % 5);
+	options.window_bits = 9 + (flags & 7) % 7;
+	options.mem_level = 1 + (settings / 50) % 5 * 2;
+	options.threads = 1 + ((flags >> 3) & 3);
+	options.separate_palette = (flags >> 5) & 1;
+	options.optimize = (flags >> 6) & 1;
+	options.optimize_palette = options.optimize && (settings & 1);
+	options.incremental = !options.optimize && (flags >> 7);
+
+	FUZZ_CHECK(xyzimage_set_compress_options(image, &options, NULL));
+
+	fuzz_buffer buffer;
+	buffer.data = NULL;
+	buffer.len = 0;
+
+	XYZImage* decoded = fuzz_write(image, &buffer) ? fuzz_reopen(&buffer) : NULL;
+
+	if (decoded) {
+		fuzz_check_decoded(image, &options, decoded);
+		fuzz_rewrite_palette(&buffer, decoded);
+		xyzimage_free(decoded);
+
+		if (options.incremental) {
+			fuzz_incremental(image, &options, data, size, &buffer);
+		}
+	}
+
+	free(buffer.data);
+	xyzimage_free(image);
+
+	return 0;
+}
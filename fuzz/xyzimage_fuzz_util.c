@@ -0,0 +1,67 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include "xyzimage_fuzz.h"
+
+int fuzz_too_large(const uint8_t* file, size_t size) {
+	if (size < 8) {
+		return 0;
+	}
+
+	size_t w = file[4] | (file[5] << 8);
+	size_t h = file[6] | (file[7] << 8);
+
+	return w * h > FUZZ_MAX_PIXELS;
+}
+
+size_t fuzz_read_func(void* userdata, void* buffer, size_t amount, xyzimage_error_t* error) {
+	fuzz_reader* reader = (fuzz_reader*)userdata;
+	size_t remaining = reader->size - reader->offset;
+	size_t len = amount;
+
+	if (len > reader->chunk) {
+		len = reader->chunk;
+	}
+
+	// A short read without an error code is a read error, the end of the data is reported as EOF
+	if (len >= remaining) {
+		len = remaining;
+		if (error) {
+			*error = XYZIMAGE_ERROR_IO_READ_END_OF_FILE;
+		}
+	} else if (len < amount && error) {
+		*error = XYZIMAGE_ERROR_IO_READ_GENERIC;
+	}
+
+	memcpy(buffer, reader->data + reader->offset, len);
+	reader->offset += len;
+
+	return len;
+}
+
+void fuzz_check_same_image(XYZImage* a, XYZImage* b) {
+	uint16_t w = xyzimage_get_width(a);
+	uint16_t h = xyzimage_get_height(a);
+
+	FUZZ_CHECK(xyzimage_get_width(b) == w && xyzimage_get_height(b) == h);
+
+	const XYZImage_Palette* palette_a = xyzimage_get_palette_handle(a, NULL);
+	const XYZImage_Palette* palette_b = xyzimage_get_palette_handle(b, NULL);
+	FUZZ_CHECK(palette_a && palette_b && memcmp(palette_a, palette_b, sizeof(XYZImage_Palette)) == 0);
+
+	const uint8_t* pixels_a = (const uint8_t*)xyzimage_get_buffer(a, NULL);
+	const uint8_t* pixels_b = (const uint8_t*)xyzimage_get_buffer(b, NULL);
+	size_t pitch_a = xyzimage_get_pitch(a);
+	size_t pitch_b = xyzimage_get_pitch(b);
+
+	uint16_t y;
+	for (y = 0; w > 0 && y < h; ++y) {
+		FUZZ_CHECK(memcmp(pixels_a + y * pitch_a, pixels_b + y * pitch_b, w) == 0);
+	}
+}
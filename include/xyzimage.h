@@ -19,6 +19,28 @@ extern "C" {
 
 typedef struct XYZImage XYZImage;
 
+/**
+ * Keeps the zlib state and the temporary buffers of the open and write functions alive between calls.
+ * See xyzimage_context_create.
+ */
+typedef struct XYZImage_Context XYZImage_Context;
+
+/**
+ * Stores palettes shared by many images once, see xyzimage_palette_cache_create.
+ */
+typedef struct XYZImage_PaletteCache XYZImage_PaletteCache;
+
+/**
+ * Push decoder: Decodes a XYZ image from data chunks passed by the caller.
+ * See xyzimage_decoder_create.
+ */
+typedef struct XYZImage_Decoder XYZImage_Decoder;
+
+/**
+ * Decodes requested images in the background, see xyzimage_loader_create.
+ */
+typedef struct XYZImage_Loader XYZImage_Loader;
+
 /** Number of palette entries (colors) in the XYZ color palette */
 #define XYZIMAGE_PALETTE_ENTRIES 256
 /** Size of the whole palette in bytes */
@@ -82,22 +104,133 @@ enum XYZImage_Error {
 	/** The used API call is not supported by this library version */
 	XYZIMAGE_ERROR_NOT_IMPLEMENTED,
 	/** The requested XYZImage_Format is not supported by this library version */
-	XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED
+	XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED,
+	/** At least one passed argument is out of range */
+	XYZIMAGE_ERROR_INVALID_ARGUMENT,
+	/** The pack has no XYZP magic or its index is corrupted */
+	XYZIMAGE_ERROR_PACK_INVALID,
+	/** The request of the loader is not finished yet */
+	XYZIMAGE_ERROR_LOAD_PENDING
 };
 
 /**
  * The color format of the image buffer.
  * During writing all formats are internally converted to the default format because
  * that is the only format supported by XYZ.
- * Currently no other formats are supported.
+ * The palette is built from the unique colors of the image, writing fails when there are more than 256.
  */
 enum XYZImage_Format {
 	/** No format specified */
 	XYZIMAGE_FORMAT_NONE = 0,
 	/** Default XYZ format: 1 byte per pixel referencing 256 colors in the palette */
-	XYZIMAGE_FORMAT_DEFAULT
+	XYZIMAGE_FORMAT_DEFAULT,
+	/** 4 bytes per pixel: red, green, blue and one unused byte */
+	XYZIMAGE_FORMAT_RGBX,
+	/**
+	 * 4 bytes per pixel: red, green, blue and alpha.
+	 * Alpha must be 0 or 255, transparent pixels are written as palette index 0.
+	 * Leaves 255 colors for the opaque pixels when the image has transparent pixels, otherwise 256.
+	 */
+	XYZIMAGE_FORMAT_RGBA
+};
+
+/**
+ * Result of xyzimage_decoder_feed.
+ */
+enum XYZImage_DecoderStatus {
+	/** Decoding failed, the error code is set */
+	XYZIMAGE_DECODER_ERROR = 0,
+	/** All passed data was consumed and the image is not complete yet */
+	XYZIMAGE_DECODER_NEED_MORE_INPUT,
+	/** The header was parsed, the size of the image is available. Feed the remaining data again. */
+	XYZIMAGE_DECODER_HEADER_READY,
+	/** The image is complete, data behind the image is not consumed */
+	XYZIMAGE_DECODER_DONE
 };
 
+/**
+ * Byte order of the color components of a 32 bit pixel in memory.
+ * Used by the functions converting to RGBA.
+ */
+enum XYZImage_ChannelOrder {
+	/** red, green, blue, alpha */
+	XYZIMAGE_CHANNEL_ORDER_RGBA = 0,
+	/** blue, green, red, alpha */
+	XYZIMAGE_CHANNEL_ORDER_BGRA,
+	/** alpha, red, green, blue */
+	XYZIMAGE_CHANNEL_ORDER_ARGB,
+	/** alpha, blue, green, red */
+	XYZIMAGE_CHANNEL_ORDER_ABGR
+};
+
+/**
+ * Compression strategies of zlib used by the write functions.
+ * RLE and FILTERED usually work well on indexed tile art.
+ */
+enum XYZImage_CompressStrategy {
+	/** Z_DEFAULT_STRATEGY */
+	XYZIMAGE_COMPRESS_STRATEGY_DEFAULT = 0,
+	/** Z_FILTERED */
+	XYZIMAGE_COMPRESS_STRATEGY_FILTERED,
+	/** Z_HUFFMAN_ONLY */
+	XYZIMAGE_COMPRESS_STRATEGY_HUFFMAN_ONLY,
+	/** Z_RLE */
+	XYZIMAGE_COMPRESS_STRATEGY_RLE,
+	/** Z_FIXED */
+	XYZIMAGE_COMPRESS_STRATEGY_FIXED
+};
+
+/**
+ * Options of the zlib compression used by the write functions.
+ * See deflateInit2 of zlib for details.
+ */
+typedef struct {
+	/** Compression level from 0 (no compression, fastest) to 9 (best compression, default) */
+	int level;
+	/** Compression strategy, default is XYZIMAGE_COMPRESS_STRATEGY_DEFAULT */
+	enum XYZImage_CompressStrategy strategy;
+	/** Base two logarithm of the window size from 9 to 15 (default) */
+	int window_bits;
+	/** Memory used for the internal compression state from 1 to 9, default is 8 */
+	int mem_level;
+	/**
+	 * Amount of threads compressing large images, 0 uses one thread per processor.
+	 * Default is 1 (single threaded). With multiple threads the image is split into
+	 * blocks which compress slightly worse, the output is still a regular XYZ file.
+	 */
+	unsigned int threads;
+	/**
+	 * When non-zero (default) the compressed palette ends on a block boundary that resets the dictionary.
+	 * Costs a few bytes and allows xyzimage_rewrite_palette to keep the compressed pixels.
+	 */
+	int separate_palette;
+	/**
+	 * When non-zero the image is compressed with several levels, strategies and memory levels and
+	 * the smallest stream is written, the settings above are one of them. Default is 0.
+	 * Meant for release builds: Compressing takes about ten times longer, the candidates are
+	 * compressed in parallel by the given amount of threads.
+	 */
+	int optimize;
+	/**
+	 * When non-zero and optimize is set the candidates are also compressed with the palette entries
+	 * sorted by usage, this makes the block headers smaller and doubles the time. Entry 0 (transparency)
+	 * keeps its place. The written file shows the same picture but the order of the palette changes.
+	 * Default is 0.
+	 */
+	int optimize_palette;
+	/**
+	 * When non-zero the write functions keep the compressed image in bands of rows, following
+	 * writes only compress the bands changed through xyzimage_mark_dirty again. Default is 0.
+	 * Meant for saving the same image repeatedly, e.g. autosave in an editor. Costs memory of
+	 * about the compressed size, the palette is always compressed. Changing the size or the zlib
+	 * settings compresses all bands. Has no effect on RGB images and when optimize is set.
+	 */
+	int incremental;
+} XYZImage_CompressOptions;
+
+/** Passed as transparent index when all palette entries are opaque */
+#define XYZIMAGE_NO_TRANSPARENCY -1
+
 typedef enum XYZImage_Error xyzimage_error_t;
 
 /**
@@ -126,6 +259,40 @@ typedef size_t (*xyzimage_read_func_t)(void* userdata, void* buffer, size_t amou
 typedef size_t (*xyzimage_compress_func_t)(
 		const void* buffer_in, size_t size_in, void* buffer_out, size_t size_out, xyzimage_error_t* error);
 
+/**
+ * Prototype of the custom decompress function used by the open functions.
+ * The input buffer contains a zlib stream (RFC 1950), it can be followed by unrelated trailing data.
+ *
+ * @param buffer_in Compressed XYZ image input buffer
+ * @param size_in Size of the input buffer in bytes
+ * @param buffer_out Uncompressed XYZ image output buffer
+ * @param size_out Size of the output buffer in bytes, this is the exact size of the uncompressed image
+ * @param error When non-null receives the error code when an error occurred
+ * @return How many bytes were written into the output buffer. In error case 0 must be returned and an error code set.
+ */
+typedef size_t (*xyzimage_decompress_func_t)(
+		const void* buffer_in, size_t size_in, void* buffer_out, size_t size_out, xyzimage_error_t* error);
+
+/**
+ * Custom memory allocation functions, see xyzimage_set_allocator.
+ * The functions must behave like malloc, realloc and free of the C library.
+ */
+typedef struct {
+	/** Allocates size bytes, returns NULL on error */
+	void* (*malloc_func)(void* userdata, size_t size);
+	/** Resizes the allocation ptr (can be NULL) to size bytes, returns NULL on error */
+	void* (*realloc_func)(void* userdata, void* ptr, size_t size);
+	/** Frees the allocation ptr (can be NULL) */
+	void (*free_func)(void* userdata, void* ptr);
+	/** Custom data forwarded to the functions */
+	void* userdata;
+} XYZImage_Allocator;
+
+/**
+ * Bump allocator providing the temporary memory of the open and write functions, see xyzimage_arena_create.
+ */
+typedef struct XYZImage_Arena XYZImage_Arena;
+
 /**
  * Prototype of the custom read function passed to xyzimage_open.
  *
@@ -137,6 +304,107 @@ typedef size_t (*xyzimage_compress_func_t)(
  */
 typedef size_t (*xyzimage_write_func_t)(void* userdata, const void* buffer, size_t amount, xyzimage_error_t* error);
 
+/**
+ * Prototype of the row function passed to xyzimage_read_rows.
+ *
+ * @param userdata row_userdata passed to xyzimage_read_rows
+ * @param palette Palette of the image
+ * @param y Index of the row
+ * @param row Palette indices of the row, only valid during the call
+ * @param width Width of the image, amount of palette indices in row
+ * @return 1 to continue, 0 to stop decoding
+ */
+typedef int (*xyzimage_row_func_t)(void* userdata, const XYZImage_Palette* palette, uint16_t y, const uint8_t* row, uint16_t width);
+
+/** Row count passed to xyzimage_read_rows to decode all rows starting at the first row */
+#define XYZIMAGE_ROWS_ALL 0xFFFFu
+
+/**
+ * Phases reported to the trace function and measured in XYZImage_Stats, see xyzimage_context_set_trace_func.
+ */
+enum XYZImage_TracePhase {
+	/** A whole open call of a context */
+	XYZIMAGE_TRACE_PHASE_OPEN = 0,
+	/** A whole write call of a context */
+	XYZIMAGE_TRACE_PHASE_WRITE,
+	/** A call of the read function */
+	XYZIMAGE_TRACE_PHASE_READ_FUNC,
+	/** A call of the write function */
+	XYZIMAGE_TRACE_PHASE_WRITE_FUNC,
+	/** Decompression by zlib or the custom decompress function */
+	XYZIMAGE_TRACE_PHASE_DECOMPRESS,
+	/** Compression by zlib or the custom compress function */
+	XYZIMAGE_TRACE_PHASE_COMPRESS,
+	/** Conversion and copying of pixels between formats and buffers */
+	XYZIMAGE_TRACE_PHASE_CONVERT,
+	/** Amount of phases */
+	XYZIMAGE_TRACE_PHASE_COUNT
+};
+
+/**
+ * Counters of a context, see xyzimage_context_set_stats.
+ * All values are accumulated, reset the struct with xyzimage_stats_reset.
+ */
+typedef struct {
+	/** Amount of successfully opened images */
+	uint64_t images_opened;
+	/** Amount of successfully written images */
+	uint64_t images_written;
+	/** Bytes returned by the read function or consumed from a memory buffer */
+	uint64_t bytes_read;
+	/** Bytes passed to the write function or written into a memory buffer */
+	uint64_t bytes_written;
+	/** Size of the compressed streams of the opened images */
+	uint64_t compressed_read;
+	/** Size of the decompressed streams (palette and pixels) of the opened images */
+	uint64_t decompressed_read;
+	/** Size of the compressed streams of the written images */
+	uint64_t compressed_written;
+	/** Size of the uncompressed streams (palette and pixels) of the written images */
+	uint64_t uncompressed_written;
+	/** Calls of the read function */
+	uint64_t read_calls;
+	/** Calls of the write function */
+	uint64_t write_calls;
+	/** Calls of the allocator of the context, including the allocation of the opened images */
+	uint64_t allocations;
+	/** Time spent in each phase in nanoseconds, nested phases are also part of the enclosing phase */
+	uint64_t time_ns[XYZIMAGE_TRACE_PHASE_COUNT];
+} XYZImage_Stats;
+
+/**
+ * Prototype of the trace function, see xyzimage_context_set_trace_func.
+ *
+ * @param userdata userdata passed to xyzimage_context_set_trace_func
+ * @param phase The phase that begins or ends
+ * @param begin 1 when the phase begins, 0 when it ends
+ */
+typedef void (*xyzimage_trace_func_t)(void* userdata, enum XYZImage_TracePhase phase, int begin);
+
+/**
+ * Userdata of xyzimage_mread_func: A memory buffer containing a XYZ image.
+ */
+typedef struct {
+	/** Start of the memory buffer */
+	const void* data;
+	/** Size of the memory buffer in bytes */
+	size_t size;
+	/** Current read position, after reading points behind the XYZ image */
+	size_t offset;
+} XYZImage_MemoryReader;
+
+/**
+ * Userdata of xyzimage_mwrite_func: A memory buffer receiving a XYZ image.
+ */
+typedef struct {
+	/** Start of the memory buffer */
+	void* data;
+	/** Size of the memory buffer in bytes */
+	size_t size;
+	/** Current write position, after writing points behind the XYZ image */
+	size_t offset;
+} XYZImage_MemoryWriter;
+
 /**
  * Instantiates a new, empty (black) XYZ image providing a buffer in the specified format.
  *
@@ -158,6 +426,8 @@ int xyzimage_free(XYZImage* image);
 
 /**
  * Loads a XYZ image from a FILE handle.
+ * Regular files are loaded from the current position to the end with a single read (or memory mapped
+ * when large) and the file position is behind the image afterwards. Other streams are read in chunks.
  * The pixel format of images loaded through this function is XYZIMAGE_FORMAT_DEFAULT.
  *
  * @param file Handle to read from
@@ -177,6 +447,277 @@ XYZImage* xyzimage_fopen(FILE* file, xyzimage_error_t* error);
  */
 XYZImage* xyzimage_open(void* userdata, xyzimage_read_func_t read_func, xyzimage_error_t* error);
 
+/**
+ * Loads a XYZ image of known size using a custom read function.
+ * Exactly size bytes are read, never more, and the end of the data does not need to be signaled with
+ * XYZIMAGE_ERROR_IO_READ_END_OF_FILE. This decodes XYZ images embedded in larger files in place and
+ * the custom decompress function receives a buffer of the exact compressed size.
+ * The pixel format of images loaded through this function is XYZIMAGE_FORMAT_DEFAULT.
+ *
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function used for parsing
+ * @param size Size of the XYZ file (header and compressed data) in bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return An instance of XYZImage when successful, on error NULL is returned and an error code set.
+ */
+XYZImage* xyzimage_open_sized(void* userdata, xyzimage_read_func_t read_func, size_t size, xyzimage_error_t* error);
+
+/**
+ * Loads a XYZ image using a custom read function and decodes the pixels into a user provided buffer.
+ * The returned XYZImage uses the buffer as its image buffer but does not take ownership of it:
+ * The buffer must stay valid until the image is freed and is not freed by xyzimage_free.
+ * The pixel format of images loaded through this function is XYZIMAGE_FORMAT_DEFAULT.
+ *
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function used for parsing
+ * @param buffer Buffer receiving the pixels of the image
+ * @param len Size of the buffer in bytes, must be at least pitch * (height - 1) + width
+ * @param pitch Distance between the start of two rows in bytes, 0 when the rows are not padded
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return An instance of XYZImage when successful, on error NULL is returned and an error code set.
+ */
+XYZImage* xyzimage_open_buffer(void* userdata, xyzimage_read_func_t read_func, void* buffer, size_t len, size_t pitch, xyzimage_error_t* error);
+
+/**
+ * Creates a push decoder. Unlike the open functions, which pull the data through a read function,
+ * the caller passes the data in chunks of any size with xyzimage_decoder_feed as it arrives.
+ * This allows decoding many images on one thread from non-blocking I/O.
+ * zlib is always used, the custom decompress function is ignored.
+ *
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return decoder or NULL on error
+ */
+XYZImage_Decoder* xyzimage_decoder_create(xyzimage_error_t* error);
+
+/**
+ * Frees the decoder and the image when it was not taken by xyzimage_decoder_take_image.
+ *
+ * @param decoder Decoder to free
+ */
+void xyzimage_decoder_free(XYZImage_Decoder* decoder);
+
+/**
+ * Passes the next chunk of the XYZ file to the decoder.
+ * Decoding stops after the header (XYZIMAGE_DECODER_HEADER_READY) and after the image (XYZIMAGE_DECODER_DONE),
+ * then consumed can be smaller than len. Pass the remaining data in the next call.
+ * After an error all further calls fail with the same error.
+ *
+ * @param decoder Instance of XYZImage_Decoder
+ * @param data Next chunk of the file
+ * @param len Size of the chunk in bytes
+ * @param consumed When non-null receives the amount of bytes consumed from data
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return State of the decoder
+ */
+enum XYZImage_DecoderStatus xyzimage_decoder_feed(XYZImage_Decoder* decoder, const void* data, size_t len, size_t* consumed, xyzimage_error_t* error);
+
+/**
+ * Retrieves the size of the image, available after XYZIMAGE_DECODER_HEADER_READY.
+ *
+ * @param decoder Instance of XYZImage_Decoder
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @return 1 when the header was parsed, 0 otherwise
+ */
+int xyzimage_decoder_get_size(const XYZImage_Decoder* decoder, uint16_t* width, uint16_t* height);
+
+/**
+ * Takes the decoded image out of the decoder, available after XYZIMAGE_DECODER_DONE.
+ * The caller owns the image and must free it with xyzimage_free.
+ *
+ * @param decoder Instance of XYZImage_Decoder
+ * @return The image or NULL when decoding did not finish or the image was already taken
+ */
+XYZImage* xyzimage_decoder_take_image(XYZImage_Decoder* decoder);
+
+/**
+ * Loads a XYZ image using a custom read function and decodes it directly into a 32 bit per pixel buffer.
+ * The palette lookup happens while inflating, no XYZImage is created.
+ * Every pixel has an alpha value of 255, except for pixels referencing the transparent index with alpha 0.
+ *
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function used for parsing
+ * @param buffer Buffer receiving the pixels of the image
+ * @param len Size of the buffer in bytes, must be at least pitch * (height - 1) + width * 4
+ * @param pitch Distance between the start of two rows in bytes, 0 when the rows are not padded
+ * @param order Byte order of the color components
+ * @param transparent_index Palette index that is transparent (RPG Maker uses 0) or XYZIMAGE_NO_TRANSPARENCY
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_open_rgba(void* userdata, xyzimage_read_func_t read_func, void* buffer, size_t len, size_t pitch,
+		enum XYZImage_ChannelOrder order, int transparent_index, uint16_t* width, uint16_t* height, xyzimage_error_t* error);
+
+/**
+ * Loads a XYZ image from a memory buffer.
+ * The compressed data is passed to zlib directly from the buffer without copying.
+ * The pixel format of images loaded through this function is XYZIMAGE_FORMAT_DEFAULT.
+ *
+ * @param data Buffer containing the XYZ image
+ * @param len Size of the buffer in bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return An instance of XYZImage when successful, on error NULL is returned and an error code set.
+ */
+XYZImage* xyzimage_mopen(const void* data, size_t len, xyzimage_error_t* error);
+
+/**
+ * Read function for XYZImage_MemoryReader userdata.
+ * When passed as read_func to any open function the memory is read without copying.
+ *
+ * @param userdata Pointer to a XYZImage_MemoryReader
+ * @param buffer Output buffer
+ * @param amount How many bytes to read into the buffer
+ * @param error When non-null receives the error code when an error occurred
+ * @return How many bytes were read into the buffer.
+ */
+size_t xyzimage_mread_func(void* userdata, void* buffer, size_t amount, xyzimage_error_t* error);
+
+/**
+ * Reads only the header of a XYZ image using a custom read function.
+ * This is much faster than decoding the whole image when only the dimensions are of interest.
+ *
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function used for parsing
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @param palette When non-null the palette is decompressed into it, the pixels are not decompressed
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_probe(void* userdata, xyzimage_read_func_t read_func, uint16_t* width, uint16_t* height, XYZImage_Palette* palette, xyzimage_error_t* error);
+
+/**
+ * Reads only the header of a XYZ image from a FILE handle.
+ * See xyzimage_probe for details. The position of the file handle is not restored.
+ *
+ * @param file Handle to read from
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @param palette When non-null the palette is decompressed into it, the pixels are not decompressed
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_fprobe(FILE* file, uint16_t* width, uint16_t* height, XYZImage_Palette* palette, xyzimage_error_t* error);
+
+/**
+ * Reads only the header of a XYZ image from a memory buffer.
+ * See xyzimage_probe for details.
+ *
+ * @param data Buffer containing the XYZ image
+ * @param len Size of the buffer in bytes
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @param palette When non-null the palette is decompressed into it, the pixels are not decompressed
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_mprobe(const void* data, size_t len, uint16_t* width, uint16_t* height, XYZImage_Palette* palette, xyzimage_error_t* error);
+
+/**
+ * Decodes a range of rows of a XYZ image using a custom read function without creating a XYZImage.
+ * Every row is passed to row_func as soon as it was inflated. The rows above first_row are inflated but
+ * not passed, decoding stops after the last requested row: The remaining stream is not read.
+ * The checksum of the image is only verified when the range includes the last row.
+ * zlib is always used, the custom decompress function is ignored.
+ *
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function used for parsing
+ * @param first_row Index of the first row passed to row_func
+ * @param row_count Amount of rows to decode, clipped to the height, XYZIMAGE_ROWS_ALL for all rows
+ * @param row_func Invoked for every row, can stop decoding by returning 0
+ * @param row_userdata Custom data forwarded to row_func
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success or when row_func stopped decoding, on error 0 is returned and an error code set.
+ */
+int xyzimage_read_rows(void* userdata, xyzimage_read_func_t read_func, uint16_t first_row, uint16_t row_count,
+		xyzimage_row_func_t row_func, void* row_userdata, uint16_t* width, uint16_t* height, xyzimage_error_t* error);
+
+/**
+ * Decodes a range of rows of a XYZ image from a file, see xyzimage_read_rows.
+ *
+ * @param file File handle
+ * @param first_row Index of the first row passed to row_func
+ * @param row_count Amount of rows to decode, clipped to the height, XYZIMAGE_ROWS_ALL for all rows
+ * @param row_func Invoked for every row, can stop decoding by returning 0
+ * @param row_userdata Custom data forwarded to row_func
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success or when row_func stopped decoding, on error 0 is returned and an error code set.
+ */
+int xyzimage_fread_rows(FILE* file, uint16_t first_row, uint16_t row_count,
+		xyzimage_row_func_t row_func, void* row_userdata, uint16_t* width, uint16_t* height, xyzimage_error_t* error);
+
+/**
+ * Decodes a range of rows of a XYZ image from a memory buffer, see xyzimage_read_rows.
+ *
+ * @param data Buffer containing the XYZ image
+ * @param len Size of the buffer in bytes
+ * @param first_row Index of the first row passed to row_func
+ * @param row_count Amount of rows to decode, clipped to the height, XYZIMAGE_ROWS_ALL for all rows
+ * @param row_func Invoked for every row, can stop decoding by returning 0
+ * @param row_userdata Custom data forwarded to row_func
+ * @param width When non-null receives the width of the image
+ * @param height When non-null receives the height of the image
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success or when row_func stopped decoding, on error 0 is returned and an error code set.
+ */
+int xyzimage_mread_rows(const void* data, size_t len, uint16_t first_row, uint16_t row_count,
+		xyzimage_row_func_t row_func, void* row_userdata, uint16_t* width, uint16_t* height, xyzimage_error_t* error);
+
+/**
+ * Describes one image decoded by xyzimage_open_batch.
+ * Exactly one source is used: path, when NULL data, when NULL read_func.
+ */
+typedef struct {
+	/** Path of a XYZ file to load */
+	const char* path;
+	/** Memory buffer containing a XYZ image, see xyzimage_mopen */
+	const void* data;
+	/** Size of data in bytes */
+	size_t size;
+	/** Custom read function, see xyzimage_open */
+	xyzimage_read_func_t read_func;
+	/** Custom data forwarded to read_func */
+	void* userdata;
+	/** Receives the decoded image or NULL on error, must be freed by the caller unless the callback took it */
+	XYZImage* image;
+	/** Receives the error code of this item */
+	xyzimage_error_t error;
+} XYZImage_BatchItem;
+
+/**
+ * Prototype of the function invoked by xyzimage_open_batch after an item was processed.
+ * Invoked from the worker threads: Calls for different items can happen concurrently.
+ *
+ * @param userdata userdata passed to xyzimage_open_batch
+ * @param item The processed item, check item->image and item->error for the result.
+ *             The callback can take the image and set item->image to NULL, it must not change item->error.
+ * @param index Index of the item
+ */
+typedef void (*xyzimage_batch_callback_t)(void* userdata, XYZImage_BatchItem* item, size_t index);
+
+/**
+ * Decodes many XYZ images in parallel using a pool of worker threads.
+ * The workers take the next unprocessed item until all items are done.
+ * The calling thread takes part in decoding and the function returns when all items are processed.
+ * When the library is built without thread support all items are decoded by the calling thread.
+ *
+ * @param items Images to decode, results are stored in the items
+ * @param count Amount of items
+ * @param threads Amount of threads to use, 0 uses one thread per processor
+ * @param callback When non-null invoked after each item was processed
+ * @param userdata Custom data forwarded to callback
+ * @param error When non-null receives the error code of the first failed item or XYZIMAGE_ERROR_OK on success
+ * @return 1 when all items were decoded successfully, otherwise 0 and an error code set.
+ */
+int xyzimage_open_batch(XYZImage_BatchItem* items, size_t count, unsigned int threads,
+		xyzimage_batch_callback_t callback, void* userdata, xyzimage_error_t* error);
+
 /**
  * Retrieves the width of the XYZ image.
  *
@@ -196,6 +737,8 @@ uint16_t xyzimage_get_height(const XYZImage* image);
 /**
  * Retrieves the palette of the XYZ image for read/write operations.
  * Fails when the image format of the buffer is not using an indexed palette.
+ * A palette shared through a XYZImage_PaletteCache is copied first because it can be modified through
+ * the pointer, use xyzimage_get_palette_handle for read-only access.
  *
  * @param image Instance of XYZImage
  * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
@@ -203,6 +746,77 @@ uint16_t xyzimage_get_height(const XYZImage* image);
  */
 XYZImage_Palette* xyzimage_get_palette(XYZImage* image, xyzimage_error_t* error);
 
+/**
+ * Retrieves the palette of the XYZ image for read operations.
+ * Images sharing a palette through a XYZImage_PaletteCache return the same pointer, it can be used
+ * as a key for e.g. a palette texture. The pointer is valid until the image is freed or
+ * xyzimage_get_palette is called.
+ *
+ * @param image Instance of XYZImage
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return Pointer to the palette or NULL on error
+ */
+const XYZImage_Palette* xyzimage_get_palette_handle(const XYZImage* image, xyzimage_error_t* error);
+
+/**
+ * Calculates a 64 bit hash of the palette. Equal palettes have equal hashes on every platform.
+ * Shared palettes are hashed once when they are added to the cache.
+ *
+ * @param image Instance of XYZImage
+ * @return Hash of the palette, 0 when the image is invalid or not indexed
+ */
+uint64_t xyzimage_get_palette_hash(const XYZImage* image);
+
+/**
+ * Checks if the palette differs from the palette a hash was taken from.
+ * Used to skip uploading the palette again, e.g. after switching to an image using the same colors.
+ *
+ * @param image Instance of XYZImage
+ * @param hash Hash of the previous palette or 0, receives the hash of the current palette
+ * @return 1 when the palette changed, otherwise 0
+ */
+int xyzimage_palette_changed(const XYZImage* image, uint64_t* hash);
+
+/**
+ * Creates a palette cache.
+ * Images opened through a context using the cache reference a shared copy of their palette instead of
+ * embedding it: Images with identical palettes use the same memory. The cache is thread safe and can be
+ * used by many contexts.
+ *
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return cache or NULL on error, must be freed with xyzimage_palette_cache_free
+ */
+XYZImage_PaletteCache* xyzimage_palette_cache_create(xyzimage_error_t* error);
+
+/**
+ * Frees a palette cache.
+ * Images that still reference a palette of the cache keep it valid, the memory is released
+ * when the last of them is freed.
+ *
+ * @param cache Cache to free
+ */
+void xyzimage_palette_cache_free(XYZImage_PaletteCache* cache);
+
+/**
+ * Retrieves the amount of distinct palettes in the cache.
+ * Palettes are removed when no image references them anymore.
+ *
+ * @param cache Instance of XYZImage_PaletteCache
+ * @return Amount of palettes
+ */
+size_t xyzimage_palette_cache_get_count(XYZImage_PaletteCache* cache);
+
+/**
+ * Replaces the palette of the image with the shared copy from the cache.
+ * Used for images that were not opened through a context using the cache.
+ *
+ * @param image Instance of XYZImage
+ * @param cache Instance of XYZImage_PaletteCache
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_share_palette(XYZImage* image, XYZImage_PaletteCache* cache, xyzimage_error_t* error);
+
 /**
  * Retrieves the pixel format of the XYZ image.
  *
@@ -220,6 +834,43 @@ enum XYZImage_Format xyzimage_get_format(const XYZImage* image);
  */
 void* xyzimage_get_buffer(XYZImage* image, size_t* len);
 
+/**
+ * Retrieves the distance between the start of two rows of the image buffer.
+ * This is only different to the width for images loaded by xyzimage_open_buffer.
+ *
+ * @param image Instance of XYZImage
+ * @return Pitch of the image buffer in bytes, 0 when the image is invalid.
+ */
+size_t xyzimage_get_pitch(const XYZImage* image);
+
+/**
+ * Converts the XYZ image into a 32 bit per pixel buffer by looking up the palette.
+ * Every pixel has an alpha value of 255, except for pixels referencing the transparent index with alpha 0.
+ *
+ * @param image Instance of XYZImage
+ * @param buffer Buffer receiving the pixels of the image
+ * @param len Size of the buffer in bytes, must be at least pitch * (height - 1) + width * 4
+ * @param pitch Distance between the start of two rows in bytes, 0 when the rows are not padded
+ * @param order Byte order of the color components
+ * @param transparent_index Palette index that is transparent (RPG Maker uses 0) or XYZIMAGE_NO_TRANSPARENCY
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_convert_rgba(const XYZImage* image, void* buffer, size_t len, size_t pitch,
+		enum XYZImage_ChannelOrder order, int transparent_index, xyzimage_error_t* error);
+
+/**
+ * Replaces every palette index of the image with lut[index].
+ * Used for recoloring and for merging palettes: Reordering the palette and the indices together keeps
+ * the picture unchanged. Uses SIMD instructions when supported by the CPU.
+ *
+ * @param image Instance of XYZImage
+ * @param lut XYZIMAGE_PALETTE_ENTRIES new palette indices
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_remap_indices(XYZImage* image, const uint8_t* lut, xyzimage_error_t* error);
+
 /**
  * Calculates the theoretical filesize when the image would be saved uncompressed.
  *
@@ -241,33 +892,683 @@ size_t xyzimage_get_filesize(const XYZImage* image);
 size_t xyzimage_get_compressed_filesize(const XYZImage* image);
 
 /**
- * Allows specifying of a custom compression function for the write functions.
- * Only for advanced use cases.
+ * Retrieves the Adler-32 checksum stored in the zlib stream the image was opened from or last written to.
+ * When the checksum was not verified (see xyzimage_context_set_verify_checksum) it can be compared
+ * against a checksum calculated offline.
  *
  * @param image Instance of XYZImage
- * @param compress_func Custom compress function to use, when NULL zlib DEFLATE is used.
+ * @param checksum Receives the checksum
+ * @return 1 on success, 0 when the checksum is unknown: the image was created by xyzimage_alloc and
+ *  not written yet or it was opened with a custom decompress function
  */
-void xyzimage_set_compress_func(XYZImage* image, xyzimage_compress_func_t compress_func);
+int xyzimage_get_checksum(const XYZImage* image, uint32_t* checksum);
 
 /**
- * Writes a XYZ image to a FILE handle.
+ * Retrieves the hash of the palette and the pixels calculated while the image was decoded.
+ * Suited as key of a cache of decoded images: Equal pictures have equal hashes, independent of
+ * how they were compressed. The hash is not updated when the palette or the pixels change.
+ *
+ * The hash is XXH64 over the 768 palette bytes followed by the palette indices row by row
+ * without padding. The seed is width | (height << 16).
  *
  * @param image Instance of XYZImage
- * @param file Handle to write to
- * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
- * @return 1 on success, on error 0 is returned and an error code set.
+ * @param hash Receives the hash
+ * @return 1 on success, 0 when the hash is unknown: the image was not decoded or
+ *  hashing was disabled (see xyzimage_context_set_content_hash)
  */
-int xyzimage_fwrite(XYZImage* image, FILE* file, xyzimage_error_t* error);
+int xyzimage_get_content_hash(const XYZImage* image, uint64_t* hash);
 
 /**
- * Writes a XYZ image using a custom write function.
+ * Hashes a XYZ file in memory without decompressing it.
+ * Equal files have equal hashes, this allows skipping the decoding of already cached images.
+ * The same picture compressed differently gets a different hash, unlike xyzimage_get_content_hash.
  *
- * @param userdata Custom data forwarded to write_func
- * @param write_func Custom write function
+ * @param data XYZ file, the whole buffer is hashed
+ * @param len Size of data in bytes
+ * @param hash Receives the hash (XXH64 with seed 0)
  * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
  * @return 1 on success, on error 0 is returned and an error code set.
  */
-int xyzimage_write(XYZImage* image, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error);
+int xyzimage_mhash(const void* data, size_t len, uint64_t* hash, xyzimage_error_t* error);
+
+/**
+ * Allows specifying of a custom compression function for the write functions.
+ * Only for advanced use cases.
+ *
+ * @param image Instance of XYZImage
+ * @param compress_func Custom compress function to use, when NULL zlib DEFLATE is used.
+ */
+void xyzimage_set_compress_func(XYZImage* image, xyzimage_compress_func_t compress_func);
+
+/**
+ * Sets the options of the zlib compression used by the write functions.
+ * Has no effect when a custom compress function is set.
+ * Low levels or the RLE strategy are useful for interactive saving.
+ *
+ * @param image Instance of XYZImage
+ * @param options Compression options to use
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_set_compress_options(XYZImage* image, const XYZImage_CompressOptions* options, xyzimage_error_t* error);
+
+/**
+ * Marks a rectangle of the pixels as changed for the incremental compression (see XYZImage_CompressOptions).
+ * Must be called for every change of the image buffer, unmarked changes are missing in the written file.
+ * The palette needs no marking, it is always compressed. The rectangle is clipped to the image.
+ * Does nothing when the image was not written incrementally yet.
+ *
+ * @param image Instance of XYZImage
+ * @param x Left column of the rectangle
+ * @param y Top row of the rectangle
+ * @param width Width of the rectangle
+ * @param height Height of the rectangle
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_mark_dirty(XYZImage* image, uint16_t x, uint16_t y, uint16_t width, uint16_t height, xyzimage_error_t* error);
+
+/**
+ * Retrieves the options of the zlib compression used by the write functions.
+ *
+ * @param image Instance of XYZImage
+ * @param options Receives the compression options
+ * @return 1 on success, 0 when the image is invalid
+ */
+int xyzimage_get_compress_options(const XYZImage* image, XYZImage_CompressOptions* options);
+
+/**
+ * Allows specifying of a custom decompression function for all open functions.
+ * Only for advanced use cases, e.g. to use a faster inflate implementation.
+ * The setting is global: Do not call this function while images are decoded by other threads.
+ *
+ * Unlike zlib, which streams the image, the custom function receives the whole compressed image and
+ * decompresses it into an intermediate buffer. When reading through xyzimage_mread_func the
+ * memory is passed without copying but the whole remaining buffer is consumed.
+ *
+ * @param decompress_func Custom decompress function to use, when NULL zlib INFLATE is used.
+ */
+void xyzimage_set_decompress_func(xyzimage_decompress_func_t decompress_func);
+
+/**
+ * Sets the memory allocation functions used for all allocations of the library, this includes zlib.
+ * The setting is global: Do not call this function while other threads use the library.
+ * Images remember the allocator they were created with and are freed with it.
+ *
+ * @param allocator Functions to use, when NULL malloc, realloc and free of the C library are used.
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_set_allocator(const XYZImage_Allocator* allocator, xyzimage_error_t* error);
+
+/**
+ * Creates a bump allocator for the temporary memory (zlib state and intermediate buffers)
+ * of the open and write functions. Allocating from it is cheap and does not fragment the heap.
+ * After each open or write function the arena is reset. When the arena is too small
+ * the allocator set by xyzimage_set_allocator is used for the remaining allocations.
+ * Decoding requires about 48 KiB, encoding about 300 KiB plus width * height for RGBX and RGBA images,
+ * use xyzimage_arena_get_peak_usage to tune the size.
+ *
+ * @param size Size of the arena in bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return arena or NULL on error
+ */
+XYZImage_Arena* xyzimage_arena_create(size_t size, xyzimage_error_t* error);
+
+/**
+ * Frees the arena. It must not be in use by xyzimage_set_scratch_arena.
+ *
+ * @param arena Arena to free
+ */
+void xyzimage_arena_free(XYZImage_Arena* arena);
+
+/**
+ * Retrieves the largest amount of memory that was allocated from the arena at once.
+ *
+ * @param arena Arena to query
+ * @return Peak usage in bytes
+ */
+size_t xyzimage_arena_get_peak_usage(const XYZImage_Arena* arena);
+
+/**
+ * Sets the arena providing the temporary memory of the open and write functions.
+ * An arena can only serve one function at a time: Do not use the library from multiple threads
+ * while an arena is set, this includes xyzimage_open_batch.
+ *
+ * @param arena Arena to use, when NULL the allocator set by xyzimage_set_allocator is used.
+ */
+void xyzimage_set_scratch_arena(XYZImage_Arena* arena);
+
+/**
+ * Writes a XYZ image to a FILE handle.
+ *
+ * @param image Instance of XYZImage
+ * @param file Handle to write to
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_fwrite(XYZImage* image, FILE* file, xyzimage_error_t* error);
+
+/**
+ * Writes a XYZ image using a custom write function.
+ *
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Custom write function
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_write(XYZImage* image, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error);
+
+/**
+ * Writes a XYZ image into a memory buffer.
+ * The image is compressed directly into the buffer.
+ * A buffer of xyzimage_get_write_bound bytes is always large enough.
+ *
+ * @param image Instance of XYZImage
+ * @param buffer Buffer to write to
+ * @param len Size of the buffer in bytes
+ * @param written When non-null receives the amount of written bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_mwrite(XYZImage* image, void* buffer, size_t len, size_t* written, xyzimage_error_t* error);
+
+/**
+ * Write function for XYZImage_MemoryWriter userdata.
+ * When passed as write_func to xyzimage_write the image is compressed directly into the memory.
+ *
+ * @param userdata Pointer to a XYZImage_MemoryWriter
+ * @param buffer Input buffer
+ * @param amount How many bytes to write from the buffer
+ * @param error When non-null receives the error code when an error occurred
+ * @return How many bytes were written from the buffer.
+ */
+size_t xyzimage_mwrite_func(void* userdata, const void* buffer, size_t amount, xyzimage_error_t* error);
+
+/**
+ * Calculates the maximum size of the image after writing with the current compression options.
+ * Changing the options with xyzimage_set_compress_options can change the bound.
+ *
+ * @param image Instance of XYZImage
+ * @return Upper bound of the written size in bytes, 0 on error
+ */
+size_t xyzimage_get_write_bound(const XYZImage* image);
+
+/**
+ * Writes a XYZ image with a different palette using a custom write function.
+ * When the compressed palette ends on a block boundary (see XYZImage_CompressOptions.separate_palette)
+ * only the palette is compressed again: The compressed pixels are copied and the checksum is updated.
+ * The pixels are inflated once to verify that they do not depend on the palette.
+ * Otherwise the image is decoded and written again with the default compression options.
+ *
+ * @param data Buffer containing the XYZ image
+ * @param len Size of the buffer in bytes
+ * @param palette The new palette
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Custom write function
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_rewrite_palette(const void* data, size_t len, const XYZImage_Palette* palette,
+		void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error);
+
+/**
+ * Creates a context for the xyzimage_context_ functions.
+ * A context keeps the inflate and deflate state of zlib and grows a scratch buffer until all temporary
+ * allocations fit. Reusing it for many images avoids allocations, after the first images only the
+ * decoded images are allocated.
+ * A context must be used by one thread at a time, use one context per thread.
+ *
+ * @param allocator Allocator of the context and of images opened with it, when NULL the allocator set by xyzimage_set_allocator is used.
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return context or NULL on error
+ */
+XYZImage_Context* xyzimage_context_create(const XYZImage_Allocator* allocator, xyzimage_error_t* error);
+
+/**
+ * Frees the context. Images opened with it stay valid.
+ *
+ * @param context Context to free
+ */
+void xyzimage_context_free(XYZImage_Context* context);
+
+/**
+ * Sets the custom decompression function of the context, see xyzimage_set_decompress_func.
+ * Defaults to the global function at the time the context was created.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param decompress_func Custom decompress function to use, when NULL zlib INFLATE is used.
+ */
+void xyzimage_context_set_decompress_func(XYZImage_Context* context, xyzimage_decompress_func_t decompress_func);
+
+/**
+ * Enables or disables the verification of the Adler-32 checksum when opening images with the context.
+ * Only disable it for trusted sources, e.g. data whose integrity was already checked by a hash,
+ * corrupted pixels are not detected then. Without verification zlib skips calculating the checksum
+ * over the decompressed data. The stored checksum is available through xyzimage_get_checksum.
+ * Has no effect when a custom decompress function is used. Enabled by default.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param verify 1 to verify the checksum, 0 to skip it
+ */
+void xyzimage_context_set_verify_checksum(XYZImage_Context* context, int verify);
+
+/**
+ * Sets whether the images opened by the context get a content hash (see xyzimage_get_content_hash).
+ * The data is hashed right after inflating it, while it is still in the cache. Enabled by default.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param enabled 1 to calculate the hash, 0 to skip it
+ */
+void xyzimage_context_set_content_hash(XYZImage_Context* context, int enabled);
+
+/**
+ * Sets the struct receiving the counters of the context.
+ * The counters of all following calls of the context are added to it, to measure a single call
+ * reset it before. Time is only measured when stats are set.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param stats Counters to update, must stay valid while set, NULL disables the counters
+ */
+void xyzimage_context_set_stats(XYZImage_Context* context, XYZImage_Stats* stats);
+
+/**
+ * Sets a function that is called at the beginning and at the end of each XYZImage_TracePhase.
+ * Used to forward the phases to a profiler. The phases of one call are properly nested.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param trace_func Function to call, NULL disables tracing
+ * @param userdata Custom data forwarded to trace_func
+ */
+void xyzimage_context_set_trace_func(XYZImage_Context* context, xyzimage_trace_func_t trace_func, void* userdata);
+
+/**
+ * Sets the cache storing the palettes of the images opened with the context, see xyzimage_palette_cache_create.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param cache Cache to use, must not be freed while set, NULL stores the palette in every image
+ */
+void xyzimage_context_set_palette_cache(XYZImage_Context* context, XYZImage_PaletteCache* cache);
+
+/**
+ * Sets all counters to 0.
+ *
+ * @param stats Counters to reset
+ */
+void xyzimage_stats_reset(XYZImage_Stats* stats);
+
+/**
+ * Like xyzimage_open but uses the state of the context.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return XYZImage or NULL on error
+ */
+XYZImage* xyzimage_context_open(XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func, xyzimage_error_t* error);
+
+/**
+ * Like xyzimage_open_sized but uses the state of the context.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function
+ * @param size Size of the XYZ file (header and compressed data) in bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return XYZImage or NULL on error
+ */
+XYZImage* xyzimage_context_open_sized(XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		size_t size, xyzimage_error_t* error);
+
+/**
+ * Like xyzimage_fopen but uses the state of the context.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param file File handle
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return XYZImage or NULL on error
+ */
+XYZImage* xyzimage_context_fopen(XYZImage_Context* context, FILE* file, xyzimage_error_t* error);
+
+/**
+ * Like xyzimage_mopen but uses the state of the context.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param data Memory buffer containing a XYZ image
+ * @param len Size of the memory buffer in bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return XYZImage or NULL on error
+ */
+XYZImage* xyzimage_context_mopen(XYZImage_Context* context, const void* data, size_t len, xyzimage_error_t* error);
+
+/**
+ * Like xyzimage_open_buffer but uses the state of the context.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param userdata Custom data forwarded to read_func
+ * @param read_func Custom read function
+ * @param buffer Buffer receiving the palette indices
+ * @param len Size of the buffer in bytes
+ * @param pitch Distance between the start of two rows in bytes, 0 for width
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return XYZImage or NULL on error
+ */
+XYZImage* xyzimage_context_open_buffer(XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		void* buffer, size_t len, size_t pitch, xyzimage_error_t* error);
+
+/**
+ * Like xyzimage_write but uses the state of the context.
+ * The deflate state is reused when the compression options did not change.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param image Instance of XYZImage
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Custom write function
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_context_write(XYZImage_Context* context, XYZImage* image, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error);
+
+/**
+ * Like xyzimage_fwrite but uses the state of the context.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param image Instance of XYZImage
+ * @param file File handle
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_context_fwrite(XYZImage_Context* context, XYZImage* image, FILE* file, xyzimage_error_t* error);
+
+/**
+ * Like xyzimage_mwrite but uses the state of the context.
+ *
+ * @param context Instance of XYZImage_Context
+ * @param image Instance of XYZImage
+ * @param buffer Buffer to write to
+ * @param len Size of the buffer in bytes
+ * @param written When non-null receives the amount of written bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_context_mwrite(XYZImage_Context* context, XYZImage* image, void* buffer, size_t len, size_t* written, xyzimage_error_t* error);
+
+/**
+ * Opaque handle of a pack of XYZ images.
+ * A pack stores many XYZ files together with a hash index of their names: Looking up an image takes
+ * constant time and the width, height and palette of every image are available without inflating it.
+ * Large pack files are memory mapped when supported by the platform.
+ */
+typedef struct XYZImage_Pack XYZImage_Pack;
+
+/**
+ * Describes one image of a pack.
+ * All pointers refer to memory of the pack and stay valid until the pack is freed.
+ */
+typedef struct {
+	/** Name of the image, NUL terminated */
+	const char* name;
+	/** Width of the image */
+	uint16_t width;
+	/** Height of the image */
+	uint16_t height;
+	/** Palette of the image */
+	const XYZImage_Palette* palette;
+	/** The XYZ file, can be passed to xyzimage_mopen */
+	const void* data;
+	/** Size of data in bytes */
+	size_t size;
+} XYZImage_PackEntry;
+
+/**
+ * Describes one image added by xyzimage_pack_write.
+ */
+typedef struct {
+	/** Name of the image, must be unique in the pack */
+	const char* name;
+	/** The image, written like xyzimage_write does */
+	XYZImage* image;
+} XYZImage_PackItem;
+
+/**
+ * Opens a pack from a file.
+ * The index is validated once here, lookups afterwards do not check it again.
+ *
+ * @param path Path of the pack file
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return pack or NULL on error, must be freed with xyzimage_pack_free
+ */
+XYZImage_Pack* xyzimage_pack_open(const char* path, xyzimage_error_t* error);
+
+/**
+ * Opens a pack from a memory buffer.
+ * The buffer is not copied and must stay valid until the pack is freed.
+ *
+ * @param data Buffer containing the pack
+ * @param len Size of the buffer in bytes
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return pack or NULL on error, must be freed with xyzimage_pack_free
+ */
+XYZImage_Pack* xyzimage_pack_mopen(const void* data, size_t len, xyzimage_error_t* error);
+
+/**
+ * Frees a pack.
+ * Images opened from the pack are not affected.
+ *
+ * @param pack Pack to free
+ */
+void xyzimage_pack_free(XYZImage_Pack* pack);
+
+/**
+ * Retrieves the amount of images in a pack.
+ *
+ * @param pack Instance of XYZImage_Pack
+ * @return Amount of images, 0 when pack is NULL
+ */
+size_t xyzimage_pack_get_count(const XYZImage_Pack* pack);
+
+/**
+ * Looks up an image of a pack by name.
+ *
+ * @param pack Instance of XYZImage_Pack
+ * @param name Name of the image
+ * @param index When non-null receives the index of the image
+ * @return 1 when the image exists, otherwise 0
+ */
+int xyzimage_pack_find(const XYZImage_Pack* pack, const char* name, size_t* index);
+
+/**
+ * Retrieves the description of an image of a pack.
+ *
+ * @param pack Instance of XYZImage_Pack
+ * @param index Index of the image
+ * @param entry Receives the description
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_pack_get_entry(const XYZImage_Pack* pack, size_t index, XYZImage_PackEntry* entry, xyzimage_error_t* error);
+
+/**
+ * Decodes an image of a pack, see xyzimage_mopen.
+ *
+ * @param pack Instance of XYZImage_Pack
+ * @param index Index of the image
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return image or NULL on error
+ */
+XYZImage* xyzimage_pack_open_image(const XYZImage_Pack* pack, size_t index, xyzimage_error_t* error);
+
+/**
+ * Writes a pack using a custom write function.
+ * All images are compressed to memory first because the index precedes the image data.
+ *
+ * @param items Images to write
+ * @param count Amount of items
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Custom write function
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_pack_write(const XYZImage_PackItem* items, size_t count, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error);
+
+/**
+ * Writes a pack to a file, see xyzimage_pack_write.
+ *
+ * @param items Images to write
+ * @param count Amount of items
+ * @param file File handle
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_pack_fwrite(const XYZImage_PackItem* items, size_t count, FILE* file, xyzimage_error_t* error);
+
+/**
+ * Identifies a request of a XYZImage_Loader, 0 is never a valid ticket.
+ */
+typedef uint64_t xyzimage_ticket_t;
+
+/**
+ * Options of xyzimage_loader_create, zero-initialized options are the default.
+ */
+typedef struct {
+	/** Amount of worker threads, 0 uses one thread per processor */
+	unsigned int threads;
+	/**
+	 * Upper limit in bytes of the decoded images held by the loader, 0 for no limit.
+	 * Counts running decodes and results not taken yet. A decode exceeding the budget
+	 * waits after the header until enough memory was released, unless the loader holds
+	 * nothing else or a caller waits for it in xyzimage_loader_take.
+	 */
+	size_t memory_budget;
+} XYZImage_LoaderOptions;
+
+/**
+ * Describes one image requested from a XYZImage_Loader.
+ * Exactly one source is used: path, when NULL data, when NULL read_func.
+ * data and userdata must stay valid until the result was taken, for cancelled requests
+ * until xyzimage_loader_free because a running decode stops only at the next chunk.
+ */
+typedef struct {
+	/** Path of a XYZ file to load */
+	const char* path;
+	/** Memory buffer containing a XYZ image */
+	const void* data;
+	/** Size of data in bytes */
+	size_t size;
+	/** Custom read function, invoked from a worker thread */
+	xyzimage_read_func_t read_func;
+	/** Custom data forwarded to read_func */
+	void* userdata;
+	/** Higher priorities are decoded first, requests with the same priority in order */
+	int priority;
+	/**
+	 * Format of the result: XYZIMAGE_FORMAT_DEFAULT (or NONE) for the indexed image,
+	 * XYZIMAGE_FORMAT_RGBA or XYZIMAGE_FORMAT_RGBX for an image expanded with xyzimage_convert_rgba
+	 */
+	enum XYZImage_Format format;
+	/** Palette index that becomes transparent in XYZIMAGE_FORMAT_RGBA results or XYZIMAGE_NO_TRANSPARENCY */
+	int transparent_index;
+} XYZImage_LoadRequest;
+
+/**
+ * State of a request of a XYZImage_Loader.
+ */
+enum XYZImage_LoadStatus {
+	/** The ticket is unknown, was taken or was cancelled */
+	XYZIMAGE_LOAD_INVALID = 0,
+	/** Waiting for a worker */
+	XYZIMAGE_LOAD_QUEUED,
+	/** Being decoded */
+	XYZIMAGE_LOAD_RUNNING,
+	/** Finished successfully or with an error, see xyzimage_loader_take */
+	XYZIMAGE_LOAD_DONE
+};
+
+/**
+ * Creates a loader decoding requested images on a pool of worker threads.
+ * Requests of the same source and format that are in flight or not taken yet share one decode.
+ * When the library is built without thread support the requests are decoded by xyzimage_loader_take.
+ *
+ * @param options Options of the loader, NULL uses the defaults
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return loader or NULL on error
+ */
+XYZImage_Loader* xyzimage_loader_create(const XYZImage_LoaderOptions* options, xyzimage_error_t* error);
+
+/**
+ * Cancels all requests, waits for the workers and frees the loader with all results not taken.
+ *
+ * @param loader Loader to free
+ */
+void xyzimage_loader_free(XYZImage_Loader* loader);
+
+/**
+ * Queues a request. Each call returns a new ticket, also when the decode is shared.
+ * The ticket is valid until it was taken or cancelled.
+ *
+ * @param loader Instance of XYZImage_Loader
+ * @param request Description of the image, copied by the loader except for data and userdata
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return ticket of the request or 0 on error
+ */
+xyzimage_ticket_t xyzimage_loader_request(XYZImage_Loader* loader, const XYZImage_LoadRequest* request, xyzimage_error_t* error);
+
+/**
+ * Changes the priority of a request. Shared decodes use the highest priority of their tickets.
+ * Only affects requests that are still queued.
+ *
+ * @param loader Instance of XYZImage_Loader
+ * @param ticket Ticket returned by xyzimage_loader_request
+ * @param priority New priority
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_loader_set_priority(XYZImage_Loader* loader, xyzimage_ticket_t ticket, int priority, xyzimage_error_t* error);
+
+/**
+ * Cancels a request and invalidates the ticket.
+ * The decode is dropped from the queue or aborted between two chunks when no other ticket shares it.
+ *
+ * @param loader Instance of XYZImage_Loader
+ * @param ticket Ticket returned by xyzimage_loader_request
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return 1 on success, on error 0 is returned and an error code set.
+ */
+int xyzimage_loader_cancel(XYZImage_Loader* loader, xyzimage_ticket_t ticket, xyzimage_error_t* error);
+
+/**
+ * Retrieves the state of a request.
+ *
+ * @param loader Instance of XYZImage_Loader
+ * @param ticket Ticket returned by xyzimage_loader_request
+ * @return state of the request, XYZIMAGE_LOAD_INVALID for unknown tickets
+ */
+enum XYZImage_LoadStatus xyzimage_loader_get_status(XYZImage_Loader* loader, xyzimage_ticket_t ticket);
+
+/**
+ * Retrieves the tickets of finished requests. Each ticket is reported once.
+ *
+ * @param loader Instance of XYZImage_Loader
+ * @param tickets Receives the tickets
+ * @param count Capacity of tickets
+ * @return Amount of tickets stored
+ */
+size_t xyzimage_loader_poll(XYZImage_Loader* loader, xyzimage_ticket_t* tickets, size_t count);
+
+/**
+ * Takes the result of a request and invalidates the ticket, unless the request is pending.
+ * The caller owns the returned image. When other tickets share the decode the caller receives a copy.
+ * Waiting for a queued request decodes it on the calling thread right away.
+ *
+ * @param loader Instance of XYZImage_Loader
+ * @param ticket Ticket returned by xyzimage_loader_request
+ * @param wait When non-zero blocks until the request finished,
+ *  otherwise pending requests fail with XYZIMAGE_ERROR_LOAD_PENDING and keep the ticket
+ * @param error When non-null receives the error code on error or XYZIMAGE_ERROR_OK on success
+ * @return image or NULL on error
+ */
+XYZImage* xyzimage_loader_take(XYZImage_Loader* loader, xyzimage_ticket_t ticket, int wait, xyzimage_error_t* error);
 
 /**
  * Checks if the passed pointer points to a valid XYZImage struct.
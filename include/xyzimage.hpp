@@ -0,0 +1,521 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#ifndef LIBXYZIMAGE_XYZIMAGE_HPP
+#define LIBXYZIMAGE_XYZIMAGE_HPP
+
+// Header-only C++17 wrapper of xyzimage.h, no additional library is needed
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#if __has_include(<span>)
+#  include <span>
+#endif
+
+#include "xyzimage.h"
+
+namespace xyz {
+
+/**
+ * Non-owning view of contiguous memory.
+ * Converts to std::span when the standard library provides it.
+ */
+template <typename T>
+class Span {
+public:
+	using element_type = T;
+	using value_type = std::remove_cv_t<T>;
+	using iterator = T*;
+
+	constexpr Span() noexcept = default;
+
+	constexpr Span(T* data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+	template <std::size_t N>
+	constexpr Span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+
+	/** Views the elements of a contiguous container, e.g. std::vector or std::array */
+	template <typename Container, typename = std::enable_if_t<
+		std::is_convertible_v<std::remove_pointer_t<decltype(std::declval<Container&>().data())>(*)[], T(*)[]> &&
+		!std::is_same_v<std::decay_t<Container>, Span>>>
+	constexpr Span(Container& container) noexcept : data_(container.data()), size_(container.size()) {}
+
+	/** Views of mutable memory convert to views of const memory */
+	template <typename U, typename = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+	constexpr Span(const Span<U>& other) noexcept : data_(other.data()), size_(other.size()) {}
+
+#ifdef __cpp_lib_span
+	template <typename U, std::size_t N, typename = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+	constexpr Span(std::span<U, N> other) noexcept : data_(other.data()), size_(other.size()) {}
+
+	constexpr operator std::span<T>() const noexcept {
+		return std::span<T>(data_, size_);
+	}
+#endif
+
+	constexpr T* data() const noexcept {
+		return data_;
+	}
+
+	constexpr std::size_t size() const noexcept {
+		return size_;
+	}
+
+	constexpr std::size_t size_bytes() const noexcept {
+		return size_ * sizeof(T);
+	}
+
+	constexpr bool empty() const noexcept {
+		return size_ == 0;
+	}
+
+	constexpr T* begin() const noexcept {
+		return data_;
+	}
+
+	constexpr T* end() const noexcept {
+		return data_ + size_;
+	}
+
+	constexpr T& operator[](std::size_t index) const noexcept {
+		return data_[index];
+	}
+
+	/** Part of the view starting at offset with count elements */
+	constexpr Span subspan(std::size_t offset, std::size_t count) const noexcept {
+		return Span(data_ + offset, count);
+	}
+
+private:
+	T* data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+/** Views any memory as bytes */
+template <typename T>
+inline Span<const std::byte> as_bytes(Span<T> span) noexcept {
+	return Span<const std::byte>(reinterpret_cast<const std::byte*>(span.data()), span.size_bytes());
+}
+
+/** Views the elements of a contiguous container as bytes, e.g. a std::vector<uint8_t> read from a file */
+template <typename Container>
+inline Span<const std::byte> as_bytes(const Container& container) noexcept {
+	return as_bytes(Span<const std::remove_pointer_t<decltype(container.data())>>(container.data(), container.size()));
+}
+
+/** Mutable version of as_bytes, e.g. for the output buffer of Image::write */
+template <typename Container>
+inline Span<std::byte> as_writable_bytes(Container& container) noexcept {
+	return Span<std::byte>(reinterpret_cast<std::byte*>(container.data()), container.size() * sizeof(*container.data()));
+}
+
+/**
+ * Error code of a failed call, see XYZImage_Error.
+ */
+class Error {
+public:
+	constexpr explicit Error(xyzimage_error_t code) noexcept : code_(code) {}
+
+	constexpr xyzimage_error_t code() const noexcept {
+		return code_;
+	}
+
+	/** Human readable description of the error */
+	const char* message() const noexcept {
+		return xyzimage_get_error_message(code_);
+	}
+
+	constexpr bool operator==(const Error& other) const noexcept {
+		return code_ == other.code_;
+	}
+
+	constexpr bool operator!=(const Error& other) const noexcept {
+		return code_ != other.code_;
+	}
+
+private:
+	xyzimage_error_t code_;
+};
+
+/**
+ * Thrown by Expected::value when no value is available.
+ */
+class BadExpectedAccess : public std::runtime_error {
+public:
+	explicit BadExpectedAccess(Error error) : std::runtime_error(error.message()), error_(error) {}
+
+	Error error() const noexcept {
+		return error_;
+	}
+
+private:
+	Error error_;
+};
+
+namespace detail {
+
+[[noreturn]] inline void throw_bad_access(Error error) {
+#ifdef __cpp_exceptions
+	throw BadExpectedAccess(error);
+#else
+	(void)error;
+	std::abort();
+#endif
+}
+
+} // namespace detail
+
+/**
+ * Either the result of a call or the error it failed with, modelled after std::expected.
+ */
+template <typename T>
+class [[nodiscard]] Expected {
+public:
+	Expected(T value) : value_(std::move(value)), error_(XYZIMAGE_ERROR_OK) {}
+
+	Expected(Error error) : error_(error) {}
+
+	constexpr bool has_value() const noexcept {
+		return value_.has_value();
+	}
+
+	constexpr explicit operator bool() const noexcept {
+		return has_value();
+	}
+
+	/** Error of the call, only valid when there is no value */
+	constexpr Error error() const noexcept {
+		return error_;
+	}
+
+	T& value() & {
+		if (!has_value()) {
+			detail::throw_bad_access(error_);
+		}
+		return *value_;
+	}
+
+	const T& value() const & {
+		if (!has_value()) {
+			detail::throw_bad_access(error_);
+		}
+		return *value_;
+	}
+
+	T&& value() && {
+		if (!has_value()) {
+			detail::throw_bad_access(error_);
+		}
+		return std::move(*value_);
+	}
+
+	template <typename U>
+	T value_or(U&& fallback) const & {
+		return has_value() ? *value_ : static_cast<T>(std::forward<U>(fallback));
+	}
+
+	template <typename U>
+	T value_or(U&& fallback) && {
+		return has_value() ? std::move(*value_) : static_cast<T>(std::forward<U>(fallback));
+	}
+
+	// Unchecked access, the value must exist
+	T& operator*() & noexcept {
+		return *value_;
+	}
+
+	const T& operator*() const & noexcept {
+		return *value_;
+	}
+
+	T&& operator*() && noexcept {
+		return std::move(*value_);
+	}
+
+	T* operator->() noexcept {
+		return &*value_;
+	}
+
+	const T* operator->() const noexcept {
+		return &*value_;
+	}
+
+private:
+	std::optional<T> value_;
+	Error error_;
+};
+
+/**
+ * Success or the error of a call without a result.
+ */
+template <>
+class [[nodiscard]] Expected<void> {
+public:
+	Expected() noexcept : error_(XYZIMAGE_ERROR_OK) {}
+
+	Expected(Error error) noexcept : error_(error) {}
+
+	constexpr bool has_value() const noexcept {
+		return error_.code() == XYZIMAGE_ERROR_OK;
+	}
+
+	constexpr explicit operator bool() const noexcept {
+		return has_value();
+	}
+
+	constexpr Error error() const noexcept {
+		return error_;
+	}
+
+	void value() const {
+		if (!has_value()) {
+			detail::throw_bad_access(error_);
+		}
+	}
+
+private:
+	Error error_;
+};
+
+namespace detail {
+
+// The C functions report unknown failures without setting an error code
+inline Error make_error(xyzimage_error_t error) noexcept {
+	return Error(error != XYZIMAGE_ERROR_OK ? error : XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+}
+
+inline Expected<void> make_result(int success, xyzimage_error_t error) noexcept {
+	if (success) {
+		return Expected<void>();
+	}
+	return make_error(error);
+}
+
+} // namespace detail
+
+/**
+ * Owns a XYZImage and frees it on destruction. Move-only.
+ * The pixel and palette accessors return views into the image, they are valid until the image
+ * is freed or modified in a way that replaces the memory (e.g. mutable_palette on a shared palette).
+ */
+class Image {
+public:
+	/** Empty image not owning a handle */
+	Image() noexcept = default;
+
+	/** Takes the ownership of a handle returned by the C API */
+	explicit Image(XYZImage* image) noexcept : image_(image) {}
+
+	Image(const Image&) = delete;
+	Image& operator=(const Image&) = delete;
+
+	Image(Image&& other) noexcept : image_(other.release()) {}
+
+	Image& operator=(Image&& other) noexcept {
+		if (this != &other) {
+			reset(other.release());
+		}
+		return *this;
+	}
+
+	~Image() {
+		xyzimage_free(image_);
+	}
+
+	/**
+	 * Creates an empty (black) image, the buffer is zero-filled, see xyzimage_alloc.
+	 */
+	static Expected<Image> alloc(uint16_t width, uint16_t height, XYZImage_Format format = XYZIMAGE_FORMAT_DEFAULT) {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		XYZImage* image = xyzimage_alloc(width, height, format, &error);
+		return from_handle(image, error);
+	}
+
+	/**
+	 * Decodes a XYZ image from memory, see xyzimage_mopen.
+	 * The data is not referenced after the call.
+	 */
+	static Expected<Image> open(Span<const std::byte> data) {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		XYZImage* image = xyzimage_mopen(data.data(), data.size(), &error);
+		return from_handle(image, error);
+	}
+
+	/**
+	 * Decodes a XYZ image from memory through a context, see xyzimage_context_mopen.
+	 */
+	static Expected<Image> open(XYZImage_Context* context, Span<const std::byte> data) {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		XYZImage* image = xyzimage_context_mopen(context, data.data(), data.size(), &error);
+		return from_handle(image, error);
+	}
+
+	/**
+	 * Decodes a XYZ image from a file, see xyzimage_fopen.
+	 */
+	static Expected<Image> open(FILE* file) {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		XYZImage* image = xyzimage_fopen(file, &error);
+		return from_handle(image, error);
+	}
+
+	/** Handle for calling the C API, the ownership stays with this object */
+	XYZImage* get() const noexcept {
+		return image_;
+	}
+
+	/** Gives up the ownership of the handle, the caller must free it */
+	XYZImage* release() noexcept {
+		XYZImage* image = image_;
+		image_ = nullptr;
+		return image;
+	}
+
+	/** Frees the current handle and takes the ownership of another one */
+	void reset(XYZImage* image = nullptr) noexcept {
+		XYZImage* old = image_;
+		image_ = image;
+		xyzimage_free(old);
+	}
+
+	explicit operator bool() const noexcept {
+		return image_ != nullptr;
+	}
+
+	uint16_t width() const noexcept {
+		return xyzimage_get_width(image_);
+	}
+
+	uint16_t height() const noexcept {
+		return xyzimage_get_height(image_);
+	}
+
+	XYZImage_Format format() const noexcept {
+		return xyzimage_get_format(image_);
+	}
+
+	/** Distance between the start of two rows of the pixels in bytes */
+	std::size_t pitch() const noexcept {
+		return xyzimage_get_pitch(image_);
+	}
+
+	/** View of the image buffer, empty when the image is invalid */
+	Span<uint8_t> pixels() noexcept {
+		std::size_t len = 0;
+		uint8_t* buffer = static_cast<uint8_t*>(xyzimage_get_buffer(image_, &len));
+		return buffer ? Span<uint8_t>(buffer, len) : Span<uint8_t>();
+	}
+
+	Span<const uint8_t> pixels() const noexcept {
+		return const_cast<Image*>(this)->pixels();
+	}
+
+	/** View of a row of the image buffer, y must be less than the height */
+	Span<uint8_t> row(uint16_t y) noexcept {
+		return pixels().subspan(y * pitch(), row_size());
+	}
+
+	Span<const uint8_t> row(uint16_t y) const noexcept {
+		return const_cast<Image*>(this)->row(y);
+	}
+
+	/**
+	 * Palette for read operations, see xyzimage_get_palette_handle.
+	 * A shared palette is not copied.
+	 */
+	Expected<Span<const XYZImage_PaletteEntry>> palette() const noexcept {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		const XYZImage_Palette* palette = xyzimage_get_palette_handle(image_, &error);
+		if (palette == nullptr) {
+			return detail::make_error(error);
+		}
+		return Span<const XYZImage_PaletteEntry>(palette->entry);
+	}
+
+	/**
+	 * Palette for read/write operations, see xyzimage_get_palette.
+	 * A shared palette is copied first, this can fail with XYZIMAGE_ERROR_OUT_OF_MEMORY.
+	 */
+	Expected<Span<XYZImage_PaletteEntry>> mutable_palette() noexcept {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		XYZImage_Palette* palette = xyzimage_get_palette(image_, &error);
+		if (palette == nullptr) {
+			return detail::make_error(error);
+		}
+		return Span<XYZImage_PaletteEntry>(palette->entry);
+	}
+
+	/**
+	 * Converts the image into 32 bit pixels, see xyzimage_convert_rgba.
+	 *
+	 * @param buffer Receives the pixels
+	 * @param pitch Distance between the start of two rows in bytes, 0 when the rows are not padded
+	 */
+	Expected<void> convert_rgba(Span<std::byte> buffer, std::size_t pitch = 0,
+			XYZImage_ChannelOrder order = XYZIMAGE_CHANNEL_ORDER_RGBA, int transparent_index = XYZIMAGE_NO_TRANSPARENCY) const noexcept {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		int success = xyzimage_convert_rgba(image_, buffer.data(), buffer.size(), pitch, order, transparent_index, &error);
+		return detail::make_result(success, error);
+	}
+
+	/** Upper bound of the written size in bytes, see xyzimage_get_write_bound */
+	std::size_t write_bound() const noexcept {
+		return xyzimage_get_write_bound(image_);
+	}
+
+	/**
+	 * Writes the image into memory, see xyzimage_mwrite.
+	 * A buffer of write_bound() bytes is always large enough.
+	 *
+	 * @return Amount of written bytes
+	 */
+	Expected<std::size_t> write(Span<std::byte> buffer) noexcept {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		std::size_t written = 0;
+		if (!xyzimage_mwrite(image_, buffer.data(), buffer.size(), &written, &error)) {
+			return detail::make_error(error);
+		}
+		return written;
+	}
+
+	/**
+	 * Writes the image into a file, see xyzimage_fwrite.
+	 */
+	Expected<void> write(FILE* file) noexcept {
+		xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+		int success = xyzimage_fwrite(image_, file, &error);
+		return detail::make_result(success, error);
+	}
+
+private:
+	static Expected<Image> from_handle(XYZImage* image, xyzimage_error_t error) {
+		if (image == nullptr) {
+			return detail::make_error(error);
+		}
+		return Image(image);
+	}
+
+	std::size_t row_size() const noexcept {
+		// The last row of a padded buffer has no padding
+		std::size_t height = xyzimage_get_height(image_);
+		return height > 0 ? pixels().size() - pitch() * (height - 1) : 0;
+	}
+
+	XYZImage* image_ = nullptr;
+};
+
+} // namespace xyz
+
+#endif
@@ -28,6 +28,7 @@
 find_package(PkgConfig QUIET)
 
 find_package(ZLIB REQUIRED QUIET)
+find_package(Threads QUIET)
 
 pkg_check_modules(PC_XYZIMAGE QUIET xyzimage)
 
@@ -57,6 +58,11 @@ if(XYZIMAGE_FOUND)
 			IMPORTED_LOCATION "${XYZIMAGE_LIBRARY}"
 			INTERFACE_INCLUDE_DIRECTORIES "${XYZIMAGE_INCLUDE_DIRS}"
 			INTERFACE_LINK_LIBRARIES ZLIB::ZLIB)
+
+		if(TARGET Threads::Threads)
+			set_property(TARGET xyzimage::xyzimage APPEND PROPERTY
+				INTERFACE_LINK_LIBRARIES Threads::Threads)
+		endif()
 	endif()
 endif()
 
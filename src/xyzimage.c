@@ -8,13 +8,15 @@
  */
 
 #include <memory.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <zlib.h>
 
 #include "xyzimage.h"
+#include "xyzimage_private.h"
 
 // Increment when the data format of struct XYZImage changes
-#define XYZPRIV_CURRENT_STRUCT_VERSION 1
+#define XYZPRIV_CURRENT_STRUCT_VERSION 7
 
 #define XYZPRIV_HEADER_SIZE 8u
 
@@ -24,388 +26,1979 @@ struct XYZImage {
 	uint16_t width;
 	uint16_t height;
 	enum XYZImage_Format format;
-	XYZImage_Palette palette;
+	// Points to palette_storage, to an allocated copy or to a palette of a XYZImage_PaletteCache
+	XYZImage_Palette* palette;
+	xyzpriv_shared_palette* shared_palette;
+	int palette_allocated;
 	size_t data_len;
 	size_t data_len_compressed;
+	// Adler-32 of the zlib stream the image was opened from or written to, valid when has_checksum is set
+	uint32_t checksum;
+	int has_checksum;
+	// Hash of palette and pixels calculated while decoding, valid when has_content_hash is set
+	uint64_t content_hash;
+	int has_content_hash;
 	void* data;
+	// Distance between the start of two rows in bytes
+	size_t pitch;
+	// 0 when data is a buffer provided by the user
+	int owns_data;
 	xyzimage_compress_func_t compress_func;
+	XYZImage_CompressOptions compress_options;
+	// Compressed bands of the last incremental write, NULL before
+	xyzpriv_segments* segments;
+	// Allocator of the struct and of data
+	XYZImage_Allocator allocator;
+	// Must be the last member: Not allocated when the palette is shared
+	XYZImage_Palette palette_storage;
+};
+
+// Size of the window used for feeding compressed data to zlib
+#define XYZPRIV_READ_CHUNK_SIZE 4096u
+
+// Amount of bytes inflated at once while hashing, the hashed data is still in the cache
+#define XYZPRIV_HASH_SLICE_SIZE 65536u
+
+// Maximal amount of palette indices inflated at once by the functions decoding without an image buffer.
+// Large enough for the common sizes of up to 480x256 pixels, these are inflated in one call.
+#define XYZPRIV_RGBA_STRIP_SIZE 131072u
+
+// Size of the source when it is not known, the end is detected through EOF then
+#define XYZPRIV_UNKNOWN_LENGTH ((size_t)-1)
+
+// The palette is inflated directly into the struct, it must not contain padding
+typedef char xyzpriv_palette_size_check[sizeof(XYZImage_Palette) == XYZIMAGE_PALETTE_SIZE ? 1 : -1];
+
+typedef struct {
+	// Points to stream_storage or to the stream of a context
+	z_stream* stream;
+	z_stream stream_storage;
+	XYZImage_Context* context;
+	xyzpriv_scratch* scratch;
+	void* userdata;
+	xyzimage_read_func_t read_func;
+	// Set when reading from memory, the chunk buffer is bypassed then
+	XYZImage_MemoryReader* mem;
+	size_t read_limit;
+	// Bytes of the compressed stream taken from the source, never more than read_limit
+	size_t source_fed;
+	// Bytes of the compressed stream not read yet or XYZPRIV_UNKNOWN_LENGTH, data behind it is never read
+	size_t source_remaining;
+	int eof;
+	int stream_end;
+	// Trusted source: Raw inflate without checksum verification, the zlib header and trailer are parsed here
+	int raw;
+	int raw_header_pending;
+	size_t raw_consumed;
+	// Checksum stored in the stream, available after xyzpriv_decoder_finish
+	uint32_t checksum;
+	// When set the inflated data is hashed
+	int hash_content;
+	xyzpriv_hash64_state content_hash;
+	xyzimage_decompress_func_t decompress_func;
+	// Used instead of zlib when a custom decompress function is set:
+	// The whole image is decompressed during init and then served from this buffer
+	Bytef* decompressed;
+	size_t decompressed_len;
+	size_t decompressed_pos;
+	size_t compressed_len;
+	Bytef chunk[XYZPRIV_READ_CHUNK_SIZE];
+} xyzpriv_decoder;
+
+// Size of the buffer collecting compressed data before passing it to write_func
+#define XYZPRIV_WRITE_CHUNK_SIZE 16384u
+
+typedef struct {
+	// Points to stream_storage or to the stream of a context
+	z_stream* stream;
+	z_stream stream_storage;
+	XYZImage_Context* context;
+	xyzpriv_scratch* scratch;
+	void* userdata;
+	xyzimage_write_func_t write_func;
+	// Set when writing to memory, the chunk buffer is bypassed then
+	XYZImage_MemoryWriter* mem;
+	Bytef chunk[XYZPRIV_WRITE_CHUNK_SIZE];
+} xyzpriv_encoder;
+
+struct XYZImage_Context {
+	XYZImage_Allocator allocator;
+	// Temporary memory of one function, grows until all allocations fit
+	XYZImage_Arena* arena;
+	// Allocates the zlib state, it lives as long as the context
+	xyzpriv_scratch zlib_scratch;
+	xyzimage_decompress_func_t decompress_func;
+	z_stream inflate_stream;
+	int inflate_ready;
+	z_stream deflate_stream;
+	int deflate_ready;
+	// Options deflate_stream was initialized with
+	XYZImage_CompressOptions deflate_options;
+	// When 0 the Adler-32 checksum is not verified while decoding
+	int verify_checksum;
+	// When 0 no content hash is calculated while decoding
+	int content_hash;
+	// Counters and trace function, both optional
+	XYZImage_Stats* stats;
+	xyzimage_trace_func_t trace_func;
+	void* trace_userdata;
+	// When set the palettes of opened images are shared through it
+	XYZImage_PaletteCache* palette_cache;
 };
 
+// Custom decompress function used by all decoders, NULL for zlib
+static xyzimage_decompress_func_t xyzpriv_decompress_func = NULL;
+
 static void xyzpriv_set_error(xyzimage_error_t* error, xyzimage_error_t which) {
 	if (error != NULL) {
 		*error = which;
 	}
 }
 
-static void xyzpriv_swap_when_big(uint16_t* us) {
-	union {
-		uint32_t i;
-		char c[4];
-	} d = {0x01020304};
+static uint64_t xyzpriv_content_hash_seed(uint16_t width, uint16_t height) {
+	// Images of different size with the same bytes get different hashes
+	return (uint64_t)width | ((uint64_t)height << 16);
+}
 
-	int is_big = d.c[0] == 1;
+static uint32_t xyzpriv_read_be32(const uint8_t* data) {
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
 
-	if (!is_big) {
-		return;
+static uint64_t xyzpriv_trace_begin(const XYZImage_Context* context, enum XYZImage_TracePhase phase) {
+	// Returns the start time passed to xyzpriv_trace_end, without a context nothing is traced
+	if (context == NULL) {
+		return 0;
 	}
 
-	*us = (*us >> 8) |
-		  (*us << 8);
+	if (context->trace_func) {
+		context->trace_func(context->trace_userdata, phase, 1);
+	}
+
+	return context->stats ? xyzpriv_get_time_ns() : 0;
 }
 
-static size_t xyzpriv_fread_func(void* userdata, void* buffer, size_t amount, xyzimage_error_t* error) {
-	if (userdata == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
-		return 0;
+static void xyzpriv_trace_end(const XYZImage_Context* context, enum XYZImage_TracePhase phase, uint64_t start) {
+	if (context == NULL) {
+		return;
 	}
 
-	size_t res = fread(buffer, 1, amount, (FILE*)userdata);
-	if (res != amount) {
-		if (feof((FILE*)userdata)) {
-			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_END_OF_FILE);
-		} else {
-			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
-		}
+	if (context->stats) {
+		context->stats->time_ns[phase] += xyzpriv_get_time_ns() - start;
 	}
 
-	return res;
+	if (context->trace_func) {
+		context->trace_func(context->trace_userdata, phase, 0);
+	}
 }
 
-static size_t xyzpriv_compress_func(const void* buffer_in, size_t len_in, void* buffer_out, size_t len_out, xyzimage_error_t* error) {
-	// buffer_in, buffer_out, len_in and len_out verified by caller
-	uLong comp_size = compressBound(len_in);
+static XYZImage_Stats* xyzpriv_get_stats(const XYZImage_Context* context) {
+	return context ? context->stats : NULL;
+}
 
-	if (comp_size > len_out) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
-		return 0;
-	}
+static size_t xyzpriv_call_read(const XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		void* buffer, size_t amount, xyzimage_error_t* error) {
+	uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_READ_FUNC);
+	size_t res = read_func(userdata, buffer, amount, error);
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_READ_FUNC, start);
 
-	void* buffer_out_tmp = malloc(comp_size);
+	XYZImage_Stats* stats = xyzpriv_get_stats(context);
 
-	if (buffer_out_tmp == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-		return 0;
+	if (stats) {
+		stats->read_calls += 1;
+		stats->bytes_read += res;
 	}
 
-	int error_code = compress2(
-			buffer_out_tmp, &comp_size, buffer_in, len_in, Z_BEST_COMPRESSION);
+	return res;
+}
+
+static size_t xyzpriv_call_write(const XYZImage_Context* context, void* userdata, xyzimage_write_func_t write_func,
+		const void* buffer, size_t amount, xyzimage_error_t* error) {
+	uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_WRITE_FUNC);
+	size_t res = write_func(userdata, buffer, amount, error);
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_WRITE_FUNC, start);
 
-	if (error_code != Z_OK) {
-		free(buffer_out_tmp);
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_COMPRESS);
-		return 0;
+	XYZImage_Stats* stats = xyzpriv_get_stats(context);
+
+	if (stats) {
+		stats->write_calls += 1;
+		stats->bytes_written += res;
 	}
 
-	memcpy(buffer_out, buffer_out_tmp, comp_size);
+	return res;
+}
 
-	free(buffer_out_tmp);
+// Userdata of xyzpriv_traced_write_func, traces writes of functions that do not know the context
+typedef struct {
+	const XYZImage_Context* context;
+	void* userdata;
+	xyzimage_write_func_t write_func;
+} xyzpriv_traced_writer;
 
-	return comp_size;
+static size_t xyzpriv_traced_write_func(void* userdata, const void* buffer, size_t amount, xyzimage_error_t* error) {
+	xyzpriv_traced_writer* writer = (xyzpriv_traced_writer*)userdata;
+	return xyzpriv_call_write(writer->context, writer->userdata, writer->write_func, buffer, amount, error);
 }
 
-static size_t xyzpriv_fwrite_func(void* userdata, const void* buffer, size_t amount, xyzimage_error_t* error) {
+static size_t xyzpriv_fread_func(void* userdata, void* buffer, size_t amount, xyzimage_error_t* error) {
 	if (userdata == NULL) {
 		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
 		return 0;
 	}
 
-	size_t res = fwrite(buffer, 1, amount, (FILE*)userdata);
+	size_t res = fread(buffer, 1, amount, (FILE*)userdata);
 	if (res != amount) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_WRITE);
+		if (feof((FILE*)userdata)) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_END_OF_FILE);
+		} else {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
+		}
 	}
 
 	return res;
 }
 
-static XYZImage* xyzpriv_alloc() {
-	XYZImage* img = (XYZImage*)malloc(sizeof(struct XYZImage));
+static int xyzpriv_decoder_decompress_all(xyzpriv_decoder* dec, size_t size, xyzimage_error_t* error) {
+	// The custom decompress function operates on the whole compressed image
+	const Bytef* compressed_xyz;
+	Bytef* compressed_xyz_owned = NULL;
+	size_t res;
+	int clamped = 0;
 
-	// Magic bytes of the struct, not of the XYZ image
-	img->header[0] = 'L';
-	img->header[1] = 'X';
-	img->header[2] = 'Y';
-	img->header[3] = 'Z';
+	if (dec->mem) {
+		// The memory is passed without copying, the decompressor must ignore trailing data
+		XYZImage_MemoryReader* mem = dec->mem;
+		res = mem->offset < mem->size ? mem->size - mem->offset : 0;
 
-	img->version = XYZPRIV_CURRENT_STRUCT_VERSION;
+		if (res > dec->source_remaining) {
+			res = dec->source_remaining;
+		}
 
-	img->format = XYZIMAGE_FORMAT_DEFAULT;
+		if (res > dec->read_limit) {
+			// Like the stream path the decompressor sees at most twice the uncompressed size
+			res = dec->read_limit;
+			clamped = 1;
+		}
 
-	memset(&img->palette, '\0', sizeof(img->palette));
+		compressed_xyz = (const Bytef*)mem->data + mem->offset;
+		mem->offset += res;
+	} else if (dec->source_remaining != XYZPRIV_UNKNOWN_LENGTH) {
+		// The exact size is known, no need to guess and to rely on EOF
+		compressed_xyz_owned = xyzpriv_scratch_malloc(dec->scratch, dec->source_remaining > 0 ? dec->source_remaining : 1);
 
-	img->data = NULL;
-	img->data_len = 0;
-	img->data_len_compressed = 0;
+		if (compressed_xyz_owned == NULL) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			return 0;
+		}
 
-	img->compress_func = xyzpriv_compress_func;
+		xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+		res = xyzpriv_call_read(dec->context, dec->userdata, dec->read_func, compressed_xyz_owned, dec->source_remaining, &e);
 
-	return img;
-}
+		if (res != dec->source_remaining) {
+			xyzpriv_scratch_free(dec->scratch, compressed_xyz_owned);
+			xyzpriv_set_error(error, e == XYZIMAGE_ERROR_OK || e == XYZIMAGE_ERROR_IO_READ_END_OF_FILE ? XYZIMAGE_ERROR_IO_READ_GENERIC : e);
+			return 0;
+		}
 
-XYZImage* xyzimage_alloc(uint16_t width, uint16_t height, enum XYZImage_Format format, xyzimage_error_t* error) {
-	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+		dec->source_remaining = 0;
+		compressed_xyz = compressed_xyz_owned;
+	} else {
+		compressed_xyz_owned = xyzpriv_scratch_malloc(dec->scratch, size);
 
-	unsigned int multiplier = 0;
+		if (compressed_xyz_owned == NULL) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			return 0;
+		}
 
-	switch (format) {
-		case XYZIMAGE_FORMAT_DEFAULT:
-			multiplier = 1;
-			break;
-		default:
-			xyzpriv_set_error(error, XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED);
-			return NULL;
-	}
+		// Special error handling for EOF check
+		xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+		res = xyzpriv_call_read(dec->context, dec->userdata, dec->read_func, compressed_xyz_owned, size, &e);
 
-	XYZImage* image = xyzpriv_alloc();
+		if (e == XYZIMAGE_ERROR_OK) {
+			// Compression ratio is worse than 1, double the buffer size and try again
+			Bytef* compressed_xyz_new = xyzpriv_scratch_realloc(dec->scratch, compressed_xyz_owned, size * 2);
 
-	if (image == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-		return NULL;
-	}
+			if (compressed_xyz_new == NULL) {
+				xyzpriv_scratch_free(dec->scratch, compressed_xyz_owned);
+				xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+				return 0;
+			}
 
-	image->width = width;
-	image->height = height;
+			compressed_xyz_owned = compressed_xyz_new;
 
-	image->data_len = (uint32_t)width * height * multiplier;
-	void* data = calloc(1, image->data_len);
+			res += xyzpriv_call_read(dec->context, dec->userdata, dec->read_func, compressed_xyz_owned + size, size, &e);
+		}
 
-	if (data == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-		image->data_len = 0;
-		return NULL;
-	}
+		if (e != XYZIMAGE_ERROR_IO_READ_END_OF_FILE) {
+			xyzpriv_scratch_free(dec->scratch, compressed_xyz_owned);
 
-	image->data = data;
+			// Not EOF and compressed image is larger than twice the uncompressed
+			xyzpriv_set_error(error, e == XYZIMAGE_ERROR_OK ? XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_BIG : e);
+			return 0;
+		}
 
-	return image;
-}
+		compressed_xyz = compressed_xyz_owned;
+	}
 
-int xyzimage_free(XYZImage* image) {
-	if (!xyzimage_is_valid(image)) {
+	dec->decompressed = xyzpriv_scratch_malloc(dec->scratch, size);
+
+	if (dec->decompressed == NULL) {
+		xyzpriv_scratch_free(dec->scratch, compressed_xyz_owned);
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
 		return 0;
 	}
 
-	// Corrupt header to prevent use after free
-	image->header[0] = '!';
+	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+	uint64_t start = xyzpriv_trace_begin(dec->context, XYZIMAGE_TRACE_PHASE_DECOMPRESS);
+	dec->decompressed_len = dec->decompress_func(compressed_xyz, res, dec->decompressed, size, &e);
+	dec->compressed_len = res;
+	xyzpriv_trace_end(dec->context, XYZIMAGE_TRACE_PHASE_DECOMPRESS, start);
 
-	free(image->data);
-	image->data = NULL;
-	image->data_len = 0;
-	free(image);
+	xyzpriv_scratch_free(dec->scratch, compressed_xyz_owned);
+
+	if (e != XYZIMAGE_ERROR_OK) {
+		// A stream that needs more than the limit is too big, not corrupt
+		xyzpriv_set_error(error, clamped ? XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_BIG : e);
+		return 0;
+	}
 
 	return 1;
 }
 
-XYZImage* xyzimage_fopen(FILE* file, xyzimage_error_t* error) {
-	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+static int xyzpriv_decoder_init(xyzpriv_decoder* dec, xyzpriv_scratch* scratch, XYZImage_Context* context,
+		void* userdata, xyzimage_read_func_t read_func, size_t size, size_t compressed_len,
+		xyzimage_decompress_func_t decompress_func, xyzimage_error_t* error) {
+	// size is the expected size of the decompressed image
+	// compressed_len is the size of the compressed stream in the source or XYZPRIV_UNKNOWN_LENGTH
+	// decompress_func is NULL when zlib is used
+	// When context is non-null the inflate state of the context is reused
+	dec->stream = context ? &context->inflate_stream : &dec->stream_storage;
+	dec->stream->next_in = Z_NULL;
+	dec->stream->avail_in = 0;
+
+	dec->context = context;
+	dec->scratch = scratch;
+	dec->userdata = userdata;
+	dec->read_func = read_func;
+	dec->mem = read_func == xyzimage_mread_func ? (XYZImage_MemoryReader*)userdata : NULL;
+	// Compressed images larger than twice the uncompressed size are rejected
+	dec->read_limit = size * 2;
+	dec->source_fed = 0;
+	dec->source_remaining = compressed_len;
+	dec->eof = 0;
+	dec->stream_end = 0;
+	dec->raw = context && !context->verify_checksum && decompress_func == NULL;
+	dec->raw_header_pending = dec->raw;
+	dec->raw_consumed = 0;
+	dec->checksum = 0;
+	dec->hash_content = 0;
+	dec->decompressed = NULL;
+	dec->decompressed_len = 0;
+	dec->decompressed_pos = 0;
+	dec->compressed_len = 0;
+	dec->decompress_func = decompress_func;
+
+	if (compressed_len != XYZPRIV_UNKNOWN_LENGTH && compressed_len > dec->read_limit) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_BIG);
+		return 0;
+	}
 
-	if (file == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
-		return NULL;
+	if (decompress_func != NULL) {
+		if (!xyzpriv_decoder_decompress_all(dec, size, error)) {
+			xyzpriv_scratch_free(scratch, dec->decompressed);
+			dec->decompressed = NULL;
+			return 0;
+		}
+
+		return 1;
 	}
 
-	return xyzimage_open(file, xyzpriv_fread_func, error);
-}
+	int zlib_error;
+	// Negative window bits select a raw deflate stream without header and checksum
+	int window_bits = dec->raw ? -MAX_WBITS : MAX_WBITS;
 
-XYZImage* xyzimage_open(void* userdata, xyzimage_read_func_t read_func, xyzimage_error_t* error) {
-	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+	if (context && context->inflate_ready) {
+		zlib_error = inflateReset2(dec->stream, window_bits);
 
-	if (read_func == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
-		return NULL;
+		if (zlib_error == Z_OK) {
+			return 1;
+		}
+
+		inflateEnd(dec->stream);
+		context->inflate_ready = 0;
 	}
 
-	// Check for XYZ1 header
-	char xyz_header[4];
-	size_t res = read_func(userdata, xyz_header, 4, error);
+	dec->stream->zalloc = xyzpriv_zalloc;
+	dec->stream->zfree = xyzpriv_zfree;
+	dec->stream->opaque = context ? &context->zlib_scratch : scratch;
 
-	if (res != 4 || (error && *error != 0)) {
-		return NULL;
+	zlib_error = inflateInit2(dec->stream, window_bits);
+
+	if (zlib_error != Z_OK) {
+		xyzpriv_set_error(error, zlib_error == Z_MEM_ERROR ? XYZIMAGE_ERROR_OUT_OF_MEMORY : XYZIMAGE_ERROR_ZLIB);
+		return 0;
 	}
 
-	if (memcmp(xyz_header, "XYZ1", 4) != 0) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_BAD_HEADER);
-		return NULL;
+	if (context) {
+		context->inflate_ready = 1;
 	}
 
-	// Read width and height
-	uint16_t width;
-	res = read_func(userdata, &width, 2, error);
+	return 1;
+}
 
-	if (res != 2 || (error && *error != 0)) {
-		return NULL;
+static size_t xyzpriv_decoder_get_compressed_size(const xyzpriv_decoder* dec) {
+	if (dec->decompressed) {
+		return dec->compressed_len;
 	}
 
-	xyzpriv_swap_when_big(&width);
+	return dec->stream->total_in + dec->raw_consumed;
+}
 
-	uint16_t height;
-	res = read_func(userdata, &height, 2, error);
+static void xyzpriv_decoder_end(xyzpriv_decoder* dec) {
+	XYZImage_Stats* stats = xyzpriv_get_stats(dec->context);
 
-	if (res != 2 || (error && *error != 0)) {
-		return NULL;
+	if (dec->mem && stats) {
+		// Memory is consumed without calling the read function
+		stats->bytes_read += xyzpriv_decoder_get_compressed_size(dec);
 	}
 
-	xyzpriv_swap_when_big(&height);
-
-	// Allocate XYZImage structure
-	XYZImage* image = xyzimage_alloc(width, height, XYZIMAGE_FORMAT_DEFAULT, error);
+	if (dec->decompressed) {
+		xyzpriv_scratch_free(dec->scratch, dec->decompressed);
+		dec->decompressed = NULL;
+		return;
+	}
 
-	if (!image || (error && *error != 0)) {
-		return NULL;
+	if (dec->mem) {
+		// Give back the bytes that were not consumed by zlib
+		dec->mem->offset -= dec->stream->avail_in;
 	}
 
-	// Allocate intermediate buffers
-	size_t xyz_size = (size_t)(XYZIMAGE_PALETTE_SIZE + (uint32_t)image->width * image->height);
+	if (dec->context == NULL) {
+		inflateEnd(dec->stream);
+	}
+}
 
-	Bytef* compressed_xyz = malloc(xyz_size);
+static int xyzpriv_decoder_fill(xyzpriv_decoder* dec, xyzimage_error_t* error) {
+	if (dec->eof) {
+		// The compressed stream is truncated
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_ZLIB);
+		return 0;
+	}
 
-	if (compressed_xyz == NULL) {
-		xyzimage_free(image);
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-		return NULL;
+	if (dec->source_fed >= dec->read_limit) {
+		// Not EOF and compressed image is larger than twice the uncompressed
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_BIG);
+		return 0;
 	}
 
-	Bytef* decompressed_xyz = malloc(xyz_size);
+	// Never hand zlib more than the limit, the next fill reports the image as too big then
+	size_t allowed = dec->read_limit - dec->source_fed;
 
-	if (decompressed_xyz == NULL) {
-		xyzimage_free(image);
-		free(compressed_xyz);
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-		return NULL;
-	}
+	if (dec->mem) {
+		// Feed zlib directly from the memory buffer
+		XYZImage_MemoryReader* mem = dec->mem;
+		size_t remaining = mem->offset < mem->size ? mem->size - mem->offset : 0;
 
-	// Read the XYZ image
-	// Special error handling for EOF check
-	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
-	res = read_func(userdata, compressed_xyz, xyz_size, &e);
+		if (remaining > dec->source_remaining) {
+			remaining = dec->source_remaining;
+		}
 
-	if (e == XYZIMAGE_ERROR_OK) {
-		// Compression ratio is worse than 1, double the buffer size and try again
-		Bytef* compressed_xyz_new = realloc(compressed_xyz, xyz_size * 2);
+		size_t amount = remaining < allowed ? remaining : allowed;
 
-		if (compressed_xyz_new == NULL) {
-			xyzimage_free(image);
-			free(compressed_xyz);
-			free(decompressed_xyz);
-			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-			return NULL;
+		if (amount > (uInt)-1) {
+			amount = (uInt)-1;
 		}
 
-		compressed_xyz = compressed_xyz_new;
+		if (amount == remaining) {
+			dec->eof = 1;
+		}
 
-		res += read_func(userdata, compressed_xyz + xyz_size, xyz_size, &e);
-	}
+		if (amount == 0) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_ZLIB);
+			return 0;
+		}
 
-	if (e != XYZIMAGE_ERROR_IO_READ_END_OF_FILE) {
-		xyzimage_free(image);
-		free(compressed_xyz);
-		free(decompressed_xyz);
+		dec->stream->next_in = (Bytef*)mem->data + mem->offset;
+		dec->stream->avail_in = (uInt)amount;
+		mem->offset += amount;
+		dec->source_fed += amount;
 
-		if (e == XYZIMAGE_ERROR_OK) {
-			// Not EOF and compressed image is larger than twice the uncompressed
-			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_BIG);
-			return NULL;
+		if (dec->source_remaining != XYZPRIV_UNKNOWN_LENGTH) {
+			dec->source_remaining -= amount;
 		}
 
-		xyzpriv_set_error(error, e);
-		return NULL;
+		return 1;
 	}
 
-	image->data_len_compressed = res;
+	// Never read behind the end of the source when its size is known
+	size_t amount = sizeof(dec->chunk) < allowed ? sizeof(dec->chunk) : allowed;
 
-	// Decompress the XYZ image
-	uLongf xyz_size_out = (uLongf)xyz_size;
-	int zlib_error = uncompress(
-			decompressed_xyz, &xyz_size_out, compressed_xyz, (uLong)res);
+	if (amount >= dec->source_remaining) {
+		amount = dec->source_remaining;
+		dec->eof = 1;
+	}
 
-	free(compressed_xyz);
+	// Special error handling for EOF check
+	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+	size_t res = amount == 0 ? 0 : xyzpriv_call_read(dec->context, dec->userdata, dec->read_func, dec->chunk, amount, &e);
 
-	if (zlib_error != Z_OK) {
-		xyzimage_free(image);
-		free(decompressed_xyz);
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_ZLIB);
-		return NULL;
+	if (e == XYZIMAGE_ERROR_IO_READ_END_OF_FILE) {
+		dec->eof = 1;
+	} else if (e != XYZIMAGE_ERROR_OK) {
+		xyzpriv_set_error(error, e);
+		return 0;
 	}
 
-	if (xyz_size_out != xyz_size) {
-		xyzimage_free(image);
-		free(decompressed_xyz);
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_SMALL);
-		return NULL;
-	}
+	dec->source_fed += res;
 
-	// Fill the data structures
-	int i;
-	for (i = 0; i < XYZIMAGE_PALETTE_ENTRIES; ++i) {
-		image->palette.entry[i].red = decompressed_xyz[i * 3];
-		image->palette.entry[i].green = decompressed_xyz[i * 3 + 1];
-		image->palette.entry[i].blue = decompressed_xyz[i * 3 + 2];
+	if (dec->source_remaining != XYZPRIV_UNKNOWN_LENGTH) {
+		dec->source_remaining -= res;
 	}
 
-	size_t img_buffer_len;
-	void* img_buffer = xyzimage_get_buffer(image, &img_buffer_len);
-	if (img_buffer == NULL) {
-		xyzimage_free(image);
-		free(decompressed_xyz);
-		return NULL;
+	if (res == 0) {
+		xyzpriv_set_error(error, dec->eof ? XYZIMAGE_ERROR_ZLIB : XYZIMAGE_ERROR_IO_READ_GENERIC);
+		return 0;
 	}
 
-	memcpy(img_buffer, decompressed_xyz + XYZIMAGE_PALETTE_SIZE, img_buffer_len);
+	dec->stream->next_in = dec->chunk;
+	dec->stream->avail_in = (uInt)res;
 
-	free(decompressed_xyz);
+	return 1;
+}
 
-	return image;
+static int xyzpriv_decoder_read_raw(xyzpriv_decoder* dec, uint8_t* buffer, size_t len, xyzimage_error_t* error) {
+	// Takes bytes of the compressed stream that are not passed to raw inflate (zlib header and checksum)
+	while (len > 0) {
+		if (dec->stream->avail_in == 0 && !xyzpriv_decoder_fill(dec, error)) {
+			return 0;
+		}
+
+		size_t amount = dec->stream->avail_in < len ? dec->stream->avail_in : len;
+		memcpy(buffer, dec->stream->next_in, amount);
+		dec->stream->next_in += amount;
+		dec->stream->avail_in -= (uInt)amount;
+		dec->raw_consumed += amount;
+		buffer += amount;
+		len -= amount;
+	}
+
+	return 1;
 }
 
-uint16_t xyzimage_get_width(const XYZImage* image) {
-	if (!xyzimage_is_valid(image)) {
+static int xyzpriv_decoder_skip_header(xyzpriv_decoder* dec, xyzimage_error_t* error) {
+	// Only checks what is required to know that a raw deflate stream follows
+	uint8_t header[2];
+
+	if (!xyzpriv_decoder_read_raw(dec, header, sizeof(header), error)) {
 		return 0;
 	}
 
-	return image->width;
-}
+	dec->raw_header_pending = 0;
 
-uint16_t xyzimage_get_height(const XYZImage* image) {
-	if (!xyzimage_is_valid(image)) {
+	if ((header[0] & 0x0F) != Z_DEFLATED || (header[0] >> 4) > MAX_WBITS - 8 ||
+			((header[0] << 8) | header[1]) % 31 != 0 || (header[1] & 0x20) != 0) {
+		// Not deflate, window too large, bad header checksum or preset dictionary
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_ZLIB);
 		return 0;
 	}
 
-	return image->height;
+	return 1;
 }
 
-XYZImage_Palette* xyzimage_get_palette(XYZImage* image, xyzimage_error_t* error) {
-	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+static int xyzpriv_decoder_inflate(xyzpriv_decoder* dec, void* buffer_out, size_t len_out, xyzimage_error_t* error) {
+	if (dec->decompressed) {
+		if (dec->decompressed_len - dec->decompressed_pos < len_out) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_SMALL);
+			return 0;
+		}
 
-	if (!xyzimage_is_valid(image)) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
-		return NULL;
+		uint64_t start = xyzpriv_trace_begin(dec->context, XYZIMAGE_TRACE_PHASE_CONVERT);
+		memcpy(buffer_out, dec->decompressed + dec->decompressed_pos, len_out);
+		dec->decompressed_pos += len_out;
+		xyzpriv_trace_end(dec->context, XYZIMAGE_TRACE_PHASE_CONVERT, start);
+
+		if (dec->hash_content) {
+			xyzpriv_hash64_update(&dec->content_hash, buffer_out, len_out);
+		}
+
+		return 1;
 	}
 
-	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_IMAGE_NOT_INDEXED);
-		return NULL;
+	if (dec->raw_header_pending && !xyzpriv_decoder_skip_header(dec, error)) {
+		return 0;
 	}
 
-	return &image->palette;
-}
+	Bytef* out = (Bytef*)buffer_out;
+	size_t out_remaining = len_out;
 
-enum XYZImage_Format xyzimage_get_format(const XYZImage* image) {
-	if (!xyzimage_is_valid(image)) {
-		return XYZIMAGE_FORMAT_NONE;
-	}
+	while (out_remaining > 0) {
+		if (dec->stream_end) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_SMALL);
+			return 0;
+		}
 
-	return image->format;
-}
+		if (dec->stream->avail_in == 0 && !xyzpriv_decoder_fill(dec, error)) {
+			return 0;
+		}
 
-void* xyzimage_get_buffer(XYZImage* image, size_t* len) {
-	if (!xyzimage_is_valid(image)) {
-		return NULL;
-	}
+		// The hash is updated in slices, otherwise large images leave the cache before being hashed
+		size_t slice = dec->hash_content && out_remaining > XYZPRIV_HASH_SLICE_SIZE ? XYZPRIV_HASH_SLICE_SIZE : out_remaining;
+		dec->stream->next_out = out;
+		dec->stream->avail_out = slice > (uInt)-1 ? (uInt)-1 : (uInt)slice;
+		uInt avail_out = dec->stream->avail_out;
 
-	if (len) {
-		*len = image->data_len;
+		uint64_t start = xyzpriv_trace_begin(dec->context, XYZIMAGE_TRACE_PHASE_DECOMPRESS);
+		int zlib_error = inflate(dec->stream, Z_NO_FLUSH);
+		xyzpriv_trace_end(dec->context, XYZIMAGE_TRACE_PHASE_DECOMPRESS, start);
+
+		size_t produced = avail_out - dec->stream->avail_out;
+
+		if (dec->hash_content) {
+			xyzpriv_hash64_update(&dec->content_hash, out, produced);
+		}
+
+		out += produced;
+		out_remaining -= produced;
+
+		if (zlib_error == Z_STREAM_END) {
+			dec->stream_end = 1;
+		} else if (zlib_error != Z_OK && zlib_error != Z_BUF_ERROR) {
+			xyzpriv_set_error(error, zlib_error == Z_MEM_ERROR ? XYZIMAGE_ERROR_OUT_OF_MEMORY : XYZIMAGE_ERROR_ZLIB);
+			return 0;
+		}
 	}
 
-	return image->data;
+	return 1;
+}
+
+static int xyzpriv_decoder_finish(xyzpriv_decoder* dec, xyzimage_error_t* error) {
+	if (dec->decompressed) {
+		// The custom decompress function was limited to the expected size
+		return 1;
+	}
+
+	// Consume the remaining compressed stream (usually only the checksum)
+	// The stream must not contain more data than the palette and the pixels
+	Bytef excess;
+	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+
+	if (xyzpriv_decoder_inflate(dec, &excess, 1, &e)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_ZLIB);
+		return 0;
+	}
+
+	if (e != XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_SMALL) {
+		xyzpriv_set_error(error, e);
+		return 0;
+	}
+
+	if (!dec->raw) {
+		// Verified by zlib, equal to the stored checksum
+		dec->checksum = (uint32_t)dec->stream->adler;
+		return 1;
+	}
+
+	// The raw stream ended, the stored checksum (big endian) follows
+	uint8_t trailer[4];
+
+	if (!xyzpriv_decoder_read_raw(dec, trailer, sizeof(trailer), error)) {
+		return 0;
+	}
+
+	dec->checksum = xyzpriv_read_be32(trailer);
+
+	return 1;
+}
+
+int xyzpriv_get_zlib_strategy(enum XYZImage_CompressStrategy strategy) {
+	switch (strategy) {
+		case XYZIMAGE_COMPRESS_STRATEGY_DEFAULT:
+			return Z_DEFAULT_STRATEGY;
+		case XYZIMAGE_COMPRESS_STRATEGY_FILTERED:
+			return Z_FILTERED;
+		case XYZIMAGE_COMPRESS_STRATEGY_HUFFMAN_ONLY:
+			return Z_HUFFMAN_ONLY;
+		case XYZIMAGE_COMPRESS_STRATEGY_RLE:
+			return Z_RLE;
+		case XYZIMAGE_COMPRESS_STRATEGY_FIXED:
+			return Z_FIXED;
+		default:
+			return -1;
+	}
+}
+
+static size_t xyzpriv_fwrite_func(void* userdata, const void* buffer, size_t amount, xyzimage_error_t* error) {
+	if (userdata == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	size_t res = fwrite(buffer, 1, amount, (FILE*)userdata);
+	if (res != amount) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_WRITE);
+	}
+
+	return res;
+}
+
+size_t xyzimage_mread_func(void* userdata, void* buffer, size_t amount, xyzimage_error_t* error) {
+	XYZImage_MemoryReader* reader = (XYZImage_MemoryReader*)userdata;
+
+	if (reader == NULL || buffer == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	size_t remaining = reader->offset < reader->size ? reader->size - reader->offset : 0;
+
+	if (amount > remaining) {
+		amount = remaining;
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_END_OF_FILE);
+	}
+
+	memcpy(buffer, (const uint8_t*)reader->data + reader->offset, amount);
+	reader->offset += amount;
+
+	return amount;
+}
+
+size_t xyzimage_mwrite_func(void* userdata, const void* buffer, size_t amount, xyzimage_error_t* error) {
+	XYZImage_MemoryWriter* writer = (XYZImage_MemoryWriter*)userdata;
+
+	if (writer == NULL || buffer == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	size_t remaining = writer->offset < writer->size ? writer->size - writer->offset : 0;
+
+	if (amount > remaining) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
+		return 0;
+	}
+
+	memcpy((uint8_t*)writer->data + writer->offset, buffer, amount);
+	writer->offset += amount;
+
+	return amount;
+}
+
+static XYZImage* xyzpriv_alloc(const XYZImage_Allocator* allocator, int own_palette) {
+	// Images sharing their palette do not need the storage at the end of the struct
+	size_t size = own_palette ? sizeof(struct XYZImage) : offsetof(struct XYZImage, palette_storage);
+	XYZImage* img = (XYZImage*)allocator->malloc_func(allocator->userdata, size);
+
+	if (img == NULL) {
+		return NULL;
+	}
+
+	img->allocator = *allocator;
+
+	// Magic bytes of the struct, not of the XYZ image
+	img->header[0] = 'L';
+	img->header[1] = 'X';
+	img->header[2] = 'Y';
+	img->header[3] = 'Z';
+
+	img->version = XYZPRIV_CURRENT_STRUCT_VERSION;
+
+	img->format = XYZIMAGE_FORMAT_DEFAULT;
+
+	img->palette = NULL;
+	img->shared_palette = NULL;
+	img->palette_allocated = 0;
+
+	if (own_palette) {
+		img->palette = &img->palette_storage;
+		memset(img->palette, '\0', sizeof(XYZImage_Palette));
+	}
+
+	img->data = NULL;
+	img->data_len = 0;
+	img->data_len_compressed = 0;
+	img->checksum = 0;
+	img->has_checksum = 0;
+	img->content_hash = 0;
+	img->has_content_hash = 0;
+	img->pitch = 0;
+	img->owns_data = 1;
+
+	img->compress_func = NULL;
+	img->compress_options.level = 9;
+	img->compress_options.strategy = XYZIMAGE_COMPRESS_STRATEGY_DEFAULT;
+	img->compress_options.window_bits = 15;
+	img->compress_options.mem_level = 8;
+	img->compress_options.threads = 1;
+	img->compress_options.separate_palette = 1;
+	img->compress_options.optimize = 0;
+	img->compress_options.optimize_palette = 0;
+	img->compress_options.incremental = 0;
+	img->segments = NULL;
+
+	return img;
+}
+
+static XYZImage* xyzpriv_alloc_image(const XYZImage_Allocator* allocator, uint16_t width, uint16_t height,
+		enum XYZImage_Format format, int zero_fill, int own_palette, xyzimage_error_t* error) {
+	unsigned int multiplier = 0;
+
+	switch (format) {
+		case XYZIMAGE_FORMAT_DEFAULT:
+			multiplier = 1;
+			break;
+		case XYZIMAGE_FORMAT_RGBX:
+		case XYZIMAGE_FORMAT_RGBA:
+			multiplier = 4;
+			break;
+		default:
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED);
+			return NULL;
+	}
+
+	// 65535x65535 images with 4 bytes per pixel do not fit into 32 bits
+	size_t pixels = (size_t)width * height;
+
+	if (pixels > SIZE_MAX / multiplier) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	XYZImage* image = xyzpriv_alloc(allocator, own_palette);
+
+	if (image == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	image->width = width;
+	image->height = height;
+	image->format = format;
+
+	image->pitch = (size_t)width * multiplier;
+
+	image->data_len = pixels * multiplier;
+	void* data = image->allocator.malloc_func(image->allocator.userdata, image->data_len);
+
+	if (data == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		image->allocator.free_func(image->allocator.userdata, image);
+		return NULL;
+	}
+
+	if (zero_fill) {
+		memset(data, '\0', image->data_len);
+	}
+
+	image->data = data;
+
+	return image;
+}
+
+XYZImage* xyzimage_alloc(uint16_t width, uint16_t height, enum XYZImage_Format format, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	return xyzpriv_alloc_image(xyzpriv_get_allocator(), width, height, format, 1, 1, error);
+}
+
+int xyzimage_free(XYZImage* image) {
+	if (!xyzimage_is_valid(image)) {
+		return 0;
+	}
+
+	// Corrupt header to prevent use after free
+	image->header[0] = '!';
+
+	if (image->owns_data) {
+		image->allocator.free_func(image->allocator.userdata, image->data);
+	}
+
+	if (image->shared_palette) {
+		xyzpriv_palette_cache_release(image->shared_palette);
+	} else if (image->palette_allocated) {
+		image->allocator.free_func(image->allocator.userdata, image->palette);
+	}
+
+	xyzpriv_segments_free(image->segments);
+
+	image->data = NULL;
+	image->data_len = 0;
+	image->allocator.free_func(image->allocator.userdata, image);
+
+	return 1;
+}
+
+static int xyzpriv_read_header(const XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		uint16_t* width, uint16_t* height, xyzimage_error_t* error) {
+	// The header is read at once: XYZ1 magic followed by width and height (little endian)
+	uint8_t xyz_header[XYZPRIV_HEADER_SIZE];
+	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+	size_t res = xyzpriv_call_read(context, userdata, read_func, xyz_header, XYZPRIV_HEADER_SIZE, &e);
+
+	// Check for XYZ1 header
+	if (res >= 4 && memcmp(xyz_header, "XYZ1", 4) != 0) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_BAD_HEADER);
+		return 0;
+	}
+
+	if (res != XYZPRIV_HEADER_SIZE || e != XYZIMAGE_ERROR_OK) {
+		// A source ending before the end of the header has no valid header, END_OF_FILE is internal
+		if (e == XYZIMAGE_ERROR_IO_READ_END_OF_FILE) {
+			e = XYZIMAGE_ERROR_IO_READ_BAD_HEADER;
+		}
+
+		xyzpriv_set_error(error, e != XYZIMAGE_ERROR_OK ? e : XYZIMAGE_ERROR_IO_READ_GENERIC);
+		return 0;
+	}
+
+	*width = (uint16_t)(xyz_header[4] | (xyz_header[5] << 8));
+	*height = (uint16_t)(xyz_header[6] | (xyz_header[7] << 8));
+
+	return 1;
+}
+
+int xyzimage_probe(void* userdata, xyzimage_read_func_t read_func, uint16_t* width, uint16_t* height, XYZImage_Palette* palette, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (read_func == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	uint16_t w;
+	uint16_t h;
+
+	if (!xyzpriv_read_header(NULL, userdata, read_func, &w, &h, error)) {
+		return 0;
+	}
+
+	if (width) {
+		*width = w;
+	}
+
+	if (height) {
+		*height = h;
+	}
+
+	if (palette == NULL) {
+		return 1;
+	}
+
+	// Only inflate the palette, zlib is always used because it can stop early
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin_global(&scratch);
+
+	xyzpriv_decoder dec;
+
+	if (!xyzpriv_decoder_init(&dec, &scratch, NULL, userdata, read_func, XYZIMAGE_PALETTE_SIZE + (size_t)w * h, XYZPRIV_UNKNOWN_LENGTH, NULL, error)) {
+		xyzpriv_scratch_end(&scratch);
+		return 0;
+	}
+
+	int success = xyzpriv_decoder_inflate(&dec, palette, XYZIMAGE_PALETTE_SIZE, error);
+
+	xyzpriv_decoder_end(&dec);
+	xyzpriv_scratch_end(&scratch);
+
+	return success;
+}
+
+int xyzimage_fprobe(FILE* file, uint16_t* width, uint16_t* height, XYZImage_Palette* palette, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	return xyzimage_probe(file, xyzpriv_fread_func, width, height, palette, error);
+}
+
+int xyzimage_mprobe(const void* data, size_t len, uint16_t* width, uint16_t* height, XYZImage_Palette* palette, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (data == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	XYZImage_MemoryReader reader;
+	reader.data = data;
+	reader.size = len;
+	reader.offset = 0;
+
+	return xyzimage_probe(&reader, xyzimage_mread_func, width, height, palette, error);
+}
+
+int xyzimage_read_rows(void* userdata, xyzimage_read_func_t read_func, uint16_t first_row, uint16_t row_count,
+		xyzimage_row_func_t row_func, void* row_userdata, uint16_t* width, uint16_t* height, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (read_func == NULL || row_func == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	uint16_t w;
+	uint16_t h;
+
+	if (!xyzpriv_read_header(NULL, userdata, read_func, &w, &h, error)) {
+		return 0;
+	}
+
+	if (width) {
+		*width = w;
+	}
+
+	if (height) {
+		*height = h;
+	}
+
+	// Rows behind the last requested row are not inflated
+	uint32_t end_row = (uint32_t)first_row + row_count;
+	if (end_row > h) {
+		end_row = h;
+	}
+
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin_global(&scratch);
+
+	// Strips of rows are inflated at once like in xyzimage_open_rgba
+	size_t strip_rows = w > 0 ? XYZPRIV_RGBA_STRIP_SIZE / w : 1;
+	if (strip_rows > end_row) {
+		strip_rows = end_row > 0 ? end_row : 1;
+	}
+
+	uint8_t* strip = (uint8_t*)xyzpriv_scratch_malloc(&scratch, w > 0 ? strip_rows * w : 1);
+
+	if (strip == NULL) {
+		xyzpriv_scratch_end(&scratch);
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return 0;
+	}
+
+	xyzpriv_decoder dec;
+
+	if (!xyzpriv_decoder_init(&dec, &scratch, NULL, userdata, read_func, XYZIMAGE_PALETTE_SIZE + (size_t)w * h, XYZPRIV_UNKNOWN_LENGTH, NULL, error)) {
+		xyzpriv_scratch_free(&scratch, strip);
+		xyzpriv_scratch_end(&scratch);
+		return 0;
+	}
+
+	XYZImage_Palette palette;
+	int success = xyzpriv_decoder_inflate(&dec, &palette, XYZIMAGE_PALETTE_SIZE, error);
+	int stopped = 0;
+
+	uint32_t y;
+	for (y = 0; success && !stopped && y < end_row; y += (uint32_t)strip_rows) {
+		size_t rows = end_row - y < strip_rows ? end_row - y : strip_rows;
+		success = xyzpriv_decoder_inflate(&dec, strip, rows * w, error);
+
+		size_t i;
+		for (i = 0; success && !stopped && i < rows; ++i) {
+			if (y + i >= first_row) {
+				stopped = !row_func(row_userdata, &palette, (uint16_t)(y + i), strip + i * w, w);
+			}
+		}
+	}
+
+	if (success && !stopped && end_row == h) {
+		success = xyzpriv_decoder_finish(&dec, error);
+	}
+
+	xyzpriv_decoder_end(&dec);
+	xyzpriv_scratch_free(&scratch, strip);
+	xyzpriv_scratch_end(&scratch);
+
+	return success;
+}
+
+int xyzimage_fread_rows(FILE* file, uint16_t first_row, uint16_t row_count,
+		xyzimage_row_func_t row_func, void* row_userdata, uint16_t* width, uint16_t* height, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	return xyzimage_read_rows(file, xyzpriv_fread_func, first_row, row_count, row_func, row_userdata, width, height, error);
+}
+
+int xyzimage_mread_rows(const void* data, size_t len, uint16_t first_row, uint16_t row_count,
+		xyzimage_row_func_t row_func, void* row_userdata, uint16_t* width, uint16_t* height, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (data == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	XYZImage_MemoryReader reader;
+	reader.data = data;
+	reader.size = len;
+	reader.offset = 0;
+
+	return xyzimage_read_rows(&reader, xyzimage_mread_func, first_row, row_count, row_func, row_userdata, width, height, error);
+}
+
+XYZImage* xyzimage_mopen(const void* data, size_t len, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (data == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	XYZImage_MemoryReader reader;
+	reader.data = data;
+	reader.size = len;
+	reader.offset = 0;
+
+	return xyzimage_open(&reader, xyzimage_mread_func, error);
+}
+
+static XYZImage* xyzpriv_open_scratch(xyzpriv_scratch* scratch, XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		size_t source_len, void* buffer, size_t len, size_t pitch, xyzimage_error_t* error) {
+	// source_len is the size of the XYZ file in the source or XYZPRIV_UNKNOWN_LENGTH
+	if (read_func == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	if (source_len < XYZPRIV_HEADER_SIZE) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_BAD_HEADER);
+		return NULL;
+	}
+
+	uint16_t width;
+	uint16_t height;
+
+	if (!xyzpriv_read_header(context, userdata, read_func, &width, &height, error)) {
+		return NULL;
+	}
+
+	// Allocate XYZImage structure
+	XYZImage* image;
+	XYZImage_PaletteCache* palette_cache = context ? context->palette_cache : NULL;
+
+	if (buffer == NULL) {
+		// Not zero filled because the whole buffer is overwritten
+		image = xyzpriv_alloc_image(scratch->allocator, width, height, XYZIMAGE_FORMAT_DEFAULT, 0, palette_cache == NULL, error);
+
+		if (!image) {
+			return NULL;
+		}
+
+		if (scratch->stats) {
+			// The struct and the pixels
+			scratch->stats->allocations += 2;
+		}
+	} else {
+		// Wrap the user provided buffer
+		if (pitch == 0) {
+			pitch = width;
+		}
+
+		// No buffer fits a pitch whose last row ends past SIZE_MAX
+		if (pitch < width || (height > 1 && pitch > (SIZE_MAX - width) / (height - 1))) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
+			return NULL;
+		}
+
+		size_t required = height == 0 ? 0 : pitch * (height - 1) + width;
+
+		if (len < required) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
+			return NULL;
+		}
+
+		image = xyzpriv_alloc(scratch->allocator, palette_cache == NULL);
+
+		if (!image) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			return NULL;
+		}
+
+		if (scratch->stats) {
+			scratch->stats->allocations += 1;
+		}
+
+		image->width = width;
+		image->height = height;
+		image->data = buffer;
+		image->data_len = required;
+		image->pitch = pitch;
+		image->owns_data = 0;
+	}
+
+	// Decompress the XYZ image directly into the palette and the image buffer
+	xyzpriv_decoder dec;
+
+	size_t compressed_len = source_len == XYZPRIV_UNKNOWN_LENGTH ? XYZPRIV_UNKNOWN_LENGTH : source_len - XYZPRIV_HEADER_SIZE;
+
+	if (!xyzpriv_decoder_init(&dec, scratch, context, userdata, read_func, XYZIMAGE_PALETTE_SIZE + (size_t)width * height,
+			compressed_len, context ? context->decompress_func : xyzpriv_decompress_func, error)) {
+		xyzimage_free(image);
+		return NULL;
+	}
+
+	dec.hash_content = context == NULL || context->content_hash;
+	xyzpriv_hash64_begin(&dec.content_hash, xyzpriv_content_hash_seed(width, height));
+
+	// A shared palette is looked up after decoding it
+	XYZImage_Palette decoded_palette;
+	int success = xyzpriv_decoder_inflate(&dec, palette_cache ? &decoded_palette : image->palette, XYZIMAGE_PALETTE_SIZE, error);
+
+	if (success && palette_cache) {
+		image->shared_palette = xyzpriv_palette_cache_intern(palette_cache, &decoded_palette, xyzpriv_palette_hash(&decoded_palette));
+
+		if (image->shared_palette) {
+			image->palette = &image->shared_palette->palette;
+		} else {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			success = 0;
+		}
+	}
+
+	if (success) {
+		if (image->pitch == width) {
+			success = xyzpriv_decoder_inflate(&dec, image->data, (size_t)width * height, error);
+		} else {
+			// Inflate row by row to skip the padding between the rows
+			uint16_t y;
+			for (y = 0; success && y < height; ++y) {
+				success = xyzpriv_decoder_inflate(&dec, (uint8_t*)image->data + y * image->pitch, width, error);
+			}
+		}
+	}
+
+	if (!success || !xyzpriv_decoder_finish(&dec, error)) {
+		xyzpriv_decoder_end(&dec);
+		xyzimage_free(image);
+		return NULL;
+	}
+
+	image->data_len_compressed = xyzpriv_decoder_get_compressed_size(&dec);
+	// The custom decompress function does not report the checksum
+	image->checksum = dec.checksum;
+	image->has_checksum = dec.decompressed == NULL;
+	image->content_hash = dec.hash_content ? xyzpriv_hash64_end(&dec.content_hash) : 0;
+	image->has_content_hash = dec.hash_content;
+
+	xyzpriv_decoder_end(&dec);
+
+	if (scratch->stats) {
+		scratch->stats->images_opened += 1;
+		scratch->stats->compressed_read += image->data_len_compressed;
+		scratch->stats->decompressed_read += XYZIMAGE_PALETTE_SIZE + (size_t)width * height;
+	}
+
+	return image;
+}
+
+static void xyzpriv_scratch_begin_context(xyzpriv_scratch* scratch, XYZImage_Context* context) {
+	if (context) {
+		xyzpriv_scratch_begin(scratch, context->arena, &context->allocator);
+		scratch->stats = context->stats;
+	} else {
+		xyzpriv_scratch_begin_global(scratch);
+	}
+}
+
+static XYZImage* xyzpriv_open(XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		size_t source_len, void* buffer, size_t len, size_t pitch, xyzimage_error_t* error) {
+	uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_OPEN);
+
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin_context(&scratch, context);
+
+	XYZImage* image = xyzpriv_open_scratch(&scratch, context, userdata, read_func, source_len, buffer, len, pitch, error);
+
+	xyzpriv_scratch_end(&scratch);
+
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_OPEN, start);
+
+	return image;
+}
+
+static XYZImage* xyzpriv_fopen(XYZImage_Context* context, FILE* file, xyzimage_error_t* error) {
+	// Regular files are loaded at once and decoded from memory,
+	// this avoids many small reads and a guessed buffer size
+	uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_OPEN);
+
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin_context(&scratch, context);
+
+	XYZImage* image;
+	xyzpriv_file_view view;
+
+	if (xyzpriv_file_view_open(&view, file, &scratch)) {
+		XYZImage_MemoryReader reader;
+		reader.data = view.data;
+		reader.size = view.len;
+		reader.offset = 0;
+
+		image = xyzpriv_open_scratch(&scratch, context, &reader, xyzimage_mread_func, XYZPRIV_UNKNOWN_LENGTH, NULL, 0, 0, error);
+
+		xyzpriv_file_view_close(&view, file, reader.offset, &scratch);
+	} else {
+		image = xyzpriv_open_scratch(&scratch, context, file, xyzpriv_fread_func, XYZPRIV_UNKNOWN_LENGTH, NULL, 0, 0, error);
+	}
+
+	xyzpriv_scratch_end(&scratch);
+
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_OPEN, start);
+
+	return image;
+}
+
+XYZImage* xyzimage_fopen(FILE* file, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	return xyzpriv_fopen(NULL, file, error);
+}
+
+XYZImage* xyzimage_open(void* userdata, xyzimage_read_func_t read_func, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	return xyzpriv_open(NULL, userdata, read_func, XYZPRIV_UNKNOWN_LENGTH, NULL, 0, 0, error);
+}
+
+XYZImage* xyzimage_open_sized(void* userdata, xyzimage_read_func_t read_func, size_t size, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	return xyzpriv_open(NULL, userdata, read_func, size, NULL, 0, 0, error);
+}
+
+XYZImage* xyzimage_open_buffer(void* userdata, xyzimage_read_func_t read_func, void* buffer, size_t len, size_t pitch, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (buffer == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	return xyzpriv_open(NULL, userdata, read_func, XYZPRIV_UNKNOWN_LENGTH, buffer, len, pitch, error);
+}
+
+enum xyzpriv_feed_state {
+	XYZPRIV_FEED_HEADER,
+	XYZPRIV_FEED_INFLATE,
+	XYZPRIV_FEED_DONE,
+	XYZPRIV_FEED_ERROR
+};
+
+struct XYZImage_Decoder {
+	enum xyzpriv_feed_state state;
+	uint8_t header[XYZPRIV_HEADER_SIZE];
+	size_t header_len;
+	uint16_t width;
+	uint16_t height;
+	XYZImage* image;
+	z_stream stream;
+	int stream_ready;
+	// Amount of inflated bytes, out_len is the size of palette and pixels
+	size_t out_pos;
+	size_t out_len;
+	// Compressed images larger than twice the uncompressed size are rejected
+	size_t read_limit;
+	xyzpriv_hash64_state content_hash;
+	xyzimage_error_t error;
+	XYZImage_Allocator allocator;
+	// Allocates the zlib state, it lives as long as the decoder
+	xyzpriv_scratch zlib_scratch;
+};
+
+XYZImage_Decoder* xyzimage_decoder_create(xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	const XYZImage_Allocator* allocator = xyzpriv_get_allocator();
+	XYZImage_Decoder* decoder = (XYZImage_Decoder*)allocator->malloc_func(allocator->userdata, sizeof(XYZImage_Decoder));
+
+	if (decoder == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	decoder->state = XYZPRIV_FEED_HEADER;
+	decoder->header_len = 0;
+	decoder->width = 0;
+	decoder->height = 0;
+	decoder->image = NULL;
+	decoder->stream_ready = 0;
+	decoder->out_pos = 0;
+	decoder->out_len = 0;
+	decoder->read_limit = 0;
+	decoder->error = XYZIMAGE_ERROR_OK;
+	decoder->allocator = *allocator;
+	xyzpriv_scratch_begin(&decoder->zlib_scratch, NULL, &decoder->allocator);
+
+	return decoder;
+}
+
+void xyzimage_decoder_free(XYZImage_Decoder* decoder) {
+	if (decoder == NULL) {
+		return;
+	}
+
+	if (decoder->stream_ready) {
+		inflateEnd(&decoder->stream);
+	}
+
+	if (decoder->image) {
+		xyzimage_free(decoder->image);
+	}
+
+	XYZImage_Allocator allocator = decoder->allocator;
+	allocator.free_func(allocator.userdata, decoder);
+}
+
+static enum XYZImage_DecoderStatus xyzpriv_decoder_fail(XYZImage_Decoder* decoder, xyzimage_error_t which, xyzimage_error_t* error) {
+	decoder->state = XYZPRIV_FEED_ERROR;
+	decoder->error = which;
+
+	if (decoder->stream_ready) {
+		inflateEnd(&decoder->stream);
+		decoder->stream_ready = 0;
+	}
+
+	xyzpriv_set_error(error, which);
+
+	return XYZIMAGE_DECODER_ERROR;
+}
+
+static enum XYZImage_DecoderStatus xyzpriv_decoder_feed_header(XYZImage_Decoder* decoder, xyzimage_error_t* error) {
+	// XYZ1 magic followed by width and height (little endian)
+	if (memcmp(decoder->header, "XYZ1", 4) != 0) {
+		return xyzpriv_decoder_fail(decoder, XYZIMAGE_ERROR_IO_READ_BAD_HEADER, error);
+	}
+
+	decoder->width = (uint16_t)(decoder->header[4] | (decoder->header[5] << 8));
+	decoder->height = (uint16_t)(decoder->header[6] | (decoder->header[7] << 8));
+
+	// Not zero filled because the whole buffer is overwritten
+	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+	decoder->image = xyzpriv_alloc_image(&decoder->allocator, decoder->width, decoder->height, XYZIMAGE_FORMAT_DEFAULT, 0, 1, &e);
+
+	if (decoder->image == NULL) {
+		return xyzpriv_decoder_fail(decoder, e, error);
+	}
+
+	decoder->stream.zalloc = xyzpriv_zalloc;
+	decoder->stream.zfree = xyzpriv_zfree;
+	decoder->stream.opaque = &decoder->zlib_scratch;
+	decoder->stream.next_in = Z_NULL;
+	decoder->stream.avail_in = 0;
+
+	int zlib_error = inflateInit(&decoder->stream);
+
+	if (zlib_error != Z_OK) {
+		return xyzpriv_decoder_fail(decoder, zlib_error == Z_MEM_ERROR ? XYZIMAGE_ERROR_OUT_OF_MEMORY : XYZIMAGE_ERROR_ZLIB, error);
+	}
+
+	decoder->stream_ready = 1;
+	decoder->out_len = XYZIMAGE_PALETTE_SIZE + (size_t)decoder->width * decoder->height;
+	decoder->read_limit = decoder->out_len * 2;
+	xyzpriv_hash64_begin(&decoder->content_hash, xyzpriv_content_hash_seed(decoder->width, decoder->height));
+	decoder->state = XYZPRIV_FEED_INFLATE;
+
+	return XYZIMAGE_DECODER_HEADER_READY;
+}
+
+enum XYZImage_DecoderStatus xyzimage_decoder_feed(XYZImage_Decoder* decoder, const void* data, size_t len, size_t* consumed, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (consumed) {
+		*consumed = 0;
+	}
+
+	if (decoder == NULL || (data == NULL && len > 0)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return XYZIMAGE_DECODER_ERROR;
+	}
+
+	if (decoder->state == XYZPRIV_FEED_ERROR) {
+		xyzpriv_set_error(error, decoder->error);
+		return XYZIMAGE_DECODER_ERROR;
+	}
+
+	if (decoder->state == XYZPRIV_FEED_DONE) {
+		return XYZIMAGE_DECODER_DONE;
+	}
+
+	const uint8_t* in = (const uint8_t*)data;
+	size_t remaining = len;
+
+	if (decoder->state == XYZPRIV_FEED_HEADER) {
+		size_t amount = XYZPRIV_HEADER_SIZE - decoder->header_len;
+		if (amount > remaining) {
+			amount = remaining;
+		}
+
+		memcpy(decoder->header + decoder->header_len, in, amount);
+		decoder->header_len += amount;
+
+		if (consumed) {
+			*consumed = amount;
+		}
+
+		if (decoder->header_len >= 4 && memcmp(decoder->header, "XYZ1", 4) != 0) {
+			return xyzpriv_decoder_fail(decoder, XYZIMAGE_ERROR_IO_READ_BAD_HEADER, error);
+		}
+
+		if (decoder->header_len < XYZPRIV_HEADER_SIZE) {
+			return XYZIMAGE_DECODER_NEED_MORE_INPUT;
+		}
+
+		return xyzpriv_decoder_feed_header(decoder, error);
+	}
+
+	z_stream* stream = &decoder->stream;
+	XYZImage* image = decoder->image;
+
+	while (remaining > 0) {
+		if (stream->total_in >= decoder->read_limit) {
+			return xyzpriv_decoder_fail(decoder, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_BIG, error);
+		}
+
+		// Inflate into the palette, then into the pixels, then into a byte detecting excess data
+		Bytef excess;
+
+		if (decoder->out_pos < XYZIMAGE_PALETTE_SIZE) {
+			stream->next_out = (Bytef*)image->palette + decoder->out_pos;
+			stream->avail_out = (uInt)(XYZIMAGE_PALETTE_SIZE - decoder->out_pos);
+		} else if (decoder->out_pos < decoder->out_len) {
+			size_t pixels_left = decoder->out_len - decoder->out_pos;
+			stream->next_out = (Bytef*)image->data + (decoder->out_pos - XYZIMAGE_PALETTE_SIZE);
+			stream->avail_out = pixels_left > (uInt)-1 ? (uInt)-1 : (uInt)pixels_left;
+		} else {
+			stream->next_out = &excess;
+			stream->avail_out = 1;
+		}
+
+		// Never inflate more input than the limit, large feeds are otherwise accepted in one call
+		size_t allowed = decoder->read_limit - stream->total_in;
+		size_t amount = remaining < allowed ? remaining : allowed;
+		uInt avail_in = amount > (uInt)-1 ? (uInt)-1 : (uInt)amount;
+		uInt avail_out = stream->avail_out;
+		stream->next_in = (Bytef*)in;
+		stream->avail_in = avail_in;
+
+		int zlib_error = inflate(stream, Z_NO_FLUSH);
+
+		size_t used = avail_in - stream->avail_in;
+		size_t produced = avail_out - stream->avail_out;
+
+		in += used;
+		remaining -= used;
+		if (consumed) {
+			*consumed += used;
+		}
+
+		if (decoder->out_pos == decoder->out_len && produced > 0) {
+			// The stream must not contain more data than the palette and the pixels
+			return xyzpriv_decoder_fail(decoder, XYZIMAGE_ERROR_ZLIB, error);
+		}
+
+		xyzpriv_hash64_update(&decoder->content_hash, stream->next_out - produced, produced);
+		decoder->out_pos += produced;
+
+		if (zlib_error == Z_STREAM_END) {
+			if (decoder->out_pos < decoder->out_len) {
+				return xyzpriv_decoder_fail(decoder, XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_SMALL, error);
+			}
+
+			image->data_len_compressed = stream->total_in;
+			image->checksum = (uint32_t)stream->adler;
+			image->has_checksum = 1;
+			image->content_hash = xyzpriv_hash64_end(&decoder->content_hash);
+			image->has_content_hash = 1;
+			inflateEnd(stream);
+			decoder->stream_ready = 0;
+			decoder->state = XYZPRIV_FEED_DONE;
+
+			return XYZIMAGE_DECODER_DONE;
+		}
+
+		if (zlib_error != Z_OK && zlib_error != Z_BUF_ERROR) {
+			return xyzpriv_decoder_fail(decoder, zlib_error == Z_MEM_ERROR ? XYZIMAGE_ERROR_OUT_OF_MEMORY : XYZIMAGE_ERROR_ZLIB, error);
+		}
+
+		if (used == 0 && produced == 0) {
+			break;
+		}
+	}
+
+	return XYZIMAGE_DECODER_NEED_MORE_INPUT;
+}
+
+int xyzimage_decoder_get_size(const XYZImage_Decoder* decoder, uint16_t* width, uint16_t* height) {
+	if (decoder == NULL || (decoder->state != XYZPRIV_FEED_INFLATE && decoder->state != XYZPRIV_FEED_DONE)) {
+		return 0;
+	}
+
+	if (width) {
+		*width = decoder->width;
+	}
+
+	if (height) {
+		*height = decoder->height;
+	}
+
+	return 1;
+}
+
+XYZImage* xyzimage_decoder_take_image(XYZImage_Decoder* decoder) {
+	if (decoder == NULL || decoder->state != XYZPRIV_FEED_DONE) {
+		return NULL;
+	}
+
+	XYZImage* image = decoder->image;
+	decoder->image = NULL;
+
+	return image;
+}
+
+static int xyzpriv_check_rgba_buffer(uint16_t width, uint16_t height, size_t len, size_t* pitch, xyzimage_error_t* error) {
+	if (*pitch == 0) {
+		*pitch = (size_t)width * 4;
+	}
+
+	size_t row_size = (size_t)width * 4;
+
+	// No buffer fits a pitch whose last row ends past SIZE_MAX
+	if (*pitch < row_size || (height > 1 && *pitch > (SIZE_MAX - row_size) / (height - 1))) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
+		return 0;
+	}
+
+	size_t required = height == 0 ? 0 : *pitch * (height - 1) + row_size;
+
+	if (len < required) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
+		return 0;
+	}
+
+	return 1;
+}
+
+int xyzimage_open_rgba(void* userdata, xyzimage_read_func_t read_func, void* buffer, size_t len, size_t pitch,
+		enum XYZImage_ChannelOrder order, int transparent_index, uint16_t* width, uint16_t* height, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (read_func == NULL || buffer == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	uint16_t w;
+	uint16_t h;
+
+	if (!xyzpriv_read_header(NULL, userdata, read_func, &w, &h, error)) {
+		return 0;
+	}
+
+	if (width) {
+		*width = w;
+	}
+
+	if (height) {
+		*height = h;
+	}
+
+	if (!xyzpriv_check_rgba_buffer(w, h, len, &pitch, error)) {
+		return 0;
+	}
+
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin_global(&scratch);
+
+	// Receives a strip of rows of palette indices at a time. Inflating single rows is slower,
+	// zlib only uses its fast decoding loop while plenty of output space is left.
+	size_t strip_rows = w > 0 ? XYZPRIV_RGBA_STRIP_SIZE / w : 1;
+	if (strip_rows > h) {
+		strip_rows = h > 0 ? h : 1;
+	}
+
+	uint8_t* strip = (uint8_t*)xyzpriv_scratch_malloc(&scratch, w > 0 ? strip_rows * w : 1);
+
+	if (strip == NULL) {
+		xyzpriv_scratch_end(&scratch);
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return 0;
+	}
+
+	xyzpriv_decoder dec;
+
+	if (!xyzpriv_decoder_init(&dec, &scratch, NULL, userdata, read_func, XYZIMAGE_PALETTE_SIZE + (size_t)w * h, XYZPRIV_UNKNOWN_LENGTH, xyzpriv_decompress_func, error)) {
+		xyzpriv_scratch_free(&scratch, strip);
+		xyzpriv_scratch_end(&scratch);
+		return 0;
+	}
+
+	XYZImage_Palette palette;
+	uint32_t lut[XYZIMAGE_PALETTE_ENTRIES];
+	xyzpriv_expand_func_t expand = xyzpriv_get_expand_func();
+
+	int success = xyzpriv_decoder_inflate(&dec, &palette, XYZIMAGE_PALETTE_SIZE, error);
+
+	if (success && !xyzpriv_build_lut(&palette, order, transparent_index, lut)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED);
+		success = 0;
+	}
+
+	size_t y;
+	for (y = 0; success && y < h; y += strip_rows) {
+		size_t rows = h - y < strip_rows ? h - y : strip_rows;
+		success = xyzpriv_decoder_inflate(&dec, strip, rows * w, error);
+
+		if (success) {
+			xyzpriv_expand_rows(expand, strip, w, (uint8_t*)buffer + y * pitch, pitch, w, rows, lut);
+		}
+	}
+
+	if (success) {
+		success = xyzpriv_decoder_finish(&dec, error);
+	}
+
+	xyzpriv_decoder_end(&dec);
+	xyzpriv_scratch_free(&scratch, strip);
+	xyzpriv_scratch_end(&scratch);
+
+	return success;
+}
+
+uint16_t xyzimage_get_width(const XYZImage* image) {
+	if (!xyzimage_is_valid(image)) {
+		return 0;
+	}
+
+	return image->width;
+}
+
+uint16_t xyzimage_get_height(const XYZImage* image) {
+	if (!xyzimage_is_valid(image)) {
+		return 0;
+	}
+
+	return image->height;
+}
+
+XYZImage_Palette* xyzimage_get_palette(XYZImage* image, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return NULL;
+	}
+
+	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IMAGE_NOT_INDEXED);
+		return NULL;
+	}
+
+	if (image->shared_palette) {
+		// Copy on write, the other images keep the shared palette
+		XYZImage_Palette* palette = (XYZImage_Palette*)image->allocator.malloc_func(image->allocator.userdata, sizeof(XYZImage_Palette));
+
+		if (palette == NULL) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			return NULL;
+		}
+
+		memcpy(palette, image->palette, sizeof(XYZImage_Palette));
+		xyzpriv_palette_cache_release(image->shared_palette);
+
+		image->shared_palette = NULL;
+		image->palette = palette;
+		image->palette_allocated = 1;
+	}
+
+	return image->palette;
+}
+
+const XYZImage_Palette* xyzimage_get_palette_handle(const XYZImage* image, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return NULL;
+	}
+
+	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IMAGE_NOT_INDEXED);
+		return NULL;
+	}
+
+	return image->palette;
+}
+
+uint64_t xyzimage_get_palette_hash(const XYZImage* image) {
+	if (!xyzimage_is_valid(image) || image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		return 0;
+	}
+
+	if (image->shared_palette) {
+		return image->shared_palette->hash;
+	}
+
+	return xyzpriv_palette_hash(image->palette);
+}
+
+int xyzimage_palette_changed(const XYZImage* image, uint64_t* hash) {
+	if (hash == NULL) {
+		return 1;
+	}
+
+	uint64_t current = xyzimage_get_palette_hash(image);
+	int changed = current != *hash;
+	*hash = current;
+
+	return changed;
+}
+
+int xyzimage_share_palette(XYZImage* image, XYZImage_PaletteCache* cache, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return 0;
+	}
+
+	if (cache == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IMAGE_NOT_INDEXED);
+		return 0;
+	}
+
+	if (image->shared_palette && image->shared_palette->cache == cache) {
+		return 1;
+	}
+
+	uint64_t hash = xyzimage_get_palette_hash(image);
+	xyzpriv_shared_palette* shared = xyzpriv_palette_cache_intern(cache, image->palette, hash);
+
+	if (shared == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return 0;
+	}
+
+	if (image->shared_palette) {
+		xyzpriv_palette_cache_release(image->shared_palette);
+	} else if (image->palette_allocated) {
+		image->allocator.free_func(image->allocator.userdata, image->palette);
+		image->palette_allocated = 0;
+	}
+
+	image->shared_palette = shared;
+	image->palette = &shared->palette;
+
+	return 1;
+}
+
+enum XYZImage_Format xyzimage_get_format(const XYZImage* image) {
+	if (!xyzimage_is_valid(image)) {
+		return XYZIMAGE_FORMAT_NONE;
+	}
+
+	return image->format;
+}
+
+void* xyzimage_get_buffer(XYZImage* image, size_t* len) {
+	if (!xyzimage_is_valid(image)) {
+		return NULL;
+	}
+
+	if (len) {
+		*len = image->data_len;
+	}
+
+	return image->data;
+}
+
+size_t xyzimage_get_pitch(const XYZImage* image) {
+	if (!xyzimage_is_valid(image)) {
+		return 0;
+	}
+
+	return image->pitch;
+}
+
+int xyzimage_convert_rgba(const XYZImage* image, void* buffer, size_t len, size_t pitch,
+		enum XYZImage_ChannelOrder order, int transparent_index, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return 0;
+	}
+
+	if (buffer == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IMAGE_NOT_INDEXED);
+		return 0;
+	}
+
+	if (!xyzpriv_check_rgba_buffer(image->width, image->height, len, &pitch, error)) {
+		return 0;
+	}
+
+	uint32_t lut[XYZIMAGE_PALETTE_ENTRIES];
+
+	if (!xyzpriv_build_lut(image->palette, order, transparent_index, lut)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED);
+		return 0;
+	}
+
+	xyzpriv_expand_rows(xyzpriv_get_expand_func(), (const uint8_t*)image->data, image->pitch, (uint8_t*)buffer, pitch,
+		image->width, image->height, lut);
+
+	return 1;
+}
+
+int xyzimage_remap_indices(XYZImage* image, const uint8_t* lut, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return 0;
+	}
+
+	if (lut == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IMAGE_NOT_INDEXED);
+		return 0;
+	}
+
+	xyzpriv_remap_func_t remap = xyzpriv_get_remap_func();
+	xyzpriv_segments_mark_rows(image->segments, 0, image->height);
+
+	if (image->pitch == image->width) {
+		remap((uint8_t*)image->data, (size_t)image->width * image->height, lut);
+	} else {
+		uint16_t y;
+		for (y = 0; y < image->height; ++y) {
+			remap((uint8_t*)image->data + y * image->pitch, image->width, lut);
+		}
+	}
+
+	return 1;
 }
 
 size_t xyzimage_get_filesize(const XYZImage* image) {
@@ -413,46 +2006,634 @@ size_t xyzimage_get_filesize(const XYZImage* image) {
 		return 0;
 	}
 
-	return (uint32_t)image->width * image->height + XYZPRIV_HEADER_SIZE + XYZIMAGE_PALETTE_SIZE;
+	return (uint32_t)image->width * image->height + XYZPRIV_HEADER_SIZE + XYZIMAGE_PALETTE_SIZE;
+}
+
+size_t xyzimage_get_compressed_filesize(const XYZImage* image) {
+	if (!xyzimage_is_valid(image)) {
+		return 0;
+	}
+
+	return image->data_len_compressed + XYZPRIV_HEADER_SIZE;
+}
+
+int xyzimage_get_checksum(const XYZImage* image, uint32_t* checksum) {
+	if (!xyzimage_is_valid(image) || !image->has_checksum) {
+		return 0;
+	}
+
+	if (checksum) {
+		*checksum = image->checksum;
+	}
+
+	return 1;
+}
+
+int xyzimage_get_content_hash(const XYZImage* image, uint64_t* hash) {
+	if (!xyzimage_is_valid(image) || !image->has_content_hash) {
+		return 0;
+	}
+
+	if (hash) {
+		*hash = image->content_hash;
+	}
+
+	return 1;
+}
+
+int xyzimage_mhash(const void* data, size_t len, uint64_t* hash, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (data == NULL || hash == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	if (len < XYZPRIV_HEADER_SIZE || memcmp(data, "XYZ1", 4) != 0) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_BAD_HEADER);
+		return 0;
+	}
+
+	*hash = xyzpriv_hash64(data, len, 0);
+
+	return 1;
+}
+
+void xyzimage_set_decompress_func(xyzimage_decompress_func_t decompress_func) {
+	xyzpriv_decompress_func = decompress_func;
+}
+
+void xyzimage_set_compress_func(XYZImage* image, xyzimage_compress_func_t compress_func) {
+	if (!xyzimage_is_valid(image)) {
+		return;
+	}
+
+	image->compress_func = compress_func;
+}
+
+int xyzimage_set_compress_options(XYZImage* image, const XYZImage_CompressOptions* options, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return 0;
+	}
+
+	if (options == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	if (options->level < 0 || options->level > 9 ||
+			xyzpriv_get_zlib_strategy(options->strategy) < 0 ||
+			options->window_bits < 9 || options->window_bits > 15 ||
+			options->mem_level < 1 || options->mem_level > 9) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	image->compress_options = *options;
+
+	return 1;
+}
+
+int xyzimage_mark_dirty(XYZImage* image, uint16_t x, uint16_t y, uint16_t width, uint16_t height, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return 0;
+	}
+
+	// Clipped to the image, the bands consist of whole rows
+	if (x >= image->width || y >= image->height || width == 0 || height == 0) {
+		return 1;
+	}
+
+	uint16_t row_count = height > image->height - y ? (uint16_t)(image->height - y) : height;
+	xyzpriv_segments_mark_rows(image->segments, y, row_count);
+
+	return 1;
+}
+
+int xyzimage_get_compress_options(const XYZImage* image, XYZImage_CompressOptions* options) {
+	if (!xyzimage_is_valid(image) || options == NULL) {
+		return 0;
+	}
+
+	*options = image->compress_options;
+
+	return 1;
+}
+
+int xyzimage_fwrite(XYZImage* image, FILE* file, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return 0;
+	}
+
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	return xyzimage_write(image, file, xyzpriv_fwrite_func, error);
+}
+
+static size_t xyzpriv_raw_deflate_bound(const XYZImage_CompressOptions* options, size_t len) {
+	// The bounds of deflateBound without the zlib wrapper. The tight one only holds for the default
+	// window and memory level, the optimizer also tries other memory levels.
+	if (options->window_bits == 15 && options->mem_level == 8 && !options->optimize) {
+		return len + (len >> 12) + (len >> 14) + (len >> 25) + 7;
+	}
+
+	// Fixed blocks with 9 bit literals (memory level 2 and above) or stored blocks of 127 bytes (memory level 1)
+	size_t fixed_len = len + (len >> 3) + (len >> 8) + (len >> 9) + 4;
+	size_t stored_len = len + (len >> 5) + (len >> 7) + (len >> 11) + 7;
+
+	return fixed_len > stored_len ? fixed_len : stored_len;
+}
+
+size_t xyzimage_get_write_bound(const XYZImage* image) {
+	if (!xyzimage_is_valid(image)) {
+		return 0;
+	}
+
+	size_t pixels = (size_t)image->width * image->height;
+
+	// Each flush and each separately compressed segment adds up to an empty stored block, the
+	// bit alignment and a block header. The incremental bands of 64 KiB pixels are the smallest
+	// segments, the parallel blocks are larger. Plus the palette and the last segment.
+	size_t pieces = 2 + (pixels + 65535) / 65536;
+
+	// XYZ header, zlib header and adler32 trailer
+	return XYZPRIV_HEADER_SIZE + 6 + xyzpriv_raw_deflate_bound(&image->compress_options, XYZIMAGE_PALETTE_SIZE + pixels) + pieces * 16;
+}
+
+static int xyzpriv_encoder_reuse(XYZImage_Context* context, const XYZImage_CompressOptions* options) {
+	// deflateParams is not used: Older zlib versions emit data when it is called after deflateReset
+	if (!context->deflate_ready) {
+		return 0;
+	}
+
+	if (context->deflate_options.level == options->level &&
+			context->deflate_options.strategy == options->strategy &&
+			context->deflate_options.window_bits == options->window_bits &&
+			context->deflate_options.mem_level == options->mem_level &&
+			deflateReset(&context->deflate_stream) == Z_OK) {
+		return 1;
+	}
+
+	deflateEnd(&context->deflate_stream);
+	context->deflate_ready = 0;
+
+	return 0;
+}
+
+static int xyzpriv_encoder_init(xyzpriv_encoder* enc, xyzpriv_scratch* scratch, XYZImage_Context* context,
+		const XYZImage_CompressOptions* options, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	// When context is non-null the deflate state of the context is reused
+	enc->stream = context ? &context->deflate_stream : &enc->stream_storage;
+	enc->context = context;
+	enc->scratch = scratch;
+	enc->userdata = userdata;
+	enc->write_func = write_func;
+	enc->mem = write_func == xyzimage_mwrite_func ? (XYZImage_MemoryWriter*)userdata : NULL;
+
+	if (context == NULL || !xyzpriv_encoder_reuse(context, options)) {
+		enc->stream->zalloc = xyzpriv_zalloc;
+		enc->stream->zfree = xyzpriv_zfree;
+		enc->stream->opaque = context ? &context->zlib_scratch : scratch;
+
+		int zlib_error = deflateInit2(enc->stream, options->level, Z_DEFLATED, options->window_bits,
+			options->mem_level, xyzpriv_get_zlib_strategy(options->strategy));
+
+		if (zlib_error != Z_OK) {
+			xyzpriv_set_error(error, zlib_error == Z_MEM_ERROR ? XYZIMAGE_ERROR_OUT_OF_MEMORY : XYZIMAGE_ERROR_IO_COMPRESS);
+			return 0;
+		}
+
+		if (context) {
+			context->deflate_ready = 1;
+			context->deflate_options = *options;
+		}
+	}
+
+	if (enc->mem) {
+		// Compress directly into the memory buffer
+		XYZImage_MemoryWriter* mem = enc->mem;
+		size_t remaining = mem->offset < mem->size ? mem->size - mem->offset : 0;
+		enc->stream->next_out = (Bytef*)mem->data + mem->offset;
+		enc->stream->avail_out = remaining > (uInt)-1 ? (uInt)-1 : (uInt)remaining;
+	} else {
+		enc->stream->next_out = enc->chunk;
+		enc->stream->avail_out = sizeof(enc->chunk);
+	}
+
+	return 1;
+}
+
+static void xyzpriv_encoder_end(xyzpriv_encoder* enc) {
+	if (enc->context == NULL) {
+		deflateEnd(enc->stream);
+	}
+}
+
+static int xyzpriv_encoder_drain(xyzpriv_encoder* enc, xyzimage_error_t* error) {
+	if (enc->mem) {
+		// Nowhere to flush to, the memory buffer is full
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
+		return 0;
+	}
+
+	size_t len = sizeof(enc->chunk) - enc->stream->avail_out;
+
+	if (len > 0) {
+		size_t res = xyzpriv_call_write(enc->context, enc->userdata, enc->write_func, enc->chunk, len, error);
+
+		if (res != len || (error && *error != 0)) {
+			return 0;
+		}
+	}
+
+	enc->stream->next_out = enc->chunk;
+	enc->stream->avail_out = sizeof(enc->chunk);
+
+	return 1;
+}
+
+static int xyzpriv_encoder_deflate(xyzpriv_encoder* enc, const void* buffer_in, size_t len_in, int flush, xyzimage_error_t* error) {
+	enc->stream->next_in = (Bytef*)buffer_in;
+	enc->stream->avail_in = (uInt)len_in;
+
+	for (;;) {
+		uint64_t start = xyzpriv_trace_begin(enc->context, XYZIMAGE_TRACE_PHASE_COMPRESS);
+		int zlib_error = deflate(enc->stream, flush);
+		xyzpriv_trace_end(enc->context, XYZIMAGE_TRACE_PHASE_COMPRESS, start);
+
+		if (zlib_error == Z_STREAM_ERROR) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_COMPRESS);
+			return 0;
+		}
+
+		if (flush == Z_FINISH) {
+			if (zlib_error == Z_STREAM_END) {
+				break;
+			}
+		} else if (enc->stream->avail_in == 0 && enc->stream->avail_out > 0) {
+			break;
+		}
+
+		if (enc->stream->avail_out == 0 && !xyzpriv_encoder_drain(enc, error)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int xyzpriv_encoder_finish(xyzpriv_encoder* enc, xyzimage_error_t* error) {
+	if (!xyzpriv_encoder_deflate(enc, NULL, 0, Z_FINISH, error)) {
+		return 0;
+	}
+
+	if (enc->mem) {
+		XYZImage_Stats* stats = xyzpriv_get_stats(enc->context);
+
+		if (stats) {
+			// Memory is written without calling the write function
+			stats->bytes_written += enc->stream->total_out;
+		}
+
+		enc->mem->offset += enc->stream->total_out;
+		return 1;
+	}
+
+	return xyzpriv_encoder_drain(enc, error);
+}
+
+static int xyzpriv_write_header(const XYZImage* image, const XYZImage_Context* context,
+		void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	// XYZ1 magic followed by width and height (little endian)
+	uint8_t xyz_header[XYZPRIV_HEADER_SIZE];
+	memcpy(xyz_header, "XYZ1", 4);
+	xyz_header[4] = (uint8_t)(image->width & 0xFF);
+	xyz_header[5] = (uint8_t)(image->width >> 8);
+	xyz_header[6] = (uint8_t)(image->height & 0xFF);
+	xyz_header[7] = (uint8_t)(image->height >> 8);
+
+	size_t res = xyzpriv_call_write(context, userdata, write_func, xyz_header, XYZPRIV_HEADER_SIZE, error);
+
+	if (res != XYZPRIV_HEADER_SIZE || (error && *error != 0)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static Bytef* xyzpriv_convert_to_default(const XYZImage* image, xyzpriv_scratch* scratch, const XYZImage_Context* context,
+		XYZImage_Palette* palette, xyzimage_error_t* error) {
+	// Converts RGBX and RGBA images to palette indices, the caller frees the result
+	Bytef* indices = xyzpriv_scratch_malloc(scratch, (size_t)image->width * image->height);
+
+	if (indices == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_CONVERT);
+	xyzimage_error_t e = xyzpriv_quantize(image->data, image->pitch, image->width, image->height,
+		image->format == XYZIMAGE_FORMAT_RGBA, palette, indices);
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_CONVERT, start);
+
+	if (e != XYZIMAGE_ERROR_OK) {
+		xyzpriv_scratch_free(scratch, indices);
+		xyzpriv_set_error(error, e);
+		return NULL;
+	}
+
+	return indices;
+}
+
+static int xyzpriv_write_stream(XYZImage* image, xyzpriv_scratch* scratch, XYZImage_Context* context,
+		void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	// The palette and the rows are fed to deflate directly from the image,
+	// compressed data is flushed to write_func in chunks
+	const XYZImage_Palette* palette = image->palette;
+	const uint8_t* pixels = image->data;
+	size_t pitch = image->pitch;
+
+	XYZImage_Palette converted_palette;
+	Bytef* converted = NULL;
+
+	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		converted = xyzpriv_convert_to_default(image, scratch, context, &converted_palette, error);
+
+		if (converted == NULL) {
+			return 0;
+		}
+
+		palette = &converted_palette;
+		pixels = converted;
+		pitch = image->width;
+	}
+
+	// Restored on failure, the memory does not contain a valid image then
+	size_t mem_offset = write_func == xyzimage_mwrite_func ? ((XYZImage_MemoryWriter*)userdata)->offset : 0;
+
+	if (!xyzpriv_write_header(image, context, userdata, write_func, error)) {
+		xyzpriv_scratch_free(scratch, converted);
+		return 0;
+	}
+
+	size_t len = XYZIMAGE_PALETTE_SIZE + (size_t)image->width * image->height;
+
+	// Converted images get a new palette order each time, the bands cannot be kept
+	int incremental = image->compress_options.incremental && converted == NULL;
+
+	if (image->compress_options.optimize || incremental || xyzpriv_deflate_is_parallel(&image->compress_options, len)) {
+		// The writes are traced through a wrapper
+		xyzpriv_traced_writer writer;
+		writer.context = context;
+		writer.userdata = userdata;
+		writer.write_func = write_func;
+
+		void* write_userdata = context ? (void*)&writer : userdata;
+		xyzimage_write_func_t traced_write_func = context ? xyzpriv_traced_write_func : write_func;
+
+		size_t written;
+		uint32_t checksum;
+		int success;
+		uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_COMPRESS);
+
+		// The optimizer compresses the whole stream with each candidate, the block split is not used
+		if (image->compress_options.optimize) {
+			success = xyzpriv_deflate_optimize(palette, pixels, pitch, image->width, image->height, &image->compress_options,
+				write_userdata, traced_write_func, &written, &checksum, error);
+		} else if (incremental) {
+			success = xyzpriv_deflate_incremental(&image->segments, palette, pixels, pitch, image->width, image->height,
+				&image->compress_options, write_userdata, traced_write_func, &written, &checksum, error);
+		} else {
+			success = xyzpriv_deflate_parallel(palette, pixels, pitch, image->width, image->height, &image->compress_options,
+				write_userdata, traced_write_func, &written, &checksum, error);
+		}
+
+		xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_COMPRESS, start);
+
+		if (success) {
+			image->data_len_compressed = written;
+			image->checksum = checksum;
+			image->has_checksum = 1;
+		} else if (write_func == xyzimage_mwrite_func) {
+			((XYZImage_MemoryWriter*)userdata)->offset = mem_offset;
+		}
+
+		xyzpriv_scratch_free(scratch, converted);
+
+		return success;
+	}
+
+	xyzpriv_encoder enc;
+
+	if (!xyzpriv_encoder_init(&enc, scratch, context, &image->compress_options, userdata, write_func, error)) {
+		xyzpriv_scratch_free(scratch, converted);
+		if (enc.mem) {
+			enc.mem->offset = mem_offset;
+		}
+		return 0;
+	}
+
+	// A full flush puts the pixels into blocks that do not depend on the palette
+	int success = xyzpriv_encoder_deflate(&enc, palette, XYZIMAGE_PALETTE_SIZE,
+		image->compress_options.separate_palette ? Z_FULL_FLUSH : Z_NO_FLUSH, error);
+
+	if (success) {
+		if (pitch == image->width) {
+			success = xyzpriv_encoder_deflate(&enc, pixels, (size_t)image->width * image->height, Z_NO_FLUSH, error);
+		} else {
+			uint16_t y;
+			for (y = 0; success && y < image->height; ++y) {
+				success = xyzpriv_encoder_deflate(&enc, pixels + y * pitch, image->width, Z_NO_FLUSH, error);
+			}
+		}
+	}
+
+	if (success) {
+		success = xyzpriv_encoder_finish(&enc, error);
+	}
+
+	if (success) {
+		// Update compressed size information (for statistical purposes)
+		image->data_len_compressed = enc.stream->total_out;
+		image->checksum = (uint32_t)enc.stream->adler;
+		image->has_checksum = 1;
+	} else if (enc.mem) {
+		enc.mem->offset = mem_offset;
+	}
+
+	xyzpriv_encoder_end(&enc);
+	xyzpriv_scratch_free(scratch, converted);
+
+	return success;
 }
 
-size_t xyzimage_get_compressed_filesize(const XYZImage* image) {
-	if (!xyzimage_is_valid(image)) {
+static void xyzpriv_set_stream_checksum(XYZImage* image, const void* stream, size_t len) {
+	// A zlib stream has a 2 byte header and ends with the checksum
+	image->has_checksum = len >= 6;
+	image->checksum = image->has_checksum ? xyzpriv_read_be32((const uint8_t*)stream + len - 4) : 0;
+}
+
+static int xyzpriv_write_custom(XYZImage* image, xyzpriv_scratch* scratch, const XYZImage_Context* context,
+		void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	// The custom compress function operates on the whole image, this requires intermediate buffers
+	size_t xyz_size = (size_t)(XYZIMAGE_PALETTE_SIZE + (uint32_t)image->width * image->height);
+
+	Bytef* decompressed_xyz = xyzpriv_scratch_malloc(scratch, xyz_size);
+
+	if (decompressed_xyz == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
 		return 0;
 	}
 
-	return image->data_len_compressed + XYZPRIV_HEADER_SIZE;
-}
+	// Fill the buffer
+	uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_CONVERT);
 
-void xyzimage_set_compress_func(XYZImage* image, xyzimage_compress_func_t compress_func) {
-	if (!xyzimage_is_valid(image)) {
-		return;
+	if (image->format != XYZIMAGE_FORMAT_DEFAULT) {
+		// Convert to the default format, this builds the palette
+		xyzimage_error_t e = xyzpriv_quantize(image->data, image->pitch, image->width, image->height,
+			image->format == XYZIMAGE_FORMAT_RGBA, (XYZImage_Palette*)decompressed_xyz, decompressed_xyz + XYZIMAGE_PALETTE_SIZE);
+
+		if (e != XYZIMAGE_ERROR_OK) {
+			xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_CONVERT, start);
+			xyzpriv_scratch_free(scratch, decompressed_xyz);
+			xyzpriv_set_error(error, e);
+			return 0;
+		}
+	} else {
+		memcpy(decompressed_xyz, image->palette, XYZIMAGE_PALETTE_SIZE);
+
+		if (image->pitch == image->width) {
+			memcpy(decompressed_xyz + XYZIMAGE_PALETTE_SIZE, image->data, image->data_len);
+		} else {
+			uint16_t y;
+			for (y = 0; y < image->height; ++y) {
+				memcpy(decompressed_xyz + XYZIMAGE_PALETTE_SIZE + (size_t)y * image->width,
+					(const uint8_t*)image->data + y * image->pitch, image->width);
+			}
+		}
 	}
 
-	if (compress_func == NULL) {
-		image->compress_func = xyzpriv_compress_func;
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_CONVERT, start);
+
+	void* compressed_xyz;
+	size_t compressed_len;
+
+	if (write_func == xyzimage_mwrite_func) {
+		// Compress directly into the memory buffer, behind the header
+		XYZImage_MemoryWriter* writer = (XYZImage_MemoryWriter*)userdata;
+		size_t remaining = writer->offset < writer->size ? writer->size - writer->offset : 0;
+
+		if (remaining <= XYZPRIV_HEADER_SIZE) {
+			xyzpriv_scratch_free(scratch, decompressed_xyz);
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_BUFFER_TOO_SMALL);
+			return 0;
+		}
+
+		compressed_xyz = (uint8_t*)writer->data + writer->offset + XYZPRIV_HEADER_SIZE;
+		compressed_len = remaining - XYZPRIV_HEADER_SIZE;
 	} else {
-		image->compress_func = compress_func;
+		compressed_len = xyz_size;
+		compressed_xyz = xyzpriv_scratch_malloc(scratch, compressed_len);
+
+		if (compressed_xyz == NULL) {
+			xyzpriv_scratch_free(scratch, decompressed_xyz);
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			return 0;
+		}
 	}
-}
 
-int xyzimage_fwrite(XYZImage* image, FILE* file, xyzimage_error_t* error) {
-	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+	// Special error handling for buffer too small check (compressed > decompressed)
+	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+	start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_COMPRESS);
+	size_t compressed_size = image->compress_func(decompressed_xyz, xyz_size, compressed_xyz, compressed_len, &e);
 
-	if (!xyzimage_is_valid(image)) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+	if (e == XYZIMAGE_ERROR_BUFFER_TOO_SMALL && write_func != xyzimage_mwrite_func) {
+		// Compression ratio is worse than 1, double the buffer size and try again
+		Bytef* compressed_xyz_new = xyzpriv_scratch_realloc(scratch, compressed_xyz, xyz_size * 2);
+
+		if (compressed_xyz_new == NULL) {
+			xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_COMPRESS, start);
+			xyzpriv_scratch_free(scratch, compressed_xyz);
+			xyzpriv_scratch_free(scratch, decompressed_xyz);
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			return 0;
+		}
+
+		compressed_xyz = compressed_xyz_new;
+
+		compressed_size = image->compress_func(decompressed_xyz, xyz_size, compressed_xyz, xyz_size * 2, error);
+	} else {
+		xyzpriv_set_error(error, e);
+	}
+
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_COMPRESS, start);
+
+	xyzpriv_scratch_free(scratch, decompressed_xyz);
+
+	if (write_func == xyzimage_mwrite_func) {
+		if (compressed_size == 0 || (error && *error)) {
+			return 0;
+		}
+
+		// The compressed data is already in place, only the header is missing
+		image->data_len_compressed = compressed_size;
+		xyzpriv_set_stream_checksum(image, compressed_xyz, compressed_size);
+
+		if (!xyzpriv_write_header(image, context, userdata, write_func, error)) {
+			return 0;
+		}
+
+		((XYZImage_MemoryWriter*)userdata)->offset += compressed_size;
+
+		XYZImage_Stats* stats = xyzpriv_get_stats(context);
+
+		if (stats) {
+			// Memory is written without calling the write function
+			stats->bytes_written += compressed_size;
+		}
+
+		return 1;
+	}
+
+	if (compressed_size == 0 || (error && *error)) {
+		xyzpriv_scratch_free(scratch, compressed_xyz);
 		return 0;
 	}
 
-	if (file == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+	// Update compressed size information (for statistical purposes)
+	image->data_len_compressed = compressed_size;
+	xyzpriv_set_stream_checksum(image, compressed_xyz, compressed_size);
+
+	if (!xyzpriv_write_header(image, context, userdata, write_func, error)) {
+		xyzpriv_scratch_free(scratch, compressed_xyz);
 		return 0;
 	}
 
-	return xyzimage_write(image, file, xyzpriv_fwrite_func, error);
+	// Write compressed image
+	size_t res = xyzpriv_call_write(context, userdata, write_func, compressed_xyz, compressed_size, error);
+
+	xyzpriv_scratch_free(scratch, compressed_xyz);
+
+	if (res != compressed_size || (error && *error != 0)) {
+		return 0;
+	}
+
+	return 1;
 }
 
-int xyzimage_write(XYZImage* image, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+static int xyzpriv_write(XYZImage_Context* context, XYZImage* image, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
 	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
 
 	if (!xyzimage_is_valid(image)) {
@@ -467,115 +2648,290 @@ int xyzimage_write(XYZImage* image, void* userdata, xyzimage_write_func_t write_
 
 	switch (image->format) {
 		case XYZIMAGE_FORMAT_DEFAULT:
+		case XYZIMAGE_FORMAT_RGBX:
+		case XYZIMAGE_FORMAT_RGBA:
 			break;
 		default:
 			xyzpriv_set_error(error, XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED);
 			return 0;
 	}
 
-	// Allocate intermediate buffer
-	size_t xyz_size = (size_t)(XYZIMAGE_PALETTE_SIZE + (uint32_t)image->width * image->height);
+	uint64_t start = xyzpriv_trace_begin(context, XYZIMAGE_TRACE_PHASE_WRITE);
 
-	Bytef* decompressed_xyz = malloc(xyz_size);
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin_context(&scratch, context);
 
-	if (decompressed_xyz == NULL) {
-		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+	int success;
+
+	if (image->compress_func) {
+		success = xyzpriv_write_custom(image, &scratch, context, userdata, write_func, error);
+	} else {
+		success = xyzpriv_write_stream(image, &scratch, context, userdata, write_func, error);
+	}
+
+	xyzpriv_scratch_end(&scratch);
+
+	if (success && scratch.stats) {
+		scratch.stats->images_written += 1;
+		scratch.stats->compressed_written += image->data_len_compressed;
+		scratch.stats->uncompressed_written += XYZIMAGE_PALETTE_SIZE + (size_t)image->width * image->height;
+	}
+
+	xyzpriv_trace_end(context, XYZIMAGE_TRACE_PHASE_WRITE, start);
+
+	return success;
+}
+
+static int xyzpriv_mwrite(XYZImage_Context* context, XYZImage* image, void* buffer, size_t len, size_t* written, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (written) {
+		*written = 0;
+	}
+
+	if (!xyzimage_is_valid(image)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
 		return 0;
 	}
 
-	// Fill the buffer
-	int i;
-	for (i = 0; i < XYZIMAGE_PALETTE_ENTRIES; ++i) {
-		decompressed_xyz[i * 3] = image->palette.entry[i].red;
-		decompressed_xyz[i * 3 + 1] = image->palette.entry[i].green;
-		decompressed_xyz[i * 3 + 2] = image->palette.entry[i].blue;
+	if (buffer == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
 	}
 
-	memcpy(decompressed_xyz + XYZIMAGE_PALETTE_SIZE, image->data, image->data_len);
+	XYZImage_MemoryWriter writer;
+	writer.data = buffer;
+	writer.size = len;
+	writer.offset = 0;
 
-	// Compress using the compression function
-	void* compressed_xyz = malloc(xyz_size);
+	if (!xyzpriv_write(context, image, &writer, xyzimage_mwrite_func, error)) {
+		return 0;
+	}
+
+	if (written) {
+		*written = writer.offset;
+	}
+
+	return 1;
+}
+
+int xyzimage_mwrite(XYZImage* image, void* buffer, size_t len, size_t* written, xyzimage_error_t* error) {
+	return xyzpriv_mwrite(NULL, image, buffer, len, written, error);
+}
+
+int xyzimage_write(XYZImage* image, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	return xyzpriv_write(NULL, image, userdata, write_func, error);
+}
+
+XYZImage_Context* xyzimage_context_create(const XYZImage_Allocator* allocator, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (allocator == NULL) {
+		allocator = xyzpriv_get_allocator();
+	} else if (allocator->malloc_func == NULL || allocator->realloc_func == NULL || allocator->free_func == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
 
-	if (compressed_xyz == NULL) {
-		free(decompressed_xyz);
+	XYZImage_Context* context = (XYZImage_Context*)allocator->malloc_func(allocator->userdata, sizeof(XYZImage_Context));
+
+	if (context == NULL) {
 		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-		return 0;
+		return NULL;
 	}
 
-	// Special error handling for buffer too small check (compressed > decompressed)
-	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
-	size_t compressed_size = image->compress_func(decompressed_xyz, xyz_size, compressed_xyz, xyz_size, &e);
+	context->allocator = *allocator;
+	context->arena = xyzpriv_arena_create(0, &context->allocator, 1, error);
 
-	if (e == XYZIMAGE_ERROR_BUFFER_TOO_SMALL) {
-		// Compression ratio is worse than 1, double the buffer size and try again
-		Bytef* compressed_xyz_new = realloc(compressed_xyz, xyz_size * 2);
+	if (context->arena == NULL) {
+		allocator->free_func(allocator->userdata, context);
+		return NULL;
+	}
 
-		if (compressed_xyz_new == NULL) {
-			xyzimage_free(image);
-			free(compressed_xyz);
-			free(decompressed_xyz);
-			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
-			return 0;
-		}
+	xyzpriv_scratch_begin(&context->zlib_scratch, NULL, &context->allocator);
+	context->decompress_func = xyzpriv_decompress_func;
+	context->inflate_ready = 0;
+	context->deflate_ready = 0;
+	context->verify_checksum = 1;
+	context->content_hash = 1;
+	context->stats = NULL;
+	context->trace_func = NULL;
+	context->trace_userdata = NULL;
+	context->palette_cache = NULL;
+
+	return context;
+}
 
-		compressed_xyz = compressed_xyz_new;
+void xyzimage_context_free(XYZImage_Context* context) {
+	if (context == NULL) {
+		return;
+	}
 
-		compressed_size = image->compress_func(decompressed_xyz, xyz_size, compressed_xyz, xyz_size * 2, error);
-	} else {
-		xyzpriv_set_error(error, e);
+	if (context->inflate_ready) {
+		inflateEnd(&context->inflate_stream);
 	}
 
-	free(decompressed_xyz);
+	if (context->deflate_ready) {
+		deflateEnd(&context->deflate_stream);
+	}
 
-	if (compressed_size == 0 || (error && *error)) {
-		free(compressed_xyz);
-		return 0;
+	xyzimage_arena_free(context->arena);
+
+	XYZImage_Allocator allocator = context->allocator;
+	allocator.free_func(allocator.userdata, context);
+}
+
+void xyzimage_context_set_decompress_func(XYZImage_Context* context, xyzimage_decompress_func_t decompress_func) {
+	if (context == NULL) {
+		return;
 	}
 
-	// Update compressed size information (for statistical purposes)
-	image->data_len_compressed = compressed_size;
+	context->decompress_func = decompress_func;
+}
+
+void xyzimage_context_set_verify_checksum(XYZImage_Context* context, int verify) {
+	if (context == NULL) {
+		return;
+	}
+
+	context->verify_checksum = verify != 0;
+}
 
-	// Write the header
-	char xyz_header[4] = {'X', 'Y', 'Z', '1'};
+void xyzimage_context_set_content_hash(XYZImage_Context* context, int enabled) {
+	if (context == NULL) {
+		return;
+	}
 
-	size_t res = write_func(userdata, xyz_header, 4, error);
+	context->content_hash = enabled != 0;
+}
 
-	if (res != 4 || (error && *error != 0)) {
-		free(compressed_xyz);
-		return 0;
+void xyzimage_context_set_stats(XYZImage_Context* context, XYZImage_Stats* stats) {
+	if (context == NULL) {
+		return;
 	}
 
-	// Write width and height
-	uint16_t width = image->width;
-	xyzpriv_swap_when_big(&width);
+	context->stats = stats;
+	// Allocations of the zlib state are counted as well
+	context->zlib_scratch.stats = stats;
+}
+
+void xyzimage_context_set_trace_func(XYZImage_Context* context, xyzimage_trace_func_t trace_func, void* userdata) {
+	if (context == NULL) {
+		return;
+	}
 
-	res = write_func(userdata, &width, 2, error);
+	context->trace_func = trace_func;
+	context->trace_userdata = userdata;
+}
 
-	if (res != 2 || (error && *error != 0)) {
-		free(compressed_xyz);
-		return 0;
+void xyzimage_context_set_palette_cache(XYZImage_Context* context, XYZImage_PaletteCache* cache) {
+	if (context == NULL) {
+		return;
 	}
 
-	uint16_t height = image->height;
-	xyzpriv_swap_when_big(&height);
+	context->palette_cache = cache;
+}
+
+void xyzimage_stats_reset(XYZImage_Stats* stats) {
+	if (stats == NULL) {
+		return;
+	}
+
+	memset(stats, '\0', sizeof(XYZImage_Stats));
+}
+
+XYZImage* xyzimage_context_open(XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (context == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	return xyzpriv_open(context, userdata, read_func, XYZPRIV_UNKNOWN_LENGTH, NULL, 0, 0, error);
+}
+
+XYZImage* xyzimage_context_open_sized(XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		size_t size, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (context == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	return xyzpriv_open(context, userdata, read_func, size, NULL, 0, 0, error);
+}
+
+XYZImage* xyzimage_context_fopen(XYZImage_Context* context, FILE* file, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	if (context == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	return xyzpriv_fopen(context, file, error);
+}
+
+XYZImage* xyzimage_context_mopen(XYZImage_Context* context, const void* data, size_t len, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (data == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	XYZImage_MemoryReader reader;
+	reader.data = data;
+	reader.size = len;
+	reader.offset = 0;
+
+	return xyzimage_context_open(context, &reader, xyzimage_mread_func, error);
+}
+
+XYZImage* xyzimage_context_open_buffer(XYZImage_Context* context, void* userdata, xyzimage_read_func_t read_func,
+		void* buffer, size_t len, size_t pitch, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (context == NULL || buffer == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
 
-	res = write_func(userdata, &height, 2, error);
+	return xyzpriv_open(context, userdata, read_func, XYZPRIV_UNKNOWN_LENGTH, buffer, len, pitch, error);
+}
 
-	if (res != 2 || (error && *error != 0)) {
-		free(compressed_xyz);
+int xyzimage_context_write(XYZImage_Context* context, XYZImage* image, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	if (context == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
 		return 0;
 	}
 
-	// Write compressed image
-	res = write_func(userdata, compressed_xyz, compressed_size, error);
+	return xyzpriv_write(context, image, userdata, write_func, error);
+}
+
+int xyzimage_context_fwrite(XYZImage_Context* context, XYZImage* image, FILE* file, xyzimage_error_t* error) {
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
 
-	free(compressed_xyz);
+	return xyzimage_context_write(context, image, file, xyzpriv_fwrite_func, error);
+}
 
-	if (res != compressed_size || (error && *error != 0)) {
+int xyzimage_context_mwrite(XYZImage_Context* context, XYZImage* image, void* buffer, size_t len, size_t* written, xyzimage_error_t* error) {
+	if (context == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
 		return 0;
 	}
 
-	return 1;
+	return xyzpriv_mwrite(context, image, buffer, len, written, error);
 }
 
 int xyzimage_is_valid(const XYZImage* image) {
@@ -587,7 +2943,7 @@ int xyzimage_is_valid(const XYZImage* image) {
 		return 0;
 	}
 
-	if (image->version != 1) {
+	if (image->version != XYZPRIV_CURRENT_STRUCT_VERSION) {
 		return 0;
 	}
 
@@ -632,6 +2988,12 @@ const char* xyzimage_get_error_message(xyzimage_error_t error) {
 			return "The used API call is not supported by this library version.";
 		case XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED:
 			return "The requested XYZImage_Format is not supported by this library version.";
+		case XYZIMAGE_ERROR_INVALID_ARGUMENT:
+			return "At least one passed argument is out of range.";
+		case XYZIMAGE_ERROR_PACK_INVALID:
+			return "The pack has no XYZP magic or its index is corrupted.";
+		case XYZIMAGE_ERROR_LOAD_PENDING:
+			return "The request of the loader is not finished yet.";
 		default:
 			return "Unknown error.";
 	}
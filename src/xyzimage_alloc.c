@@ -0,0 +1,348 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <memory.h>
+#include <stdlib.h>
+
+#include "xyzimage_private.h"
+
+// Alignment of arena allocations, sufficient for all types used by the library and zlib
+#define XYZPRIV_ARENA_ALIGN 16u
+
+// Every arena allocation is preceded by a header storing the size of the allocation
+#define XYZPRIV_ARENA_HEADER_SIZE XYZPRIV_ARENA_ALIGN
+
+struct XYZImage_Arena {
+	uint8_t* data;
+	size_t size;
+	size_t offset;
+	size_t peak;
+	// Growable arenas grow at the end of a scope when allocations did not fit
+	int growable;
+	// Size that would have been required for the largest scope
+	size_t wanted;
+	// Allocator that allocated the arena
+	XYZImage_Allocator allocator;
+};
+
+static void* xyzpriv_default_malloc(void* userdata, size_t size) {
+	(void)userdata;
+	return malloc(size);
+}
+
+static void* xyzpriv_default_realloc(void* userdata, void* ptr, size_t size) {
+	(void)userdata;
+	return realloc(ptr, size);
+}
+
+static void xyzpriv_default_free(void* userdata, void* ptr) {
+	(void)userdata;
+	free(ptr);
+}
+
+static XYZImage_Allocator xyzpriv_allocator = {
+	xyzpriv_default_malloc,
+	xyzpriv_default_realloc,
+	xyzpriv_default_free,
+	NULL
+};
+
+static XYZImage_Arena* xyzpriv_scratch_arena = NULL;
+
+int xyzimage_set_allocator(const XYZImage_Allocator* allocator, xyzimage_error_t* error) {
+	if (error) {
+		*error = XYZIMAGE_ERROR_OK;
+	}
+
+	if (allocator == NULL) {
+		xyzpriv_allocator.malloc_func = xyzpriv_default_malloc;
+		xyzpriv_allocator.realloc_func = xyzpriv_default_realloc;
+		xyzpriv_allocator.free_func = xyzpriv_default_free;
+		xyzpriv_allocator.userdata = NULL;
+		return 1;
+	}
+
+	if (allocator->malloc_func == NULL || allocator->realloc_func == NULL || allocator->free_func == NULL) {
+		if (error) {
+			*error = XYZIMAGE_ERROR_POINTER_BAD;
+		}
+		return 0;
+	}
+
+	xyzpriv_allocator = *allocator;
+
+	return 1;
+}
+
+const XYZImage_Allocator* xyzpriv_get_allocator(void) {
+	return &xyzpriv_allocator;
+}
+
+void* xyzpriv_malloc(size_t size) {
+	return xyzpriv_allocator.malloc_func(xyzpriv_allocator.userdata, size);
+}
+
+void* xyzpriv_calloc(size_t count, size_t size) {
+	if (size != 0 && count > (size_t)-1 / size) {
+		return NULL;
+	}
+
+	void* ptr = xyzpriv_malloc(count * size);
+
+	if (ptr) {
+		memset(ptr, '\0', count * size);
+	}
+
+	return ptr;
+}
+
+void* xyzpriv_realloc(void* ptr, size_t size) {
+	return xyzpriv_allocator.realloc_func(xyzpriv_allocator.userdata, ptr, size);
+}
+
+void xyzpriv_free(void* ptr) {
+	xyzpriv_allocator.free_func(xyzpriv_allocator.userdata, ptr);
+}
+
+XYZImage_Arena* xyzpriv_arena_create(size_t size, const XYZImage_Allocator* allocator, int growable, xyzimage_error_t* error) {
+	XYZImage_Arena* arena = (XYZImage_Arena*)allocator->malloc_func(allocator->userdata, sizeof(XYZImage_Arena));
+
+	if (arena == NULL) {
+		if (error) {
+			*error = XYZIMAGE_ERROR_OUT_OF_MEMORY;
+		}
+		return NULL;
+	}
+
+	arena->data = NULL;
+
+	if (size > 0) {
+		arena->data = (uint8_t*)allocator->malloc_func(allocator->userdata, size);
+
+		if (arena->data == NULL) {
+			allocator->free_func(allocator->userdata, arena);
+			if (error) {
+				*error = XYZIMAGE_ERROR_OUT_OF_MEMORY;
+			}
+			return NULL;
+		}
+	}
+
+	arena->size = size;
+	arena->offset = 0;
+	arena->peak = 0;
+	arena->growable = growable;
+	arena->wanted = 0;
+	arena->allocator = *allocator;
+
+	return arena;
+}
+
+XYZImage_Arena* xyzimage_arena_create(size_t size, xyzimage_error_t* error) {
+	if (error) {
+		*error = XYZIMAGE_ERROR_OK;
+	}
+
+	return xyzpriv_arena_create(size, &xyzpriv_allocator, 0, error);
+}
+
+void xyzimage_arena_free(XYZImage_Arena* arena) {
+	if (arena == NULL) {
+		return;
+	}
+
+	XYZImage_Allocator allocator = arena->allocator;
+	allocator.free_func(allocator.userdata, arena->data);
+	allocator.free_func(allocator.userdata, arena);
+}
+
+size_t xyzimage_arena_get_peak_usage(const XYZImage_Arena* arena) {
+	if (arena == NULL) {
+		return 0;
+	}
+
+	return arena->peak;
+}
+
+void xyzimage_set_scratch_arena(XYZImage_Arena* arena) {
+	xyzpriv_scratch_arena = arena;
+}
+
+static size_t xyzpriv_arena_align(size_t size) {
+	return (size + XYZPRIV_ARENA_ALIGN - 1) & ~(size_t)(XYZPRIV_ARENA_ALIGN - 1);
+}
+
+static int xyzpriv_arena_contains(const XYZImage_Arena* arena, const void* ptr) {
+	return arena && (const uint8_t*)ptr >= arena->data && (const uint8_t*)ptr < arena->data + arena->size;
+}
+
+static size_t xyzpriv_arena_get_size(const void* ptr) {
+	size_t size;
+	memcpy(&size, (const uint8_t*)ptr - XYZPRIV_ARENA_HEADER_SIZE, sizeof(size));
+	return size;
+}
+
+static int xyzpriv_arena_is_last(const XYZImage_Arena* arena, const void* ptr) {
+	return (const uint8_t*)ptr + xyzpriv_arena_align(xyzpriv_arena_get_size(ptr)) == arena->data + arena->offset;
+}
+
+static void* xyzpriv_arena_malloc(XYZImage_Arena* arena, size_t size) {
+	// The arena base is aligned by malloc, all offsets are multiples of the alignment
+	if (size > arena->size || xyzpriv_arena_align(size) + XYZPRIV_ARENA_HEADER_SIZE > arena->size - arena->offset) {
+		if (size < (size_t)-1 / 2) {
+			size_t wanted = arena->offset + XYZPRIV_ARENA_HEADER_SIZE + xyzpriv_arena_align(size);
+
+			if (wanted > arena->wanted) {
+				arena->wanted = wanted;
+			}
+		}
+
+		return NULL;
+	}
+
+	uint8_t* ptr = arena->data + arena->offset + XYZPRIV_ARENA_HEADER_SIZE;
+	memcpy(ptr - XYZPRIV_ARENA_HEADER_SIZE, &size, sizeof(size));
+
+	arena->offset += XYZPRIV_ARENA_HEADER_SIZE + xyzpriv_arena_align(size);
+
+	if (arena->offset > arena->peak) {
+		arena->peak = arena->offset;
+	}
+
+	return ptr;
+}
+
+void xyzpriv_scratch_begin(xyzpriv_scratch* scratch, XYZImage_Arena* arena, const XYZImage_Allocator* allocator) {
+	scratch->arena = arena;
+	scratch->mark = arena ? arena->offset : 0;
+	scratch->allocator = allocator;
+	scratch->stats = NULL;
+}
+
+void xyzpriv_scratch_begin_global(xyzpriv_scratch* scratch) {
+	xyzpriv_scratch_begin(scratch, xyzpriv_scratch_arena, &xyzpriv_allocator);
+}
+
+void xyzpriv_scratch_end(xyzpriv_scratch* scratch) {
+	XYZImage_Arena* arena = scratch->arena;
+
+	if (arena == NULL) {
+		return;
+	}
+
+	// Everything allocated from the arena since begin is released at once
+	arena->offset = scratch->mark;
+
+	if (arena->offset == 0 && arena->growable && arena->wanted > arena->size) {
+		// Grow to avoid allocations by the next scope, on failure the arena stays empty
+		XYZImage_Allocator* allocator = &arena->allocator;
+		allocator->free_func(allocator->userdata, arena->data);
+
+		arena->data = (uint8_t*)allocator->malloc_func(allocator->userdata, arena->wanted);
+		arena->size = arena->data ? arena->wanted : 0;
+		arena->wanted = 0;
+
+		if (scratch->stats) {
+			scratch->stats->allocations += 1;
+		}
+	}
+}
+
+void* xyzpriv_scratch_malloc(xyzpriv_scratch* scratch, size_t size) {
+	if (scratch->arena) {
+		void* ptr = xyzpriv_arena_malloc(scratch->arena, size);
+
+		if (ptr) {
+			return ptr;
+		}
+	}
+
+	if (scratch->stats) {
+		scratch->stats->allocations += 1;
+	}
+
+	return scratch->allocator->malloc_func(scratch->allocator->userdata, size);
+}
+
+void* xyzpriv_scratch_realloc(xyzpriv_scratch* scratch, void* ptr, size_t size) {
+	XYZImage_Arena* arena = scratch->arena;
+
+	if (ptr == NULL) {
+		return xyzpriv_scratch_malloc(scratch, size);
+	}
+
+	if (!xyzpriv_arena_contains(arena, ptr)) {
+		if (scratch->stats) {
+			scratch->stats->allocations += 1;
+		}
+
+		return scratch->allocator->realloc_func(scratch->allocator->userdata, ptr, size);
+	}
+
+	size_t old_size = xyzpriv_arena_get_size(ptr);
+
+	if (xyzpriv_arena_is_last(arena, ptr)) {
+		// Grow or shrink in place
+		size_t start = (size_t)((uint8_t*)ptr - arena->data);
+
+		if (size <= arena->size && xyzpriv_arena_align(size) <= arena->size - start) {
+			memcpy((uint8_t*)ptr - XYZPRIV_ARENA_HEADER_SIZE, &size, sizeof(size));
+			arena->offset = start + xyzpriv_arena_align(size);
+
+			if (arena->offset > arena->peak) {
+				arena->peak = arena->offset;
+			}
+
+			return ptr;
+		}
+	} else if (size <= old_size) {
+		return ptr;
+	}
+
+	void* ptr_new = xyzpriv_scratch_malloc(scratch, size);
+
+	if (ptr_new == NULL) {
+		return NULL;
+	}
+
+	memcpy(ptr_new, ptr, old_size < size ? old_size : size);
+	xyzpriv_scratch_free(scratch, ptr);
+
+	return ptr_new;
+}
+
+void xyzpriv_scratch_free(xyzpriv_scratch* scratch, void* ptr) {
+	XYZImage_Arena* arena = scratch->arena;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	if (!xyzpriv_arena_contains(arena, ptr)) {
+		scratch->allocator->free_func(scratch->allocator->userdata, ptr);
+		return;
+	}
+
+	// Only the last allocation can be released early, the rest is released by xyzpriv_scratch_end
+	if (xyzpriv_arena_is_last(arena, ptr)) {
+		arena->offset = (size_t)((uint8_t*)ptr - arena->data) - XYZPRIV_ARENA_HEADER_SIZE;
+	}
+}
+
+voidpf xyzpriv_zalloc(voidpf opaque, uInt items, uInt size) {
+	if (size != 0 && items > (size_t)-1 / size) {
+		return Z_NULL;
+	}
+
+	return xyzpriv_scratch_malloc((xyzpriv_scratch*)opaque, (size_t)items * size);
+}
+
+void xyzpriv_zfree(voidpf opaque, voidpf address) {
+	xyzpriv_scratch_free((xyzpriv_scratch*)opaque, address);
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <stdlib.h>
+
+#include "xyzimage.h"
+#include "xyzimage_thread.h"
+
+typedef struct {
+	XYZImage_BatchItem* items;
+	xyzimage_batch_callback_t callback;
+	void* userdata;
+} xyzpriv_batch;
+
+static void xyzpriv_batch_decode(void* arg, size_t index) {
+	xyzpriv_batch* batch = (xyzpriv_batch*)arg;
+	XYZImage_BatchItem* item = &batch->items[index];
+
+	item->error = XYZIMAGE_ERROR_OK;
+
+	if (item->path) {
+		FILE* file = fopen(item->path, "rb");
+
+		if (file == NULL) {
+			item->image = NULL;
+			item->error = XYZIMAGE_ERROR_IO_READ_GENERIC;
+		} else {
+			item->image = xyzimage_fopen(file, &item->error);
+			fclose(file);
+		}
+	} else if (item->data) {
+		item->image = xyzimage_mopen(item->data, item->size, &item->error);
+	} else {
+		item->image = xyzimage_open(item->userdata, item->read_func, &item->error);
+	}
+
+	if (batch->callback) {
+		batch->callback(batch->userdata, item, index);
+	}
+}
+
+int xyzimage_open_batch(XYZImage_BatchItem* items, size_t count, unsigned int threads,
+		xyzimage_batch_callback_t callback, void* userdata, xyzimage_error_t* error) {
+	if (error) {
+		*error = XYZIMAGE_ERROR_OK;
+	}
+
+	if (items == NULL && count > 0) {
+		if (error) {
+			*error = XYZIMAGE_ERROR_POINTER_BAD;
+		}
+		return 0;
+	}
+
+	xyzpriv_batch batch;
+	batch.items = items;
+	batch.callback = callback;
+	batch.userdata = userdata;
+
+	xyzpriv_parallel_for(count, threads, xyzpriv_batch_decode, &batch);
+
+	// Report the error of the first failed item, the callback can have taken the image
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		if (items[i].error != XYZIMAGE_ERROR_OK) {
+			if (error) {
+				*error = items[i].error;
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+}
@@ -0,0 +1,304 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <memory.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "xyzimage_private.h"
+#include "xyzimage_thread.h"
+
+// Amount of uncompressed bytes compressed by one task
+#define XYZPRIV_DEFLATE_BLOCK_SIZE (128u * 1024u)
+
+// Amount of uncompressed bytes preceding a block used as preset dictionary (maximal window size of deflate)
+#define XYZPRIV_DEFLATE_DICT_SIZE 32768u
+
+typedef struct {
+	const xyzpriv_deflate_source* source;
+	// Size of the uncompressed stream: palette followed by the pixels
+	size_t len;
+	const XYZImage_CompressOptions* options;
+	xyzpriv_deflate_segment* blocks;
+	size_t block_count;
+} xyzpriv_deflate_job;
+
+static void xyzpriv_deflate_copy(const xyzpriv_deflate_source* source, size_t offset, size_t len, Bytef* dst) {
+	// Copies a range of the uncompressed stream, this hides the palette and the pitch of the pixels
+	if (offset < XYZIMAGE_PALETTE_SIZE) {
+		size_t amount = XYZIMAGE_PALETTE_SIZE - offset;
+		if (amount > len) {
+			amount = len;
+		}
+
+		memcpy(dst, (const uint8_t*)source->palette + offset, amount);
+		dst += amount;
+		offset += amount;
+		len -= amount;
+	}
+
+	offset -= XYZIMAGE_PALETTE_SIZE;
+
+	while (len > 0) {
+		size_t y = offset / source->width;
+		size_t x = offset % source->width;
+		size_t amount = source->width - x;
+		if (amount > len) {
+			amount = len;
+		}
+
+		memcpy(dst, source->pixels + y * source->pitch + x, amount);
+		dst += amount;
+		offset += amount;
+		len -= amount;
+	}
+}
+
+static xyzimage_error_t xyzpriv_deflate_block_compress(z_stream* stream, xyzpriv_deflate_segment* block, size_t* capacity, int flush) {
+	// Compresses the remaining input of the stream, the output buffer grows as needed
+	for (;;) {
+		int zlib_error = deflate(stream, flush);
+
+		if (zlib_error == Z_STREAM_ERROR) {
+			return XYZIMAGE_ERROR_IO_COMPRESS;
+		}
+
+		if (flush == Z_FINISH ? zlib_error == Z_STREAM_END : stream->avail_out > 0) {
+			return XYZIMAGE_ERROR_OK;
+		}
+
+		if (stream->avail_out == 0) {
+			Bytef* data_new = xyzpriv_realloc(block->data, *capacity * 2);
+
+			if (data_new == NULL) {
+				return XYZIMAGE_ERROR_OUT_OF_MEMORY;
+			}
+
+			block->data = data_new;
+			stream->next_out = block->data + *capacity;
+			stream->avail_out = (uInt)*capacity;
+			*capacity *= 2;
+		}
+	}
+}
+
+xyzimage_error_t xyzpriv_deflate_segment_compress(const xyzpriv_deflate_source* source, size_t start, size_t len,
+		size_t dict_len, int last, const XYZImage_CompressOptions* options, xyzpriv_deflate_segment* segment) {
+	segment->data = NULL;
+	segment->len = 0;
+	segment->raw_len = len;
+
+	Bytef* in = xyzpriv_malloc(dict_len + len);
+
+	if (in == NULL) {
+		return XYZIMAGE_ERROR_OUT_OF_MEMORY;
+	}
+
+	xyzpriv_deflate_copy(source, start - dict_len, dict_len + len, in);
+
+	segment->adler = (uint32_t)adler32(adler32(0L, Z_NULL, 0), in + dict_len, (uInt)len);
+
+	// The arenas are single threaded, the workers use the global allocator
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin(&scratch, NULL, xyzpriv_get_allocator());
+
+	// Raw deflate: The zlib header and the checksum are written once for the whole stream
+	z_stream stream;
+	stream.zalloc = xyzpriv_zalloc;
+	stream.zfree = xyzpriv_zfree;
+	stream.opaque = &scratch;
+
+	int zlib_error = deflateInit2(&stream, options->level, Z_DEFLATED, -options->window_bits,
+		options->mem_level, xyzpriv_get_zlib_strategy(options->strategy));
+
+	if (zlib_error != Z_OK) {
+		xyzpriv_free(in);
+		return zlib_error == Z_MEM_ERROR ? XYZIMAGE_ERROR_OUT_OF_MEMORY : XYZIMAGE_ERROR_IO_COMPRESS;
+	}
+
+	// Continue where the previous segment stopped, this keeps the compression ratio close to a single stream
+	if (dict_len > 0 && deflateSetDictionary(&stream, in, (uInt)dict_len) != Z_OK) {
+		deflateEnd(&stream);
+		xyzpriv_free(in);
+		return XYZIMAGE_ERROR_IO_COMPRESS;
+	}
+
+	// Room for the empty stored blocks emitted by the flushes
+	size_t capacity = deflateBound(&stream, (uLong)len) + 32;
+	segment->data = xyzpriv_malloc(capacity);
+
+	if (segment->data == NULL) {
+		deflateEnd(&stream);
+		xyzpriv_free(in);
+		return XYZIMAGE_ERROR_OUT_OF_MEMORY;
+	}
+
+	stream.next_in = in + dict_len;
+	stream.avail_in = (uInt)len;
+	stream.next_out = segment->data;
+	stream.avail_out = (uInt)capacity;
+
+	xyzimage_error_t e = XYZIMAGE_ERROR_OK;
+
+	if (start == 0 && len > XYZIMAGE_PALETTE_SIZE && options->separate_palette) {
+		// Like the single threaded path: The palette ends with a full flush
+		stream.avail_in = XYZIMAGE_PALETTE_SIZE;
+		e = xyzpriv_deflate_block_compress(&stream, segment, &capacity, Z_FULL_FLUSH);
+		stream.avail_in = (uInt)(len - XYZIMAGE_PALETTE_SIZE);
+	}
+
+	// Non-final segments end with a sync flush: They end on a byte boundary and can be concatenated
+	if (e == XYZIMAGE_ERROR_OK) {
+		e = xyzpriv_deflate_block_compress(&stream, segment, &capacity, last ? Z_FINISH : Z_SYNC_FLUSH);
+	}
+
+	segment->len = capacity - stream.avail_out;
+
+	deflateEnd(&stream);
+	xyzpriv_free(in);
+
+	return e;
+}
+
+static xyzimage_error_t xyzpriv_deflate_block_run(const xyzpriv_deflate_job* job, size_t index, xyzpriv_deflate_segment* block) {
+	size_t start = index * XYZPRIV_DEFLATE_BLOCK_SIZE;
+	size_t len = job->len - start < XYZPRIV_DEFLATE_BLOCK_SIZE ? job->len - start : XYZPRIV_DEFLATE_BLOCK_SIZE;
+	size_t dict_len = start < XYZPRIV_DEFLATE_DICT_SIZE ? start : XYZPRIV_DEFLATE_DICT_SIZE;
+
+	return xyzpriv_deflate_segment_compress(job->source, start, len, dict_len, index + 1 == job->block_count, job->options, block);
+}
+
+static void xyzpriv_deflate_task(void* arg, size_t index) {
+	xyzpriv_deflate_job* job = (xyzpriv_deflate_job*)arg;
+	xyzpriv_deflate_segment* block = &job->blocks[index];
+
+	block->error = xyzpriv_deflate_block_run(job, index, block);
+}
+
+int xyzpriv_deflate_is_parallel(const XYZImage_CompressOptions* options, size_t len) {
+#ifdef XYZPRIV_HAVE_THREADS
+	return options->threads != 1 && len > XYZPRIV_DEFLATE_BLOCK_SIZE;
+#else
+	(void)options;
+	(void)len;
+	return 0;
+#endif
+}
+
+int xyzpriv_deflate_write_segments(const XYZImage_CompressOptions* options, const xyzpriv_deflate_segment* segments, size_t count,
+		void* userdata, xyzimage_write_func_t write_func, size_t* written, uint32_t* checksum, xyzimage_error_t* error) {
+	// zlib header, equal to the one written by deflate for these options
+	int strategy = xyzpriv_get_zlib_strategy(options->strategy);
+	unsigned int level_flags = 3;
+
+	if (strategy >= Z_HUFFMAN_ONLY || options->level < 2) {
+		level_flags = 0;
+	} else if (options->level < 6) {
+		level_flags = 1;
+	} else if (options->level == 6) {
+		level_flags = 2;
+	}
+
+	unsigned int header = (Z_DEFLATED + ((unsigned int)(options->window_bits - 8) << 4)) << 8;
+	header |= level_flags << 6;
+	header += 31 - (header % 31);
+
+	uint8_t zlib_header[2];
+	zlib_header[0] = (uint8_t)(header >> 8);
+	zlib_header[1] = (uint8_t)(header & 0xFF);
+
+	*written = 0;
+	*checksum = 0;
+
+	size_t res = write_func(userdata, zlib_header, sizeof(zlib_header), error);
+	int success = res == sizeof(zlib_header) && !(error && *error != 0);
+	*written += res;
+
+	uLong adler = adler32(0L, Z_NULL, 0);
+	size_t i;
+
+	for (i = 0; success && i < count; ++i) {
+		res = write_func(userdata, segments[i].data, segments[i].len, error);
+		success = res == segments[i].len && !(error && *error != 0);
+		*written += res;
+
+		adler = adler32_combine(adler, segments[i].adler, (z_off_t)segments[i].raw_len);
+	}
+
+	if (success) {
+		// Checksum of the whole uncompressed stream (big endian)
+		uint8_t trailer[4];
+		trailer[0] = (uint8_t)(adler >> 24);
+		trailer[1] = (uint8_t)((adler >> 16) & 0xFF);
+		trailer[2] = (uint8_t)((adler >> 8) & 0xFF);
+		trailer[3] = (uint8_t)(adler & 0xFF);
+
+		res = write_func(userdata, trailer, sizeof(trailer), error);
+		success = res == sizeof(trailer) && !(error && *error != 0);
+		*written += res;
+		*checksum = (uint32_t)adler;
+	}
+
+	return success;
+}
+
+int xyzpriv_deflate_parallel(const XYZImage_Palette* palette, const uint8_t* pixels, size_t pitch, uint16_t width, uint16_t height,
+		const XYZImage_CompressOptions* options, void* userdata, xyzimage_write_func_t write_func, size_t* written,
+		uint32_t* checksum, xyzimage_error_t* error) {
+	xyzpriv_deflate_source source;
+	source.palette = palette;
+	source.pixels = pixels;
+	source.pitch = pitch;
+	source.width = width;
+	source.height = height;
+
+	xyzpriv_deflate_job job;
+	job.source = &source;
+	job.len = XYZIMAGE_PALETTE_SIZE + (size_t)width * height;
+	job.options = options;
+	job.block_count = (job.len + XYZPRIV_DEFLATE_BLOCK_SIZE - 1) / XYZPRIV_DEFLATE_BLOCK_SIZE;
+	job.blocks = xyzpriv_calloc(job.block_count, sizeof(xyzpriv_deflate_segment));
+
+	*written = 0;
+	*checksum = 0;
+
+	if (job.blocks == NULL) {
+		if (error) {
+			*error = XYZIMAGE_ERROR_OUT_OF_MEMORY;
+		}
+		return 0;
+	}
+
+	xyzpriv_parallel_for(job.block_count, options->threads, xyzpriv_deflate_task, &job);
+
+	int success = 1;
+	size_t i;
+
+	for (i = 0; i < job.block_count; ++i) {
+		if (job.blocks[i].error != XYZIMAGE_ERROR_OK) {
+			if (error) {
+				*error = job.blocks[i].error;
+			}
+			success = 0;
+			break;
+		}
+	}
+
+	if (success) {
+		success = xyzpriv_deflate_write_segments(options, job.blocks, job.block_count, userdata, write_func, written, checksum, error);
+	}
+
+	for (i = 0; i < job.block_count; ++i) {
+		xyzpriv_free(job.blocks[i].data);
+	}
+
+	xyzpriv_free(job.blocks);
+
+	return success;
+}
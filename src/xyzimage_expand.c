@@ -0,0 +1,190 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <memory.h>
+
+#include "xyzimage_private.h"
+
+// The AVX2 kernel is compiled with a target attribute and selected at runtime,
+// no special compiler flags are needed. SSSE3 and NEON kernels are not provided, other
+// targets use the scalar kernel. An SSSE3 version splitting the table into four byte planes
+// needs 64 shuffles per 16 pixels and was about five times slower than the scalar kernel.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define XYZPRIV_HAVE_AVX2
+#  include <immintrin.h>
+#endif
+
+int xyzpriv_build_lut(const XYZImage_Palette* palette, enum XYZImage_ChannelOrder order, int transparent_index, uint32_t* lut) {
+	// Byte offsets of red, green, blue and alpha inside of a pixel
+	int r, g, b, a;
+
+	switch (order) {
+		case XYZIMAGE_CHANNEL_ORDER_RGBA:
+			r = 0; g = 1; b = 2; a = 3;
+			break;
+		case XYZIMAGE_CHANNEL_ORDER_BGRA:
+			r = 2; g = 1; b = 0; a = 3;
+			break;
+		case XYZIMAGE_CHANNEL_ORDER_ARGB:
+			r = 1; g = 2; b = 3; a = 0;
+			break;
+		case XYZIMAGE_CHANNEL_ORDER_ABGR:
+			r = 3; g = 2; b = 1; a = 0;
+			break;
+		default:
+			return 0;
+	}
+
+	int i;
+	for (i = 0; i < XYZIMAGE_PALETTE_ENTRIES; ++i) {
+		// Written bytewise, this makes the table independent of the endianness
+		uint8_t* pixel = (uint8_t*)&lut[i];
+		pixel[r] = palette->entry[i].red;
+		pixel[g] = palette->entry[i].green;
+		pixel[b] = palette->entry[i].blue;
+		pixel[a] = i == transparent_index ? 0 : 255;
+	}
+
+	return 1;
+}
+
+static void xyzpriv_expand_scalar(const uint8_t* src, uint8_t* dst, size_t count, const uint32_t* lut) {
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		uint32_t p0 = lut[src[i]];
+		uint32_t p1 = lut[src[i + 1]];
+		uint32_t p2 = lut[src[i + 2]];
+		uint32_t p3 = lut[src[i + 3]];
+		memcpy(dst + i * 4, &p0, 4);
+		memcpy(dst + i * 4 + 4, &p1, 4);
+		memcpy(dst + i * 4 + 8, &p2, 4);
+		memcpy(dst + i * 4 + 12, &p3, 4);
+	}
+
+	for (; i < count; ++i) {
+		uint32_t p = lut[src[i]];
+		memcpy(dst + i * 4, &p, 4);
+	}
+}
+
+#ifdef XYZPRIV_HAVE_AVX2
+__attribute__((target("avx2")))
+static void xyzpriv_expand_avx2(const uint8_t* src, uint8_t* dst, size_t count, const uint32_t* lut) {
+	size_t i = 0;
+
+	// Gathers 8 pixels at once
+	for (; i + 8 <= count; i += 8) {
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+		__m256i pixels = _mm256_i32gather_epi32((const int*)lut, indices, 4);
+		_mm256_storeu_si256((__m256i*)(dst + i * 4), pixels);
+	}
+
+	xyzpriv_expand_scalar(src + i, dst + i * 4, count - i, lut);
+}
+#endif
+
+xyzpriv_expand_func_t xyzpriv_get_expand_func(void) {
+#ifdef XYZPRIV_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		return xyzpriv_expand_avx2;
+	}
+#endif
+
+	return xyzpriv_expand_scalar;
+}
+
+void xyzpriv_expand_rows(xyzpriv_expand_func_t expand, const uint8_t* src, size_t src_pitch, uint8_t* dst, size_t dst_pitch,
+		size_t width, size_t rows, const uint32_t* lut) {
+	if (src_pitch == width && dst_pitch == width * 4) {
+		expand(src, dst, width * rows, lut);
+		return;
+	}
+
+	size_t y;
+	for (y = 0; y < rows; ++y) {
+		expand(src + y * src_pitch, dst + y * dst_pitch, width, lut);
+	}
+}
+
+static void xyzpriv_remap_scalar(uint8_t* data, size_t count, const uint8_t* lut) {
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		uint8_t p0 = lut[data[i]];
+		uint8_t p1 = lut[data[i + 1]];
+		uint8_t p2 = lut[data[i + 2]];
+		uint8_t p3 = lut[data[i + 3]];
+		data[i] = p0;
+		data[i + 1] = p1;
+		data[i + 2] = p2;
+		data[i + 3] = p3;
+	}
+
+	for (; i < count; ++i) {
+		data[i] = lut[data[i]];
+	}
+}
+
+#ifdef XYZPRIV_HAVE_AVX2
+__attribute__((target("avx2")))
+static void xyzpriv_remap_avx2(uint8_t* data, size_t count, const uint8_t* lut) {
+	size_t i = 0;
+
+	if (count >= 32) {
+		// The table is split into 16 rows of 16 entries: The low nibble is looked up in every row
+		// with a byte shuffle, the bits of the high nibble select the row in a tree of blends
+		__m256i rows[16];
+		int k;
+
+		for (k = 0; k < 16; ++k) {
+			rows[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + k * 16)));
+		}
+
+		const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+		for (; i + 32 <= count; i += 32) {
+			__m256i indices = _mm256_loadu_si256((const __m256i*)(data + i));
+			__m256i low = _mm256_and_si256(indices, nibble);
+			__m256i level[8];
+
+			// Blends use the highest bit of every byte: Move bit 4, 5, 6 and 7 there
+			__m256i select = _mm256_slli_epi16(indices, 3);
+			for (k = 0; k < 8; ++k) {
+				level[k] = _mm256_blendv_epi8(_mm256_shuffle_epi8(rows[2 * k], low), _mm256_shuffle_epi8(rows[2 * k + 1], low), select);
+			}
+
+			select = _mm256_slli_epi16(indices, 2);
+			for (k = 0; k < 4; ++k) {
+				level[k] = _mm256_blendv_epi8(level[2 * k], level[2 * k + 1], select);
+			}
+
+			select = _mm256_slli_epi16(indices, 1);
+			level[0] = _mm256_blendv_epi8(level[0], level[1], select);
+			level[1] = _mm256_blendv_epi8(level[2], level[3], select);
+
+			__m256i result = _mm256_blendv_epi8(level[0], level[1], indices);
+
+			_mm256_storeu_si256((__m256i*)(data + i), result);
+		}
+	}
+
+	xyzpriv_remap_scalar(data + i, count - i, lut);
+}
+#endif
+
+xyzpriv_remap_func_t xyzpriv_get_remap_func(void) {
+#ifdef XYZPRIV_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		return xyzpriv_remap_avx2;
+	}
+#endif
+
+	return xyzpriv_remap_scalar;
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "xyzimage_private.h"
+
+#if defined(_WIN32)
+#  include <io.h>
+#  include <sys/stat.h>
+#elif defined(XYZIMAGE_HAVE_FSTAT)
+#  include <sys/stat.h>
+#  ifdef XYZIMAGE_HAVE_MMAP
+#    include <sys/mman.h>
+#  endif
+#endif
+
+// Files with more remaining bytes than this are memory mapped instead of read
+#define XYZPRIV_MMAP_THRESHOLD (1024u * 1024u)
+
+static int xyzpriv_file_get_size(FILE* file, size_t* size) {
+	// Only regular files have a meaningful size, pipes and devices use the stream path
+#if defined(_WIN32)
+	struct _stat64 st;
+
+	if (_fstat64(_fileno(file), &st) != 0 || (st.st_mode & _S_IFMT) != _S_IFREG) {
+		return 0;
+	}
+#elif defined(XYZIMAGE_HAVE_FSTAT)
+	struct stat st;
+
+	if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return 0;
+	}
+#else
+	(void)file;
+	(void)size;
+	return 0;
+#endif
+
+#if defined(_WIN32) || defined(XYZIMAGE_HAVE_FSTAT)
+	if (st.st_size < 0 || (uint64_t)st.st_size > (size_t)-1) {
+		return 0;
+	}
+
+	*size = (size_t)st.st_size;
+
+	return 1;
+#endif
+}
+
+int xyzpriv_file_view_open(xyzpriv_file_view* view, FILE* file, xyzpriv_scratch* scratch) {
+	view->data = NULL;
+	view->len = 0;
+	view->mapping = NULL;
+	view->mapping_len = 0;
+	view->buffer = NULL;
+
+	size_t size;
+
+	if (!xyzpriv_file_get_size(file, &size)) {
+		return 0;
+	}
+
+	view->position = ftell(file);
+
+	if (view->position < 0) {
+		return 0;
+	}
+
+	size_t position = (size_t)view->position;
+	size_t remaining = position < size ? size - position : 0;
+
+#if !defined(_WIN32) && defined(XYZIMAGE_HAVE_FSTAT) && defined(XYZIMAGE_HAVE_MMAP)
+	if (remaining > XYZPRIV_MMAP_THRESHOLD) {
+		// Mapped from the start of the file because the offset must be page aligned
+		void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+		if (mapping != MAP_FAILED) {
+			view->mapping = mapping;
+			view->mapping_len = size;
+			view->data = (const uint8_t*)mapping + position;
+			view->len = remaining;
+
+			return 1;
+		}
+	}
+#endif
+
+	view->buffer = xyzpriv_scratch_malloc(scratch, remaining > 0 ? remaining : 1);
+
+	if (view->buffer == NULL) {
+		// Not an error, the stream path needs less memory
+		return 0;
+	}
+
+	// A short read (file truncated meanwhile) is detected by the decoder
+	view->len = fread(view->buffer, 1, remaining, file);
+	view->data = (const uint8_t*)view->buffer;
+
+	return 1;
+}
+
+void xyzpriv_file_view_close(xyzpriv_file_view* view, FILE* file, size_t consumed, xyzpriv_scratch* scratch) {
+#if !defined(_WIN32) && defined(XYZIMAGE_HAVE_FSTAT) && defined(XYZIMAGE_HAVE_MMAP)
+	if (view->mapping) {
+		munmap(view->mapping, view->mapping_len);
+	}
+#endif
+
+	xyzpriv_scratch_free(scratch, view->buffer);
+
+	if (file) {
+		// Position the file behind the image
+		fseek(file, view->position + (long)consumed, SEEK_SET);
+	}
+
+	view->data = NULL;
+	view->mapping = NULL;
+	view->buffer = NULL;
+}
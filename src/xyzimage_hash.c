@@ -0,0 +1,168 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <string.h>
+
+#include "xyzimage_private.h"
+
+// 64 bit hash following the XXH64 algorithm, the result is identical on every platform
+
+#define XYZPRIV_PRIME64_1 0x9E3779B185EBCA87ull
+#define XYZPRIV_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define XYZPRIV_PRIME64_3 0x165667B19E3779F9ull
+#define XYZPRIV_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define XYZPRIV_PRIME64_5 0x27D4EB2F165667C5ull
+
+static uint64_t xyzpriv_rotl64(uint64_t value, int amount) {
+	return (value << amount) | (value >> (64 - amount));
+}
+
+static uint64_t xyzpriv_read_le64(const uint8_t* data) {
+	return (uint64_t)data[0] | ((uint64_t)data[1] << 8) | ((uint64_t)data[2] << 16) | ((uint64_t)data[3] << 24) |
+		((uint64_t)data[4] << 32) | ((uint64_t)data[5] << 40) | ((uint64_t)data[6] << 48) | ((uint64_t)data[7] << 56);
+}
+
+static uint32_t xyzpriv_read_le32(const uint8_t* data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint64_t xyzpriv_hash_round(uint64_t acc, uint64_t input) {
+	acc += input * XYZPRIV_PRIME64_2;
+	acc = xyzpriv_rotl64(acc, 31);
+	return acc * XYZPRIV_PRIME64_1;
+}
+
+static uint64_t xyzpriv_hash_merge(uint64_t acc, uint64_t value) {
+	acc ^= xyzpriv_hash_round(0, value);
+	return acc * XYZPRIV_PRIME64_1 + XYZPRIV_PRIME64_4;
+}
+
+static uint64_t xyzpriv_hash_finalize(uint64_t hash, const uint8_t* p, const uint8_t* end) {
+	// Mixes in the last bytes (less than a stripe) and avalanches the result
+	while ((size_t)(end - p) >= 8) {
+		hash ^= xyzpriv_hash_round(0, xyzpriv_read_le64(p));
+		hash = xyzpriv_rotl64(hash, 27) * XYZPRIV_PRIME64_1 + XYZPRIV_PRIME64_4;
+		p += 8;
+	}
+
+	if ((size_t)(end - p) >= 4) {
+		hash ^= (uint64_t)xyzpriv_read_le32(p) * XYZPRIV_PRIME64_1;
+		hash = xyzpriv_rotl64(hash, 23) * XYZPRIV_PRIME64_2 + XYZPRIV_PRIME64_3;
+		p += 4;
+	}
+
+	while (p < end) {
+		hash ^= *p * XYZPRIV_PRIME64_5;
+		hash = xyzpriv_rotl64(hash, 11) * XYZPRIV_PRIME64_1;
+		++p;
+	}
+
+	hash ^= hash >> 33;
+	hash *= XYZPRIV_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XYZPRIV_PRIME64_3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+static uint64_t xyzpriv_hash_converge(const uint64_t* acc) {
+	uint64_t hash = xyzpriv_rotl64(acc[0], 1) + xyzpriv_rotl64(acc[1], 7) + xyzpriv_rotl64(acc[2], 12) + xyzpriv_rotl64(acc[3], 18);
+	hash = xyzpriv_hash_merge(hash, acc[0]);
+	hash = xyzpriv_hash_merge(hash, acc[1]);
+	hash = xyzpriv_hash_merge(hash, acc[2]);
+	return xyzpriv_hash_merge(hash, acc[3]);
+}
+
+static const uint8_t* xyzpriv_hash_stripes(uint64_t* acc, const uint8_t* p, size_t stripes) {
+	// Four independent lanes of 8 bytes per stripe
+	uint64_t v1 = acc[0];
+	uint64_t v2 = acc[1];
+	uint64_t v3 = acc[2];
+	uint64_t v4 = acc[3];
+
+	while (stripes-- > 0) {
+		v1 = xyzpriv_hash_round(v1, xyzpriv_read_le64(p));
+		v2 = xyzpriv_hash_round(v2, xyzpriv_read_le64(p + 8));
+		v3 = xyzpriv_hash_round(v3, xyzpriv_read_le64(p + 16));
+		v4 = xyzpriv_hash_round(v4, xyzpriv_read_le64(p + 24));
+		p += 32;
+	}
+
+	acc[0] = v1;
+	acc[1] = v2;
+	acc[2] = v3;
+	acc[3] = v4;
+
+	return p;
+}
+
+static void xyzpriv_hash_init_acc(uint64_t* acc, uint64_t seed) {
+	acc[0] = seed + XYZPRIV_PRIME64_1 + XYZPRIV_PRIME64_2;
+	acc[1] = seed + XYZPRIV_PRIME64_2;
+	acc[2] = seed;
+	acc[3] = seed - XYZPRIV_PRIME64_1;
+}
+
+uint64_t xyzpriv_hash64(const void* data, size_t len, uint64_t seed) {
+	const uint8_t* p = (const uint8_t*)data;
+	uint64_t hash;
+
+	if (len >= 32) {
+		uint64_t acc[4];
+		xyzpriv_hash_init_acc(acc, seed);
+		p = xyzpriv_hash_stripes(acc, p, len / 32);
+		hash = xyzpriv_hash_converge(acc);
+	} else {
+		hash = seed + XYZPRIV_PRIME64_5;
+	}
+
+	return xyzpriv_hash_finalize(hash + (uint64_t)len, p, (const uint8_t*)data + len);
+}
+
+void xyzpriv_hash64_begin(xyzpriv_hash64_state* state, uint64_t seed) {
+	xyzpriv_hash_init_acc(state->acc, seed);
+	state->seed = seed;
+	state->total_len = 0;
+	state->pending_len = 0;
+}
+
+void xyzpriv_hash64_update(xyzpriv_hash64_state* state, const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	state->total_len += len;
+
+	if (state->pending_len > 0) {
+		size_t amount = sizeof(state->pending) - state->pending_len;
+		if (amount > len) {
+			amount = len;
+		}
+
+		memcpy(state->pending + state->pending_len, p, amount);
+		state->pending_len += amount;
+		p += amount;
+		len -= amount;
+
+		if (state->pending_len < sizeof(state->pending)) {
+			return;
+		}
+
+		xyzpriv_hash_stripes(state->acc, state->pending, 1);
+		state->pending_len = 0;
+	}
+
+	p = xyzpriv_hash_stripes(state->acc, p, len / 32);
+	state->pending_len = len % 32;
+	memcpy(state->pending, p, state->pending_len);
+}
+
+uint64_t xyzpriv_hash64_end(const xyzpriv_hash64_state* state) {
+	uint64_t hash = state->total_len >= 32 ? xyzpriv_hash_converge(state->acc) : state->seed + XYZPRIV_PRIME64_5;
+
+	return xyzpriv_hash_finalize(hash + state->total_len, state->pending, state->pending + state->pending_len);
+}
@@ -0,0 +1,255 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <string.h>
+
+#include "xyzimage_private.h"
+#include "xyzimage_thread.h"
+
+// Minimal amount of pixels per band, bands consist of whole rows
+#define XYZPRIV_INCREMENTAL_BAND_SIZE 65536u
+
+// Amount of pixels preceding a band used as preset dictionary (maximal window size of deflate)
+#define XYZPRIV_INCREMENTAL_DICT_SIZE 32768u
+
+struct xyzpriv_segments {
+	// Settings the segments were compressed with, a change invalidates all of them
+	XYZImage_CompressOptions options;
+	uint16_t width;
+	uint16_t height;
+	uint16_t band_rows;
+	size_t band_count;
+	// The palette followed by one segment per band
+	xyzpriv_deflate_segment* segments;
+	// Per band: non-zero when the band must be compressed again
+	uint8_t* dirty;
+};
+
+typedef struct {
+	xyzpriv_segments* segments;
+	const xyzpriv_deflate_source* source;
+	// Bands compressed by the tasks
+	const size_t* bands;
+} xyzpriv_incremental_job;
+
+static size_t xyzpriv_incremental_band_start(const xyzpriv_segments* segments, size_t band) {
+	// Offset of the first pixel of the band in the uncompressed stream
+	return XYZIMAGE_PALETTE_SIZE + band * segments->band_rows * (size_t)segments->width;
+}
+
+static size_t xyzpriv_incremental_dict_len(const xyzpriv_segments* segments, size_t band) {
+	// The first band does not depend on the palette, the palette can change without affecting it
+	size_t pixels_before = xyzpriv_incremental_band_start(segments, band) - XYZIMAGE_PALETTE_SIZE;
+
+	return pixels_before < XYZPRIV_INCREMENTAL_DICT_SIZE ? pixels_before : XYZPRIV_INCREMENTAL_DICT_SIZE;
+}
+
+static int xyzpriv_incremental_matches(const xyzpriv_segments* segments, uint16_t width, uint16_t height,
+		const XYZImage_CompressOptions* options) {
+	return segments->width == width && segments->height == height &&
+		segments->options.level == options->level &&
+		segments->options.strategy == options->strategy &&
+		segments->options.window_bits == options->window_bits &&
+		segments->options.mem_level == options->mem_level;
+}
+
+static xyzpriv_segments* xyzpriv_incremental_create(uint16_t width, uint16_t height, const XYZImage_CompressOptions* options) {
+	xyzpriv_segments* segments = xyzpriv_calloc(1, sizeof(xyzpriv_segments));
+
+	if (segments == NULL) {
+		return NULL;
+	}
+
+	segments->options = *options;
+	segments->width = width;
+	segments->height = height;
+
+	if (width > 0 && height > 0) {
+		size_t band_rows = (XYZPRIV_INCREMENTAL_BAND_SIZE + width - 1) / width;
+		segments->band_rows = (uint16_t)(band_rows < height ? band_rows : height);
+		segments->band_count = (height + segments->band_rows - 1) / segments->band_rows;
+	}
+
+	segments->segments = xyzpriv_calloc(1 + segments->band_count, sizeof(xyzpriv_deflate_segment));
+	segments->dirty = xyzpriv_malloc(segments->band_count > 0 ? segments->band_count : 1);
+
+	if (segments->segments == NULL || segments->dirty == NULL) {
+		xyzpriv_segments_free(segments);
+		return NULL;
+	}
+
+	// Nothing was compressed yet
+	memset(segments->dirty, 1, segments->band_count);
+
+	return segments;
+}
+
+static xyzimage_error_t xyzpriv_incremental_compress(xyzpriv_segments* segments, const xyzpriv_deflate_source* source, size_t index) {
+	// Index 0 is the palette, the old segment is only replaced on success
+	xyzpriv_deflate_segment segment;
+	xyzimage_error_t e;
+
+	if (index == 0) {
+		e = xyzpriv_deflate_segment_compress(source, 0, XYZIMAGE_PALETTE_SIZE, 0, segments->band_count == 0,
+			&segments->options, &segment);
+	} else {
+		size_t band = index - 1;
+		size_t start = xyzpriv_incremental_band_start(segments, band);
+		size_t end = band + 1 == segments->band_count ?
+			XYZIMAGE_PALETTE_SIZE + (size_t)segments->width * segments->height : xyzpriv_incremental_band_start(segments, band + 1);
+
+		e = xyzpriv_deflate_segment_compress(source, start, end - start, xyzpriv_incremental_dict_len(segments, band),
+			band + 1 == segments->band_count, &segments->options, &segment);
+	}
+
+	if (e != XYZIMAGE_ERROR_OK) {
+		xyzpriv_free(segment.data);
+		return e;
+	}
+
+	segment.error = XYZIMAGE_ERROR_OK;
+	xyzpriv_free(segments->segments[index].data);
+	segments->segments[index] = segment;
+
+	return XYZIMAGE_ERROR_OK;
+}
+
+static void xyzpriv_incremental_task(void* arg, size_t index) {
+	xyzpriv_incremental_job* job = (xyzpriv_incremental_job*)arg;
+	size_t band = job->bands[index];
+	xyzimage_error_t e = xyzpriv_incremental_compress(job->segments, job->source, band + 1);
+
+	job->segments->segments[band + 1].error = e;
+
+	if (e == XYZIMAGE_ERROR_OK) {
+		job->segments->dirty[band] = 0;
+	}
+}
+
+void xyzpriv_segments_mark_rows(xyzpriv_segments* segments, uint16_t first_row, uint16_t row_count) {
+	if (segments == NULL || row_count == 0) {
+		return;
+	}
+
+	size_t last_row = (size_t)first_row + row_count;
+	size_t band;
+
+	for (band = 0; band < segments->band_count; ++band) {
+		size_t band_first = band * segments->band_rows;
+		size_t band_last = band_first + segments->band_rows;
+
+		// The band also depends on the rows of its dictionary
+		size_t dict_pixels = (band_first * segments->width) - xyzpriv_incremental_dict_len(segments, band);
+		size_t dict_first = dict_pixels / segments->width;
+
+		if (first_row < band_last && last_row > dict_first) {
+			segments->dirty[band] = 1;
+		}
+	}
+}
+
+void xyzpriv_segments_free(xyzpriv_segments* segments) {
+	if (segments == NULL) {
+		return;
+	}
+
+	if (segments->segments) {
+		size_t i;
+		for (i = 0; i < 1 + segments->band_count; ++i) {
+			xyzpriv_free(segments->segments[i].data);
+		}
+	}
+
+	xyzpriv_free(segments->segments);
+	xyzpriv_free(segments->dirty);
+	xyzpriv_free(segments);
+}
+
+int xyzpriv_deflate_incremental(xyzpriv_segments** segments_ptr, const XYZImage_Palette* palette, const uint8_t* pixels,
+		size_t pitch, uint16_t width, uint16_t height, const XYZImage_CompressOptions* options,
+		void* userdata, xyzimage_write_func_t write_func, size_t* written, uint32_t* checksum, xyzimage_error_t* error) {
+	xyzpriv_segments* segments = *segments_ptr;
+
+	*written = 0;
+	*checksum = 0;
+
+	if (segments && !xyzpriv_incremental_matches(segments, width, height, options)) {
+		xyzpriv_segments_free(segments);
+		segments = NULL;
+		*segments_ptr = NULL;
+	}
+
+	if (segments == NULL) {
+		segments = xyzpriv_incremental_create(width, height, options);
+
+		if (segments == NULL) {
+			if (error) {
+				*error = XYZIMAGE_ERROR_OUT_OF_MEMORY;
+			}
+			return 0;
+		}
+
+		*segments_ptr = segments;
+	}
+
+	// The thread count does not affect the output
+	segments->options.threads = options->threads;
+
+	xyzpriv_deflate_source source;
+	source.palette = palette;
+	source.pixels = pixels;
+	source.pitch = pitch;
+	source.width = width;
+	source.height = height;
+
+	// The palette is not tracked, compressing it is cheap
+	xyzimage_error_t e = xyzpriv_incremental_compress(segments, &source, 0);
+
+	size_t* bands = xyzpriv_malloc((segments->band_count > 0 ? segments->band_count : 1) * sizeof(size_t));
+
+	if (e == XYZIMAGE_ERROR_OK && bands == NULL) {
+		e = XYZIMAGE_ERROR_OUT_OF_MEMORY;
+	}
+
+	if (e == XYZIMAGE_ERROR_OK) {
+		size_t count = 0;
+		size_t band;
+
+		for (band = 0; band < segments->band_count; ++band) {
+			if (segments->dirty[band]) {
+				bands[count++] = band;
+			}
+		}
+
+		xyzpriv_incremental_job job;
+		job.segments = segments;
+		job.source = &source;
+		job.bands = bands;
+
+		xyzpriv_parallel_for(count, options->threads, xyzpriv_incremental_task, &job);
+
+		// Failed bands stay dirty and are compressed again by the next call
+		size_t i;
+		for (i = 0; e == XYZIMAGE_ERROR_OK && i < count; ++i) {
+			e = segments->segments[bands[i] + 1].error;
+		}
+	}
+
+	xyzpriv_free(bands);
+
+	if (e != XYZIMAGE_ERROR_OK) {
+		if (error) {
+			*error = e;
+		}
+		return 0;
+	}
+
+	return xyzpriv_deflate_write_segments(&segments->options, segments->segments, 1 + segments->band_count,
+		userdata, write_func, written, checksum, error);
+}
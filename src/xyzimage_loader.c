@@ -0,0 +1,1052 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xyzimage_private.h"
+#include "xyzimage_thread.h"
+
+// Bytes passed to the decoder at once, cancellation is checked between the chunks
+#define XYZPRIV_LOADER_CHUNK_SIZE 65536u
+
+// Initial amount of queue entries and ticket slots, both double when full
+#define XYZPRIV_LOADER_INITIAL_CAPACITY 16u
+
+// Marks the end of the ticket lists
+#define XYZPRIV_LOADER_NO_TICKET ((size_t)-1)
+
+enum xyzpriv_load_state {
+	XYZPRIV_LOAD_QUEUED,
+	XYZPRIV_LOAD_RUNNING,
+	XYZPRIV_LOAD_DONE
+};
+
+typedef struct xyzpriv_load_job {
+	// Source and format of the request, only one source is set. The path is owned by the job
+	char* path;
+	const void* data;
+	size_t size;
+	xyzimage_read_func_t read_func;
+	void* userdata;
+	enum XYZImage_Format format;
+	int transparent_index;
+
+	enum xyzpriv_load_state state;
+	// Highest priority of the tickets, the sequence keeps the request order for equal priorities
+	int priority;
+	uint64_t sequence;
+	// Position in the queue while queued
+	size_t heap_index;
+	// Set when the last ticket was released while running, the decode stops at the next chunk
+	int cancelled;
+	// Set while a caller waits for the job, the budget is ignored then
+	int waited;
+	// List of the tickets sharing the job
+	size_t first_ticket;
+	size_t ticket_count;
+	// Bytes of the memory budget held by the job
+	size_t reserved;
+	XYZImage* image;
+	xyzimage_error_t error;
+	struct xyzpriv_load_job* prev;
+	struct xyzpriv_load_job* next;
+} xyzpriv_load_job;
+
+typedef struct {
+	// Part of the ticket, incremented on release to invalidate the old ticket
+	uint32_t generation;
+	int in_use;
+	// Set when xyzimage_loader_poll returned the ticket
+	int reported;
+	int priority;
+	xyzpriv_load_job* job;
+	// Next ticket of the same job or next free slot
+	size_t next;
+} xyzpriv_load_ticket;
+
+struct XYZImage_Loader {
+	// All jobs that are queued, running or hold a result
+	xyzpriv_load_job* jobs;
+	// Binary heap of the queued jobs, the most important one first
+	xyzpriv_load_job** queue;
+	size_t queue_count;
+	size_t queue_capacity;
+	// A ticket is the slot index plus one in the lower and the generation in the upper 32 bits
+	xyzpriv_load_ticket* tickets;
+	size_t ticket_capacity;
+	size_t free_ticket;
+	uint64_t sequence;
+	size_t memory_budget;
+	size_t memory_used;
+	int shutdown;
+	unsigned int worker_count;
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_thread_t workers[XYZPRIV_MAX_THREADS];
+	xyzpriv_mutex_t mutex;
+	// Signaled when a job was queued
+	xyzpriv_cond_t work_cond;
+	// Broadcast when a job finished, was cancelled or waited for and when memory was released
+	xyzpriv_cond_t state_cond;
+#endif
+};
+
+static void xyzpriv_set_error(xyzimage_error_t* error, xyzimage_error_t which) {
+	if (error != NULL) {
+		*error = which;
+	}
+}
+
+static void xyzpriv_loader_lock(XYZImage_Loader* loader) {
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_lock(&loader->mutex);
+#else
+	(void)loader;
+#endif
+}
+
+static void xyzpriv_loader_unlock(XYZImage_Loader* loader) {
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_unlock(&loader->mutex);
+#else
+	(void)loader;
+#endif
+}
+
+static void xyzpriv_loader_notify(XYZImage_Loader* loader) {
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_cond_broadcast(&loader->state_cond);
+#else
+	(void)loader;
+#endif
+}
+
+static void xyzpriv_loader_wait(XYZImage_Loader* loader) {
+	// Without threads nothing runs concurrently, the callers never wait
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_cond_wait(&loader->state_cond, &loader->mutex);
+#else
+	(void)loader;
+#endif
+}
+
+static int xyzpriv_loader_before(const xyzpriv_load_job* a, const xyzpriv_load_job* b) {
+	return a->priority > b->priority || (a->priority == b->priority && a->sequence < b->sequence);
+}
+
+static void xyzpriv_loader_queue_set(XYZImage_Loader* loader, size_t index, xyzpriv_load_job* job) {
+	loader->queue[index] = job;
+	job->heap_index = index;
+}
+
+static void xyzpriv_loader_queue_fix(XYZImage_Loader* loader, size_t index) {
+	xyzpriv_load_job* job = loader->queue[index];
+
+	// Sift up
+	while (index > 0 && xyzpriv_loader_before(job, loader->queue[(index - 1) / 2])) {
+		xyzpriv_loader_queue_set(loader, index, loader->queue[(index - 1) / 2]);
+		index = (index - 1) / 2;
+	}
+
+	// Sift down
+	for (;;) {
+		size_t child = index * 2 + 1;
+
+		if (child >= loader->queue_count) {
+			break;
+		}
+
+		if (child + 1 < loader->queue_count && xyzpriv_loader_before(loader->queue[child + 1], loader->queue[child])) {
+			++child;
+		}
+
+		if (!xyzpriv_loader_before(loader->queue[child], job)) {
+			break;
+		}
+
+		xyzpriv_loader_queue_set(loader, index, loader->queue[child]);
+		index = child;
+	}
+
+	xyzpriv_loader_queue_set(loader, index, job);
+}
+
+static int xyzpriv_loader_queue_reserve(XYZImage_Loader* loader) {
+	if (loader->queue_count < loader->queue_capacity) {
+		return 1;
+	}
+
+	size_t capacity = loader->queue_capacity * 2;
+	xyzpriv_load_job** queue = (xyzpriv_load_job**)xyzpriv_realloc(loader->queue, capacity * sizeof(xyzpriv_load_job*));
+
+	if (queue == NULL) {
+		return 0;
+	}
+
+	loader->queue = queue;
+	loader->queue_capacity = capacity;
+
+	return 1;
+}
+
+static void xyzpriv_loader_queue_push(XYZImage_Loader* loader, xyzpriv_load_job* job) {
+	// The capacity was reserved before
+	xyzpriv_loader_queue_set(loader, loader->queue_count++, job);
+	xyzpriv_loader_queue_fix(loader, job->heap_index);
+}
+
+static void xyzpriv_loader_queue_remove(XYZImage_Loader* loader, xyzpriv_load_job* job) {
+	size_t index = job->heap_index;
+	xyzpriv_load_job* last = loader->queue[--loader->queue_count];
+
+	if (last != job) {
+		xyzpriv_loader_queue_set(loader, index, last);
+		xyzpriv_loader_queue_fix(loader, index);
+	}
+}
+
+static size_t xyzpriv_loader_ticket_alloc(XYZImage_Loader* loader) {
+	if (loader->free_ticket == XYZPRIV_LOADER_NO_TICKET) {
+		size_t capacity = loader->ticket_capacity > 0 ? loader->ticket_capacity * 2 : XYZPRIV_LOADER_INITIAL_CAPACITY;
+
+		if (capacity > UINT32_MAX) {
+			return XYZPRIV_LOADER_NO_TICKET;
+		}
+
+		xyzpriv_load_ticket* tickets = (xyzpriv_load_ticket*)xyzpriv_realloc(loader->tickets, capacity * sizeof(xyzpriv_load_ticket));
+
+		if (tickets == NULL) {
+			return XYZPRIV_LOADER_NO_TICKET;
+		}
+
+		// Push the new slots on the free list, the lowest index ends up first
+		size_t i;
+		for (i = capacity; i > loader->ticket_capacity; --i) {
+			tickets[i - 1].generation = 0;
+			tickets[i - 1].in_use = 0;
+			tickets[i - 1].job = NULL;
+			tickets[i - 1].next = loader->free_ticket;
+			loader->free_ticket = i - 1;
+		}
+
+		loader->tickets = tickets;
+		loader->ticket_capacity = capacity;
+	}
+
+	size_t index = loader->free_ticket;
+	loader->free_ticket = loader->tickets[index].next;
+
+	return index;
+}
+
+static void xyzpriv_loader_ticket_free(XYZImage_Loader* loader, size_t index) {
+	xyzpriv_load_ticket* slot = &loader->tickets[index];
+
+	slot->in_use = 0;
+	slot->job = NULL;
+	++slot->generation;
+	slot->next = loader->free_ticket;
+	loader->free_ticket = index;
+}
+
+static xyzimage_ticket_t xyzpriv_loader_ticket_id(const XYZImage_Loader* loader, size_t index) {
+	return ((uint64_t)loader->tickets[index].generation << 32) | (uint64_t)(index + 1);
+}
+
+static size_t xyzpriv_loader_find_ticket(const XYZImage_Loader* loader, xyzimage_ticket_t ticket) {
+	uint64_t index = (ticket & 0xFFFFFFFFu);
+
+	if (index == 0 || index > loader->ticket_capacity) {
+		return XYZPRIV_LOADER_NO_TICKET;
+	}
+
+	const xyzpriv_load_ticket* slot = &loader->tickets[index - 1];
+
+	if (!slot->in_use || slot->generation != (uint32_t)(ticket >> 32)) {
+		return XYZPRIV_LOADER_NO_TICKET;
+	}
+
+	return (size_t)(index - 1);
+}
+
+static void xyzpriv_loader_release_memory(XYZImage_Loader* loader, xyzpriv_load_job* job, size_t bytes) {
+	job->reserved -= bytes;
+	loader->memory_used -= bytes;
+	xyzpriv_loader_notify(loader);
+}
+
+static void xyzpriv_loader_job_free(XYZImage_Loader* loader, xyzpriv_load_job* job) {
+	if (job->prev) {
+		job->prev->next = job->next;
+	} else {
+		loader->jobs = job->next;
+	}
+
+	if (job->next) {
+		job->next->prev = job->prev;
+	}
+
+	if (job->reserved > 0) {
+		xyzpriv_loader_release_memory(loader, job, job->reserved);
+	}
+
+	if (job->image) {
+		xyzimage_free(job->image);
+	}
+
+	xyzpriv_free(job->path);
+	xyzpriv_free(job);
+}
+
+static void xyzpriv_loader_update_priority(XYZImage_Loader* loader, xyzpriv_load_job* job) {
+	size_t index = job->first_ticket;
+	int priority = loader->tickets[index].priority;
+
+	for (index = loader->tickets[index].next; index != XYZPRIV_LOADER_NO_TICKET; index = loader->tickets[index].next) {
+		if (loader->tickets[index].priority > priority) {
+			priority = loader->tickets[index].priority;
+		}
+	}
+
+	if (priority != job->priority) {
+		job->priority = priority;
+
+		if (job->state == XYZPRIV_LOAD_QUEUED) {
+			xyzpriv_loader_queue_fix(loader, job->heap_index);
+		}
+	}
+}
+
+static void xyzpriv_loader_release_ticket(XYZImage_Loader* loader, size_t index) {
+	xyzpriv_load_job* job = loader->tickets[index].job;
+
+	size_t* link = &job->first_ticket;
+	while (*link != index) {
+		link = &loader->tickets[*link].next;
+	}
+	*link = loader->tickets[index].next;
+	--job->ticket_count;
+
+	xyzpriv_loader_ticket_free(loader, index);
+
+	if (job->ticket_count > 0) {
+		xyzpriv_loader_update_priority(loader, job);
+		return;
+	}
+
+	switch (job->state) {
+		case XYZPRIV_LOAD_QUEUED:
+			xyzpriv_loader_queue_remove(loader, job);
+			xyzpriv_loader_job_free(loader, job);
+			break;
+		case XYZPRIV_LOAD_RUNNING:
+			// The worker frees the job, wake it when waiting for memory
+			job->cancelled = 1;
+			xyzpriv_loader_notify(loader);
+			break;
+		case XYZPRIV_LOAD_DONE:
+			xyzpriv_loader_job_free(loader, job);
+			break;
+	}
+}
+
+// Reserves the memory of a decode, waits while the budget is exhausted. Returns 0 when cancelled.
+static int xyzpriv_loader_reserve(XYZImage_Loader* loader, xyzpriv_load_job* job, size_t bytes) {
+	xyzpriv_loader_lock(loader);
+
+	while (!job->cancelled && !job->waited && loader->memory_budget > 0 &&
+			loader->memory_used > 0 && loader->memory_used + bytes > loader->memory_budget) {
+		xyzpriv_loader_wait(loader);
+	}
+
+	int success = !job->cancelled;
+
+	if (success) {
+		job->reserved += bytes;
+		loader->memory_used += bytes;
+	}
+
+	xyzpriv_loader_unlock(loader);
+
+	return success;
+}
+
+static int xyzpriv_loader_is_cancelled(XYZImage_Loader* loader, xyzpriv_load_job* job) {
+	xyzpriv_loader_lock(loader);
+	int cancelled = job->cancelled;
+	xyzpriv_loader_unlock(loader);
+
+	return cancelled;
+}
+
+// Reads the next chunk of the source. Returns 0 at the end or on error.
+static size_t xyzpriv_loader_read(xyzpriv_load_job* job, FILE* file, uint8_t* chunk, size_t* offset,
+		const uint8_t** input, int* end, xyzimage_error_t* error) {
+	if (*end) {
+		return 0;
+	}
+
+	if (job->data) {
+		size_t len = job->size - *offset;
+
+		if (len > XYZPRIV_LOADER_CHUNK_SIZE) {
+			len = XYZPRIV_LOADER_CHUNK_SIZE;
+		}
+
+		*input = (const uint8_t*)job->data + *offset;
+		*offset += len;
+		*end = *offset == job->size;
+
+		return len;
+	}
+
+	*input = chunk;
+
+	if (file) {
+		size_t len = fread(chunk, 1, XYZPRIV_LOADER_CHUNK_SIZE, file);
+
+		if (len < XYZPRIV_LOADER_CHUNK_SIZE) {
+			*end = 1;
+
+			if (ferror(file)) {
+				xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
+				return 0;
+			}
+		}
+
+		return len;
+	}
+
+	xyzimage_error_t read_error = XYZIMAGE_ERROR_OK;
+	size_t len = job->read_func(job->userdata, chunk, XYZPRIV_LOADER_CHUNK_SIZE, &read_error);
+
+	if (read_error != XYZIMAGE_ERROR_OK) {
+		*end = 1;
+
+		if (read_error != XYZIMAGE_ERROR_IO_READ_END_OF_FILE) {
+			xyzpriv_set_error(error, read_error);
+			return 0;
+		}
+	} else if (len == 0) {
+		*end = 1;
+	}
+
+	return len;
+}
+
+// Decodes the job with the push decoder, the loader is not locked
+static XYZImage* xyzpriv_loader_decode(XYZImage_Loader* loader, xyzpriv_load_job* job, uint8_t* chunk, xyzimage_error_t* error) {
+	FILE* file = NULL;
+
+	if (job->path) {
+		file = fopen(job->path, "rb");
+
+		if (file == NULL) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
+			return NULL;
+		}
+	}
+
+	XYZImage_Decoder* decoder = xyzimage_decoder_create(error);
+
+	if (decoder == NULL) {
+		if (file) {
+			fclose(file);
+		}
+		return NULL;
+	}
+
+	enum XYZImage_DecoderStatus status = XYZIMAGE_DECODER_NEED_MORE_INPUT;
+	const uint8_t* input = NULL;
+	size_t input_len = 0;
+	size_t offset = 0;
+	size_t indexed_bytes = 0;
+	int end = 0;
+
+	while (status != XYZIMAGE_DECODER_ERROR && status != XYZIMAGE_DECODER_DONE) {
+		if (input_len == 0) {
+			if (xyzpriv_loader_is_cancelled(loader, job)) {
+				// The result is discarded, the error is never reported
+				xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
+				break;
+			}
+
+			xyzimage_error_t read_error = XYZIMAGE_ERROR_OK;
+			input_len = xyzpriv_loader_read(job, file, chunk, &offset, &input, &end, &read_error);
+
+			if (input_len == 0) {
+				xyzpriv_set_error(error, read_error != XYZIMAGE_ERROR_OK ? read_error : XYZIMAGE_ERROR_IO_READ_IMAGE_TOO_SMALL);
+				break;
+			}
+		}
+
+		size_t consumed = 0;
+		status = xyzimage_decoder_feed(decoder, input, input_len, &consumed, error);
+		input += consumed;
+		input_len -= consumed;
+
+		if (status == XYZIMAGE_DECODER_HEADER_READY) {
+			uint16_t w, h;
+			xyzimage_decoder_get_size(decoder, &w, &h);
+
+			size_t pixels = (size_t)w * h;
+			indexed_bytes = XYZIMAGE_PALETTE_SIZE + pixels;
+
+			if (!xyzpriv_loader_reserve(loader, job, indexed_bytes + (job->format != XYZIMAGE_FORMAT_DEFAULT ? pixels * 4 : 0))) {
+				xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
+				break;
+			}
+		}
+	}
+
+	XYZImage* image = status == XYZIMAGE_DECODER_DONE ? xyzimage_decoder_take_image(decoder) : NULL;
+	xyzimage_decoder_free(decoder);
+
+	if (file) {
+		fclose(file);
+	}
+
+	if (image == NULL || job->format == XYZIMAGE_FORMAT_DEFAULT) {
+		return image;
+	}
+
+	uint16_t w = xyzimage_get_width(image);
+	uint16_t h = xyzimage_get_height(image);
+	XYZImage* rgba = xyzimage_alloc(w, h, job->format, error);
+
+	if (rgba) {
+		size_t len;
+		void* buffer = xyzimage_get_buffer(rgba, &len);
+		int transparent_index = job->format == XYZIMAGE_FORMAT_RGBA ? job->transparent_index : XYZIMAGE_NO_TRANSPARENCY;
+
+		if (!xyzimage_convert_rgba(image, buffer, len, 0, XYZIMAGE_CHANNEL_ORDER_RGBA, transparent_index, error)) {
+			xyzimage_free(rgba);
+			rgba = NULL;
+		}
+	}
+
+	xyzimage_free(image);
+
+	xyzpriv_loader_lock(loader);
+	xyzpriv_loader_release_memory(loader, job, indexed_bytes);
+	xyzpriv_loader_unlock(loader);
+
+	return rgba;
+}
+
+// Decodes the job and stores the result, called with the loader locked
+static void xyzpriv_loader_run(XYZImage_Loader* loader, xyzpriv_load_job* job, uint8_t* chunk) {
+	job->state = XYZPRIV_LOAD_RUNNING;
+	xyzpriv_loader_unlock(loader);
+
+	xyzimage_error_t error = XYZIMAGE_ERROR_OK;
+	XYZImage* image = xyzpriv_loader_decode(loader, job, chunk, &error);
+
+	xyzpriv_loader_lock(loader);
+
+	job->state = XYZPRIV_LOAD_DONE;
+	job->image = image;
+	job->error = image ? XYZIMAGE_ERROR_OK : error;
+
+	if (image == NULL && job->reserved > 0) {
+		xyzpriv_loader_release_memory(loader, job, job->reserved);
+	}
+
+	if (job->ticket_count == 0) {
+		xyzpriv_loader_job_free(loader, job);
+	}
+
+	xyzpriv_loader_notify(loader);
+}
+
+#ifdef XYZPRIV_HAVE_THREADS
+static void xyzpriv_loader_worker(void* arg) {
+	XYZImage_Loader* loader = (XYZImage_Loader*)arg;
+	uint8_t* chunk = (uint8_t*)xyzpriv_malloc(XYZPRIV_LOADER_CHUNK_SIZE);
+
+	xyzpriv_loader_lock(loader);
+
+	// Without a buffer the worker cannot decode, the remaining workers take the jobs
+	while (chunk) {
+		while (!loader->shutdown && loader->queue_count == 0) {
+			xyzpriv_cond_wait(&loader->work_cond, &loader->mutex);
+		}
+
+		if (loader->shutdown) {
+			break;
+		}
+
+		xyzpriv_load_job* job = loader->queue[0];
+		xyzpriv_loader_queue_remove(loader, job);
+		xyzpriv_loader_run(loader, job, chunk);
+	}
+
+	xyzpriv_loader_unlock(loader);
+
+	xyzpriv_free(chunk);
+}
+#endif
+
+XYZImage_Loader* xyzimage_loader_create(const XYZImage_LoaderOptions* options, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	XYZImage_Loader* loader = (XYZImage_Loader*)xyzpriv_malloc(sizeof(XYZImage_Loader));
+
+	if (loader == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	loader->jobs = NULL;
+	loader->queue = (xyzpriv_load_job**)xyzpriv_malloc(XYZPRIV_LOADER_INITIAL_CAPACITY * sizeof(xyzpriv_load_job*));
+	loader->queue_count = 0;
+	loader->queue_capacity = XYZPRIV_LOADER_INITIAL_CAPACITY;
+	loader->tickets = NULL;
+	loader->ticket_capacity = 0;
+	loader->free_ticket = XYZPRIV_LOADER_NO_TICKET;
+	loader->sequence = 0;
+	loader->memory_budget = options ? options->memory_budget : 0;
+	loader->memory_used = 0;
+	loader->shutdown = 0;
+	loader->worker_count = 0;
+
+	if (loader->queue == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		xyzpriv_free(loader);
+		return NULL;
+	}
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_init(&loader->mutex);
+	xyzpriv_cond_init(&loader->work_cond);
+	xyzpriv_cond_init(&loader->state_cond);
+
+	unsigned int threads = options ? options->threads : 0;
+
+	if (threads == 0) {
+		threads = xyzpriv_get_cpu_count();
+	}
+
+	if (threads > XYZPRIV_MAX_THREADS) {
+		threads = XYZPRIV_MAX_THREADS;
+	}
+
+	// When no thread starts the requests are decoded by xyzimage_loader_take
+	while (loader->worker_count < threads &&
+			xyzpriv_thread_create(&loader->workers[loader->worker_count], xyzpriv_loader_worker, loader)) {
+		++loader->worker_count;
+	}
+#endif
+
+	return loader;
+}
+
+void xyzimage_loader_free(XYZImage_Loader* loader) {
+	if (loader == NULL) {
+		return;
+	}
+
+	xyzpriv_loader_lock(loader);
+
+	loader->shutdown = 1;
+
+	xyzpriv_load_job* job;
+	for (job = loader->jobs; job; job = job->next) {
+		job->cancelled = 1;
+	}
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_cond_broadcast(&loader->work_cond);
+#endif
+	xyzpriv_loader_notify(loader);
+	xyzpriv_loader_unlock(loader);
+
+#ifdef XYZPRIV_HAVE_THREADS
+	unsigned int i;
+	for (i = 0; i < loader->worker_count; ++i) {
+		xyzpriv_thread_join(loader->workers[i]);
+	}
+#endif
+
+	while (loader->jobs) {
+		xyzpriv_loader_job_free(loader, loader->jobs);
+	}
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_cond_destroy(&loader->state_cond);
+	xyzpriv_cond_destroy(&loader->work_cond);
+	xyzpriv_mutex_destroy(&loader->mutex);
+#endif
+
+	xyzpriv_free(loader->tickets);
+	xyzpriv_free(loader->queue);
+	xyzpriv_free(loader);
+}
+
+static int xyzpriv_loader_same_source(const xyzpriv_load_job* job, const XYZImage_LoadRequest* request) {
+	if (request->path) {
+		return job->path && strcmp(job->path, request->path) == 0;
+	} else if (request->data) {
+		return job->data == request->data && job->size == request->size;
+	}
+
+	return !job->path && !job->data && job->read_func == request->read_func && job->userdata == request->userdata;
+}
+
+static xyzpriv_load_job* xyzpriv_loader_find_job(XYZImage_Loader* loader, const XYZImage_LoadRequest* request,
+		enum XYZImage_Format format, int transparent_index) {
+	xyzpriv_load_job* job;
+
+	for (job = loader->jobs; job; job = job->next) {
+		// Failed and aborted decodes are retried by a new job
+		if (job->cancelled || (job->state == XYZPRIV_LOAD_DONE && job->image == NULL)) {
+			continue;
+		}
+
+		if (job->format == format && job->transparent_index == transparent_index && xyzpriv_loader_same_source(job, request)) {
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
+static xyzpriv_load_job* xyzpriv_loader_job_create(XYZImage_Loader* loader, const XYZImage_LoadRequest* request,
+		enum XYZImage_Format format, int transparent_index) {
+	xyzpriv_load_job* job = (xyzpriv_load_job*)xyzpriv_malloc(sizeof(xyzpriv_load_job));
+
+	if (job == NULL || !xyzpriv_loader_queue_reserve(loader)) {
+		xyzpriv_free(job);
+		return NULL;
+	}
+
+	job->path = NULL;
+	job->data = NULL;
+	job->size = 0;
+	job->read_func = NULL;
+	job->userdata = NULL;
+
+	if (request->path) {
+		size_t len = strlen(request->path) + 1;
+		job->path = (char*)xyzpriv_malloc(len);
+
+		if (job->path == NULL) {
+			xyzpriv_free(job);
+			return NULL;
+		}
+
+		memcpy(job->path, request->path, len);
+	} else if (request->data) {
+		job->data = request->data;
+		job->size = request->size;
+	} else {
+		job->read_func = request->read_func;
+		job->userdata = request->userdata;
+	}
+
+	job->format = format;
+	job->transparent_index = transparent_index;
+	job->state = XYZPRIV_LOAD_QUEUED;
+	job->priority = request->priority;
+	job->sequence = loader->sequence++;
+	job->cancelled = 0;
+	job->waited = 0;
+	job->first_ticket = XYZPRIV_LOADER_NO_TICKET;
+	job->ticket_count = 0;
+	job->reserved = 0;
+	job->image = NULL;
+	job->error = XYZIMAGE_ERROR_OK;
+
+	job->prev = NULL;
+	job->next = loader->jobs;
+	if (loader->jobs) {
+		loader->jobs->prev = job;
+	}
+	loader->jobs = job;
+
+	xyzpriv_loader_queue_push(loader, job);
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_cond_signal(&loader->work_cond);
+#endif
+
+	return job;
+}
+
+xyzimage_ticket_t xyzimage_loader_request(XYZImage_Loader* loader, const XYZImage_LoadRequest* request, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (loader == NULL || request == NULL || (!request->path && !request->data && !request->read_func)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	enum XYZImage_Format format = request->format == XYZIMAGE_FORMAT_NONE ? XYZIMAGE_FORMAT_DEFAULT : request->format;
+	int transparent_index = XYZIMAGE_NO_TRANSPARENCY;
+
+	switch (format) {
+		case XYZIMAGE_FORMAT_RGBA:
+			transparent_index = request->transparent_index;
+
+			if (transparent_index < XYZIMAGE_NO_TRANSPARENCY || transparent_index >= XYZIMAGE_PALETTE_ENTRIES) {
+				xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+				return 0;
+			}
+			break;
+		case XYZIMAGE_FORMAT_DEFAULT:
+		case XYZIMAGE_FORMAT_RGBX:
+			break;
+		default:
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_FORMAT_NOT_SUPPORTED);
+			return 0;
+	}
+
+	xyzpriv_loader_lock(loader);
+
+	size_t index = xyzpriv_loader_ticket_alloc(loader);
+	xyzpriv_load_job* job = NULL;
+
+	if (index != XYZPRIV_LOADER_NO_TICKET) {
+		job = xyzpriv_loader_find_job(loader, request, format, transparent_index);
+
+		if (job == NULL) {
+			job = xyzpriv_loader_job_create(loader, request, format, transparent_index);
+		}
+
+		if (job == NULL) {
+			xyzpriv_loader_ticket_free(loader, index);
+		}
+	}
+
+	if (job == NULL) {
+		xyzpriv_loader_unlock(loader);
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return 0;
+	}
+
+	xyzpriv_load_ticket* slot = &loader->tickets[index];
+	slot->in_use = 1;
+	slot->reported = 0;
+	slot->priority = request->priority;
+	slot->job = job;
+	slot->next = job->first_ticket;
+	job->first_ticket = index;
+	++job->ticket_count;
+
+	xyzpriv_loader_update_priority(loader, job);
+
+	xyzimage_ticket_t ticket = xyzpriv_loader_ticket_id(loader, index);
+
+	xyzpriv_loader_unlock(loader);
+
+	return ticket;
+}
+
+int xyzimage_loader_set_priority(XYZImage_Loader* loader, xyzimage_ticket_t ticket, int priority, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (loader == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	xyzpriv_loader_lock(loader);
+
+	size_t index = xyzpriv_loader_find_ticket(loader, ticket);
+
+	if (index != XYZPRIV_LOADER_NO_TICKET) {
+		loader->tickets[index].priority = priority;
+		xyzpriv_loader_update_priority(loader, loader->tickets[index].job);
+	}
+
+	xyzpriv_loader_unlock(loader);
+
+	if (index == XYZPRIV_LOADER_NO_TICKET) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	return 1;
+}
+
+int xyzimage_loader_cancel(XYZImage_Loader* loader, xyzimage_ticket_t ticket, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (loader == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	xyzpriv_loader_lock(loader);
+
+	size_t index = xyzpriv_loader_find_ticket(loader, ticket);
+
+	if (index != XYZPRIV_LOADER_NO_TICKET) {
+		xyzpriv_loader_release_ticket(loader, index);
+	}
+
+	xyzpriv_loader_unlock(loader);
+
+	if (index == XYZPRIV_LOADER_NO_TICKET) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	return 1;
+}
+
+enum XYZImage_LoadStatus xyzimage_loader_get_status(XYZImage_Loader* loader, xyzimage_ticket_t ticket) {
+	if (loader == NULL) {
+		return XYZIMAGE_LOAD_INVALID;
+	}
+
+	enum XYZImage_LoadStatus status = XYZIMAGE_LOAD_INVALID;
+
+	xyzpriv_loader_lock(loader);
+
+	size_t index = xyzpriv_loader_find_ticket(loader, ticket);
+
+	if (index != XYZPRIV_LOADER_NO_TICKET) {
+		switch (loader->tickets[index].job->state) {
+			case XYZPRIV_LOAD_QUEUED:
+				status = XYZIMAGE_LOAD_QUEUED;
+				break;
+			case XYZPRIV_LOAD_RUNNING:
+				status = XYZIMAGE_LOAD_RUNNING;
+				break;
+			case XYZPRIV_LOAD_DONE:
+				status = XYZIMAGE_LOAD_DONE;
+				break;
+		}
+	}
+
+	xyzpriv_loader_unlock(loader);
+
+	return status;
+}
+
+size_t xyzimage_loader_poll(XYZImage_Loader* loader, xyzimage_ticket_t* tickets, size_t count) {
+	if (loader == NULL || tickets == NULL) {
+		return 0;
+	}
+
+	size_t found = 0;
+
+	xyzpriv_loader_lock(loader);
+
+	size_t i;
+	for (i = 0; i < loader->ticket_capacity && found < count; ++i) {
+		xyzpriv_load_ticket* slot = &loader->tickets[i];
+
+		if (slot->in_use && !slot->reported && slot->job->state == XYZPRIV_LOAD_DONE) {
+			slot->reported = 1;
+			tickets[found++] = xyzpriv_loader_ticket_id(loader, i);
+		}
+	}
+
+	xyzpriv_loader_unlock(loader);
+
+	return found;
+}
+
+static XYZImage* xyzpriv_loader_copy_image(XYZImage* image, xyzimage_error_t* error) {
+	uint16_t w = xyzimage_get_width(image);
+	uint16_t h = xyzimage_get_height(image);
+	enum XYZImage_Format format = xyzimage_get_format(image);
+	XYZImage* copy = xyzimage_alloc(w, h, format, error);
+
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	if (format == XYZIMAGE_FORMAT_DEFAULT) {
+		memcpy(xyzimage_get_palette(copy, NULL), xyzimage_get_palette_handle(image, NULL), sizeof(XYZImage_Palette));
+	}
+
+	uint8_t* dst = (uint8_t*)xyzimage_get_buffer(copy, NULL);
+	const uint8_t* src = (const uint8_t*)xyzimage_get_buffer(image, NULL);
+	size_t dst_pitch = xyzimage_get_pitch(copy);
+	size_t src_pitch = xyzimage_get_pitch(image);
+
+	uint16_t y;
+	for (y = 0; y < h; ++y) {
+		memcpy(dst + y * dst_pitch, src + y * src_pitch, dst_pitch);
+	}
+
+	return copy;
+}
+
+XYZImage* xyzimage_loader_take(XYZImage_Loader* loader, xyzimage_ticket_t ticket, int wait, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (loader == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	xyzpriv_loader_lock(loader);
+
+	size_t index = xyzpriv_loader_find_ticket(loader, ticket);
+
+	if (index == XYZPRIV_LOADER_NO_TICKET) {
+		xyzpriv_loader_unlock(loader);
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	xyzpriv_load_job* job = loader->tickets[index].job;
+
+	while (job->state != XYZPRIV_LOAD_DONE) {
+		if (!wait) {
+			xyzpriv_loader_unlock(loader);
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_LOAD_PENDING);
+			return NULL;
+		}
+
+		job->waited = 1;
+
+		if (job->state == XYZPRIV_LOAD_QUEUED) {
+			uint8_t* chunk = (uint8_t*)xyzpriv_malloc(XYZPRIV_LOADER_CHUNK_SIZE);
+
+			if (chunk == NULL) {
+				xyzpriv_loader_unlock(loader);
+				xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+				return NULL;
+			}
+
+			xyzpriv_loader_queue_remove(loader, job);
+			xyzpriv_loader_run(loader, job, chunk);
+			xyzpriv_free(chunk);
+		} else {
+			// Wakes the worker when it waits for memory
+			xyzpriv_loader_notify(loader);
+			xyzpriv_loader_wait(loader);
+		}
+	}
+
+	XYZImage* image = NULL;
+
+	if (job->image == NULL) {
+		xyzpriv_set_error(error, job->error);
+	} else if (job->ticket_count > 1) {
+		// The other tickets keep the result, it is not modified until the last ticket takes it
+		xyzpriv_loader_unlock(loader);
+		image = xyzpriv_loader_copy_image(job->image, error);
+		xyzpriv_loader_lock(loader);
+	} else {
+		image = job->image;
+		job->image = NULL;
+	}
+
+	xyzpriv_loader_release_ticket(loader, index);
+
+	xyzpriv_loader_unlock(loader);
+
+	return image;
+}
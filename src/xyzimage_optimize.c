@@ -0,0 +1,313 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <string.h>
+#include <zlib.h>
+
+#include "xyzimage_private.h"
+#include "xyzimage_thread.h"
+
+typedef struct {
+	int level;
+	enum XYZImage_CompressStrategy strategy;
+	int mem_level;
+} xyzpriv_optimize_setting;
+
+// Settings tried in addition to the ones of the image. The level does not matter for
+// RLE and Huffman only, a higher memory level results in larger blocks.
+static const xyzpriv_optimize_setting xyzpriv_optimize_settings[] = {
+	{ 9, XYZIMAGE_COMPRESS_STRATEGY_DEFAULT, 8 },
+	{ 9, XYZIMAGE_COMPRESS_STRATEGY_DEFAULT, 9 },
+	{ 8, XYZIMAGE_COMPRESS_STRATEGY_DEFAULT, 9 },
+	{ 7, XYZIMAGE_COMPRESS_STRATEGY_DEFAULT, 9 },
+	{ 6, XYZIMAGE_COMPRESS_STRATEGY_DEFAULT, 9 },
+	{ 9, XYZIMAGE_COMPRESS_STRATEGY_FILTERED, 8 },
+	{ 9, XYZIMAGE_COMPRESS_STRATEGY_FILTERED, 9 },
+	{ 9, XYZIMAGE_COMPRESS_STRATEGY_RLE, 8 },
+	{ 9, XYZIMAGE_COMPRESS_STRATEGY_RLE, 9 },
+	{ 9, XYZIMAGE_COMPRESS_STRATEGY_HUFFMAN_ONLY, 9 }
+};
+
+#define XYZPRIV_OPTIMIZE_SETTING_COUNT (1 + sizeof(xyzpriv_optimize_settings) / sizeof(xyzpriv_optimize_settings[0]))
+
+typedef struct {
+	const XYZImage_Palette* palette;
+	const uint8_t* pixels;
+	size_t pitch;
+} xyzpriv_optimize_source;
+
+typedef struct {
+	XYZImage_CompressOptions options;
+	const xyzpriv_optimize_source* source;
+	Bytef* data;
+	size_t len;
+	uint32_t checksum;
+	xyzimage_error_t error;
+} xyzpriv_optimize_candidate;
+
+typedef struct {
+	uint16_t width;
+	uint16_t height;
+	xyzpriv_optimize_candidate* candidates;
+	// Only the smallest stream so far keeps its buffer, the others are freed when they finish
+	xyzpriv_optimize_candidate* best;
+	// Error of the failed candidate with the lowest index
+	xyzpriv_optimize_candidate* failed;
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_t mutex;
+#endif
+} xyzpriv_optimize_job;
+
+static xyzimage_error_t xyzpriv_optimize_deflate(z_stream* stream, const void* data, size_t len, int flush) {
+	// The output buffer is large enough for the whole stream
+	stream->next_in = (Bytef*)data;
+	stream->avail_in = (uInt)len;
+
+	int zlib_error = deflate(stream, flush);
+
+	if (flush == Z_FINISH ? zlib_error != Z_STREAM_END : (zlib_error != Z_OK || stream->avail_in != 0)) {
+		return XYZIMAGE_ERROR_IO_COMPRESS;
+	}
+
+	return XYZIMAGE_ERROR_OK;
+}
+
+static xyzimage_error_t xyzpriv_optimize_candidate_run(const xyzpriv_optimize_job* job, xyzpriv_optimize_candidate* candidate) {
+	const XYZImage_CompressOptions* options = &candidate->options;
+	const xyzpriv_optimize_source* source = candidate->source;
+
+	// The arenas are single threaded, the workers use the global allocator
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin(&scratch, NULL, xyzpriv_get_allocator());
+
+	z_stream stream;
+	stream.zalloc = xyzpriv_zalloc;
+	stream.zfree = xyzpriv_zfree;
+	stream.opaque = &scratch;
+
+	int zlib_error = deflateInit2(&stream, options->level, Z_DEFLATED, options->window_bits,
+		options->mem_level, xyzpriv_get_zlib_strategy(options->strategy));
+
+	if (zlib_error != Z_OK) {
+		return zlib_error == Z_MEM_ERROR ? XYZIMAGE_ERROR_OUT_OF_MEMORY : XYZIMAGE_ERROR_IO_COMPRESS;
+	}
+
+	// Room for the empty stored block of the palette flush
+	size_t capacity = deflateBound(&stream, XYZIMAGE_PALETTE_SIZE + (uLong)job->width * job->height) + 16;
+	candidate->data = xyzpriv_malloc(capacity);
+
+	if (candidate->data == NULL) {
+		deflateEnd(&stream);
+		return XYZIMAGE_ERROR_OUT_OF_MEMORY;
+	}
+
+	stream.next_out = candidate->data;
+	stream.avail_out = (uInt)capacity;
+
+	xyzimage_error_t e = xyzpriv_optimize_deflate(&stream, source->palette, XYZIMAGE_PALETTE_SIZE,
+		options->separate_palette ? Z_FULL_FLUSH : Z_NO_FLUSH);
+
+	if (source->pitch == job->width) {
+		if (e == XYZIMAGE_ERROR_OK) {
+			e = xyzpriv_optimize_deflate(&stream, source->pixels, (size_t)job->width * job->height, Z_FINISH);
+		}
+	} else {
+		uint16_t y;
+		for (y = 0; e == XYZIMAGE_ERROR_OK && y < job->height; ++y) {
+			e = xyzpriv_optimize_deflate(&stream, source->pixels + y * source->pitch, job->width, Z_NO_FLUSH);
+		}
+
+		if (e == XYZIMAGE_ERROR_OK) {
+			e = xyzpriv_optimize_deflate(&stream, NULL, 0, Z_FINISH);
+		}
+	}
+
+	candidate->len = stream.total_out;
+	candidate->checksum = (uint32_t)stream.adler;
+
+	deflateEnd(&stream);
+
+	return e;
+}
+
+static void xyzpriv_optimize_task(void* arg, size_t index) {
+	xyzpriv_optimize_job* job = (xyzpriv_optimize_job*)arg;
+	xyzpriv_optimize_candidate* candidate = &job->candidates[index];
+
+	candidate->error = xyzpriv_optimize_candidate_run(job, candidate);
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_lock(&job->mutex);
+#endif
+
+	// Ties prefer the earlier candidate: The settings of the image and the original palette
+	xyzpriv_optimize_candidate* loser = candidate;
+
+	if (candidate->error != XYZIMAGE_ERROR_OK) {
+		if (job->failed == NULL || candidate < job->failed) {
+			job->failed = candidate;
+		}
+	} else if (job->best == NULL || candidate->len < job->best->len ||
+			(candidate->len == job->best->len && candidate < job->best)) {
+		loser = job->best;
+		job->best = candidate;
+	}
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_unlock(&job->mutex);
+#endif
+
+	if (loser) {
+		xyzpriv_free(loser->data);
+		loser->data = NULL;
+	}
+}
+
+static uint8_t* xyzpriv_optimize_sort_palette(const XYZImage_Palette* palette, const uint8_t* pixels, size_t pitch,
+		uint16_t width, uint16_t height, XYZImage_Palette* sorted_palette) {
+	// Sorts the entries 1 to 255 by usage, returns the remapped pixels or NULL when the order does not change
+	size_t histogram[XYZIMAGE_PALETTE_ENTRIES] = { 0 };
+	uint8_t order[XYZIMAGE_PALETTE_ENTRIES];
+	uint8_t lut[XYZIMAGE_PALETTE_ENTRIES];
+	size_t x, i;
+	uint16_t y;
+
+	for (y = 0; y < height; ++y) {
+		const uint8_t* row = pixels + y * pitch;
+		for (x = 0; x < width; ++x) {
+			histogram[row[x]] += 1;
+		}
+	}
+
+	// Insertion sort, stable: Unused entries keep their relative order at the end
+	order[0] = 0;
+	for (i = 1; i < XYZIMAGE_PALETTE_ENTRIES; ++i) {
+		size_t j = i;
+		while (j > 1 && histogram[order[j - 1]] < histogram[i]) {
+			order[j] = order[j - 1];
+			--j;
+		}
+		order[j] = (uint8_t)i;
+	}
+
+	int changed = 0;
+
+	for (i = 0; i < XYZIMAGE_PALETTE_ENTRIES; ++i) {
+		lut[order[i]] = (uint8_t)i;
+		memcpy(&sorted_palette->entry[i], &palette->entry[order[i]], sizeof(sorted_palette->entry[i]));
+		changed |= order[i] != i;
+	}
+
+	if (!changed) {
+		return NULL;
+	}
+
+	uint8_t* sorted_pixels = xyzpriv_malloc((size_t)width * height);
+
+	if (sorted_pixels == NULL) {
+		return NULL;
+	}
+
+	for (y = 0; y < height; ++y) {
+		memcpy(sorted_pixels + (size_t)y * width, pixels + y * pitch, width);
+	}
+
+	xyzpriv_get_remap_func()(sorted_pixels, (size_t)width * height, lut);
+
+	return sorted_pixels;
+}
+
+int xyzpriv_deflate_optimize(const XYZImage_Palette* palette, const uint8_t* pixels, size_t pitch, uint16_t width, uint16_t height,
+		const XYZImage_CompressOptions* options, void* userdata, xyzimage_write_func_t write_func, size_t* written,
+		uint32_t* checksum, xyzimage_error_t* error) {
+	xyzpriv_optimize_source sources[2];
+	XYZImage_Palette sorted_palette;
+	uint8_t* sorted_pixels = NULL;
+	size_t source_count = 1;
+
+	*written = 0;
+	*checksum = 0;
+
+	sources[0].palette = palette;
+	sources[0].pixels = pixels;
+	sources[0].pitch = pitch;
+
+	if (options->optimize_palette) {
+		// Failing to allocate only skips these candidates
+		sorted_pixels = xyzpriv_optimize_sort_palette(palette, pixels, pitch, width, height, &sorted_palette);
+
+		if (sorted_pixels) {
+			sources[1].palette = &sorted_palette;
+			sources[1].pixels = sorted_pixels;
+			sources[1].pitch = width;
+			source_count = 2;
+		}
+	}
+
+	xyzpriv_optimize_candidate candidates[2 * XYZPRIV_OPTIMIZE_SETTING_COUNT];
+	xyzpriv_optimize_job job;
+	job.width = width;
+	job.height = height;
+	job.candidates = candidates;
+	job.best = NULL;
+	job.failed = NULL;
+
+	size_t count = 0;
+	size_t i, j;
+
+	for (i = 0; i < source_count; ++i) {
+		for (j = 0; j < XYZPRIV_OPTIMIZE_SETTING_COUNT; ++j) {
+			xyzpriv_optimize_candidate* candidate = &candidates[count++];
+			candidate->options = *options;
+			candidate->source = &sources[i];
+			candidate->data = NULL;
+			candidate->len = 0;
+			candidate->checksum = 0;
+			candidate->error = XYZIMAGE_ERROR_OK;
+
+			// The first candidate uses the settings of the image
+			if (j > 0) {
+				candidate->options.level = xyzpriv_optimize_settings[j - 1].level;
+				candidate->options.strategy = xyzpriv_optimize_settings[j - 1].strategy;
+				candidate->options.mem_level = xyzpriv_optimize_settings[j - 1].mem_level;
+			}
+		}
+	}
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_init(&job.mutex);
+#endif
+
+	xyzpriv_parallel_for(count, options->threads, xyzpriv_optimize_task, &job);
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_destroy(&job.mutex);
+#endif
+
+	const xyzpriv_optimize_candidate* best = job.best;
+	int success = best != NULL;
+
+	if (success) {
+		size_t res = write_func(userdata, best->data, best->len, error);
+		success = res == best->len && !(error && *error != 0);
+		*written = res;
+		*checksum = best->checksum;
+	} else if (error) {
+		*error = job.failed ? job.failed->error : XYZIMAGE_ERROR_IO_COMPRESS;
+	}
+
+	// The losers are already freed
+	if (best) {
+		xyzpriv_free(best->data);
+	}
+
+	xyzpriv_free(sorted_pixels);
+
+	return success;
+}
@@ -0,0 +1,628 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <string.h>
+
+#include "xyzimage_private.h"
+
+/*
+ * Layout of a pack, all integers are little endian:
+ *
+ *   header   "XYZP", version, entry count, table size (uint32 each)
+ *   table    table size * uint32: entry index + 1 or 0 for an empty slot,
+ *            open addressing with linear probing, the table size is a power of two
+ *   entries  entry count * XYZPRIV_PACK_ENTRY_SIZE bytes
+ *   names    NUL terminated names
+ *   palettes entry count * 768 bytes, uncompressed copy of the palette of every image
+ *   data     the XYZ files
+ */
+#define XYZPRIV_PACK_VERSION 1
+#define XYZPRIV_PACK_HEADER_SIZE 16
+#define XYZPRIV_PACK_ENTRY_SIZE 48
+#define XYZPRIV_PACK_PALETTE_SIZE 768
+
+// Offsets of the fields of an entry
+#define XYZPRIV_PACK_ENTRY_HASH 0
+#define XYZPRIV_PACK_ENTRY_NAME_OFFSET 8
+#define XYZPRIV_PACK_ENTRY_NAME_LEN 12
+#define XYZPRIV_PACK_ENTRY_WIDTH 16
+#define XYZPRIV_PACK_ENTRY_HEIGHT 18
+#define XYZPRIV_PACK_ENTRY_PALETTE_OFFSET 24
+#define XYZPRIV_PACK_ENTRY_DATA_OFFSET 32
+#define XYZPRIV_PACK_ENTRY_DATA_LEN 40
+
+struct XYZImage_Pack {
+	const uint8_t* data;
+	size_t len;
+	uint32_t count;
+	uint32_t table_size;
+	const uint8_t* table;
+	const uint8_t* entries;
+	// Set when the pack was loaded from a file
+	int has_view;
+	xyzpriv_file_view view;
+	xyzpriv_scratch scratch;
+};
+
+static void xyzpriv_set_error(xyzimage_error_t* error, xyzimage_error_t which) {
+	if (error != NULL) {
+		*error = which;
+	}
+}
+
+static uint32_t xyzpriv_get_le16(const uint8_t* data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8);
+}
+
+static uint32_t xyzpriv_get_le32(const uint8_t* data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint64_t xyzpriv_get_le64(const uint8_t* data) {
+	return (uint64_t)xyzpriv_get_le32(data) | ((uint64_t)xyzpriv_get_le32(data + 4) << 32);
+}
+
+static void xyzpriv_put_le16(uint8_t* data, uint32_t value) {
+	data[0] = (uint8_t)value;
+	data[1] = (uint8_t)(value >> 8);
+}
+
+static void xyzpriv_put_le32(uint8_t* data, uint32_t value) {
+	data[0] = (uint8_t)value;
+	data[1] = (uint8_t)(value >> 8);
+	data[2] = (uint8_t)(value >> 16);
+	data[3] = (uint8_t)(value >> 24);
+}
+
+static void xyzpriv_put_le64(uint8_t* data, uint64_t value) {
+	xyzpriv_put_le32(data, (uint32_t)value);
+	xyzpriv_put_le32(data + 4, (uint32_t)(value >> 32));
+}
+
+// FNV-1a, 64 bit
+static uint64_t xyzpriv_pack_hash(const char* name, size_t len) {
+	uint64_t hash = 14695981039346656037ull;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (uint8_t)name[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+// Smallest power of two that keeps the table at most half full
+static uint32_t xyzpriv_pack_table_size(size_t count) {
+	uint32_t size = 1;
+
+	while (size < count * 2) {
+		size <<= 1;
+	}
+
+	return size;
+}
+
+static const uint8_t* xyzpriv_pack_entry(const XYZImage_Pack* pack, size_t index) {
+	return pack->entries + index * XYZPRIV_PACK_ENTRY_SIZE;
+}
+
+// Checks that offset + len is inside the pack
+static int xyzpriv_pack_in_range(const XYZImage_Pack* pack, uint64_t offset, uint64_t len) {
+	return offset <= pack->len && len <= pack->len - offset;
+}
+
+static int xyzpriv_pack_validate(XYZImage_Pack* pack) {
+	const uint8_t* data = pack->data;
+
+	if (pack->len < XYZPRIV_PACK_HEADER_SIZE || memcmp(data, "XYZP", 4) != 0 ||
+			xyzpriv_get_le32(data + 4) != XYZPRIV_PACK_VERSION) {
+		return 0;
+	}
+
+	pack->count = xyzpriv_get_le32(data + 8);
+	pack->table_size = xyzpriv_get_le32(data + 12);
+
+	// A free slot is required to terminate the probing
+	if (pack->table_size == 0 || (pack->table_size & (pack->table_size - 1)) != 0 || pack->table_size <= pack->count) {
+		return 0;
+	}
+
+	uint64_t table_len = (uint64_t)pack->table_size * 4;
+	uint64_t entries_len = (uint64_t)pack->count * XYZPRIV_PACK_ENTRY_SIZE;
+
+	if (!xyzpriv_pack_in_range(pack, XYZPRIV_PACK_HEADER_SIZE, table_len) ||
+			!xyzpriv_pack_in_range(pack, XYZPRIV_PACK_HEADER_SIZE + table_len, entries_len)) {
+		return 0;
+	}
+
+	pack->table = data + XYZPRIV_PACK_HEADER_SIZE;
+	pack->entries = pack->table + (size_t)table_len;
+
+	uint32_t i;
+	uint32_t used = 0;
+
+	for (i = 0; i < pack->table_size; ++i) {
+		uint32_t slot = xyzpriv_get_le32(pack->table + i * 4);
+
+		if (slot > pack->count) {
+			return 0;
+		}
+
+		used += slot != 0;
+	}
+
+	if (used != pack->count) {
+		return 0;
+	}
+
+	for (i = 0; i < pack->count; ++i) {
+		const uint8_t* entry = xyzpriv_pack_entry(pack, i);
+		uint32_t name_offset = xyzpriv_get_le32(entry + XYZPRIV_PACK_ENTRY_NAME_OFFSET);
+		uint32_t name_len = xyzpriv_get_le32(entry + XYZPRIV_PACK_ENTRY_NAME_LEN);
+		uint64_t palette_offset = xyzpriv_get_le64(entry + XYZPRIV_PACK_ENTRY_PALETTE_OFFSET);
+		uint64_t data_offset = xyzpriv_get_le64(entry + XYZPRIV_PACK_ENTRY_DATA_OFFSET);
+		uint64_t data_len = xyzpriv_get_le64(entry + XYZPRIV_PACK_ENTRY_DATA_LEN);
+
+		if (!xyzpriv_pack_in_range(pack, name_offset, (uint64_t)name_len + 1) || data[(size_t)name_offset + name_len] != '\0' ||
+				!xyzpriv_pack_in_range(pack, palette_offset, XYZPRIV_PACK_PALETTE_SIZE) ||
+				!xyzpriv_pack_in_range(pack, data_offset, data_len)) {
+			return 0;
+		}
+
+		if (xyzpriv_get_le64(entry + XYZPRIV_PACK_ENTRY_HASH) != xyzpriv_pack_hash((const char*)data + name_offset, name_len)) {
+			return 0;
+		}
+
+		// The XYZ header must match the entry, the image data itself is checked when it is decoded
+		const uint8_t* xyz = data + (size_t)data_offset;
+
+		if (data_len < 8 || memcmp(xyz, "XYZ1", 4) != 0 ||
+				xyzpriv_get_le16(xyz + 4) != xyzpriv_get_le16(entry + XYZPRIV_PACK_ENTRY_WIDTH) ||
+				xyzpriv_get_le16(xyz + 6) != xyzpriv_get_le16(entry + XYZPRIV_PACK_ENTRY_HEIGHT)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static XYZImage_Pack* xyzpriv_pack_alloc(xyzimage_error_t* error) {
+	XYZImage_Pack* pack = (XYZImage_Pack*)xyzpriv_calloc(1, sizeof(XYZImage_Pack));
+
+	if (pack == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	// The content of a file lives as long as the pack, it is not taken from a scoped arena
+	xyzpriv_scratch_begin(&pack->scratch, NULL, xyzpriv_get_allocator());
+
+	return pack;
+}
+
+XYZImage_Pack* xyzimage_pack_open(const char* path, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (path == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	FILE* file = fopen(path, "rb");
+
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
+		return NULL;
+	}
+
+	XYZImage_Pack* pack = xyzpriv_pack_alloc(error);
+
+	if (pack == NULL) {
+		fclose(file);
+		return NULL;
+	}
+
+	pack->has_view = xyzpriv_file_view_open(&pack->view, file, &pack->scratch);
+	fclose(file);
+
+	if (!pack->has_view) {
+		// Packs are looked up randomly, only regular files are supported
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_READ_GENERIC);
+		xyzimage_pack_free(pack);
+		return NULL;
+	}
+
+	pack->data = pack->view.data;
+	pack->len = pack->view.len;
+
+	if (!xyzpriv_pack_validate(pack)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_PACK_INVALID);
+		xyzimage_pack_free(pack);
+		return NULL;
+	}
+
+	return pack;
+}
+
+XYZImage_Pack* xyzimage_pack_mopen(const void* data, size_t len, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (data == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return NULL;
+	}
+
+	XYZImage_Pack* pack = xyzpriv_pack_alloc(error);
+
+	if (pack == NULL) {
+		return NULL;
+	}
+
+	pack->data = (const uint8_t*)data;
+	pack->len = len;
+
+	if (!xyzpriv_pack_validate(pack)) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_PACK_INVALID);
+		xyzimage_pack_free(pack);
+		return NULL;
+	}
+
+	return pack;
+}
+
+void xyzimage_pack_free(XYZImage_Pack* pack) {
+	if (pack == NULL) {
+		return;
+	}
+
+	if (pack->has_view) {
+		xyzpriv_file_view_close(&pack->view, NULL, 0, &pack->scratch);
+	}
+
+	xyzpriv_scratch_end(&pack->scratch);
+	xyzpriv_free(pack);
+}
+
+size_t xyzimage_pack_get_count(const XYZImage_Pack* pack) {
+	return pack ? pack->count : 0;
+}
+
+int xyzimage_pack_find(const XYZImage_Pack* pack, const char* name, size_t* index) {
+	if (pack == NULL || name == NULL) {
+		return 0;
+	}
+
+	size_t name_len = strlen(name);
+	uint64_t hash = xyzpriv_pack_hash(name, name_len);
+	uint32_t mask = pack->table_size - 1;
+	uint32_t slot = (uint32_t)hash & mask;
+
+	for (;;) {
+		uint32_t value = xyzpriv_get_le32(pack->table + slot * 4);
+
+		if (value == 0) {
+			return 0;
+		}
+
+		const uint8_t* entry = xyzpriv_pack_entry(pack, value - 1);
+
+		if (xyzpriv_get_le64(entry + XYZPRIV_PACK_ENTRY_HASH) == hash &&
+				xyzpriv_get_le32(entry + XYZPRIV_PACK_ENTRY_NAME_LEN) == name_len &&
+				memcmp(pack->data + xyzpriv_get_le32(entry + XYZPRIV_PACK_ENTRY_NAME_OFFSET), name, name_len) == 0) {
+			if (index) {
+				*index = value - 1;
+			}
+			return 1;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+}
+
+int xyzimage_pack_get_entry(const XYZImage_Pack* pack, size_t index, XYZImage_PackEntry* entry, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (pack == NULL || entry == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	if (index >= pack->count) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	const uint8_t* data = xyzpriv_pack_entry(pack, index);
+
+	entry->name = (const char*)pack->data + xyzpriv_get_le32(data + XYZPRIV_PACK_ENTRY_NAME_OFFSET);
+	entry->width = (uint16_t)xyzpriv_get_le16(data + XYZPRIV_PACK_ENTRY_WIDTH);
+	entry->height = (uint16_t)xyzpriv_get_le16(data + XYZPRIV_PACK_ENTRY_HEIGHT);
+	entry->palette = (const XYZImage_Palette*)(pack->data + (size_t)xyzpriv_get_le64(data + XYZPRIV_PACK_ENTRY_PALETTE_OFFSET));
+	entry->data = pack->data + (size_t)xyzpriv_get_le64(data + XYZPRIV_PACK_ENTRY_DATA_OFFSET);
+	entry->size = (size_t)xyzpriv_get_le64(data + XYZPRIV_PACK_ENTRY_DATA_LEN);
+
+	return 1;
+}
+
+XYZImage* xyzimage_pack_open_image(const XYZImage_Pack* pack, size_t index, xyzimage_error_t* error) {
+	XYZImage_PackEntry entry;
+
+	if (!xyzimage_pack_get_entry(pack, index, &entry, error)) {
+		return NULL;
+	}
+
+	return xyzimage_mopen(entry.data, entry.size, error);
+}
+
+typedef struct {
+	uint8_t* data;
+	size_t len;
+	size_t name_len;
+	uint64_t hash;
+	XYZImage_Palette palette;
+} xyzpriv_pack_payload;
+
+// Receives each image at its write bound before the compressed file is copied to the payload
+typedef struct {
+	uint8_t* data;
+	size_t size;
+} xyzpriv_pack_work;
+
+static int xyzpriv_pack_compress(XYZImage* image, xyzpriv_pack_work* work, xyzpriv_pack_payload* payload, xyzimage_error_t* error) {
+	size_t bound = xyzimage_get_write_bound(image);
+
+	if (bound == 0) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_XYZIMAGE_INVALID);
+		return 0;
+	}
+
+	if (bound > work->size) {
+		xyzpriv_free(work->data);
+		work->size = 0;
+		work->data = (uint8_t*)xyzpriv_malloc(bound);
+
+		if (work->data == NULL) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+			return 0;
+		}
+
+		work->size = bound;
+	}
+
+	size_t len;
+
+	if (!xyzimage_mwrite(image, work->data, bound, &len, error)) {
+		return 0;
+	}
+
+	// The palette is taken from the written file: Images that are not indexed get their palette while writing
+	if (!xyzimage_mprobe(work->data, len, NULL, NULL, &payload->palette, error)) {
+		return 0;
+	}
+
+	// Only the compressed size is kept until the pack is written
+	payload->data = (uint8_t*)xyzpriv_malloc(len);
+
+	if (payload->data == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return 0;
+	}
+
+	memcpy(payload->data, work->data, len);
+	payload->len = len;
+
+	return 1;
+}
+
+static int xyzpriv_pack_write_all(void* userdata, xyzimage_write_func_t write_func, const void* data, size_t len, xyzimage_error_t* error) {
+	xyzimage_error_t write_error = XYZIMAGE_ERROR_OK;
+
+	if (write_func(userdata, data, len, &write_error) != len) {
+		xyzpriv_set_error(error, write_error != XYZIMAGE_ERROR_OK ? write_error : XYZIMAGE_ERROR_IO_WRITE);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Compresses the images and writes the pack, index and payloads are provided zeroed and work empty by the caller
+static int xyzpriv_pack_write_items(const XYZImage_PackItem* items, size_t count, uint32_t table_size,
+		uint8_t* index, size_t index_len, xyzpriv_pack_payload* payloads, xyzpriv_pack_work* work,
+		void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	size_t i;
+	uint8_t* table = index + XYZPRIV_PACK_HEADER_SIZE;
+	uint8_t* entries = table + (size_t)table_size * 4;
+	uint32_t mask = table_size - 1;
+	uint64_t names_len = 0;
+
+	for (i = 0; i < count; ++i) {
+		xyzpriv_pack_payload* payload = &payloads[i];
+		const char* name = items[i].name;
+
+		if (name == NULL || items[i].image == NULL) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+			return 0;
+		}
+
+		payload->name_len = strlen(name);
+		payload->hash = xyzpriv_pack_hash(name, payload->name_len);
+
+		if (payload->name_len > 0xFFFFFFFEu) {
+			xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+			return 0;
+		}
+
+		// Insert into the table, duplicated names are rejected
+		uint32_t slot = (uint32_t)payload->hash & mask;
+
+		for (;;) {
+			uint32_t value = xyzpriv_get_le32(table + slot * 4);
+
+			if (value == 0) {
+				xyzpriv_put_le32(table + slot * 4, (uint32_t)i + 1);
+				break;
+			}
+
+			const xyzpriv_pack_payload* other = &payloads[value - 1];
+
+			if (other->hash == payload->hash && other->name_len == payload->name_len &&
+					memcmp(items[value - 1].name, name, payload->name_len) == 0) {
+				xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+				return 0;
+			}
+
+			slot = (slot + 1) & mask;
+		}
+
+		names_len += payload->name_len + 1;
+
+		if (!xyzpriv_pack_compress(items[i].image, work, payload, error)) {
+			return 0;
+		}
+	}
+
+	// Not needed while writing
+	xyzpriv_free(work->data);
+	work->data = NULL;
+	work->size = 0;
+
+	uint64_t names_offset = index_len;
+	uint64_t palettes_offset = names_offset + names_len;
+	uint64_t data_offset = palettes_offset + (uint64_t)count * XYZPRIV_PACK_PALETTE_SIZE;
+
+	// Names are addressed with 32 bit offsets
+	if (palettes_offset > 0xFFFFFFFFu) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	memcpy(index, "XYZP", 4);
+	xyzpriv_put_le32(index + 4, XYZPRIV_PACK_VERSION);
+	xyzpriv_put_le32(index + 8, (uint32_t)count);
+	xyzpriv_put_le32(index + 12, table_size);
+
+	uint64_t name_offset = names_offset;
+
+	for (i = 0; i < count; ++i) {
+		uint8_t* entry = entries + i * XYZPRIV_PACK_ENTRY_SIZE;
+
+		xyzpriv_put_le64(entry + XYZPRIV_PACK_ENTRY_HASH, payloads[i].hash);
+		xyzpriv_put_le32(entry + XYZPRIV_PACK_ENTRY_NAME_OFFSET, (uint32_t)name_offset);
+		xyzpriv_put_le32(entry + XYZPRIV_PACK_ENTRY_NAME_LEN, (uint32_t)payloads[i].name_len);
+		xyzpriv_put_le16(entry + XYZPRIV_PACK_ENTRY_WIDTH, xyzimage_get_width(items[i].image));
+		xyzpriv_put_le16(entry + XYZPRIV_PACK_ENTRY_HEIGHT, xyzimage_get_height(items[i].image));
+		xyzpriv_put_le64(entry + XYZPRIV_PACK_ENTRY_PALETTE_OFFSET, palettes_offset + (uint64_t)i * XYZPRIV_PACK_PALETTE_SIZE);
+		xyzpriv_put_le64(entry + XYZPRIV_PACK_ENTRY_DATA_OFFSET, data_offset);
+		xyzpriv_put_le64(entry + XYZPRIV_PACK_ENTRY_DATA_LEN, payloads[i].len);
+
+		name_offset += payloads[i].name_len + 1;
+		data_offset += payloads[i].len;
+	}
+
+	if (!xyzpriv_pack_write_all(userdata, write_func, index, index_len, error)) {
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (!xyzpriv_pack_write_all(userdata, write_func, items[i].name, payloads[i].name_len + 1, error)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (!xyzpriv_pack_write_all(userdata, write_func, &payloads[i].palette, XYZPRIV_PACK_PALETTE_SIZE, error)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (!xyzpriv_pack_write_all(userdata, write_func, payloads[i].data, payloads[i].len, error)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int xyzimage_pack_write(const XYZImage_PackItem* items, size_t count, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if ((items == NULL && count > 0) || write_func == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	// The table is at most half full and its size must fit into 32 bits: At most 2^31 slots
+	if (count > 0x40000000u) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	uint32_t table_size = xyzpriv_pack_table_size(count);
+	uint64_t index_len64 = XYZPRIV_PACK_HEADER_SIZE + (uint64_t)table_size * 4 + (uint64_t)count * XYZPRIV_PACK_ENTRY_SIZE;
+
+	if (index_len64 > SIZE_MAX) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return 0;
+	}
+
+	size_t index_len = (size_t)index_len64;
+	uint8_t* index = (uint8_t*)xyzpriv_calloc(1, index_len);
+	xyzpriv_pack_payload* payloads = (xyzpriv_pack_payload*)xyzpriv_calloc(count > 0 ? count : 1, sizeof(xyzpriv_pack_payload));
+	xyzpriv_pack_work work;
+	work.data = NULL;
+	work.size = 0;
+	int res = 0;
+
+	if (index == NULL || payloads == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+	} else {
+		res = xyzpriv_pack_write_items(items, count, table_size, index, index_len, payloads, &work, userdata, write_func, error);
+	}
+
+	xyzpriv_free(work.data);
+
+	if (payloads) {
+		size_t i;
+
+		for (i = 0; i < count; ++i) {
+			if (payloads[i].data) {
+				xyzpriv_free(payloads[i].data);
+			}
+		}
+
+		xyzpriv_free(payloads);
+	}
+
+	if (index) {
+		xyzpriv_free(index);
+	}
+
+	return res;
+}
+
+static size_t xyzpriv_pack_fwrite_func(void* userdata, const void* buffer, size_t amount, xyzimage_error_t* error) {
+	size_t res = fwrite(buffer, 1, amount, (FILE*)userdata);
+
+	if (res != amount) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_WRITE);
+	}
+
+	return res;
+}
+
+int xyzimage_pack_fwrite(const XYZImage_PackItem* items, size_t count, FILE* file, xyzimage_error_t* error) {
+	if (file == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	return xyzimage_pack_write(items, count, file, xyzpriv_pack_fwrite_func, error);
+}
@@ -0,0 +1,214 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <string.h>
+
+#include "xyzimage_private.h"
+#include "xyzimage_thread.h"
+
+// Initial amount of hash buckets, the table doubles when it holds more palettes than buckets
+#define XYZPRIV_PALETTE_CACHE_BUCKETS 64u
+
+struct XYZImage_PaletteCache {
+	// Chained hash table of the shared palettes, the size is a power of two
+	xyzpriv_shared_palette** buckets;
+	size_t bucket_count;
+	size_t count;
+	// The reference of the user plus one per shared palette
+	size_t refs;
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_t mutex;
+#endif
+};
+
+static void xyzpriv_set_error(xyzimage_error_t* error, xyzimage_error_t which) {
+	if (error != NULL) {
+		*error = which;
+	}
+}
+
+static void xyzpriv_palette_cache_lock(XYZImage_PaletteCache* cache) {
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_lock(&cache->mutex);
+#else
+	(void)cache;
+#endif
+}
+
+static void xyzpriv_palette_cache_unlock(XYZImage_PaletteCache* cache) {
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_unlock(&cache->mutex);
+#else
+	(void)cache;
+#endif
+}
+
+static void xyzpriv_palette_cache_destroy(XYZImage_PaletteCache* cache) {
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_destroy(&cache->mutex);
+#endif
+	xyzpriv_free(cache->buckets);
+	xyzpriv_free(cache);
+}
+
+uint64_t xyzpriv_palette_hash(const XYZImage_Palette* palette) {
+	return xyzpriv_hash64(palette, XYZIMAGE_PALETTE_SIZE, 0);
+}
+
+XYZImage_PaletteCache* xyzimage_palette_cache_create(xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	XYZImage_PaletteCache* cache = (XYZImage_PaletteCache*)xyzpriv_malloc(sizeof(XYZImage_PaletteCache));
+
+	if (cache == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	cache->buckets = (xyzpriv_shared_palette**)xyzpriv_calloc(XYZPRIV_PALETTE_CACHE_BUCKETS, sizeof(xyzpriv_shared_palette*));
+
+	if (cache->buckets == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		xyzpriv_free(cache);
+		return NULL;
+	}
+
+	cache->bucket_count = XYZPRIV_PALETTE_CACHE_BUCKETS;
+	cache->count = 0;
+	cache->refs = 1;
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_init(&cache->mutex);
+#endif
+
+	return cache;
+}
+
+void xyzimage_palette_cache_free(XYZImage_PaletteCache* cache) {
+	if (cache == NULL) {
+		return;
+	}
+
+	// Palettes still used by images keep the cache alive
+	xyzpriv_palette_cache_lock(cache);
+	size_t refs = --cache->refs;
+	xyzpriv_palette_cache_unlock(cache);
+
+	if (refs == 0) {
+		xyzpriv_palette_cache_destroy(cache);
+	}
+}
+
+size_t xyzimage_palette_cache_get_count(XYZImage_PaletteCache* cache) {
+	if (cache == NULL) {
+		return 0;
+	}
+
+	xyzpriv_palette_cache_lock(cache);
+	size_t count = cache->count;
+	xyzpriv_palette_cache_unlock(cache);
+
+	return count;
+}
+
+static void xyzpriv_palette_cache_grow(XYZImage_PaletteCache* cache) {
+	size_t bucket_count = cache->bucket_count * 2;
+	xyzpriv_shared_palette** buckets = (xyzpriv_shared_palette**)xyzpriv_calloc(bucket_count, sizeof(xyzpriv_shared_palette*));
+
+	if (buckets == NULL) {
+		// Not an error, the chains only get longer
+		return;
+	}
+
+	size_t i;
+	for (i = 0; i < cache->bucket_count; ++i) {
+		xyzpriv_shared_palette* shared = cache->buckets[i];
+
+		while (shared) {
+			xyzpriv_shared_palette* next = shared->next;
+			size_t bucket = (size_t)shared->hash & (bucket_count - 1);
+
+			shared->next = buckets[bucket];
+			buckets[bucket] = shared;
+			shared = next;
+		}
+	}
+
+	xyzpriv_free(cache->buckets);
+	cache->buckets = buckets;
+	cache->bucket_count = bucket_count;
+}
+
+xyzpriv_shared_palette* xyzpriv_palette_cache_intern(XYZImage_PaletteCache* cache, const XYZImage_Palette* palette, uint64_t hash) {
+	xyzpriv_palette_cache_lock(cache);
+
+	size_t bucket = (size_t)hash & (cache->bucket_count - 1);
+	xyzpriv_shared_palette* shared = cache->buckets[bucket];
+
+	while (shared) {
+		if (shared->hash == hash && memcmp(&shared->palette, palette, XYZIMAGE_PALETTE_SIZE) == 0) {
+			++shared->refs;
+			xyzpriv_palette_cache_unlock(cache);
+			return shared;
+		}
+
+		shared = shared->next;
+	}
+
+	shared = (xyzpriv_shared_palette*)xyzpriv_malloc(sizeof(xyzpriv_shared_palette));
+
+	if (shared != NULL) {
+		memcpy(&shared->palette, palette, XYZIMAGE_PALETTE_SIZE);
+		shared->hash = hash;
+		shared->refs = 1;
+		shared->cache = cache;
+		shared->next = cache->buckets[bucket];
+		cache->buckets[bucket] = shared;
+
+		++cache->count;
+		++cache->refs;
+
+		if (cache->count > cache->bucket_count) {
+			xyzpriv_palette_cache_grow(cache);
+		}
+	}
+
+	xyzpriv_palette_cache_unlock(cache);
+
+	return shared;
+}
+
+void xyzpriv_palette_cache_release(xyzpriv_shared_palette* shared) {
+	XYZImage_PaletteCache* cache = shared->cache;
+
+	xyzpriv_palette_cache_lock(cache);
+
+	if (--shared->refs > 0) {
+		xyzpriv_palette_cache_unlock(cache);
+		return;
+	}
+
+	// Unlink the palette, unused palettes are not kept
+	xyzpriv_shared_palette** link = &cache->buckets[(size_t)shared->hash & (cache->bucket_count - 1)];
+
+	while (*link != shared) {
+		link = &(*link)->next;
+	}
+
+	*link = shared->next;
+	--cache->count;
+	size_t refs = --cache->refs;
+
+	xyzpriv_palette_cache_unlock(cache);
+
+	xyzpriv_free(shared);
+
+	if (refs == 0) {
+		xyzpriv_palette_cache_destroy(cache);
+	}
+}
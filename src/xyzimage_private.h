@@ -0,0 +1,412 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#ifndef LIBXYZIMAGE_XYZIMAGE_PRIVATE_H
+#define LIBXYZIMAGE_XYZIMAGE_PRIVATE_H
+
+#include <zlib.h>
+
+#include "xyzimage.h"
+
+/**
+ * Temporary memory of one open or write function.
+ * Allocations are served from the arena when set and fall back to the global allocator.
+ */
+typedef struct {
+	XYZImage_Arena* arena;
+	// Offset of the arena when the scope started
+	size_t mark;
+	// Used when the arena is NULL or full
+	const XYZImage_Allocator* allocator;
+	// When non-null receives the amount of calls of the allocator
+	XYZImage_Stats* stats;
+} xyzpriv_scratch;
+
+/**
+ * @return The allocator set by xyzimage_set_allocator
+ */
+const XYZImage_Allocator* xyzpriv_get_allocator(void);
+
+// Allocation functions using the allocator set by xyzimage_set_allocator
+void* xyzpriv_malloc(size_t size);
+void* xyzpriv_calloc(size_t count, size_t size);
+void* xyzpriv_realloc(void* ptr, size_t size);
+void xyzpriv_free(void* ptr);
+
+/**
+ * Creates an arena.
+ *
+ * @param size Initial size in bytes
+ * @param allocator Allocator of the arena and its memory
+ * @param growable When non-zero the arena grows at the end of a scope when allocations did not fit
+ * @param error When non-null receives the error code on error
+ * @return arena or NULL on error
+ */
+XYZImage_Arena* xyzpriv_arena_create(size_t size, const XYZImage_Allocator* allocator, int growable, xyzimage_error_t* error);
+
+/**
+ * Starts a scope of temporary allocations.
+ *
+ * @param scratch Scope to initialize
+ * @param arena Arena to allocate from, can be NULL
+ * @param allocator Allocator used when the arena is NULL or full, must stay valid until the scope ends
+ */
+void xyzpriv_scratch_begin(xyzpriv_scratch* scratch, XYZImage_Arena* arena, const XYZImage_Allocator* allocator);
+
+/**
+ * Starts a scope of temporary allocations using the arena set by xyzimage_set_scratch_arena.
+ */
+void xyzpriv_scratch_begin_global(xyzpriv_scratch* scratch);
+
+/**
+ * Ends the scope and resets the arena, all allocations of the scope must be unused.
+ * Growable arenas are enlarged when the scope is the outermost one.
+ */
+void xyzpriv_scratch_end(xyzpriv_scratch* scratch);
+
+// Allocation functions for temporary memory
+void* xyzpriv_scratch_malloc(xyzpriv_scratch* scratch, size_t size);
+void* xyzpriv_scratch_realloc(xyzpriv_scratch* scratch, void* ptr, size_t size);
+void xyzpriv_scratch_free(xyzpriv_scratch* scratch, void* ptr);
+
+// zlib allocation functions, opaque must point to a xyzpriv_scratch
+voidpf xyzpriv_zalloc(voidpf opaque, uInt items, uInt size);
+void xyzpriv_zfree(voidpf opaque, voidpf address);
+
+/**
+ * Whole remaining content of a FILE, see xyzpriv_file_view_open.
+ */
+typedef struct {
+	const uint8_t* data;
+	size_t len;
+	// Position of the file when the view was opened
+	long position;
+	// Set when the file is memory mapped
+	void* mapping;
+	size_t mapping_len;
+	// Set when the file was read into scratch memory
+	void* buffer;
+} xyzpriv_file_view;
+
+/**
+ * Makes the content of a regular file from the current position to the end available in memory.
+ * Large files are memory mapped when supported, otherwise the content is read with one call of fread.
+ *
+ * @param view View to initialize
+ * @param file File handle
+ * @param scratch Provides the buffer of the content
+ * @return 1 on success, 0 when the file is not a regular file or the content cannot be loaded
+ *  (this is not an error, the file must be read through xyzimage_open then)
+ */
+int xyzpriv_file_view_open(xyzpriv_file_view* view, FILE* file, xyzpriv_scratch* scratch);
+
+/**
+ * Releases the content and moves the file position behind the consumed bytes.
+ *
+ * @param view View opened with xyzpriv_file_view_open
+ * @param file File handle passed to xyzpriv_file_view_open or NULL when the file was already closed
+ * @param consumed Amount of bytes used from the content
+ * @param scratch Scratch passed to xyzpriv_file_view_open
+ */
+void xyzpriv_file_view_close(xyzpriv_file_view* view, FILE* file, size_t consumed, xyzpriv_scratch* scratch);
+
+/**
+ * @return Monotonic time in nanoseconds, only differences are meaningful
+ */
+uint64_t xyzpriv_get_time_ns(void);
+
+/**
+ * Hashes a buffer, the result is identical on every platform.
+ *
+ * @param data Data to hash
+ * @param len Size of data in bytes
+ * @param seed Start value, different seeds give unrelated hashes
+ * @return 64 bit hash
+ */
+uint64_t xyzpriv_hash64(const void* data, size_t len, uint64_t seed);
+
+/**
+ * State of a hash calculated over several buffers, the result equals xyzpriv_hash64 of the concatenated data.
+ */
+typedef struct {
+	uint64_t acc[4];
+	uint64_t seed;
+	uint64_t total_len;
+	// Bytes not forming a complete stripe yet
+	uint8_t pending[32];
+	size_t pending_len;
+} xyzpriv_hash64_state;
+
+void xyzpriv_hash64_begin(xyzpriv_hash64_state* state, uint64_t seed);
+void xyzpriv_hash64_update(xyzpriv_hash64_state* state, const void* data, size_t len);
+uint64_t xyzpriv_hash64_end(const xyzpriv_hash64_state* state);
+
+/**
+ * Palette stored once in a XYZImage_PaletteCache and referenced by many images.
+ */
+typedef struct xyzpriv_shared_palette {
+	// Must be the first member, images point to it
+	XYZImage_Palette palette;
+	uint64_t hash;
+	// Amount of images referencing the palette, protected by the mutex of the cache
+	size_t refs;
+	XYZImage_PaletteCache* cache;
+	struct xyzpriv_shared_palette* next;
+} xyzpriv_shared_palette;
+
+/**
+ * @return Hash of the palette as reported by xyzimage_get_palette_hash
+ */
+uint64_t xyzpriv_palette_hash(const XYZImage_Palette* palette);
+
+/**
+ * Looks up a palette in the cache and adds it when it is missing. Thread safe.
+ *
+ * @param cache Instance of XYZImage_PaletteCache
+ * @param palette Palette to look up
+ * @param hash Hash of the palette, see xyzpriv_palette_hash
+ * @return The shared palette with one reference added or NULL when out of memory
+ */
+xyzpriv_shared_palette* xyzpriv_palette_cache_intern(XYZImage_PaletteCache* cache, const XYZImage_Palette* palette, uint64_t hash);
+
+/**
+ * Drops one reference of a shared palette, the palette is removed from the cache when it is unused.
+ * Thread safe.
+ *
+ * @param shared Palette returned by xyzpriv_palette_cache_intern
+ */
+void xyzpriv_palette_cache_release(xyzpriv_shared_palette* shared);
+
+/**
+ * Expands count palette indices from src into 32 bit pixels in dst using the lookup table.
+ * dst does not need to be aligned.
+ */
+typedef void (*xyzpriv_expand_func_t)(const uint8_t* src, uint8_t* dst, size_t count, const uint32_t* lut);
+
+/**
+ * Builds a lookup table mapping each palette index to a 32 bit pixel in the given channel order.
+ *
+ * @param palette Palette to convert
+ * @param order Byte order of the pixel in memory
+ * @param transparent_index Palette index receiving alpha 0 or XYZIMAGE_NO_TRANSPARENCY
+ * @param lut Receives XYZIMAGE_PALETTE_ENTRIES pixels
+ * @return 1 on success, 0 when the channel order is invalid
+ */
+int xyzpriv_build_lut(const XYZImage_Palette* palette, enum XYZImage_ChannelOrder order, int transparent_index, uint32_t* lut);
+
+/**
+ * Returns the fastest expand function supported by the CPU.
+ */
+xyzpriv_expand_func_t xyzpriv_get_expand_func(void);
+
+/**
+ * Expands rows of palette indices into 32 bit pixels, unpadded rows are expanded in one call.
+ *
+ * @param expand Expand function, see xyzpriv_get_expand_func
+ * @param src Palette indices
+ * @param src_pitch Distance between the start of two rows of src in bytes
+ * @param dst Receives the pixels
+ * @param dst_pitch Distance between the start of two rows of dst in bytes
+ * @param width Amount of pixels per row
+ * @param rows Amount of rows
+ * @param lut Lookup table built by xyzpriv_build_lut
+ */
+void xyzpriv_expand_rows(xyzpriv_expand_func_t expand, const uint8_t* src, size_t src_pitch, uint8_t* dst, size_t dst_pitch,
+		size_t width, size_t rows, const uint32_t* lut);
+
+/**
+ * Replaces count palette indices in data with the entries of the lookup table.
+ *
+ * @param data Palette indices to replace
+ * @param count Amount of indices
+ * @param lut 256 new indices
+ */
+typedef void (*xyzpriv_remap_func_t)(uint8_t* data, size_t count, const uint8_t* lut);
+
+/**
+ * Returns the fastest remap function supported by the CPU.
+ */
+xyzpriv_remap_func_t xyzpriv_get_remap_func(void);
+
+/**
+ * Builds a palette out of the unique colors of a 32 bit image and converts it to palette indices.
+ *
+ * @param pixels Pixels of the image: red, green, blue and alpha (ignored when has_alpha is 0)
+ * @param pitch Distance between the start of two rows in bytes
+ * @param width Width of the image in pixel
+ * @param height Height of the image in pixel
+ * @param has_alpha When non-zero transparent pixels are mapped to index 0
+ * @param palette Receives the palette
+ * @param indices Receives width * height palette indices
+ * @return XYZIMAGE_ERROR_OK on success, the error code otherwise
+ */
+xyzimage_error_t xyzpriv_quantize(const uint8_t* pixels, size_t pitch, uint16_t width, uint16_t height,
+		int has_alpha, XYZImage_Palette* palette, uint8_t* indices);
+
+/**
+ * Converts a compression strategy to the matching zlib constant.
+ *
+ * @return zlib strategy or -1 when the strategy is invalid
+ */
+int xyzpriv_get_zlib_strategy(enum XYZImage_CompressStrategy strategy);
+
+/**
+ * Uncompressed stream of an image: The palette followed by the pixels.
+ */
+typedef struct {
+	const XYZImage_Palette* palette;
+	const uint8_t* pixels;
+	// Distance between the start of two rows in bytes
+	size_t pitch;
+	uint16_t width;
+	uint16_t height;
+} xyzpriv_deflate_source;
+
+/**
+ * Raw deflate data of a range of the uncompressed stream, segments of consecutive ranges
+ * are concatenated to a zlib stream by xyzpriv_deflate_write_segments.
+ */
+typedef struct {
+	Bytef* data;
+	size_t len;
+	// Size and Adler-32 checksum of the uncompressed range
+	size_t raw_len;
+	uint32_t adler;
+	xyzimage_error_t error;
+} xyzpriv_deflate_segment;
+
+/**
+ * Compresses a range of the uncompressed stream into a segment.
+ * The segment ends on a byte boundary (sync flush) unless it is the last one.
+ * When the range starts with the palette and separate_palette is set the palette ends with a full flush.
+ * Thread safe, the global allocator is used.
+ *
+ * @param source Uncompressed stream
+ * @param start Offset of the range in the uncompressed stream
+ * @param len Size of the range in bytes
+ * @param dict_len Amount of bytes preceding the range used as dictionary, at most 32768
+ * @param last When non-zero the segment ends the deflate stream
+ * @param options Compression options
+ * @param segment Receives the compressed data allocated by xyzpriv_malloc, the caller frees it
+ * @return XYZIMAGE_ERROR_OK on success, the error code otherwise
+ */
+xyzimage_error_t xyzpriv_deflate_segment_compress(const xyzpriv_deflate_source* source, size_t start, size_t len,
+		size_t dict_len, int last, const XYZImage_CompressOptions* options, xyzpriv_deflate_segment* segment);
+
+/**
+ * Writes segments covering the whole uncompressed stream as zlib stream: The zlib header,
+ * the segments and the combined checksum.
+ *
+ * @param options Compression options the segments were compressed with
+ * @param segments Segments in stream order
+ * @param count Amount of segments
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Receives the compressed stream
+ * @param written Receives the amount of written bytes
+ * @param checksum Receives the Adler-32 checksum of the stream
+ * @param error When non-null receives the error code on error
+ * @return 1 on success, 0 on error
+ */
+int xyzpriv_deflate_write_segments(const XYZImage_CompressOptions* options, const xyzpriv_deflate_segment* segments, size_t count,
+		void* userdata, xyzimage_write_func_t write_func, size_t* written, uint32_t* checksum, xyzimage_error_t* error);
+
+/**
+ * Compressed row bands of an image kept between writes, see xyzpriv_deflate_incremental.
+ */
+typedef struct xyzpriv_segments xyzpriv_segments;
+
+/**
+ * Compresses the palette followed by the pixels in bands of rows and keeps the segments.
+ * Following calls only compress the bands marked by xyzpriv_segments_mark_rows again,
+ * a band depends on its own rows and on the rows of its dictionary. The palette is always compressed.
+ * The segments are recreated when the size or the compression options changed.
+ *
+ * @param segments Segments of the previous call, NULL at the first call. Receives the updated segments.
+ * @param palette Palette of the image
+ * @param pixels Palette indices of the image
+ * @param pitch Distance between the start of two rows in bytes
+ * @param width Width of the image in pixel
+ * @param height Height of the image in pixel
+ * @param options Compression options, the bands are compressed in parallel by the given amount of threads
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Receives the compressed stream
+ * @param written Receives the amount of written bytes
+ * @param checksum Receives the Adler-32 checksum of the stream
+ * @param error When non-null receives the error code on error
+ * @return 1 on success, 0 on error
+ */
+int xyzpriv_deflate_incremental(xyzpriv_segments** segments, const XYZImage_Palette* palette, const uint8_t* pixels,
+		size_t pitch, uint16_t width, uint16_t height, const XYZImage_CompressOptions* options,
+		void* userdata, xyzimage_write_func_t write_func, size_t* written, uint32_t* checksum, xyzimage_error_t* error);
+
+/**
+ * Marks rows as changed, the bands containing them or using them as dictionary are compressed again.
+ *
+ * @param segments Segments of the image, can be NULL
+ * @param first_row First changed row
+ * @param row_count Amount of changed rows
+ */
+void xyzpriv_segments_mark_rows(xyzpriv_segments* segments, uint16_t first_row, uint16_t row_count);
+
+void xyzpriv_segments_free(xyzpriv_segments* segments);
+
+/**
+ * Checks whether xyzpriv_deflate_parallel is worth it for a stream of the given size.
+ *
+ * @param options Compression options of the image
+ * @param len Size of the uncompressed stream (palette and pixels)
+ * @return 1 when the stream is compressed in parallel, 0 otherwise
+ */
+int xyzpriv_deflate_is_parallel(const XYZImage_CompressOptions* options, size_t len);
+
+/**
+ * Compresses the palette followed by the pixels into a zlib stream using multiple threads.
+ * The stream is split into blocks which are compressed independently using the end of
+ * the previous block as dictionary. The result is a single regular zlib stream.
+ *
+ * @param palette Palette of the image
+ * @param pixels Palette indices of the image
+ * @param pitch Distance between the start of two rows in bytes
+ * @param width Width of the image in pixel
+ * @param height Height of the image in pixel
+ * @param options Compression options, the amount of threads is taken from them
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Receives the compressed stream
+ * @param written Receives the amount of written bytes
+ * @param checksum Receives the Adler-32 checksum of the stream
+ * @param error When non-null receives the error code on error
+ * @return 1 on success, 0 on error
+ */
+int xyzpriv_deflate_parallel(const XYZImage_Palette* palette, const uint8_t* pixels, size_t pitch, uint16_t width, uint16_t height,
+		const XYZImage_CompressOptions* options, void* userdata, xyzimage_write_func_t write_func, size_t* written,
+		uint32_t* checksum, xyzimage_error_t* error);
+
+/**
+ * Compresses the palette followed by the pixels with several zlib settings and writes the smallest stream.
+ * The candidates are compressed in parallel, the amount of threads is taken from the options.
+ * The settings of the options are always one of the candidates.
+ *
+ * @param palette Palette of the image
+ * @param pixels Palette indices of the image
+ * @param pitch Distance between the start of two rows in bytes
+ * @param width Width of the image in pixel
+ * @param height Height of the image in pixel
+ * @param options Compression options, optimize_palette also tries a palette sorted by frequency
+ * @param userdata Custom data forwarded to write_func
+ * @param write_func Receives the compressed stream
+ * @param written Receives the amount of written bytes
+ * @param checksum Receives the Adler-32 checksum of the stream
+ * @param error When non-null receives the error code on error
+ * @return 1 on success, 0 on error
+ */
+int xyzpriv_deflate_optimize(const XYZImage_Palette* palette, const uint8_t* pixels, size_t pitch, uint16_t width, uint16_t height,
+		const XYZImage_CompressOptions* options, void* userdata, xyzimage_write_func_t write_func, size_t* written,
+		uint32_t* checksum, xyzimage_error_t* error);
+
+#endif // LIBXYZIMAGE_XYZIMAGE_PRIVATE_H
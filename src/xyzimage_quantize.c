@@ -0,0 +1,146 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <memory.h>
+
+#include "xyzimage_private.h"
+
+// Open addressing hash table for the unique colors, at most 25 % filled
+#define XYZPRIV_COLOR_TABLE_BITS 10
+#define XYZPRIV_COLOR_TABLE_SIZE (1u << XYZPRIV_COLOR_TABLE_BITS)
+
+// Marks a used slot, colors only occupy the lower 24 bit
+#define XYZPRIV_COLOR_USED 0x1000000u
+
+typedef struct {
+	uint32_t key[XYZPRIV_COLOR_TABLE_SIZE];
+	uint8_t index[XYZPRIV_COLOR_TABLE_SIZE];
+	unsigned int count;
+} xyzpriv_color_table;
+
+// Returns the palette index of the color, adds it when not found.
+// Returns -1 when the palette is full.
+static int xyzpriv_color_lookup(xyzpriv_color_table* table, XYZImage_Palette* palette, uint32_t rgb) {
+	uint32_t key = rgb | XYZPRIV_COLOR_USED;
+	uint32_t slot = (rgb * 2654435761u) >> (32 - XYZPRIV_COLOR_TABLE_BITS);
+
+	while (table->key[slot] != 0) {
+		if (table->key[slot] == key) {
+			return table->index[slot];
+		}
+		slot = (slot + 1) & (XYZPRIV_COLOR_TABLE_SIZE - 1);
+	}
+
+	if (table->count == XYZIMAGE_PALETTE_ENTRIES) {
+		return -1;
+	}
+
+	unsigned int index = table->count++;
+	table->key[slot] = key;
+	table->index[slot] = (uint8_t)index;
+	palette->entry[index].red = (uint8_t)(rgb >> 16);
+	palette->entry[index].green = (uint8_t)(rgb >> 8);
+	palette->entry[index].blue = (uint8_t)rgb;
+
+	return (int)index;
+}
+
+// Frees index 0 for the transparent pixels: The color at index 0 moves to a new index
+// and the written indices are updated. Returns 0 when the palette is full.
+static int xyzpriv_reserve_transparent(xyzpriv_color_table* table, XYZImage_Palette* palette, uint8_t* indices, size_t count) {
+	if (table->count == 0) {
+		table->count = 1;
+		return 1;
+	}
+
+	if (table->count == XYZIMAGE_PALETTE_ENTRIES) {
+		return 0;
+	}
+
+	uint8_t moved = (uint8_t)table->count++;
+
+	unsigned int slot;
+	for (slot = 0; slot < XYZPRIV_COLOR_TABLE_SIZE; ++slot) {
+		if (table->key[slot] != 0 && table->index[slot] == 0) {
+			table->index[slot] = moved;
+			break;
+		}
+	}
+
+	palette->entry[moved] = palette->entry[0];
+	memset(&palette->entry[0], '\0', sizeof(palette->entry[0]));
+
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		if (indices[i] == 0) {
+			indices[i] = moved;
+		}
+	}
+
+	return 1;
+}
+
+xyzimage_error_t xyzpriv_quantize(const uint8_t* pixels, size_t pitch, uint16_t width, uint16_t height,
+		int has_alpha, XYZImage_Palette* palette, uint8_t* indices) {
+	xyzpriv_color_table table;
+	memset(table.key, '\0', sizeof(table.key));
+	table.count = 0;
+
+	memset(palette, '\0', sizeof(*palette));
+
+	// Index 0 is the transparent color in RPG Maker, reserved on the first transparent pixel
+	int transparent_reserved = 0;
+
+	// Neighbouring pixels usually have the same color, skip the lookup for them
+	uint32_t last_rgb = 0;
+	int last_index = -1;
+
+	uint16_t x, y;
+	for (y = 0; y < height; ++y) {
+		const uint8_t* src = pixels + y * pitch;
+		uint8_t* dst = indices + (size_t)y * width;
+
+		for (x = 0; x < width; ++x, src += 4) {
+			if (has_alpha && src[3] != 255) {
+				if (src[3] != 0) {
+					return XYZIMAGE_ERROR_IMAGE_ALPHA_CHANNEL;
+				}
+
+				if (!transparent_reserved) {
+					if (!xyzpriv_reserve_transparent(&table, palette, indices, (size_t)y * width + x)) {
+						return XYZIMAGE_ERROR_IMAGE_TOO_MANY_COLORS;
+					}
+
+					// The cached index can be the moved one
+					last_index = -1;
+					transparent_reserved = 1;
+				}
+
+				dst[x] = 0;
+				continue;
+			}
+
+			uint32_t rgb = ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | src[2];
+
+			if (rgb != last_rgb || last_index < 0) {
+				last_index = xyzpriv_color_lookup(&table, palette, rgb);
+
+				if (last_index < 0) {
+					return XYZIMAGE_ERROR_IMAGE_TOO_MANY_COLORS;
+				}
+
+				last_rgb = rgb;
+			}
+
+			dst[x] = (uint8_t)last_index;
+		}
+	}
+
+	return XYZIMAGE_ERROR_OK;
+}
@@ -0,0 +1,270 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <string.h>
+
+#include "xyzimage_private.h"
+
+// XYZ header and zlib header
+#define XYZPRIV_REWRITE_PREFIX_SIZE 10u
+#define XYZPRIV_REWRITE_TRAILER_SIZE 4u
+
+// Size of the buffer receiving the inflated pixels, they are only needed for the checksum
+#define XYZPRIV_REWRITE_CHUNK_SIZE 16384u
+
+static void xyzpriv_set_error(xyzimage_error_t* error, xyzimage_error_t which) {
+	if (error != NULL) {
+		*error = which;
+	}
+}
+
+typedef struct {
+	// Offset of the first pixel block relative to the start of the deflate data
+	size_t split;
+	// Size of the deflate data
+	size_t deflate_len;
+	uint32_t pixels_adler;
+} xyzpriv_rewrite_layout;
+
+static int xyzpriv_rewrite_inflate_init(z_stream* stream, xyzpriv_scratch* scratch) {
+	stream->zalloc = xyzpriv_zalloc;
+	stream->zfree = xyzpriv_zfree;
+	stream->opaque = scratch;
+	stream->next_in = Z_NULL;
+	stream->avail_in = 0;
+
+	return inflateInit2(stream, -MAX_WBITS) == Z_OK;
+}
+
+static int xyzpriv_rewrite_find_split(const Bytef* deflate_data, size_t len, xyzpriv_scratch* scratch,
+		XYZImage_Palette* palette, xyzpriv_rewrite_layout* layout) {
+	// Inflates block by block until the palette is complete and the stream is on a byte boundary
+	z_stream stream;
+
+	if (!xyzpriv_rewrite_inflate_init(&stream, scratch)) {
+		return 0;
+	}
+
+	stream.next_in = (Bytef*)deflate_data;
+	stream.avail_in = (uInt)len;
+	stream.next_out = (Bytef*)palette;
+	stream.avail_out = XYZIMAGE_PALETTE_SIZE;
+
+	int found = 0;
+
+	for (;;) {
+		uInt avail_in = stream.avail_in;
+		uInt avail_out = stream.avail_out;
+		int zlib_error = inflate(&stream, Z_BLOCK);
+
+		if (zlib_error != Z_OK) {
+			break;
+		}
+
+		// 128: Stopped at the start of a block, the lower bits are the unused bits of the last byte.
+		// Empty blocks behind the palette (e.g. of the flush) are skipped, otherwise they accumulate
+		// when an image is rewritten repeatedly.
+		if (stream.avail_out == 0 && (stream.data_type & 128) && (stream.data_type & 7) == 0) {
+			layout->split = len - stream.avail_in;
+			found = 1;
+		}
+
+		if (stream.avail_in == avail_in && stream.avail_out == avail_out) {
+			// No progress: The next block contains pixels
+			break;
+		}
+	}
+
+	inflateEnd(&stream);
+
+	return found;
+}
+
+static int xyzpriv_rewrite_check_pixels(const Bytef* deflate_data, size_t len, size_t pixel_count,
+		xyzpriv_scratch* scratch, xyzpriv_rewrite_layout* layout) {
+	// The pixel blocks must inflate without the palette as dictionary, this fails for streams
+	// referencing the palette from the pixels. Yields the checksum of the pixels.
+	z_stream stream;
+	Bytef* chunk = (Bytef*)xyzpriv_scratch_malloc(scratch, XYZPRIV_REWRITE_CHUNK_SIZE);
+
+	if (chunk == NULL) {
+		return 0;
+	}
+
+	if (!xyzpriv_rewrite_inflate_init(&stream, scratch)) {
+		xyzpriv_scratch_free(scratch, chunk);
+		return 0;
+	}
+
+	uLong adler = adler32(0L, Z_NULL, 0);
+	int zlib_error;
+
+	stream.next_in = (Bytef*)deflate_data + layout->split;
+	stream.avail_in = (uInt)(len - layout->split);
+
+	do {
+		stream.next_out = chunk;
+		stream.avail_out = XYZPRIV_REWRITE_CHUNK_SIZE;
+
+		zlib_error = inflate(&stream, Z_NO_FLUSH);
+		adler = adler32(adler, chunk, XYZPRIV_REWRITE_CHUNK_SIZE - stream.avail_out);
+	} while (zlib_error == Z_OK && stream.total_out <= pixel_count);
+
+	int valid = zlib_error == Z_STREAM_END && stream.total_out == pixel_count;
+	layout->deflate_len = len - stream.avail_in;
+	layout->pixels_adler = (uint32_t)adler;
+
+	inflateEnd(&stream);
+	xyzpriv_scratch_free(scratch, chunk);
+
+	return valid;
+}
+
+static int xyzpriv_rewrite_write(void* userdata, xyzimage_write_func_t write_func, const void* data, size_t len, xyzimage_error_t* error) {
+	xyzimage_error_t write_error = XYZIMAGE_ERROR_OK;
+
+	if (write_func(userdata, data, len, &write_error) != len) {
+		xyzpriv_set_error(error, write_error != XYZIMAGE_ERROR_OK ? write_error : XYZIMAGE_ERROR_IO_WRITE);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Returns 1 when the image was written, 0 when the pixels cannot be kept, -1 on error
+static int xyzpriv_rewrite_keep_pixels(const uint8_t* data, size_t len, const XYZImage_Palette* palette,
+		xyzpriv_scratch* scratch, void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	if (len < XYZPRIV_REWRITE_PREFIX_SIZE + XYZPRIV_REWRITE_TRAILER_SIZE || memcmp(data, "XYZ1", 4) != 0) {
+		return 0;
+	}
+
+	// zlib header without preset dictionary
+	unsigned int cmf = data[8];
+	unsigned int flg = data[9];
+
+	if ((cmf & 0x0F) != Z_DEFLATED || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20)) {
+		return 0;
+	}
+
+	size_t pixel_count = (size_t)(data[4] | (data[5] << 8)) * (size_t)(data[6] | (data[7] << 8));
+	const Bytef* deflate_data = data + XYZPRIV_REWRITE_PREFIX_SIZE;
+	size_t deflate_len = len - XYZPRIV_REWRITE_PREFIX_SIZE;
+	xyzpriv_rewrite_layout layout;
+	XYZImage_Palette old_palette;
+
+	if (!xyzpriv_rewrite_find_split(deflate_data, deflate_len, scratch, &old_palette, &layout) ||
+			!xyzpriv_rewrite_check_pixels(deflate_data, deflate_len, pixel_count, scratch, &layout) ||
+			deflate_len - layout.deflate_len < XYZPRIV_REWRITE_TRAILER_SIZE) {
+		return 0;
+	}
+
+	// A corrupted image is left to the full decoder, it reports the error
+	const uint8_t* trailer = deflate_data + layout.deflate_len;
+	uint32_t stored_adler = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) | ((uint32_t)trailer[2] << 8) | trailer[3];
+	uLong old_palette_adler = adler32(adler32(0L, Z_NULL, 0), (const Bytef*)&old_palette, XYZIMAGE_PALETTE_SIZE);
+
+	if (adler32_combine(old_palette_adler, layout.pixels_adler, (z_off_t)pixel_count) != stored_adler) {
+		return 0;
+	}
+
+	// Compress the new palette, the full flush keeps the result rewritable
+	z_stream stream;
+	stream.zalloc = xyzpriv_zalloc;
+	stream.zfree = xyzpriv_zfree;
+	stream.opaque = scratch;
+
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_COMPRESS);
+		return -1;
+	}
+
+	uLong palette_bound = deflateBound(&stream, XYZIMAGE_PALETTE_SIZE) + 16;
+	Bytef* compressed_palette = (Bytef*)xyzpriv_scratch_malloc(scratch, palette_bound);
+
+	if (compressed_palette == NULL) {
+		deflateEnd(&stream);
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_OUT_OF_MEMORY);
+		return -1;
+	}
+
+	stream.next_in = (Bytef*)palette;
+	stream.avail_in = XYZIMAGE_PALETTE_SIZE;
+	stream.next_out = compressed_palette;
+	stream.avail_out = (uInt)palette_bound;
+
+	int zlib_error = deflate(&stream, Z_FULL_FLUSH);
+	size_t compressed_palette_len = palette_bound - stream.avail_out;
+	int flushed = zlib_error == Z_OK && stream.avail_in == 0 && stream.avail_out > 0;
+	deflateEnd(&stream);
+
+	if (!flushed) {
+		xyzpriv_scratch_free(scratch, compressed_palette);
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_IO_COMPRESS);
+		return -1;
+	}
+
+	uLong palette_adler = adler32(adler32(0L, Z_NULL, 0), (const Bytef*)palette, XYZIMAGE_PALETTE_SIZE);
+	uLong adler = adler32_combine(palette_adler, layout.pixels_adler, (z_off_t)pixel_count);
+
+	uint8_t new_trailer[XYZPRIV_REWRITE_TRAILER_SIZE];
+	new_trailer[0] = (uint8_t)(adler >> 24);
+	new_trailer[1] = (uint8_t)((adler >> 16) & 0xFF);
+	new_trailer[2] = (uint8_t)((adler >> 8) & 0xFF);
+	new_trailer[3] = (uint8_t)(adler & 0xFF);
+
+	// Headers, new palette, the untouched pixel blocks and the new checksum
+	int success = xyzpriv_rewrite_write(userdata, write_func, data, XYZPRIV_REWRITE_PREFIX_SIZE, error) &&
+		xyzpriv_rewrite_write(userdata, write_func, compressed_palette, compressed_palette_len, error) &&
+		xyzpriv_rewrite_write(userdata, write_func, deflate_data + layout.split, layout.deflate_len - layout.split, error) &&
+		xyzpriv_rewrite_write(userdata, write_func, new_trailer, sizeof(new_trailer), error);
+
+	xyzpriv_scratch_free(scratch, compressed_palette);
+
+	return success ? 1 : -1;
+}
+
+int xyzimage_rewrite_palette(const void* data, size_t len, const XYZImage_Palette* palette,
+		void* userdata, xyzimage_write_func_t write_func, xyzimage_error_t* error) {
+	xyzpriv_set_error(error, XYZIMAGE_ERROR_OK);
+
+	if (data == NULL || palette == NULL || write_func == NULL) {
+		xyzpriv_set_error(error, XYZIMAGE_ERROR_POINTER_BAD);
+		return 0;
+	}
+
+	xyzpriv_scratch scratch;
+	xyzpriv_scratch_begin_global(&scratch);
+
+	int res = xyzpriv_rewrite_keep_pixels((const uint8_t*)data, len, palette, &scratch, userdata, write_func, error);
+
+	xyzpriv_scratch_end(&scratch);
+
+	if (res != 0) {
+		return res == 1;
+	}
+
+	// The pixels depend on the palette or the image is invalid: Decode and encode the whole image
+	XYZImage* image = xyzimage_mopen(data, len, error);
+
+	if (image == NULL) {
+		return 0;
+	}
+
+	XYZImage_Palette* image_palette = xyzimage_get_palette(image, error);
+	int success = image_palette != NULL;
+
+	if (success) {
+		memcpy(image_palette, palette, sizeof(XYZImage_Palette));
+		success = xyzimage_write(image, userdata, write_func, error);
+	}
+
+	xyzimage_free(image);
+
+	return success;
+}
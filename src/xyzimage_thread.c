@@ -0,0 +1,284 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "xyzimage_private.h"
+#include "xyzimage_thread.h"
+
+#if defined(XYZIMAGE_HAVE_PTHREAD)
+#  include <unistd.h>
+#  if defined(_WIN32)
+// Only included by xyzimage_thread.h for native threads, needed for the timer
+#    define WIN32_LEAN_AND_MEAN
+#    include <windows.h>
+#  endif
+#endif
+
+unsigned int xyzpriv_get_cpu_count(void) {
+#if defined(XYZIMAGE_HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (unsigned int)count : 1;
+#elif defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (unsigned int)info.dwNumberOfProcessors : 1;
+#else
+	return 1;
+#endif
+}
+
+uint64_t xyzpriv_get_time_ns(void) {
+#if defined(_WIN32)
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	// Split to avoid overflowing the multiplication
+	uint64_t seconds = (uint64_t)counter.QuadPart / (uint64_t)frequency.QuadPart;
+	uint64_t remainder = (uint64_t)counter.QuadPart % (uint64_t)frequency.QuadPart;
+	return seconds * 1000000000u + remainder * 1000000000u / (uint64_t)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+	// Processor time, not wall time, but available everywhere
+	return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+#ifdef XYZPRIV_HAVE_THREADS
+
+typedef struct {
+	xyzpriv_thread_func_t func;
+	void* arg;
+} xyzpriv_thread_start;
+
+#if defined(XYZIMAGE_HAVE_PTHREAD)
+
+static void* xyzpriv_thread_main(void* arg) {
+	xyzpriv_thread_start start = *(xyzpriv_thread_start*)arg;
+	xyzpriv_free(arg);
+	start.func(start.arg);
+	return NULL;
+}
+
+int xyzpriv_thread_create(xyzpriv_thread_t* thread, xyzpriv_thread_func_t func, void* arg) {
+	xyzpriv_thread_start* start = (xyzpriv_thread_start*)xyzpriv_malloc(sizeof(xyzpriv_thread_start));
+
+	if (start == NULL) {
+		return 0;
+	}
+
+	start->func = func;
+	start->arg = arg;
+
+	if (pthread_create(thread, NULL, xyzpriv_thread_main, start) != 0) {
+		xyzpriv_free(start);
+		return 0;
+	}
+
+	return 1;
+}
+
+void xyzpriv_thread_join(xyzpriv_thread_t thread) {
+	pthread_join(thread, NULL);
+}
+
+void xyzpriv_mutex_init(xyzpriv_mutex_t* mutex) {
+	pthread_mutex_init(mutex, NULL);
+}
+
+void xyzpriv_mutex_destroy(xyzpriv_mutex_t* mutex) {
+	pthread_mutex_destroy(mutex);
+}
+
+void xyzpriv_mutex_lock(xyzpriv_mutex_t* mutex) {
+	pthread_mutex_lock(mutex);
+}
+
+void xyzpriv_mutex_unlock(xyzpriv_mutex_t* mutex) {
+	pthread_mutex_unlock(mutex);
+}
+
+void xyzpriv_cond_init(xyzpriv_cond_t* cond) {
+	pthread_cond_init(cond, NULL);
+}
+
+void xyzpriv_cond_destroy(xyzpriv_cond_t* cond) {
+	pthread_cond_destroy(cond);
+}
+
+void xyzpriv_cond_wait(xyzpriv_cond_t* cond, xyzpriv_mutex_t* mutex) {
+	pthread_cond_wait(cond, mutex);
+}
+
+void xyzpriv_cond_signal(xyzpriv_cond_t* cond) {
+	pthread_cond_signal(cond);
+}
+
+void xyzpriv_cond_broadcast(xyzpriv_cond_t* cond) {
+	pthread_cond_broadcast(cond);
+}
+
+#elif defined(_WIN32)
+
+static DWORD WINAPI xyzpriv_thread_main(LPVOID arg) {
+	xyzpriv_thread_start start = *(xyzpriv_thread_start*)arg;
+	xyzpriv_free(arg);
+	start.func(start.arg);
+	return 0;
+}
+
+int xyzpriv_thread_create(xyzpriv_thread_t* thread, xyzpriv_thread_func_t func, void* arg) {
+	xyzpriv_thread_start* start = (xyzpriv_thread_start*)xyzpriv_malloc(sizeof(xyzpriv_thread_start));
+
+	if (start == NULL) {
+		return 0;
+	}
+
+	start->func = func;
+	start->arg = arg;
+
+	*thread = CreateThread(NULL, 0, xyzpriv_thread_main, start, 0, NULL);
+
+	if (*thread == NULL) {
+		xyzpriv_free(start);
+		return 0;
+	}
+
+	return 1;
+}
+
+void xyzpriv_thread_join(xyzpriv_thread_t thread) {
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+void xyzpriv_mutex_init(xyzpriv_mutex_t* mutex) {
+	InitializeCriticalSection(mutex);
+}
+
+void xyzpriv_mutex_destroy(xyzpriv_mutex_t* mutex) {
+	DeleteCriticalSection(mutex);
+}
+
+void xyzpriv_mutex_lock(xyzpriv_mutex_t* mutex) {
+	EnterCriticalSection(mutex);
+}
+
+void xyzpriv_mutex_unlock(xyzpriv_mutex_t* mutex) {
+	LeaveCriticalSection(mutex);
+}
+
+void xyzpriv_cond_init(xyzpriv_cond_t* cond) {
+	InitializeConditionVariable(cond);
+}
+
+void xyzpriv_cond_destroy(xyzpriv_cond_t* cond) {
+	// Condition variables do not need to be destroyed on Windows
+	(void)cond;
+}
+
+void xyzpriv_cond_wait(xyzpriv_cond_t* cond, xyzpriv_mutex_t* mutex) {
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+void xyzpriv_cond_signal(xyzpriv_cond_t* cond) {
+	WakeConditionVariable(cond);
+}
+
+void xyzpriv_cond_broadcast(xyzpriv_cond_t* cond) {
+	WakeAllConditionVariable(cond);
+}
+
+#endif
+
+#endif
+
+typedef struct {
+	size_t count;
+	// Index of the next task to run
+	size_t next;
+	xyzpriv_task_func_t func;
+	void* arg;
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_t mutex;
+#endif
+} xyzpriv_task_queue;
+
+static void xyzpriv_task_worker(void* arg) {
+	xyzpriv_task_queue* queue = (xyzpriv_task_queue*)arg;
+
+	for (;;) {
+#ifdef XYZPRIV_HAVE_THREADS
+		xyzpriv_mutex_lock(&queue->mutex);
+#endif
+		size_t index = queue->next;
+
+		if (index < queue->count) {
+			++queue->next;
+		}
+#ifdef XYZPRIV_HAVE_THREADS
+		xyzpriv_mutex_unlock(&queue->mutex);
+#endif
+
+		if (index >= queue->count) {
+			break;
+		}
+
+		queue->func(queue->arg, index);
+	}
+}
+
+void xyzpriv_parallel_for(size_t count, unsigned int threads, xyzpriv_task_func_t func, void* arg) {
+	xyzpriv_task_queue queue;
+	queue.count = count;
+	queue.next = 0;
+	queue.func = func;
+	queue.arg = arg;
+
+	if (threads == 0) {
+		threads = xyzpriv_get_cpu_count();
+	}
+
+	if (threads > XYZPRIV_MAX_THREADS) {
+		threads = XYZPRIV_MAX_THREADS;
+	}
+
+	if (threads > count) {
+		threads = (unsigned int)count;
+	}
+
+#ifdef XYZPRIV_HAVE_THREADS
+	xyzpriv_mutex_init(&queue.mutex);
+
+	// The calling thread is one of the workers
+	xyzpriv_thread_t workers[XYZPRIV_MAX_THREADS];
+	unsigned int started = 0;
+
+	while (started + 1 < threads && xyzpriv_thread_create(&workers[started], xyzpriv_task_worker, &queue)) {
+		++started;
+	}
+
+	xyzpriv_task_worker(&queue);
+
+	unsigned int i;
+	for (i = 0; i < started; ++i) {
+		xyzpriv_thread_join(workers[i]);
+	}
+
+	xyzpriv_mutex_destroy(&queue.mutex);
+#else
+	(void)threads;
+	xyzpriv_task_worker(&queue);
+#endif
+}
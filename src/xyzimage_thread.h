@@ -0,0 +1,83 @@
+/*
+ * This file is part of libxyzimage. Copyright (c) 2018 liblcf authors.
+ * https://github.com/EasyRPG/libxyzimage - https://easyrpg.org
+ *
+ * libxyzimage is Free/Libre Open Source Software, released under the
+ * MIT License. For the full copyright and license information, please view
+ * the COPYING file that was distributed with this source code.
+ */
+
+#ifndef LIBXYZIMAGE_XYZIMAGE_THREAD_H
+#define LIBXYZIMAGE_XYZIMAGE_THREAD_H
+
+// Minimal threading abstraction used by the multithreaded functions.
+// When no thread implementation is available XYZPRIV_HAVE_THREADS is not defined
+// and the callers fall back to running everything on the calling thread.
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stddef.h>
+
+#if defined(XYZIMAGE_HAVE_PTHREAD)
+#  include <pthread.h>
+#  define XYZPRIV_HAVE_THREADS
+typedef pthread_t xyzpriv_thread_t;
+typedef pthread_mutex_t xyzpriv_mutex_t;
+typedef pthread_cond_t xyzpriv_cond_t;
+#elif defined(_WIN32)
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#  define XYZPRIV_HAVE_THREADS
+typedef HANDLE xyzpriv_thread_t;
+typedef CRITICAL_SECTION xyzpriv_mutex_t;
+typedef CONDITION_VARIABLE xyzpriv_cond_t;
+#endif
+
+// Upper limit of threads used by xyzpriv_parallel_for, protects against absurd thread counts
+#define XYZPRIV_MAX_THREADS 64u
+
+typedef void (*xyzpriv_thread_func_t)(void* arg);
+
+typedef void (*xyzpriv_task_func_t)(void* arg, size_t index);
+
+/**
+ * @return Amount of processors available to the process, at least 1
+ */
+unsigned int xyzpriv_get_cpu_count(void);
+
+/**
+ * Invokes func(arg, index) for every index from 0 to count - 1.
+ * The indices are handed out in order to up to threads threads, the calling thread is one of them.
+ * Returns when all invocations finished.
+ *
+ * @param count Amount of tasks
+ * @param threads Amount of threads to use, 0 uses one thread per processor
+ * @param func Function invoked for each task, concurrently when threads are available
+ * @param arg Custom data forwarded to func
+ */
+void xyzpriv_parallel_for(size_t count, unsigned int threads, xyzpriv_task_func_t func, void* arg);
+
+#ifdef XYZPRIV_HAVE_THREADS
+/**
+ * Starts a new thread running func(arg).
+ *
+ * @return 1 on success, 0 on error
+ */
+int xyzpriv_thread_create(xyzpriv_thread_t* thread, xyzpriv_thread_func_t func, void* arg);
+void xyzpriv_thread_join(xyzpriv_thread_t thread);
+
+void xyzpriv_mutex_init(xyzpriv_mutex_t* mutex);
+void xyzpriv_mutex_destroy(xyzpriv_mutex_t* mutex);
+void xyzpriv_mutex_lock(xyzpriv_mutex_t* mutex);
+void xyzpriv_mutex_unlock(xyzpriv_mutex_t* mutex);
+
+void xyzpriv_cond_init(xyzpriv_cond_t* cond);
+void xyzpriv_cond_destroy(xyzpriv_cond_t* cond);
+void xyzpriv_cond_wait(xyzpriv_cond_t* cond, xyzpriv_mutex_t* mutex);
+void xyzpriv_cond_signal(xyzpriv_cond_t* cond);
+void xyzpriv_cond_broadcast(xyzpriv_cond_t* cond);
+#endif
+
+#endif // LIBXYZIMAGE_XYZIMAGE_THREAD_H